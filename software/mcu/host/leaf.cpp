@@ -0,0 +1,36 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The leaf firmware, built as a Linux process.
+// The Arduino IDE and platformio generate prototypes for a .ino; we have to do it ourselves.
+
+#include "Arduino.h"
+
+void read_chip_once();
+void read_radio_once();
+void boot_count();
+void start_upload();
+void make_topic();
+bool register_topic();
+void publish_data();
+void print_stats();
+void log_mode();
+void beacon_tx();
+
+#include "../leaf/src/leaf.ino"
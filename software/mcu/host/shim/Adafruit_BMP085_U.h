@@ -0,0 +1,67 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Stand in for the Adafruit BMP085 unified sensor library: there is no sensor on the host
+
+#ifndef __BMP085_H__
+#define __BMP085_H__
+
+#include "Arduino.h"
+
+#define SENSORS_PRESSURE_SEALEVELHPA 1013.25F
+
+typedef enum {
+  BMP085_MODE_ULTRALOWPOWER = 0,
+  BMP085_MODE_STANDARD      = 1,
+  BMP085_MODE_HIGHRES       = 2,
+  BMP085_MODE_ULTRAHIGHRES  = 3
+} bmp085_mode_t;
+
+typedef struct {
+  char name[12];
+  int32_t version;
+  int32_t sensor_id;
+  int32_t type;
+  float max_value;
+  float min_value;
+  float resolution;
+  int32_t min_delay;
+} sensor_t;
+
+typedef struct {
+  int32_t version;
+  int32_t sensor_id;
+  int32_t type;
+  int32_t reserved0;
+  int32_t timestamp;
+  float pressure;
+} sensors_event_t;
+
+class Adafruit_BMP085_Unified
+{
+public:
+  Adafruit_BMP085_Unified(int32_t sensor_id=-1) {}
+  bool begin(bmp085_mode_t mode=BMP085_MODE_ULTRAHIGHRES) { return false; }
+  void getSensor(sensor_t *sensor) { memset(sensor, 0, sizeof(*sensor)); }
+  bool getEvent(sensors_event_t *event) { memset(event, 0, sizeof(*event)); return false; }
+  void getTemperature(float *temp) { *temp = NAN; }
+  float pressureToAltitude(float sea_level, float atmospheric) { return 44330.0F * (1.0F - powf(atmospheric / sea_level, 0.1903F)); }
+};
+
+#endif // __BMP085_H__
@@ -0,0 +1,127 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/// @file
+/// @brief Just enough of the Arduino API to run the MCU firmware as a Linux process.
+/// The SPI bus is wired to a simulated SX1276 (software/sx1276/sx1276_sim.hpp),
+/// Serial goes to stdout, and there are no I2C devices.
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x0
+#define OUTPUT       0x1
+#define INPUT_PULLUP 0x2
+
+#define DEC 10
+#define HEX 16
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+/// Start the process again from the top, as a reset does on the hardware
+void host_reset();
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+
+class String
+{
+public:
+  String(const char *s="") : s_(s) {}
+  String(const __FlashStringHelper *s) : s_(reinterpret_cast<const char*>(s)) {}
+  const char* c_str() const { return s_.c_str(); }
+  unsigned int length() const { return s_.size(); }
+
+private:
+  std::string s_;
+};
+
+class Print
+{
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *s) { return write((const uint8_t*)s, strlen(s)); }
+
+  size_t print(const char *s) { return write(s); }
+  size_t print(const String& s) { return write(s.c_str()); }
+  size_t print(const __FlashStringHelper *s) { return write(reinterpret_cast<const char*>(s)); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base=DEC) { return print((unsigned long)n, base); }
+  size_t print(int n, int base=DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base=DEC) { return print((unsigned long)n, base); }
+  size_t print(long n, int base=DEC);
+  size_t print(unsigned long n, int base=DEC);
+  size_t print(double n, int digits=2);
+
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+  template <typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() = 0;
+};
+
+class HardwareSerial : public Stream
+{
+public:
+  void begin(unsigned long baud) {}
+
+  virtual size_t write(uint8_t c);
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  using Print::write;
+
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual int peek() { return -1; }
+  virtual void flush();
+};
+
+extern HardwareSerial Serial;
+
+#endif // Arduino_h
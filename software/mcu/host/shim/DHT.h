@@ -0,0 +1,40 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Stand in for the Adafruit DHT library: there is no sensor on the host
+
+#ifndef DHT_H
+#define DHT_H
+
+#include "Arduino.h"
+
+#define DHT11 11
+#define DHT22 22
+
+class DHT
+{
+public:
+  DHT(uint8_t pin, uint8_t type) {}
+  void begin() {}
+  bool read() { return false; }
+  float readHumidity() { return NAN; }
+  float readTemperature() { return NAN; }
+};
+
+#endif // DHT_H
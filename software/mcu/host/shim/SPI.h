@@ -0,0 +1,59 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SPI_H_INCLUDED
+#define _SPI_H_INCLUDED
+
+#include "Arduino.h"
+
+#define MSBFIRST 1
+#define LSBFIRST 0
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+class SPISettings
+{
+public:
+  SPISettings(uint32_t clock=4000000, uint8_t bit_order=MSBFIRST, uint8_t data_mode=SPI_MODE0) {}
+};
+
+/// Each transaction goes to the simulated SX1276: first byte is the address, the rest data
+class SPIClass
+{
+public:
+  SPIClass() : first_(true) {}
+
+  void begin() {}
+  void end() {}
+  void setSCK(uint8_t pin) {}
+
+  void beginTransaction(const SPISettings& settings) { first_ = true; }
+  void endTransaction() { first_ = true; }
+  uint8_t transfer(uint8_t data);
+
+private:
+  bool first_;
+};
+
+extern SPIClass SPI;
+
+#endif // _SPI_H_INCLUDED
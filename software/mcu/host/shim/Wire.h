@@ -0,0 +1,42 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TwoWire_h
+#define TwoWire_h
+
+#include "Arduino.h"
+
+/// An I2C bus with nothing on it: every address is NACKed
+class TwoWire
+{
+public:
+  void begin() {}
+  void pins(int sda, int scl) {}
+
+  void beginTransmission(uint8_t address) {}
+  uint8_t endTransmission() { return 2; }
+  uint8_t requestFrom(uint8_t address, uint8_t quantity) { return 0; }
+  size_t write(uint8_t data) { return 1; }
+  int available() { return 0; }
+  int read() { return -1; }
+};
+
+extern TwoWire Wire;
+
+#endif // TwoWire_h
@@ -0,0 +1,133 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "Wire.h"
+#include "sx1276_sim.hpp"
+
+#include <time.h>
+#include <unistd.h>
+
+HardwareSerial Serial;
+SPIClass SPI;
+TwoWire Wire;
+
+static char **host_argv = NULL;
+
+static SX1276Sim& radio_sim()
+{
+  // Created on first use, so the environment is read once main() is running
+  static SX1276Sim sim;
+  return sim;
+}
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const uint64_t boot_us = now_us();
+
+unsigned long millis() { return (unsigned long)((now_us() - boot_us) / 1000); }
+unsigned long micros() { return (unsigned long)(now_us() - boot_us); }
+void delay(unsigned long ms) { usleep(ms * 1000); }
+void delayMicroseconds(unsigned int us) { usleep(us); }
+
+// Nothing else to run; but do not spin flat out while polling the radio
+void yield() { usleep(100); }
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+int digitalRead(uint8_t pin) { return HIGH; }
+
+void host_reset()
+{
+  Serial.flush();
+  execv("/proc/self/exe", host_argv);
+  perror("host_reset");
+  exit(1);
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while (size--) { n += write(*buffer++); }
+  return n;
+}
+
+size_t Print::print(long n, int base)
+{
+  char buf[40];
+  if (base == HEX) { snprintf(buf, sizeof(buf), "%lx", n); }
+  else { snprintf(buf, sizeof(buf), "%ld", n); }
+  return write(buf);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+  char buf[40];
+  if (base == HEX) { snprintf(buf, sizeof(buf), "%lx", n); }
+  else { snprintf(buf, sizeof(buf), "%lu", n); }
+  return write(buf);
+}
+
+size_t Print::print(double n, int digits)
+{
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf);
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  return fwrite(buffer, 1, size, stdout);
+}
+
+void HardwareSerial::flush()
+{
+  fflush(stdout);
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+  uint8_t result = radio_sim().Transfer(first_, data);
+  first_ = false;
+  return result;
+}
+
+extern void setup();
+extern void loop();
+
+int main(int argc, char *argv[])
+{
+  host_argv = argv;
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  if (!radio_sim().IsOpen()) { fprintf(stderr, "No simulated radio\n"); return 1; }
+  setup();
+  for (;;) { loop(); }
+  return 0;
+}
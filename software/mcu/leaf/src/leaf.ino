@@ -30,6 +30,12 @@
 #include "sf-bmp180.h"
 #include "sf-pcf8591.h"
 #include "sf-ds1307.h"
+#include "sf-channelplan.h"
+#include "sf-tasks.h"
+#include "sf-samplebuffer.h"
+#include "sf-reportpolicy.h"
+#include "sf-slotclock.h"
+#include "sf-rtc.h"
 #include <Adafruit_BMP085_U.h>
 
 #define WITH_DHT 1
@@ -63,20 +69,103 @@ DHT HumiditySensor(PIN_DHT,DHT11);
 #endif
 
 enum PushStates {
+  SAMPLE_ONLY,    // Taking a sample, with no upload planned
   NEED_CONNECT,
   SENT_CONNECT,
   WAIT_REGACK,
-  WAIT_PUBACK
+  WAIT_SUBACK,
+  WAIT_PINGRESP,  // Warm wake: collecting whatever the gateway kept for us
+  WAIT_SENSORS,
+  WAIT_PUBACK,
+  WAIT_DISCONNECT, // Telling the gateway we are going to sleep
+  WAIT_SLOT,      // Waiting for our uplink slot before we send
+  WAIT_BEACON     // Listening for the gateway's beacon, to find our uplink slot
 };
 
 #define FAULT_SLEEP_INTERVAL_MS 20000
 
 #define ROUTINE_SLEEP_INTERVAL_MS 60000
+// Sleep after the gateway refuses an upload as congested, before trying again
+#define CONGESTION_SLEEP_INTERVAL_MS (2 * ROUTINE_SLEEP_INTERVAL_MS)
 
 #define STATS_INTERVAL_MS 6000
 
 #define RUNTIME_TIMEOUT 20000
 
+// The broker must keep our session alive while we sleep, so we can resume it on wake without reconnecting
+#define KEEPALIVE_S (3 * ROUTINE_SLEEP_INTERVAL_MS / 1000)
+
+// How long a new session sleeps between uploads, as DISCONNECT tells the gateway; twice the usual gap,
+// so a late upload keeps the session. Meanwhile the gateway keeps messages for us, and hands them over
+// when we PINGREQ on the next upload.
+#define SLEEP_DURATION_S (2 * UPLOAD_EVERY * ROUTINE_SLEEP_INTERVAL_MS / 1000)
+
+// Give up waiting for the gateway to acknowledge DISCONNECT after this long, and sleep anyway
+#define DISCONNECT_WAIT_MS 2000
+
+// Only listen for the gateway in short windows after each message we send, rather than all the time.
+// Turn off for a leaf that can only reach the gateway through a relay, which cannot time the windows.
+#define RX_WINDOWS 1
+
+// Ask the gateway for an uplink slot, and wake in it rather than whenever our own timer says, so leaves
+// stop colliding. Needs a gateway run with SX1276_SLOTS; like RX_WINDOWS, not through a relay.
+// Once the gateway says we have a slot we listen up to BEACON_LISTEN_MS for its beacon, to find when it is.
+#define SLOTTED 1
+#define BEACON_LISTEN_MS (ROUTINE_SLEEP_INTERVAL_MS + 5000)
+
+// Wake this long before our slot, so the sensors are read by then
+#define SLOT_LEAD_MS 1500
+
+// If our slot is further off than this when we want to send, e.g. the gateway moved it, send now anyway
+#define SLOT_WAIT_MAX_MS 10000
+
+// Which channel of the plan to use: FIXED uses CHANNEL_FIXED, which must match the gateway.
+// PER_NODE and HOPPING spread leaves across channels, and need a gateway listening on all of them.
+#define CHANNEL_MODE Sentrifarm::ChannelPlan::FIXED
+#define CHANNEL_FIXED 0
+
+Sentrifarm::ChannelPlan channelPlan;
+
+// The sensor reads run alongside CONNECT / REGISTER, rather than before them
+using Sentrifarm::TaskScheduler;
+TaskScheduler sensorTasks;
+
+// Give up on a sensor that takes longer than this
+#define SENSOR_BUDGET_MS 5000
+
+// Let the PCF8591 settle after changing channel
+#define PCF8591_SETTLE_MS 100
+
+// Every wake takes a sample, but only keeps it if the report policy finds something worth
+// sending, and we only upload once there are N, or sooner for an urgent change
+#define UPLOAD_EVERY 4
+
+Sentrifarm::SampleBuffer samples(UPLOAD_EVERY);
+Sentrifarm::ReportPolicy policy;
+
+Sentrifarm::SlotClock slotClock;
+
+// Set when a beacon arrives while we listen for one
+bool beacon_heard = false;
+
+// What to sleep after the beacon we are listening for, before our slot
+uint32_t beacon_interval_ms = 0;
+
+// When our slot is due, by millis(), in WAIT_SLOT
+uint32_t slot_send_ms = 0;
+
+// Set if this wake's sample should go straight away
+bool upload_urgent = false;
+
+// Number of samples in the PUBLISH awaiting PUBACK
+byte batch_count = 0;
+
+// How long to sleep once this wake is done; longer if the gateway is congested
+uint32_t sleep_interval_ms = ROUTINE_SLEEP_INTERVAL_MS;
+
+// Set once we CONNECT: the gateway only learns we sleep from a DISCONNECT in the same session
+bool need_disconnect = false;
+
 struct Metrics
 {
   int rx_count;
@@ -101,6 +190,12 @@ elapsedMillis elapsedStatTime;
 
 uint16_t registered_topic_id = 0xffff;
 
+// The MQTT-SN topic table refers to this rather than copying it, so it needs to stay put
+char TOPIC[128];
+
+// Where the gateway sends us configuration
+char CONFIG_TOPIC[64];
+
 bool in_beacon_mode = false;
 bool in_log_mode = false;
 
@@ -119,6 +214,9 @@ void read_chip_once()
   // for the moment, use the MAC of the ESP8266
   WiFi.macAddress(sensorData.mac);
   sensorData.have_mac = true;
+#elif defined(SF_HOST)
+  Sentrifarm::read_host_mac(sensorData.mac);
+  sensorData.have_mac = true;
 #endif
 }
 
@@ -158,11 +256,198 @@ void boot_count()
   Sentrifarm::save_nvram_byte(13, (bc & 0xff));
 }
 
+// --------------------------------------------------------------------------
+// Sensor tasks: each step does one stage of a read, and says how long to wait before the next
+
+ICACHE_FLASH_ATTR
+int datetime_step(TaskScheduler::Task& task)
+{
+  Sentrifarm::read_datetime_once(sensorData);
+  return TaskScheduler::DONE;
+}
+
+ICACHE_FLASH_ATTR
+int bmp_step(TaskScheduler::Task& task)
+{
+  if (task.stage++ == 0) {
+    return Sentrifarm::begin_bmp(bmp) ? 0 : TaskScheduler::DONE;
+  }
+  Sentrifarm::read_bmp(sensorData, bmp);
+  return TaskScheduler::DONE;
+}
+
+ICACHE_FLASH_ATTR
+int pcf8591_step(TaskScheduler::Task& task)
+{
+  // One channel per stage, the others get a turn while it settles
+  byte ch = task.stage++;
+  if (!Sentrifarm::read_pcf8591_channel(sensorData, ch)) {
+    Sentrifarm::pcf8591_off();
+    return TaskScheduler::DONE;
+  }
+  if (ch < 3) {
+    return PCF8591_SETTLE_MS;
+  }
+  sensorData.have_pcf8591 = true;
+  Sentrifarm::pcf8591_off();
+  return TaskScheduler::DONE;
+}
+
+#if WITH_DHT
+ICACHE_FLASH_ATTR
+int humidity_step(TaskScheduler::Task& task)
+{
+  if (task.stage++ == 0) {
+    HumiditySensor.begin();
+    return 0;
+  }
+  bool hh = HumiditySensor.read();
+  if (hh) {
+    sensorData.humidity = HumiditySensor.readHumidity();
+    sensorData.humidity_temp = HumiditySensor.readTemperature();
+    sensorData.have_humidity = true;
+    Serial.print("H/T ");
+    Serial.print(sensorData.humidity);
+    Serial.print(",");
+    Serial.print(sensorData.humidity_temp);
+    Serial.println();
+  } else {
+    digitalWrite(PIN_DHT, HIGH);
+    Serial.println("H/T ERROR");
+  }
+  return TaskScheduler::DONE;
+}
+#endif
+
+ICACHE_FLASH_ATTR
+void start_sensor_tasks()
+{
+  using Sentrifarm::SensorData;
+  sensorTasks.add("RTC", datetime_step, NULL, SensorData::TIMING_DATETIME, SENSOR_BUDGET_MS);
+  sensorTasks.add("BMP", bmp_step, NULL, SensorData::TIMING_BMP180, SENSOR_BUDGET_MS);
+  sensorTasks.add("ADC", pcf8591_step, NULL, SensorData::TIMING_PCF8591, SENSOR_BUDGET_MS);
+#if WITH_DHT
+  sensorTasks.add("H/T", humidity_step, NULL, SensorData::TIMING_HUMIDITY, SENSOR_BUDGET_MS);
+#endif
+}
+
+ICACHE_FLASH_ATTR
+void poll_sensor_tasks()
+{
+  if (sensorTasks.done()) { return; }
+  sensorTasks.poll();
+  if (sensorTasks.done()) {
+    for (byte i=0; i < sensorTasks.count(); i++) {
+      const TaskScheduler::Task& task = sensorTasks.task(i);
+      sensorData.read_ms[task.id] = task.elapsed_ms;
+    }
+    sensorData.sensors_ms = sensorTasks.elapsed_ms();
+    sensorData.debug_dump();
+    Sentrifarm::CompactSample sample;
+    Sentrifarm::SampleBuffer::Compact(sensorData, sample);
+    if (policy.Decide(sample, upload_urgent)) {
+      samples.Add(sample);
+    }
+    Serial.print(F("REPORT ")); Serial.println(sample.fields, HEX);
+  }
+}
+
+ICACHE_FLASH_ATTR
+void set_report_rules()
+{
+  // Deadband, urgent change and heartbeat (wakes) per field; see Sentrifarm::CompactSample for units
+  using Sentrifarm::ReportPolicy;
+  policy.SetRule(ReportPolicy::PRESSURE, 5, 20, 48);
+  policy.SetRule(ReportPolicy::TEMPERATURE, 3, 10, 48);
+  policy.SetRule(ReportPolicy::ADC0, 4, 0, 48);
+  policy.SetRule(ReportPolicy::ADC1, 4, 0, 48);
+  policy.SetRule(ReportPolicy::ADC2, 4, 0, 48);
+  policy.SetRule(ReportPolicy::ADC3, 4, 0, 48);
+  policy.SetRule(ReportPolicy::HUMIDITY, 3, 10, 48);
+  policy.SetRule(ReportPolicy::HUMIDITY_TEMP, 1, 0, 48);
+  policy.SetRule(ReportPolicy::VCC, 5, 0, 96);
+}
+
+ICACHE_FLASH_ATTR
+void sleep_and_reset(int ms)
+{
+  // Whatever happened, keep the samples for next time
+  samples.Save();
+  policy.Save();
+  Sentrifarm::deep_sleep_and_reset(ms);
+}
+
+// Listen for the beacon, then sleep until our slot about interval_ms from now
+ICACHE_FLASH_ATTR
+void listen_for_beacon(uint32_t interval_ms)
+{
+  Serial.println(F("WAIT BEACON"));
+  beacon_heard = false;
+  beacon_interval_ms = interval_ms;
+  MQTTHandler.ListenForBeacon(true);
+  state = WAIT_BEACON;
+  elapsedRuntime = 0;
+}
+
+// Sleep until the next wake: in our uplink slot about interval_ms from now if we have one, otherwise after
+// interval_ms. If the gateway has just offered us a slot, first listen for its beacon instead.
+ICACHE_FLASH_ATTR
+void routine_sleep(uint32_t interval_ms = ROUTINE_SLEEP_INTERVAL_MS)
+{
+#if SLOTTED
+  if (slotClock.synced()) {
+    sleep_and_reset(slotClock.Sleep(millis(), SLOT_LEAD_MS, interval_ms));
+    return;
+  }
+  if (state != WAIT_BEACON && MQTTHandler.SlotOffered()) {
+    listen_for_beacon(interval_ms);
+    return;
+  }
+#endif
+  sleep_and_reset(interval_ms);
+}
+
+// Sleep until the next wake, first telling the gateway if this session has not said so yet
+// @param save_session The gateway is known to have our session, so the next wake can resume it
+ICACHE_FLASH_ATTR
+void go_to_sleep(bool save_session)
+{
+  if (save_session) {
+    MQTTHandler.SaveSession();
+  }
+  if (!need_disconnect) {
+    routine_sleep(sleep_interval_ms);
+    return;
+  }
+  MQTTHandler.disconnect(SLEEP_DURATION_S);
+  need_disconnect = false;
+  state = WAIT_DISCONNECT;
+  elapsedRuntime = 0;
+}
+
+ICACHE_FLASH_ATTR
+void on_publish(const char* topic, const byte* data, byte len, void* context)
+{
+  // Nothing is configurable yet, so just show what arrived
+  Serial.print(F("CONFIG ")); Serial.print(topic); Serial.print(' ');
+  for (byte i=0; i < len; i++) { Serial.print((char)data[i]); }
+  Serial.println();
+}
+
+ICACHE_FLASH_ATTR
+void on_beacon(const byte* payload, byte len, void* context)
+{
+  slotClock.Beacon(payload, len, MQTTHandler.address(), millis());
+  Serial.print(F("BEACON slot=")); Serial.print(slotClock.slot());
+  Serial.print(F(" drift=")); Serial.println(slotClock.drift_ppm());
+  beacon_heard = true;
+}
+
 // --------------------------------------------------------------------------
 void setup()
 {
-  // So, to keep things simple, we read all the sensors now,
-  // then use loop() as a state machine processor for publishing the data to the central node
+  // Bring up the radio and send CONNECT, then use loop() as a state machine processor
+  // reading the sensors and publishing the data to the central node, both at once
   memset(&sensorData, 0, sizeof(sensorData)); // probably redundant
   sensorData.reset();
 
@@ -179,7 +464,7 @@ void setup()
   } else {
 #ifdef ESP8266
   // copy the counter into the ESP nvram
-    system_rtc_mem_write(64, &beacon_counter, 4);
+    system_rtc_mem_write(RTC_BEACON_BLOCK, &beacon_counter, 4);
 #endif
   }
 
@@ -198,39 +483,29 @@ void setup()
 
   read_chip_once();
   boot_count();
-  if (!in_beacon_mode && !in_log_mode) {
 #ifdef RESET_DATETIME
+  if (!in_beacon_mode && !in_log_mode) {
     Sentrifarm::fix_datetime_once();
-#endif
-    Sentrifarm::read_datetime_once(sensorData);
-    Sentrifarm::read_bmp_once(sensorData, bmp);
-    Sentrifarm::read_pcf8591_once(sensorData);
-#if WITH_DHT
-    HumiditySensor.begin();
-    bool hh = HumiditySensor.read();
-    if (hh) {
-      sensorData.humidity = HumiditySensor.readHumidity();
-      sensorData.humidity_temp = HumiditySensor.readTemperature();
-      sensorData.have_humidity = true;
-      Serial.print("H/T ");
-      Serial.print(sensorData.humidity);
-      Serial.print(",");
-      Serial.print(sensorData.humidity_temp);
-      Serial.println();
-    } else {
-      digitalWrite(PIN_DHT, HIGH);
-      Serial.println("H/T ERROR");
-    }
-#endif
   }
+#endif
   read_radio_once();
 
-  sensorData.debug_dump();
-
   Sentrifarm::led4_double_short_flash();
 
   // This also initialises correct carrier frequency, etc.
-  MQTTHandler.Begin(&Serial);
+  // When hopping, the boot count moves us to a new channel every wake
+  uint8_t channel = channelPlan.channel(CHANNEL_MODE, CHANNEL_FIXED, Sentrifarm::ChannelPlan::node_id(sensorData.mac), sensorData.bootCount);
+  Serial.print(F("Channel ")); Serial.println(channel);
+  // The gateway keeps a session per link address
+  MQTTHandler.SetAddress(MQTTSX1276::address_from_mac(sensorData.mac));
+  Serial.print(F("Address ")); Serial.println(MQTTHandler.address(), HEX);
+  MQTTHandler.Begin(&Serial, channelPlan.frequency(channel));
+  // The gateway may move us to another of its channels and data rates (adaptive data rate)
+  MQTTHandler.SetChannelPlan(&channelPlan);
+  MQTTHandler.SetPublishHandler(on_publish, NULL);
+  MQTTHandler.EnableReceiveWindows(RX_WINDOWS);
+  MQTTHandler.RequestSlot(SLOTTED);
+  MQTTHandler.SetBeaconHandler(on_beacon, NULL);
 
   metrics.reset();
 
@@ -245,30 +520,99 @@ void setup()
     return;
   }
 
+#if SLOTTED
+  // Some wakes are only to hear the beacon, before the one in our slot
+  if (slotClock.Load() && slotClock.beacon_wake()) {
+    listen_for_beacon(0);
+    return;
+  }
+#endif
+
+  start_sensor_tasks();
+
+  // Most wakes only take a sample; see Sentrifarm::SampleBuffer
+  set_report_rules();
+  samples.Load();
+  policy.Load();
+  if (!samples.ScheduledUpload()) {
+    Serial.print(F("SAMPLES ")); Serial.println(samples.count());
+    state = SAMPLE_ONLY;
+    return;
+  }
+  start_upload();
+}
+
+// void loop() {}
+
+ICACHE_FLASH_ATTR
+void start_upload()
+{
+#if SLOTTED
+  // Hold off until our slot, unless it is too far off
+  if (state != WAIT_SLOT && slotClock.synced()) {
+    uint32_t wait = slotClock.UntilSlot(millis());
+    if (wait > 0 && wait <= SLOT_WAIT_MAX_MS) {
+      slot_send_ms = millis() + wait;
+      state = WAIT_SLOT;
+      return;
+    }
+  }
+#endif
+
+  // The client id must be unique per node, or the broker drops the other session
+  char client_id[16];
+  snprintf(client_id, sizeof(client_id), "sf%02x%02x%02x", sensorData.mac[3], sensorData.mac[4], sensorData.mac[5]);
+
+  // Warm wake: the session survived deep sleep, so wake it and PUBLISH once the sensors are read
+  if (MQTTHandler.RestoreSession()) {
+    make_topic();
+    uint16_t idx = 0;
+    registered_topic_id = MQTTHandler.find_topic_id(TOPIC, idx);
+    if (registered_topic_id != 0xffff) {
+      Serial.print(F("RESUME TOPIC")); Serial.println(registered_topic_id);
+      // Anything the gateway kept for us comes before the PINGRESP
+      MQTTHandler.pingreq(client_id);
+      state = WAIT_PINGRESP;
+      return;
+    }
+    MQTTHandler.ForgetSession();
+  }
+
   // Make the first connect attempt
-  // FIXME should use mac or something
-  MQTTHandler.connect(0, 30, "sfnode1"); // keep alive in seconds
+  MQTTHandler.connect(0, KEEPALIVE_S, client_id); // keep alive in seconds
+  need_disconnect = true;
   state = SENT_CONNECT;
   Sentrifarm::led4_double_short_flash();
 }
 
-// void loop() {}
-
 // --------------------------------------------------------------------------
 ICACHE_FLASH_ATTR
-bool register_topic()
+void make_topic()
 {
-  char TOPIC[128];
   int n = snprintf(TOPIC, sizeof(TOPIC), "sentrifarm/leaf/csv/");
   snprintf(TOPIC + n, sizeof(TOPIC)-n, "%02x%02x%02x%02x%02x%02x", sensorData.mac[0],sensorData.mac[1],sensorData.mac[2],sensorData.mac[3],sensorData.mac[4],sensorData.mac[5]);
+}
+
+ICACHE_FLASH_ATTR
+void subscribe_config()
+{
+  snprintf(CONFIG_TOPIC, sizeof(CONFIG_TOPIC), "sentrifarm/leaf/cfg/%02x%02x%02x%02x%02x%02x",
+      sensorData.mac[0],sensorData.mac[1],sensorData.mac[2],sensorData.mac[3],sensorData.mac[4],sensorData.mac[5]);
+  MQTTHandler.subscribe_by_name(FLAG_QOS_0, CONFIG_TOPIC);
+}
+
+ICACHE_FLASH_ATTR
+bool register_topic()
+{
+  make_topic();
   uint16_t topic_id = 0xffff;
-  uint8_t idx = 0;
+  uint16_t idx = 0;
   if (0xffff == (topic_id = MQTTHandler.find_topic_id(TOPIC, idx))) {
     Serial.println(TOPIC);
     Serial.println("Try reg");
     if (!MQTTHandler.register_topic(TOPIC)) {
       Serial.println("Reg error");
-      Sentrifarm::deep_sleep_and_reset(FAULT_SLEEP_INTERVAL_MS);
+      sleep_and_reset(FAULT_SLEEP_INTERVAL_MS);
       return false;
     }
     return false;
@@ -282,10 +626,12 @@ bool register_topic()
 ICACHE_FLASH_ATTR
 void publish_data()
 {
-  char buf[192]; // keep it short...
-  // For the moment send ASCII
-  sensorData.make_mqtt_0(buf, sizeof(buf));
+  // Everything buffered since the last upload, as far as fits in one message
+  char buf[MQTTSN::MAX_BUFFER_SIZE - sizeof(msg_publish) + 1];
+  batch_count = samples.MakeBatch(buf, sizeof(buf), sensorData.rssi, sensorData.snr, policy);
   Serial.println(buf);
+  sensorData.awake_ms = millis();
+  Serial.print(F("AWAKE ms ")); Serial.println(sensorData.awake_ms);
 
   uint8_t flags = FLAG_QOS_1; // 0
 
@@ -300,6 +646,7 @@ void print_stats()
   Serial.print(" rx="); Serial.print(metrics.rx_count);
   Serial.print(" tout="); Serial.print(metrics.timeout_count);
   Serial.print(" crc="); Serial.print(metrics.crc_count);
+  Serial.print(" other="); Serial.print(radio.GetFilteredCount());
   Serial.print(" dis="); Serial.print(metrics.disconnect);
   Serial.println();
 }
@@ -334,7 +681,7 @@ void beacon_tx()
 {
 #ifdef ESP8266
   // copy the counter into the ESP nvram
-  system_rtc_mem_read(64, &beacon_counter, 4);
+  system_rtc_mem_read(RTC_BEACON_BLOCK, &beacon_counter, 4);
 #endif
 
   char buf[48];
@@ -352,7 +699,7 @@ void beacon_tx()
 
 #ifdef ESP8266
   // copy the counter into the ESP nvram
-  system_rtc_mem_write(64, &beacon_counter, 4);
+  system_rtc_mem_write(RTC_BEACON_BLOCK, &beacon_counter, 4);
 #endif
 
   return;
@@ -371,37 +718,95 @@ void loop()
 
   if (radio.fault()) {
     Serial.println("No radio");
-    Sentrifarm::deep_sleep_and_reset(15000);
+    sleep_and_reset(15000);
     return;
   }
 
-  // See if we can receive any radio data
+  // Sensor reads carry on while we wait for the gateway
+  poll_sensor_tasks();
+
+  if (state == SAMPLE_ONLY) {
+    if (!sensorTasks.done()) { return; }
+    if (!upload_urgent && samples.count() < UPLOAD_EVERY) {
+      routine_sleep();
+      return;
+    }
+    Serial.println(F("UPLOAD"));
+    start_upload();
+    elapsedRuntime = 0;
+  }
+
+  if (state == WAIT_SLOT) {
+    if ((int32_t)(millis() - slot_send_ms) < 0) { return; }
+    Serial.println(F("SLOT"));
+    start_upload();
+    elapsedRuntime = 0;
+  }
+
+  // See if we have received any radio data
   bool rx_ok = false;
   bool crc = false;
-  if (MQTTHandler.TryReceive(crc)) {
+  bool rx_timeout = false;
+  if (MQTTHandler.PollReceive(crc, rx_timeout)) {
     metrics.rx_count ++;
     rx_ok = true;
     Sentrifarm::led4_flash();
-  } else if (crc) { metrics.crc_count++; } else { metrics.timeout_count++; }
+  } else if (crc) { metrics.crc_count++; } else if (rx_timeout) { metrics.timeout_count++; }
 
   if (elapsedStatTime > STATS_INTERVAL_MS) {
     print_stats();
     elapsedStatTime = 0;
   }
 
-  if (elapsedRuntime > RUNTIME_TIMEOUT) {
-    Serial.println(F("TOO LONG"));
+  if (state == WAIT_BEACON) {
+    if (beacon_heard || slotClock.BeaconLate(millis()) || elapsedRuntime > BEACON_LISTEN_MS) {
+      MQTTHandler.ListenForBeacon(false);
+      if (!slotClock.synced()) {
+        Serial.println(F("NO SLOT"));
+        slotClock.Lost();
+      }
+      routine_sleep(elapsedRuntime < beacon_interval_ms ? beacon_interval_ms - elapsedRuntime : 0);
+    }
+    return;
+  }
+
+  // With receive windows, the gateway holds any reply until we send again
+  bool no_reply = !rx_ok && state != WAIT_SENSORS && MQTTHandler.WindowsClosed();
+
+  if (state == WAIT_DISCONNECT && (no_reply || elapsedRuntime > DISCONNECT_WAIT_MS)) {
+    // The gateway finds out we were asleep when we next PINGREQ
+    routine_sleep(sleep_interval_ms);
+    return;
+  }
+
+  if (no_reply || elapsedRuntime > RUNTIME_TIMEOUT) {
+    Serial.println(no_reply ? F("NO REPLY") : F("TOO LONG"));
+    // Whatever went wrong, start from scratch next time
+    MQTTHandler.ForgetSession();
     delay(100);
     if (puback_pass_hack == 0) {
       if (state != WAIT_PUBACK) { // If QOS is zero then we never get a puback
-        Sentrifarm::deep_sleep_and_reset(10000);
+        sleep_and_reset(10000);
       }
     }
-    Sentrifarm::deep_sleep_and_reset(ROUTINE_SLEEP_INTERVAL_MS);
+    sleep_and_reset(ROUTINE_SLEEP_INTERVAL_MS);
+    return;
+  }
+
+  // Publish as soon as we have both the topic and the data
+  if (state == WAIT_SENSORS && sensorTasks.done()) {
+    if (samples.count() == 0) {
+      // Quiet since the last upload: nothing to say after all
+      go_to_sleep(true);
+      return;
+    }
+    publish_data();
+    elapsedRuntime = 0; // hang around again if we got this far
+    state = WAIT_PUBACK;
     return;
   }
 
-  // Last msg rx'd was corrupted, so ignore it
+  // Nothing yet, or the last msg rx'd was corrupted, so ignore it
   if (!rx_ok) { return; }
 
   // Deal with timeouts and resends
@@ -435,20 +840,56 @@ void loop()
     case WAIT_REGACK:
       sensorData.rssi = radio.GetLastRssi();
       sensorData.snr = radio.GetLastSnr();
-      publish_data();
       elapsedRuntime = 0; // hang around again if we got this far
-      state = WAIT_PUBACK;
+      // The subscription lasts as long as the session, so only a new one needs it
+      subscribe_config();
+      state = WAIT_SUBACK;
+      break;
+
+    case WAIT_SUBACK:
+    case WAIT_PINGRESP:
+      if (state == WAIT_PINGRESP && !MQTTHandler.DidPingresp()) {
+        // The gateway has lost our session; start afresh next time
+        Serial.println(F("SESSION LOST"));
+        MQTTHandler.ForgetSession();
+        sleep_and_reset(FAULT_SLEEP_INTERVAL_MS);
+        return;
+      }
+      sensorData.rssi = radio.GetLastRssi();
+      sensorData.snr = radio.GetLastSnr();
+      elapsedRuntime = 0;
+      // Published from the top of loop(), once the sensor reads are done
+      state = WAIT_SENSORS;
       break;
 
     case WAIT_PUBACK:
       // probably actually a WILL
       puback_pass_hack ++;
       print_stats();
+      if (MQTTHandler.DidPuback() && MQTTHandler.PubackCode() == REJECTED_INVALID_TOPIC_ID) {
+        // The gateway has lost our topic; start afresh next time, keeping the batch
+        Serial.println(F("TOPIC LOST"));
+        MQTTHandler.ForgetSession();
+        sleep_and_reset(FAULT_SLEEP_INTERVAL_MS);
+        return;
+      }
       if (MQTTHandler.DidPuback() || puback_pass_hack > 2) {
-        Sentrifarm::deep_sleep_and_reset(ROUTINE_SLEEP_INTERVAL_MS);
+        // Anything but ACCEPTED means the gateway dropped the batch: keep it, else the deltas that follow have no base
+        if (MQTTHandler.DidPuback() && MQTTHandler.PubackCode() == ACCEPTED) {
+          samples.Uploaded(batch_count, policy);
+        } else if (MQTTHandler.DidPuback()) {
+          Serial.print(F("PUBACK REJECTED ")); Serial.println((int)MQTTHandler.PubackCode());
+          sleep_interval_ms = CONGESTION_SLEEP_INTERVAL_MS;
+        }
+        go_to_sleep(MQTTHandler.DidPuback());
       }
       break;
 
+    case WAIT_DISCONNECT:
+      // Acknowledged: the gateway now keeps anything for us until we PINGREQ
+      routine_sleep(sleep_interval_ms);
+      break;
+
     default:
       break;
   }
@@ -108,15 +108,19 @@ SX1276Radio::SX1276Radio(int cs_pin, const SPISettings& spi_settings)
     spi_settings_(spi_settings),
     symbol_timeout_(366), // in theory 3s, empirically 1.51s @ sf9 and bw 125000 although often, shorter maybe due to esp8266 timekeeping wierdness not accurately recording elapased time
     preamble_(0x8),
-    max_tx_payload_bytes_(0x80),
-    max_rx_payload_bytes_(0x80),
+    max_tx_payload_bytes_(0xff), // the whole FIFO: MQTT-SN messages are built to fill a LoRa payload
+    max_rx_payload_bytes_(0xff),
     bandwidth_hz_(DEFAULT_BW_HZ),
     spreading_factor_(DEFAULT_SPREADING_FACTOR),
     coding_rate_(DEFAULT_CODING_RATE),
     rssi_dbm_(-255),
     rx_snr_db_(-255),
     rx_warm_(false),
-    dead_(true)
+    dead_(true),
+    rx_filter_(NULL),
+    rx_filter_context_(NULL),
+    rx_filter_len_(0),
+    num_filtered_(0)
 {
   // Note; we want DEBUG ( Serial) here because this happens before Serial is initialised,
   // and it hangs the ESP8266
@@ -196,11 +200,32 @@ bool SX1276Radio::Begin()
   }
   dead_ = false;
 
+  WriteModemConfig();
+
+  // LED on DIO3 (bits 0..1 of register): Valid header : 01
+  // Pin header DIO1 : Rx timeout: 00
+  // Pin header DIO0 (bits 6..7) : Tx done: 01
+  WriteRegister(SX1276REG_DioMapping1, 0x41);
+
+  // Pin header DIO5 (bits 5-4): Clk Out: 10
+  WriteRegister(SX1276REG_DioMapping2, 0x20);
+
+  DefaultTxPower();
+
+  // Preamble size
+  WriteRegister(SX1276REG_PreambleLSB, preamble_);
+
+  return true;
+}
+
+ICACHE_FLASH_ATTR
+void SX1276Radio::WriteModemConfig()
+{
   // IMPORTANT: Testing of 2015-09-13 was accidentally done using 4/5
   // because we forgot to shift the CR. Which also explains why we never get CRC errors!
   // because implicit header could have been on
   // 125kHz, 4/6, explicit header
-  v = (BandwidthToBitfield(bandwidth_hz_) << 4) | (CodingRateToBitfield(coding_rate_) << 1) | 0x0;
+  byte v = (BandwidthToBitfield(bandwidth_hz_) << 4) | (CodingRateToBitfield(coding_rate_) << 1) | 0x0;
   WriteRegister(SX1276REG_ModemConfig1, v);
 
   // SF9, normal (not continuous) mode, CRC, and upper 2 bits of symbol timeout (maximum i.e. 1023)
@@ -210,26 +235,69 @@ bool SX1276Radio::Begin()
   v = symbol_timeout_ & 0xff;
   WriteRegister(SX1276REG_SymbTimeoutLsb, v);
 
-  // LED on DIO3 (bits 0..1 of register): Valid header : 01
-  // Pin header DIO1 : Rx timeout: 00
-  // Pin header DIO0 (bits 6..7) : Tx done: 01
-  WriteRegister(SX1276REG_DioMapping1, 0x41);
+  // Low data rate optimisation, AGC on. The symbols just over 16ms are where rounding would bite
+  static_assert(LowDataRate(11, 125000) && LowDataRate(12, 250000) && !LowDataRate(10, 125000) && !LowDataRate(11, 250000), "LDRO");
+  WriteRegister(SX1276REG_ModemConfig3, (LowDataRate() ? 1 << 3 : 0) | (1 << 2));
+}
 
-  // Pin header DIO5 (bits 5-4): Clk Out: 10
-  WriteRegister(SX1276REG_DioMapping2, 0x20);
+ICACHE_FLASH_ATTR
+bool SX1276Radio::SetDataRate(byte spreading_factor, byte bandwidth)
+{
+  if (spreading_factor < 7 || spreading_factor > 12 || bandwidth > SX1276_LORA_BW_500000) { return false; }
+  spreading_factor_ = spreading_factor;
+  bandwidth_hz_ = BitfieldToBandwidth(bandwidth);
+  rx_warm_ = false;
+  WriteModemConfig();
+  return true;
+}
+
+ICACHE_FLASH_ATTR
+byte SX1276Radio::GetBandwidth() const
+{
+  return BandwidthToBitfield(bandwidth_hz_);
+}
+
+ICACHE_FLASH_ATTR
+uint16_t SX1276Radio::SymbolsFor(uint16_t ms) const
+{
+  uint32_t symbol_us = (1000000UL << spreading_factor_) / bandwidth_hz_;
+  uint32_t symbols = ((uint32_t)ms * 1000 + symbol_us - 1) / symbol_us;
+  return symbols > 0x3ff ? 0x3ff : symbols;
+}
+
+ICACHE_FLASH_ATTR
+void SX1276Radio::SetTxPower(int dbm)
+{
+#if defined(SX1276_HIGH_POWER)
+  // PA_BOOST: 2 + OutputPower dBm, 3dB more with the high power DAC
+  if (dbm > 17) {
+    if (dbm > 20) { dbm = 20; }
+    WriteRegister(SX1276REG_PaConfig, 0xf0 | (dbm - 5));
+    WriteRegister(SX1276REG_PaDac, 0x87);
+  } else {
+    if (dbm < 2) { dbm = 2; }
+    WriteRegister(SX1276REG_PaConfig, 0xf0 | (dbm - 2));
+    WriteRegister(SX1276REG_PaDac, 0x84);
+  }
+#else
+  // RFO with MaxPower 7 (15dBm): 15 - (15 - OutputPower) dBm
+  if (dbm > 15) { dbm = 15; }
+  if (dbm < 0) { dbm = 0; }
+  WriteRegister(SX1276REG_PaConfig, 0x70 | dbm);
+#endif
+}
 
+ICACHE_FLASH_ATTR
+void SX1276Radio::DefaultTxPower()
+{
 #if defined(SX1276_HIGH_POWER)
   WriteRegister(SX1276REG_PaConfig, 0xff); // inAir9b
   WriteRegister(SX1276REG_PaDac, 0x87);
 #else
   // WriteRegister(SX1276REG_PaConfig, 0x7f);
   // Default: WriteRegister(SX1276REG_PaDac, 0x84);
+  WriteRegister(SX1276REG_PaConfig, 0x4f); // The reset value, ~13dBm
 #endif
-
-  // Preamble size
-  WriteRegister(SX1276REG_PreambleLSB, preamble_);
-
-  return true;
 }
 
 ICACHE_FLASH_ATTR
@@ -289,7 +357,7 @@ int SX1276Radio::PredictTimeOnAir(byte payload_len) const
   int N = (payload_len << 3) - 4 * spreading_factor_ + 28 + 16;
   // FUTURE : if header is disabled enabled, k = k - 20;
   int D = 4 * spreading_factor_;
-  // FUTURE : if low data rate optimisation enabled, D = D - 2
+  if (LowDataRate()) { D -= 8; }
 
   // To avoid float, we need to add 1 if there was a remainder
   N = N / D;  if (N % D) { N++; }
@@ -308,6 +376,14 @@ int SX1276Radio::PredictTimeOnAir(byte payload_len) const
   return Tpreamble + Tpayload;
 }
 
+ICACHE_FLASH_ATTR
+void SX1276Radio::SetSymbolTimeout(uint16_t symbols)
+{
+  symbol_timeout_ = symbols > 0x3ff ? 0x3ff : symbols;
+  WriteRegister(SX1276REG_ModemConfig2, (spreading_factor_ << 4) | (0 << 3)| (1 << 2) | ((symbol_timeout_ >> 8) & 0x03));
+  WriteRegister(SX1276REG_SymbTimeoutLsb, symbol_timeout_ & 0xff);
+}
+
 ICACHE_FLASH_ATTR
 void SX1276Radio::Standby()
 {
@@ -417,34 +493,44 @@ bool SX1276Radio::ReceiveMessage(byte buffer[], byte size, byte& received, bool&
     //DEBUG("BUFFER MAYBE TOO SHORT! DATA POTENTIALLY MAY BE LOST!\n\r");
   }
 
+  ReceiveStart();
+
+  // Now we block, until symbol timeout or we get a message
+  // and for the purpose of the ESP8266, we need to yield occasionally
+  bool finished = false;
+  do {
+    if (ReceivePoll(buffer, size, received, crc_error, finished)) { return true; }
+    if (!finished) { yield(); }
+  } while (!finished);
+  return false;
+}
+
+ICACHE_FLASH_ATTR
+void SX1276Radio::ReceiveStart()
+{
   // In most use cases we probably want to to this once then stay 'warm'
   ReceiveInit();
 
   WriteRegister(SX1276REG_IrqFlags, 0xff); // note, this one cant be verified; clears on 0xff write
 
   WriteRegister(SX1276REG_OpMode, 0x86); // RX Single mode
+}
 
-  // Now we block, until symbol timeout or we get a message
+ICACHE_FLASH_ATTR
+bool SX1276Radio::ReceivePoll(byte buffer[], byte size, byte& received, bool& crc_error, bool& finished)
+{
   // Which in practice means polling the IRQ flags
-  // and for the purpose of the ESP8266, we need to yield occasionally
-
-  bool done = false;
-  bool symbol_timeout = false;
   crc_error = false;
+  finished = false;
   byte flags = 0;
-  do {
-    flags = 0;
-    ReadRegister(SX1276REG_IrqFlags, flags);
-    if (flags & (1 << 4)) {
-      // valid header
-    }
-    if (flags & (1 << 6)) {
-      done = true;
-      break;
-    }
-    symbol_timeout = flags & (1 << 7);
-    if (!symbol_timeout) { yield(); }
-  } while (!symbol_timeout);
+  ReadRegister(SX1276REG_IrqFlags, flags);
+  if (flags & (1 << 4)) {
+    // valid header
+  }
+  bool done = flags & (1 << 6);
+  bool symbol_timeout = flags & (1 << 7);
+  if (!done && !symbol_timeout) { return false; }
+  finished = true;
 
   byte v = 0;
   byte stat = 0;
@@ -485,6 +571,10 @@ bool SX1276Radio::ReceiveMessage(byte buffer[], byte size, byte& received, bool&
 
   payloadSizeBytes--; // DONT KNOW WHY, I THINK FifoRxNbBytes points 1 down
 
+  // Each packet lands at the RX base again, but our read pointer is still after the last one
+  ReadRegister(SX1276REG_FifoRxCurrentAddr, v);
+  WriteRegister(SX1276REG_FifoAddrPtr, v);
+
   DEBUG("[DBUG] ");
   DEBUG("RX rssi_pkt=%d ", rssi_packet);
   DEBUG("snr_pkt=%d ", snr_packet);
@@ -494,7 +584,7 @@ bool SX1276Radio::ReceiveMessage(byte buffer[], byte size, byte& received, bool&
   DEBUG("hdrcnt=%d pktcnt=%d\n\r", (unsigned)headerCount, (unsigned)packetCount);
 
   // check CRC ...
-  if ((flags & (1 << 5)) == 1) {
+  if ((flags & (1 << 5)) != 0) {
     DEBUG("CRC Error. Packet rssi=%ddBm snr=%d cr=4/%d\n\r", rssi_packet, snr_packet, coding_rate);
     crc_error = true;
     return false;
@@ -508,7 +598,24 @@ bool SX1276Radio::ReceiveMessage(byte buffer[], byte size, byte& received, bool&
   for (unsigned n=0; n < payloadSizeBytes; n++) {
     ReadRegister(SX1276REG_Fifo, v);
     buffer[n] = v;
+    // Save the SPI traffic of reading out a message meant for someone else
+    if (rx_filter_ && n + 1 == rx_filter_len_ && !rx_filter_(buffer, rx_filter_len_, rx_filter_context_)) {
+      num_filtered_ ++;
+      return false;
+    }
+  }
+  if (rx_filter_ && payloadSizeBytes < rx_filter_len_ && !rx_filter_(buffer, payloadSizeBytes, rx_filter_context_)) {
+    num_filtered_ ++;
+    return false;
   }
   received = payloadSizeBytes;
   return true;
 }
+
+ICACHE_FLASH_ATTR
+void SX1276Radio::SetReceiveFilter(rx_filter_t filter, void* context, byte header_len)
+{
+  rx_filter_ = filter;
+  rx_filter_context_ = context;
+  rx_filter_len_ = header_len;
+}
@@ -34,6 +34,9 @@
 class SX1276Radio
 {
 public:
+  /// Decides from the first bytes of a message whether it is worth reading the rest
+  typedef bool (*rx_filter_t)(const byte header[], byte len, void* context);
+
   SX1276Radio(int cs_pin, const SPISettings& spi_settings);
 
   /// Revert to Standby mode and return all settings to a useful default
@@ -63,6 +66,29 @@ public:
   /// Return the SX1276 to LoRa standby mode
   void Standby();
 
+  /// How many symbols a receive waits for a preamble before giving up; short for a receive window
+  void SetSymbolTimeout(uint16_t symbols);
+
+  /// Symbols lasting at least ms at the present data rate, e.g. for SetSymbolTimeout()
+  uint16_t SymbolsFor(uint16_t ms) const;
+
+  /// Change spreading factor and bandwidth, e.g. when told to by the gateway (adaptive data rate)
+  /// @param spreading_factor 7..12
+  /// @param bandwidth Datasheet units, i.e. SX1276_LORA_BW_125000 etc.
+  /// @return false if either is out of range
+  bool SetDataRate(byte spreading_factor, byte bandwidth);
+
+  byte GetSpreadingFactor() const { return spreading_factor_; }
+
+  /// Bandwidth in datasheet units
+  byte GetBandwidth() const;
+
+  /// Set the transmit power, clamped to what the PA can do (up to 20dBm with SX1276_HIGH_POWER, else 15dBm)
+  void SetTxPower(int dbm);
+
+  /// Return to the transmit power Begin() leaves
+  void DefaultTxPower();
+
   /// Calcluates the estimated time on air in rounded up milliseconds for a given simple payload
   /// based on the formulae in the SX1276 datasheet
   int PredictTimeOnAir(byte payload_len) const;
@@ -84,6 +110,23 @@ public:
   /// @return false if timeout or crc error
   bool ReceiveMessage(byte buffer[], byte size, byte& received, bool& crc_error);
 
+  /// Start listening for one message (RX single), and return straight away.
+  /// Follow with ReceivePoll() until it reports finished.
+  void ReceiveStart();
+
+  /// Check on a receive begun by ReceiveStart(), without blocking
+  /// @param finished Set to true once a message arrived, or the symbol timeout expired
+  /// @return true if a message was received into buffer; the other parameters are as ReceiveMessage()
+  bool ReceivePoll(byte buffer[], byte size, byte& received, bool& crc_error, bool& finished);
+
+  /// Check the first header_len bytes of each message with filter before reading the rest out of the FIFO.
+  /// A message the filter rejects is left in the FIFO and reported like a symbol timeout.
+  /// Pass NULL to receive everything.
+  void SetReceiveFilter(rx_filter_t filter, void* context, byte header_len);
+
+  /// Messages rejected by the receive filter
+  uint16_t GetFilteredCount() const { return num_filtered_; }
+
 
   bool fault() const { return dead_; }
 
@@ -95,6 +138,16 @@ private:
 
   void ReceiveInit();
 
+  /// Write spreading factor, bandwidth, coding rate and symbol timeout
+  void WriteModemConfig();
+
+  /// Low data rate optimisation is mandated when a symbol lasts longer than 16ms.
+  /// In microseconds, as the gateway works it out: the two ends must agree, and SF11 at 125kHz is 16.384ms
+  static constexpr bool LowDataRate(byte spreading_factor, uint32_t bandwidth_hz) {
+    return ((uint64_t)1000000 << spreading_factor) / bandwidth_hz > 16000;
+  }
+  bool LowDataRate() const { return LowDataRate(spreading_factor_, bandwidth_hz_); }
+
   // module settings
   int cs_pin_;
   SPISettings spi_settings_;
@@ -113,6 +166,11 @@ private:
   int rx_snr_db_;
   bool rx_warm_;
   bool dead_;
+
+  rx_filter_t rx_filter_;
+  void* rx_filter_context_;
+  byte rx_filter_len_;
+  uint16_t num_filtered_;
 };
 
 #endif //SX1276_H__
@@ -53,6 +53,7 @@
 #define SX1276REG_PayloadLength     0x22
 #define SX1276REG_MaxPayloadLength  0x23
 #define SX1276REG_FifoRxByteAddrPtr 0x25
+#define SX1276REG_ModemConfig3      0x26
 #define SX1276REG_DioMapping1       0x40
 #define SX1276REG_DioMapping2       0x41
 #define SX1276REG_Version           0x42
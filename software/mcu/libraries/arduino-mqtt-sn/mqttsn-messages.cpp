@@ -57,7 +57,8 @@ _gateway_id(0),
 _response_timer(0),
 _response_retries(0)
 {
-    memset(topic_table, 0, sizeof(topic) * MAX_TOPICS);
+    clear_topics();
+    clear_inflight();
     memset(message_buffer, 0, MAX_BUFFER_SIZE);
     memset(response_buffer, 0, MAX_BUFFER_SIZE);
 }
@@ -77,12 +78,13 @@ bool MQTTSN::wait_for_response() {
                 waiting_for_response = false;
                 disconnect_handler(NULL);
             } else {
-                send_message();
+                send_message(message_buffer);
             }
 
             --_response_retries;
         }
     }
+    retry_inflight();
 
     return waiting_for_response;
 }
@@ -92,17 +94,234 @@ uint16_t MQTTSN::bswap(const uint16_t val) {
 }
 
 ICACHE_FLASH_ATTR
-uint16_t MQTTSN::find_topic_id(const char* name, uint8_t& index) {
-    for (uint8_t i = 0; i < topic_count; ++i) {
-        if (strcmp(topic_table[i].name, name) == 0) {
-            index = i;
-            return topic_table[i].id;
+uint16_t MQTTSN::find_topic_id(const char* name, uint16_t& index) {
+    const uint16_t i = lookup_name(name, strlen(name));
+    if (i == 0xffff) {
+        return 0xffff;
+    }
+    index = i;
+    return topic_table[i].id;
+}
+
+ICACHE_FLASH_ATTR
+const char* MQTTSN::find_topic_name(const uint16_t topic_id) const {
+    const uint16_t i = lookup_id(topic_id);
+    return i == 0xffff ? NULL : topic_table[i].name;
+}
+
+// FNV-1a
+uint16_t MQTTSN::hash_name(const char* name, size_t len) {
+    uint32_t h = 2166136261u;
+    while (len--) {
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+    }
+    return (uint16_t)(h ^ (h >> 16));
+}
+
+uint16_t MQTTSN::hash_id(const uint16_t id) {
+    // Gateways hand out ids sequentially; spread them out
+    return (uint16_t)((id * 40503u) >> 4);
+}
+
+uint16_t MQTTSN::lookup_name(const char* name, size_t len) const {
+    const uint16_t mask = TOPIC_SLOTS - 1;
+    for (uint16_t slot = hash_name(name, len) & mask; name_index[slot] != 0; slot = (slot + 1) & mask) {
+        const char* candidate = topic_table[name_index[slot] - 1].name;
+        if (strncmp(candidate, name, len) == 0 && candidate[len] == 0) {
+            return name_index[slot] - 1;
         }
     }
+    return 0xffff;
+}
 
+uint16_t MQTTSN::lookup_id(const uint16_t id) const {
+    const uint16_t mask = TOPIC_SLOTS - 1;
+    for (uint16_t slot = hash_id(id) & mask; id_index[slot] != 0; slot = (slot + 1) & mask) {
+        if (topic_table[id_index[slot] - 1].id == id) {
+            return id_index[slot] - 1;
+        }
+    }
     return 0xffff;
 }
 
+// Copy a name, which need not be terminated, into the arena. NULL if there is no room.
+ICACHE_FLASH_ATTR
+const char* MQTTSN::store_name(const char* name, size_t len) {
+    if (topic_names_used + len + 1 > sizeof(topic_names)) {
+        return NULL;
+    }
+    char* stored = topic_names + topic_names_used;
+    memcpy(stored, name, len);
+    stored[len] = 0;
+    topic_names_used += len + 1;
+    return stored;
+}
+
+ICACHE_FLASH_ATTR
+bool MQTTSN::add_topic(const char* stored_name, const uint16_t id) {
+    if (topic_count >= MAX_TOPICS) {
+        return false;
+    }
+    const uint16_t index = topic_count++;
+    topic_table[index].name = stored_name;
+    topic_table[index].id = id;
+
+    const uint16_t mask = TOPIC_SLOTS - 1;
+    uint16_t slot = hash_name(stored_name, strlen(stored_name)) & mask;
+    while (name_index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    name_index[slot] = index + 1;
+    index_topic_id(index);
+    return true;
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::set_topic_id(const uint16_t index, const uint16_t id) {
+    if (topic_table[index].id == id) {
+        return;
+    }
+    unindex_topic_id(index);
+    topic_table[index].id = id;
+    index_topic_id(index);
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::index_topic_id(const uint16_t index) {
+    const uint16_t mask = TOPIC_SLOTS - 1;
+    uint16_t slot = hash_id(topic_table[index].id) & mask;
+    while (id_index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    id_index[slot] = index + 1;
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::unindex_topic_id(const uint16_t index) {
+    const uint16_t mask = TOPIC_SLOTS - 1;
+    uint16_t hole = hash_id(topic_table[index].id) & mask;
+    while (id_index[hole] != index + 1) {
+        if (id_index[hole] == 0) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+    // Backward shift deletion: pull later entries of the probe run into the hole,
+    // unless that would move them before their home slot
+    for (uint16_t next = (hole + 1) & mask; id_index[next] != 0; next = (next + 1) & mask) {
+        const uint16_t home = hash_id(topic_table[id_index[next] - 1].id) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            id_index[hole] = id_index[next];
+            hole = next;
+        }
+    }
+    id_index[hole] = 0;
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::clear_topics() {
+    topic_count = 0;
+    topic_names_used = 0;
+    memset(name_index, 0, sizeof(name_index));
+    memset(id_index, 0, sizeof(id_index));
+}
+
+// Give back the space of a name not added to the table, if nothing was stored after it
+ICACHE_FLASH_ATTR
+void MQTTSN::release_name(const char* name) {
+    if (name + strlen(name) + 1 == topic_names + topic_names_used) {
+        topic_names_used = name - topic_names;
+    }
+}
+
+ICACHE_FLASH_ATTR
+MQTTSN::inflight* MQTTSN::alloc_inflight() {
+    for (uint8_t i = 0; i < MAX_INFLIGHT; ++i) {
+        if (_inflight[i].type == ADVERTISE) {
+            _inflight[i].topic_name = NULL;
+            return &_inflight[i];
+        }
+    }
+    return NULL;
+}
+
+ICACHE_FLASH_ATTR
+MQTTSN::inflight* MQTTSN::find_inflight(const uint8_t type, const uint16_t message_id) {
+    for (uint8_t i = 0; i < MAX_INFLIGHT; ++i) {
+        if (_inflight[i].type == type && _inflight[i].message_id == message_id) {
+            return &_inflight[i];
+        }
+    }
+    return NULL;
+}
+
+ICACHE_FLASH_ATTR
+uint8_t MQTTSN::inflight_count() const {
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < MAX_INFLIGHT; ++i) {
+        if (_inflight[i].type != ADVERTISE) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::send_inflight(inflight& slot, const uint8_t* msg) {
+    const message_header* hdr = reinterpret_cast<const message_header*>(msg);
+    slot.type = hdr->type;
+    slot.timer = millis();
+    slot.retries = N_RETRY;
+    DEBUG("TX %s id=%u\n\r", message_names[hdr->type], slot.message_id);
+    send_message_impl(msg, hdr->length);
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::free_inflight(inflight& slot) {
+    if (slot.type == REGISTER && slot.topic_name != NULL) {
+        const uint16_t index = lookup_name(slot.topic_name, strlen(slot.topic_name));
+        if (index == 0xffff || topic_table[index].name != slot.topic_name) {
+            release_name(slot.topic_name);
+        }
+    }
+    slot.type = ADVERTISE;
+    slot.topic_name = NULL;
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::clear_inflight() {
+    for (uint8_t i = 0; i < MAX_INFLIGHT; ++i) {
+        _inflight[i].type = ADVERTISE;
+        _inflight[i].topic_name = NULL;
+    }
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::retry_inflight() {
+    for (uint8_t i = 0; i < MAX_INFLIGHT; ++i) {
+        inflight& slot = _inflight[i];
+        if (slot.type == ADVERTISE || (millis() - slot.timer) <= (T_RETRY * 1000L)) {
+            continue;
+        }
+        if (slot.retries == 0) {
+            // The gateway has gone: same as running out of retries on anything else
+            for (uint8_t j = 0; j < MAX_INFLIGHT; ++j) {
+                if (_inflight[j].type != ADVERTISE) {
+                    free_inflight(_inflight[j]);
+                }
+            }
+            disconnect_handler(NULL);
+            return;
+        }
+        if (slot.type == PUBLISH) {
+            reinterpret_cast<msg_publish*>(slot.buffer)->flags |= FLAG_DUP;
+        }
+        const uint8_t retries = slot.retries - 1;
+        send_inflight(slot, slot.buffer);
+        slot.retries = retries;
+    }
+}
+
 ICACHE_FLASH_ATTR
 void MQTTSN::parse() {
   if (parse_impl(response_buffer)) {
@@ -112,9 +331,41 @@ void MQTTSN::parse() {
 
 ICACHE_FLASH_ATTR
 void MQTTSN::dispatch() {
-    message_header* response_message = (message_header*)response_buffer;
+    dispatch(response_buffer, MAX_BUFFER_SIZE);
+}
+
+// Smallest valid message of each type we handle; anything shorter is dropped
+ICACHE_FLASH_ATTR
+uint8_t MQTTSN::min_length(const uint8_t type) {
+    switch (type) {
+    case ADVERTISE: return sizeof(msg_advertise);
+    case GWINFO: return sizeof(msg_gwinfo);
+    case CONNACK: return sizeof(msg_connack);
+    case REGISTER: return sizeof(msg_register);
+    case REGACK: return sizeof(msg_regack);
+    case PUBLISH: return sizeof(msg_publish);
+    case PUBACK: return sizeof(msg_puback);
+    case SUBACK: return sizeof(msg_suback);
+    case UNSUBACK: return sizeof(msg_unsuback);
+    case PINGREQ: return sizeof(msg_pingreq);
+    case WILLTOPICRESP: return sizeof(msg_willtopicresp);
+    case WILLMSGRESP: return sizeof(msg_willmsgresp);
+    default: return sizeof(message_header);   // e.g. DISCONNECT, whose duration is optional
+    }
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::dispatch(const uint8_t* data, const uint8_t length) {
+    const message_header* response_message = reinterpret_cast<const message_header*>(data);
     bool handled = true;
 
+    // A length byte of 1 introduces the 3 byte form, for messages longer than we can receive
+    if (length < sizeof(message_header) || response_message->length > length ||
+        response_message->length < min_length(response_message->type)) {
+        DEBUG("RX BAD LENGTH %d/%d\n\r", length < 1 ? 0 : data[0], length);
+        return;
+    }
+
     if (response_message->type < MAX_MQTTSN_MSG_TYPE) {
       DEBUG("RX %s wait=%02x\n\r", message_names[response_message->type], waiting_for_response ? response_to_wait_for : 0xff);
     } else {
@@ -124,19 +375,19 @@ void MQTTSN::dispatch() {
     switch (response_message->type) {
     case ADVERTISE:
         if (waiting_for_response && response_to_wait_for == ADVERTISE) {
-            advertise_handler((msg_advertise*)response_buffer);
+            advertise_handler((const msg_advertise*)data);
         } else {
             handled = false;
         }
         break;
 
     case GWINFO:
-        gwinfo_handler((msg_gwinfo*)response_buffer);
+        gwinfo_handler((const msg_gwinfo*)data);
         break;
 
     case CONNACK:
         if (waiting_for_response && response_to_wait_for == CONNACK) {
-            connack_handler((msg_connack*)response_buffer);
+            connack_handler((const msg_connack*)data);
         } else {
             handled = false;
         }
@@ -151,32 +402,33 @@ void MQTTSN::dispatch() {
         break;
 
     case REGISTER:
-        register_handler((msg_register*)response_buffer);
-        break;
+        // Sent by the gateway of its own accord, e.g. ahead of messages it kept while we slept,
+        // so no answer to whatever we are waiting for
+        register_handler((const msg_register*)data);
+        return;
 
     case REGACK:
-        if (waiting_for_response && response_to_wait_for == REGACK) {
-            regack_handler((msg_regack*)response_buffer);
-        } else {
-            handled = false;
+        // Matched to its REGISTER by message id, and no concern of waiting_for_response
+        if (inflight* slot = find_inflight(REGISTER, bswap(((const msg_regack*)data)->message_id))) {
+            regack_handler((const msg_regack*)data);
+            free_inflight(*slot);
         }
-        break;
+        return;
 
     case PUBLISH:
-        publish_handler((msg_publish*)response_buffer);
-        break;
+        publish_handler((const msg_publish*)data);
+        return;
 
     case PUBACK:
-        if (waiting_for_response && response_to_wait_for == PUBACK) {
-            puback_handler((msg_puback*)response_buffer);
-        } else {
-            handled = false;
+        if (inflight* slot = find_inflight(PUBLISH, bswap(((const msg_puback*)data)->message_id))) {
+            puback_handler((const msg_puback*)data);
+            free_inflight(*slot);
         }
-        break;
+        return;
 
     case SUBACK:
         if (waiting_for_response && response_to_wait_for == SUBACK) {
-            suback_handler((msg_suback*)response_buffer);
+            suback_handler((const msg_suback*)data);
         } else {
             handled = false;
         }
@@ -184,15 +436,15 @@ void MQTTSN::dispatch() {
 
     case UNSUBACK:
         if (waiting_for_response && response_to_wait_for == UNSUBACK) {
-            unsuback_handler((msg_unsuback*)response_buffer);
+            unsuback_handler((const msg_unsuback*)data);
         } else {
             handled = false;
         }
         break;
 
     case PINGREQ:
-        pingreq_handler((msg_pingreq*)response_buffer);
-        break;
+        pingreq_handler((const msg_pingreq*)data);
+        return;
 
     case PINGRESP:
         if (waiting_for_response && response_to_wait_for == PINGRESP) {
@@ -203,12 +455,12 @@ void MQTTSN::dispatch() {
         break;
 
     case DISCONNECT:
-        disconnect_handler((msg_disconnect*)response_buffer);
+        disconnect_handler((const msg_disconnect*)data);
         break;
 
     case WILLTOPICRESP:
         if (waiting_for_response && response_to_wait_for == WILLTOPICRESP) {
-            willtopicresp_handler((msg_willtopicresp*)response_buffer);
+            willtopicresp_handler((const msg_willtopicresp*)data);
         } else {
             handled = false;
         }
@@ -216,7 +468,7 @@ void MQTTSN::dispatch() {
 
     case WILLMSGRESP:
         if (waiting_for_response && response_to_wait_for == WILLMSGRESP) {
-            willmsgresp_handler((msg_willmsgresp*)response_buffer);
+            willmsgresp_handler((const msg_willmsgresp*)data);
         } else {
             handled = false;
         }
@@ -232,10 +484,30 @@ void MQTTSN::dispatch() {
 }
 
 ICACHE_FLASH_ATTR
-void MQTTSN::send_message() {
-    message_header* hdr = reinterpret_cast<message_header*>(message_buffer);
+uint8_t* MQTTSN::tx_buffer_impl(uint8_t& capacity) {
+    capacity = MAX_BUFFER_SIZE;
+    return message_buffer;
+}
+
+// Space for an outgoing message of length bytes, or NULL if it will not fit.
+// Requests that wait_for_response() may resend are built in message_buffer;
+// the rest go straight where the driver wants them.
+ICACHE_FLASH_ATTR
+uint8_t* MQTTSN::begin_message(const size_t length, const bool retain) {
+    uint8_t capacity = MAX_BUFFER_SIZE;
+    uint8_t* buf = retain ? message_buffer : tx_buffer_impl(capacity);
+    if (length > capacity) {
+        DEBUG("TX TOO BIG %u/%u\n\r", (unsigned)length, (unsigned)capacity);
+        return NULL;
+    }
+    return buf;
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::send_message(const uint8_t* buf) {
+    const message_header* hdr = reinterpret_cast<const message_header*>(buf);
     DEBUG("TX %s\n\r", hdr->type < MAX_MQTTSN_MSG_TYPE ? message_names[hdr->type] : ">UNKNOWN");
-    send_message_impl(message_buffer, hdr->length);
+    send_message_impl(buf, hdr->length);
     if (!waiting_for_response) {
         _response_timer = millis();
         _response_retries = N_RETRY;
@@ -251,6 +523,41 @@ void MQTTSN::timeout() {
     response_to_wait_for = ADVERTISE;
 }
 
+ICACHE_FLASH_ATTR
+bool MQTTSN::save_session(session_state& state) const {
+    if (topic_count > MAX_SESSION_TOPICS) {
+        return false;
+    }
+    state.message_id = _message_id;
+    state.gateway_id = _gateway_id;
+    state.topic_count = topic_count;
+    for (uint8_t i = 0; i < topic_count; ++i) {
+        if (strlen(topic_table[i].name) >= MAX_SESSION_TOPIC_NAME) {
+            return false;
+        }
+        state.topic_ids[i] = topic_table[i].id;
+        strcpy(state.topic_names[i], topic_table[i].name);
+    }
+    return true;
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSN::restore_session(const session_state& state) {
+    _message_id = state.message_id;
+    _gateway_id = state.gateway_id;
+    clear_topics();
+    clear_inflight();
+    const uint8_t count = state.topic_count > MAX_SESSION_TOPICS ? MAX_SESSION_TOPICS : state.topic_count;
+    for (uint8_t i = 0; i < count; ++i) {
+        const char* name = store_name(state.topic_names[i], strnlen(state.topic_names[i], MAX_SESSION_TOPIC_NAME - 1));
+        if (name == NULL || !add_topic(name, state.topic_ids[i])) {
+            break;
+        }
+    }
+    waiting_for_response = false;
+    _response_retries = 0;
+}
+
 ICACHE_FLASH_ATTR
 void MQTTSN::advertise_handler(const msg_advertise* msg) {
     _gateway_id = msg->gw_id;
@@ -274,22 +581,16 @@ void MQTTSN::willmsgreq_handler(const message_header* msg) {
 
 ICACHE_FLASH_ATTR
 void MQTTSN::regack_handler(const msg_regack* msg) {
-  DEBUG("REGACK %d %d %d %d\n\r", (int)msg->return_code, topic_count, bswap(msg->message_id), _message_id);
-    if (msg->return_code == 0 && topic_count < MAX_TOPICS && bswap(msg->message_id) == _message_id) {
+  DEBUG("REGACK %d %d %d\n\r", (int)msg->return_code, topic_count, bswap(msg->message_id));
+    const inflight* slot = find_inflight(REGISTER, bswap(msg->message_id));
+    if (msg->return_code == ACCEPTED && slot != NULL) {
         const uint16_t topic_id = bswap(msg->topic_id);
+        const uint16_t index = lookup_name(slot->topic_name, strlen(slot->topic_name));
 
-        bool found_topic = false;
-
-        for (uint8_t i = 0; i < topic_count; ++i) {
-            if (topic_table[i].id == topic_id) {
-                found_topic = true;
-                break;
-            }
-        }
-
-        if (!found_topic) {
-            topic_table[topic_count].id = topic_id;
-            ++topic_count;
+        if (index != 0xffff) {
+            set_topic_id(index, topic_id);
+        } else {
+            add_topic(slot->topic_name, topic_id);
         }
     }
 }
@@ -334,13 +635,8 @@ ICACHE_FLASH_ATTR
 void MQTTSN::publish_handler(const msg_publish* msg) {
     if (msg->flags & FLAG_QOS_1) {
         return_code_t ret = REJECTED_INVALID_TOPIC_ID;
-        const uint16_t topic_id = bswap(msg->topic_id);
-
-        for (uint8_t i = 0; i < topic_count; ++i) {
-            if (topic_table[i].id == topic_id) {
-                ret = ACCEPTED;
-                break;
-            }
+        if (lookup_id(bswap(msg->topic_id)) != 0xffff) {
+            ret = ACCEPTED;
         }
 
         puback(msg->topic_id, msg->message_id, ret);
@@ -349,13 +645,20 @@ void MQTTSN::publish_handler(const msg_publish* msg) {
 
 ICACHE_FLASH_ATTR
 void MQTTSN::register_handler(const msg_register* msg) {
-    return_code_t ret = REJECTED_INVALID_TOPIC_ID;
-    uint8_t index;
-    find_topic_id(msg->topic_name, index);
+    // The gateway tells us the id it will use for a topic, e.g. one matching a wildcard subscription
+    return_code_t ret = REJECTED_CONGESTION;
+    const size_t len = msg->length > sizeof(msg_register) ? msg->length - sizeof(msg_register) : 0;
+    const uint16_t topic_id = bswap(msg->topic_id);
+    const uint16_t index = lookup_name(msg->topic_name, len);
 
     if (index != 0xffff) {
-        topic_table[index].id = bswap(msg->topic_id);
+        set_topic_id(index, topic_id);
         ret = ACCEPTED;
+    } else if (topic_count < MAX_TOPICS) {
+        const char* name = store_name(msg->topic_name, len);
+        if (name != NULL && add_topic(name, topic_id)) {
+            ret = ACCEPTED;
+        }
     }
 
     regack(msg->topic_id, msg->message_id, ret);
@@ -371,29 +674,33 @@ void MQTTSN::willmsgresp_handler(const msg_willmsgresp* msg) {
 
 ICACHE_FLASH_ATTR
 void MQTTSN::searchgw(const uint8_t radius) {
-    msg_searchgw* msg = reinterpret_cast<msg_searchgw*>(message_buffer);
+    msg_searchgw* msg = reinterpret_cast<msg_searchgw*>(begin_message(sizeof(msg_searchgw), true));
 
     msg->length = sizeof(msg_searchgw);
     msg->type = SEARCHGW;
     msg->radius = radius;
 
-    send_message();
+    send_message(message_buffer);
     waiting_for_response = true;
     response_to_wait_for = GWINFO;
 }
 
 ICACHE_FLASH_ATTR
 void MQTTSN::connect(const uint8_t flags, const uint16_t duration, const char* client_id) {
-    msg_connect* msg = reinterpret_cast<msg_connect*>(message_buffer);
+    const size_t len = strlen(client_id);
+    msg_connect* msg = reinterpret_cast<msg_connect*>(begin_message(sizeof(msg_connect) + len, true));
+    if (msg == NULL) {
+        return;
+    }
 
-    msg->length = sizeof(msg_connect) + strlen(client_id);
+    msg->length = sizeof(msg_connect) + len;
     msg->type = CONNECT;
     msg->flags = flags;
     msg->protocol_id = PROTOCOL_ID;
     msg->duration = bswap(duration);
-    strcpy(msg->client_id, client_id);
+    memcpy(msg->client_id, client_id, len);
 
-    send_message();
+    send_message(message_buffer);
     waiting_for_response = true;
     response_to_wait_for = CONNACK;
 }
@@ -401,20 +708,25 @@ void MQTTSN::connect(const uint8_t flags, const uint16_t duration, const char* c
 ICACHE_FLASH_ATTR
 void MQTTSN::willtopic(const uint8_t flags, const char* will_topic, const bool update) {
     if (will_topic == NULL) {
-        message_header* msg = reinterpret_cast<message_header*>(message_buffer);
+        message_header* msg = reinterpret_cast<message_header*>(begin_message(sizeof(message_header), false));
 
         msg->type = update ? WILLTOPICUPD : WILLTOPIC;
         msg->length = sizeof(message_header);
+        send_message(reinterpret_cast<uint8_t*>(msg));
     } else {
-        msg_willtopic* msg = reinterpret_cast<msg_willtopic*>(message_buffer);
+        const size_t len = strlen(will_topic);
+        msg_willtopic* msg = reinterpret_cast<msg_willtopic*>(begin_message(sizeof(msg_willtopic) + len, false));
+        if (msg == NULL) {
+            return;
+        }
 
+        msg->length = sizeof(msg_willtopic) + len;
         msg->type = update ? WILLTOPICUPD : WILLTOPIC;
         msg->flags = flags;
-        strcpy(msg->will_topic, will_topic);
+        memcpy(msg->will_topic, will_topic, len);
+        send_message(reinterpret_cast<uint8_t*>(msg));
     }
 
-    send_message();
-
 //    if ((flags & QOS_MASK) == FLAG_QOS_1 || (flags & QOS_MASK) == FLAG_QOS_2) {
 //        waiting_for_response = true;
 //        response_to_wait_for = WILLMSGREQ;
@@ -423,63 +735,78 @@ void MQTTSN::willtopic(const uint8_t flags, const char* will_topic, const bool u
 
 ICACHE_FLASH_ATTR
 void MQTTSN::willmsg(const void* will_msg, const uint8_t will_msg_len, const bool update) {
-    msg_willmsg* msg = reinterpret_cast<msg_willmsg*>(message_buffer);
+    msg_willmsg* msg = reinterpret_cast<msg_willmsg*>(begin_message(sizeof(msg_willmsg) + will_msg_len, false));
+    if (msg == NULL) {
+        return;
+    }
 
     msg->length = sizeof(msg_willmsg) + will_msg_len;
     msg->type = update ? WILLMSGUPD : WILLMSG;
     memcpy(msg->willmsg, will_msg, will_msg_len);
 
-    send_message();
+    send_message(reinterpret_cast<uint8_t*>(msg));
 }
 
 ICACHE_FLASH_ATTR
 void MQTTSN::disconnect(const uint16_t duration) {
-    msg_disconnect* msg = reinterpret_cast<msg_disconnect*>(message_buffer);
+    msg_disconnect* msg = reinterpret_cast<msg_disconnect*>(begin_message(sizeof(msg_disconnect), true));
 
     msg->length = sizeof(message_header);
     msg->type = DISCONNECT;
 
     if (duration > 0) {
-        msg->length += sizeof(msg_disconnect);
+        msg->length = sizeof(msg_disconnect);
         msg->duration = bswap(duration);
     }
 
-    send_message();
+    send_message(message_buffer);
     waiting_for_response = true;
     response_to_wait_for = DISCONNECT;
 }
 
 ICACHE_FLASH_ATTR
 bool MQTTSN::register_topic(const char* name) {
-    if (!waiting_for_response && topic_count < (MAX_TOPICS - 1)) {
-        ++_message_id;
-
-        // Fill in the next table entry, but we only increment the counter to
-        // the next topic when we get a REGACK from the broker. So don't issue
-        // another REGISTER until we have resolved this one.
-        topic_table[topic_count].name = name;
-        topic_table[topic_count].id = 0;
-
-        msg_register* msg = reinterpret_cast<msg_register*>(message_buffer);
-
-        msg->length = sizeof(msg_register) + strlen(name);
-        msg->type = REGISTER;
-        msg->topic_id = 0;
-        msg->message_id = bswap(_message_id);
-        strcpy(msg->topic_name, name);
-
-        send_message();
-        waiting_for_response = true;
-        response_to_wait_for = REGACK;
-        return true;
+    if (waiting_for_response || topic_count >= MAX_TOPICS) {
+        return false;
+    }
+    // Already on its way
+    for (uint8_t i = 0; i < MAX_INFLIGHT; ++i) {
+        if (_inflight[i].type == REGISTER && strcmp(_inflight[i].topic_name, name) == 0) {
+            return true;
+        }
+    }
+    const size_t len = strlen(name);
+    if (sizeof(msg_register) + len > MAX_BUFFER_SIZE) {
+        return false;
     }
+    inflight* slot = alloc_inflight();
+    msg_register* msg = reinterpret_cast<msg_register*>(begin_message(sizeof(msg_register) + len, false));
+    if (slot == NULL || msg == NULL) {
+        return false;
+    }
+    // The name is kept with the slot, and only added to the table when we get a REGACK from the broker
+    slot->topic_name = store_name(name, len);
+    if (slot->topic_name == NULL) {
+        return false;
+    }
+    ++_message_id;
 
-    return false;
+    msg->length = sizeof(msg_register) + len;
+    msg->type = REGISTER;
+    msg->topic_id = 0;
+    msg->message_id = bswap(_message_id);
+    memcpy(msg->topic_name, name, len);
+
+    // Sent from where it was built; the slot keeps a copy for resending
+    memcpy(slot->buffer, msg, msg->length);
+    slot->message_id = _message_id;
+    send_inflight(*slot, reinterpret_cast<uint8_t*>(msg));
+    return true;
 }
 
 ICACHE_FLASH_ATTR
 void MQTTSN::regack(const uint16_t topic_id, const uint16_t message_id, const return_code_t return_code) {
-    msg_regack* msg = reinterpret_cast<msg_regack*>(message_buffer);
+    msg_regack* msg = reinterpret_cast<msg_regack*>(begin_message(sizeof(msg_regack), false));
 
     msg->length = sizeof(msg_regack);
     msg->type = REGACK;
@@ -487,15 +814,28 @@ void MQTTSN::regack(const uint16_t topic_id, const uint16_t message_id, const re
     msg->message_id = bswap(message_id);
     msg->return_code = return_code;
 
-    send_message();
+    send_message(reinterpret_cast<uint8_t*>(msg));
 }
 
 ICACHE_FLASH_ATTR
-void MQTTSN::publish(const uint8_t flags, const uint16_t topic_id, const void* data, const uint8_t data_len) {
+bool MQTTSN::publish(const uint8_t flags, const uint16_t topic_id, const void* data, const uint8_t data_len) {
+    // Acknowledged messages wait in a slot of the in-flight window; several can be outstanding
+    inflight* slot = NULL;
+    if ((flags & QOS_MASK) == FLAG_QOS_1 || (flags & QOS_MASK) == FLAG_QOS_2) {
+        if (sizeof(msg_publish) + data_len > MAX_BUFFER_SIZE) {
+            return false;
+        }
+        slot = alloc_inflight();
+        if (slot == NULL) {
+            return false;
+        }
+    }
+    msg_publish* msg = reinterpret_cast<msg_publish*>(begin_message(sizeof(msg_publish) + data_len, false));
+    if (msg == NULL) {
+        return false;
+    }
     ++_message_id;
 
-    msg_publish* msg = reinterpret_cast<msg_publish*>(message_buffer);
-
     msg->length = sizeof(msg_publish) + data_len;
     msg->type = PUBLISH;
     msg->flags = flags;
@@ -503,46 +843,48 @@ void MQTTSN::publish(const uint8_t flags, const uint16_t topic_id, const void* d
     msg->message_id = bswap(_message_id);
     memcpy(msg->data, data, data_len);
 
-    send_message();
-
-    if ((flags & QOS_MASK) == FLAG_QOS_1 || (flags & QOS_MASK) == FLAG_QOS_2) {
-        waiting_for_response = true;
-        response_to_wait_for = PUBACK;
+    if (slot != NULL) {
+        memcpy(slot->buffer, msg, msg->length);
+        slot->message_id = _message_id;
+        send_inflight(*slot, reinterpret_cast<uint8_t*>(msg));
+    } else {
+        send_message(reinterpret_cast<uint8_t*>(msg));
     }
+    return true;
 }
 
 #ifdef USE_QOS2
 void MQTTSN::pubrec() {
-    msg_pubqos2* msg = reinterpret_cast<msg_pubqos2*>(message_buffer);
+    msg_pubqos2* msg = reinterpret_cast<msg_pubqos2*>(begin_message(sizeof(msg_pubqos2), false));
     msg->length = sizeof(msg_pubqos2);
     msg->type = PUBREC;
     msg->message_id = bswap(_message_id);
 
-    send_message();
+    send_message(reinterpret_cast<uint8_t*>(msg));
 }
 
 void MQTTSN::pubrel() {
-    msg_pubqos2* msg = reinterpret_cast<msg_pubqos2*>(message_buffer);
+    msg_pubqos2* msg = reinterpret_cast<msg_pubqos2*>(begin_message(sizeof(msg_pubqos2), false));
     msg->length = sizeof(msg_pubqos2);
     msg->type = PUBREL;
     msg->message_id = bswap(_message_id);
 
-    send_message();
+    send_message(reinterpret_cast<uint8_t*>(msg));
 }
 
 void MQTTSN::pubcomp() {
-    msg_pubqos2* msg = reinterpret_cast<msg_pubqos2*>(message_buffer);
+    msg_pubqos2* msg = reinterpret_cast<msg_pubqos2*>(begin_message(sizeof(msg_pubqos2), false));
     msg->length = sizeof(msg_pubqos2);
     msg->type = PUBCOMP;
     msg->message_id = bswap(_message_id);
 
-    send_message();
+    send_message(reinterpret_cast<uint8_t*>(msg));
 }
 #endif
 
 ICACHE_FLASH_ATTR
 void MQTTSN::puback(const uint16_t topic_id, const uint16_t message_id, const return_code_t return_code) {
-    msg_puback* msg = reinterpret_cast<msg_puback*>(message_buffer);
+    msg_puback* msg = reinterpret_cast<msg_puback*>(begin_message(sizeof(msg_puback), false));
 
     msg->length = sizeof(msg_puback);
     msg->type = PUBACK;
@@ -550,24 +892,27 @@ void MQTTSN::puback(const uint16_t topic_id, const uint16_t message_id, const re
     msg->message_id = bswap(message_id);
     msg->return_code = return_code;
 
-    send_message();
+    send_message(reinterpret_cast<uint8_t*>(msg));
 }
 
 ICACHE_FLASH_ATTR
 void MQTTSN::subscribe_by_name(const uint8_t flags, const char* topic_name) {
-    ++_message_id;
-
-    msg_subscribe* msg = reinterpret_cast<msg_subscribe*>(message_buffer);
-
     // The -2 here is because we're unioning a 0-length member (topic_name)
     // with a uint16_t in the msg_subscribe struct.
-    msg->length = sizeof(msg_subscribe) + strlen(topic_name) - 2;
+    const size_t len = strlen(topic_name);
+    msg_subscribe* msg = reinterpret_cast<msg_subscribe*>(begin_message(sizeof(msg_subscribe) + len - 2, true));
+    if (msg == NULL) {
+        return;
+    }
+    ++_message_id;
+
+    msg->length = sizeof(msg_subscribe) + len - 2;
     msg->type = SUBSCRIBE;
     msg->flags = (flags & QOS_MASK) | FLAG_TOPIC_NAME;
     msg->message_id = bswap(_message_id);
-    strcpy(msg->topic_name, topic_name);
+    memcpy(msg->topic_name, topic_name, len);
 
-    send_message();
+    send_message(message_buffer);
 
     if ((flags & QOS_MASK) == FLAG_QOS_1 || (flags & QOS_MASK) == FLAG_QOS_2) {
         waiting_for_response = true;
@@ -579,7 +924,7 @@ ICACHE_FLASH_ATTR
 void MQTTSN::subscribe_by_id(const uint8_t flags, const uint16_t topic_id) {
     ++_message_id;
 
-    msg_subscribe* msg = reinterpret_cast<msg_subscribe*>(message_buffer);
+    msg_subscribe* msg = reinterpret_cast<msg_subscribe*>(begin_message(sizeof(msg_subscribe), true));
 
     msg->length = sizeof(msg_subscribe);
     msg->type = SUBSCRIBE;
@@ -587,7 +932,7 @@ void MQTTSN::subscribe_by_id(const uint8_t flags, const uint16_t topic_id) {
     msg->message_id = bswap(_message_id);
     msg->topic_id = bswap(topic_id);
 
-    send_message();
+    send_message(message_buffer);
 
     if ((flags & QOS_MASK) == FLAG_QOS_1 || (flags & QOS_MASK) == FLAG_QOS_2) {
         waiting_for_response = true;
@@ -597,19 +942,22 @@ void MQTTSN::subscribe_by_id(const uint8_t flags, const uint16_t topic_id) {
 
 ICACHE_FLASH_ATTR
 void MQTTSN::unsubscribe_by_name(const uint8_t flags, const char* topic_name) {
-    ++_message_id;
-
-    msg_unsubscribe* msg = reinterpret_cast<msg_unsubscribe*>(message_buffer);
-
     // The -2 here is because we're unioning a 0-length member (topic_name)
     // with a uint16_t in the msg_unsubscribe struct.
-    msg->length = sizeof(msg_unsubscribe) + strlen(topic_name) - 2;
+    const size_t len = strlen(topic_name);
+    msg_unsubscribe* msg = reinterpret_cast<msg_unsubscribe*>(begin_message(sizeof(msg_unsubscribe) + len - 2, true));
+    if (msg == NULL) {
+        return;
+    }
+    ++_message_id;
+
+    msg->length = sizeof(msg_unsubscribe) + len - 2;
     msg->type = UNSUBSCRIBE;
     msg->flags = (flags & QOS_MASK) | FLAG_TOPIC_NAME;
     msg->message_id = bswap(_message_id);
-    strcpy(msg->topic_name, topic_name);
+    memcpy(msg->topic_name, topic_name, len);
 
-    send_message();
+    send_message(message_buffer);
 
     if ((flags & QOS_MASK) == FLAG_QOS_1 || (flags & QOS_MASK) == FLAG_QOS_2) {
         waiting_for_response = true;
@@ -621,7 +969,7 @@ ICACHE_FLASH_ATTR
 void MQTTSN::unsubscribe_by_id(const uint8_t flags, const uint16_t topic_id) {
     ++_message_id;
 
-    msg_unsubscribe* msg = reinterpret_cast<msg_unsubscribe*>(message_buffer);
+    msg_unsubscribe* msg = reinterpret_cast<msg_unsubscribe*>(begin_message(sizeof(msg_unsubscribe), true));
 
     msg->length = sizeof(msg_unsubscribe);
     msg->type = UNSUBSCRIBE;
@@ -629,7 +977,7 @@ void MQTTSN::unsubscribe_by_id(const uint8_t flags, const uint16_t topic_id) {
     msg->message_id = bswap(_message_id);
     msg->topic_id = bswap(topic_id);
 
-    send_message();
+    send_message(message_buffer);
 
     if ((flags & QOS_MASK) == FLAG_QOS_1 || (flags & QOS_MASK) == FLAG_QOS_2) {
         waiting_for_response = true;
@@ -639,12 +987,16 @@ void MQTTSN::unsubscribe_by_id(const uint8_t flags, const uint16_t topic_id) {
 
 ICACHE_FLASH_ATTR
 void MQTTSN::pingreq(const char* client_id) {
-    msg_pingreq* msg = reinterpret_cast<msg_pingreq*>(message_buffer);
-    msg->length = sizeof(msg_pingreq) + strlen(client_id);
+    const size_t len = strlen(client_id);
+    msg_pingreq* msg = reinterpret_cast<msg_pingreq*>(begin_message(sizeof(msg_pingreq) + len, true));
+    if (msg == NULL) {
+        return;
+    }
+    msg->length = sizeof(msg_pingreq) + len;
     msg->type = PINGREQ;
-    strcpy(msg->client_id, client_id);
+    memcpy(msg->client_id, client_id, len);
 
-    send_message();
+    send_message(message_buffer);
 
     waiting_for_response = true;
     response_to_wait_for = PINGRESP;
@@ -652,11 +1004,11 @@ void MQTTSN::pingreq(const char* client_id) {
 
 ICACHE_FLASH_ATTR
 void MQTTSN::pingresp() {
-    message_header* msg = reinterpret_cast<message_header*>(message_buffer);
+    message_header* msg = reinterpret_cast<message_header*>(begin_message(sizeof(message_header), false));
     msg->length = sizeof(message_header);
     msg->type = PINGRESP;
 
-    send_message();
+    send_message(reinterpret_cast<uint8_t*>(msg));
 }
 
 #ifdef USE_RF12
@@ -29,16 +29,63 @@ THE SOFTWARE.
 
 #include "mqttsn.h"
 
+// Size of the topic table. The defaults suit a leaf; a gateway or test client
+// can build with e.g. -DMQTTSN_MAX_TOPICS=4096 -DMQTTSN_TOPIC_NAME_SPACE=131072
+#ifndef MQTTSN_MAX_TOPICS
+#define MQTTSN_MAX_TOPICS 10
+#endif
+// Bytes for topic names, including terminators
+#ifndef MQTTSN_TOPIC_NAME_SPACE
+#define MQTTSN_TOPIC_NAME_SPACE 256
+#endif
+
+// Largest message kept for resending (requests and QoS 1 PUBLISH). The SX1276 FIFO
+// takes 255 bytes less 12 of relayed link framing; parts short of RAM keep the original 92.
+#ifndef MQTTSN_MAX_BUFFER_SIZE
+#if defined(ESP8266) || defined(SF_HOST)
+#define MQTTSN_MAX_BUFFER_SIZE 243
+#else
+#define MQTTSN_MAX_BUFFER_SIZE 92
+#endif
+#endif
+
+// QoS 1 PUBLISH and REGISTER messages that may await acknowledgement at once
+#ifndef MQTTSN_MAX_INFLIGHT
+#define MQTTSN_MAX_INFLIGHT 4
+#endif
+
+// Hash table slots for n topics: a power of two, at most half full
+constexpr unsigned mqttsn_topic_slots(unsigned n, unsigned slots = 4) {
+    return slots >= 2 * n ? slots : mqttsn_topic_slots(n, slots * 2);
+}
 
 class MQTTSN {
 public:
-    enum { MAX_TOPICS = 10 } ;
-    enum { MAX_BUFFER_SIZE = 92 };
+    enum { MAX_TOPICS = MQTTSN_MAX_TOPICS } ;
+    enum { TOPIC_SLOTS = mqttsn_topic_slots(MQTTSN_MAX_TOPICS) };
+    enum { MAX_BUFFER_SIZE = MQTTSN_MAX_BUFFER_SIZE };
+    enum { MAX_INFLIGHT = MQTTSN_MAX_INFLIGHT };
+    enum { MAX_SESSION_TOPICS = 4 };
+    enum { MAX_SESSION_TOPIC_NAME = 40 };
+
+    // Enough state to carry on a session without CONNECT / REGISTER, e.g. across a deep sleep.
+    // Plain data, so it can be copied to and from non-volatile memory as is.
+    struct session_state {
+        uint16_t message_id;
+        uint8_t gateway_id;
+        uint8_t topic_count;
+        uint16_t topic_ids[MAX_SESSION_TOPICS];
+        char topic_names[MAX_SESSION_TOPICS][MAX_SESSION_TOPIC_NAME];
+    };
 
     MQTTSN();
     virtual ~MQTTSN();
 
-    uint16_t find_topic_id(const char* name, uint8_t& index);
+    uint16_t find_topic_id(const char* name, uint16_t& index);
+    // Name registered for topic_id, or NULL
+    const char* find_topic_name(const uint16_t topic_id) const;
+    // Also runs the retry timers of in-flight messages. Returns true while a
+    // CONNECT or other request that must complete before anything else is outstanding.
     bool wait_for_response();
 
     void parse();
@@ -47,8 +94,12 @@ public:
     void connect(const uint8_t flags, const uint16_t duration, const char* client_id);
     void willtopic(const uint8_t flags, const char* will_topic, const bool update = false);
     void willmsg(const void* will_msg, const uint8_t will_msg_len, const bool update = false);
+    // Returns false if the message could not be sent now, e.g. the in-flight window is full
     bool register_topic(const char* name);
-    void publish(const uint8_t flags, const uint16_t topic_id, const void* data, const uint8_t data_len);
+    bool publish(const uint8_t flags, const uint16_t topic_id, const void* data, const uint8_t data_len);
+    // PUBLISH and REGISTER messages awaiting PUBACK / REGACK
+    uint8_t inflight_count() const;
+    bool inflight_full() const { return inflight_count() >= MAX_INFLIGHT; }
 #ifdef USE_QOS2
     void pubrec();
     void pubrel();
@@ -64,11 +115,22 @@ public:
 
     virtual void timeout();
 
+    // Returns false if the topic table does not fit in a session_state
+    bool save_session(session_state& state) const;
+    // Picks up where a saved session left off, ready to publish.
+    void restore_session(const session_state& state);
+
 protected:
     // When data is received then copy it into response
-    // must not exceed MAX_BUFFER_SIZE
+    // must not exceed MAX_BUFFER_SIZE.
+    // Or, to save the copy, call dispatch(buf, length) on the received data and return false
     virtual bool parse_impl(uint8_t* response) = 0;
+    // msg may be the buffer handed out by tx_buffer_impl(), already in place
     virtual void send_message_impl(const uint8_t* msg, uint8_t length) = 0;
+    // Where to build outgoing messages that are not kept for resending, e.g. straight
+    // into the driver's transmit buffer after room for its link header.
+    // Sets capacity to the space available there. Defaults to message_buffer.
+    virtual uint8_t* tx_buffer_impl(uint8_t& capacity);
 
     virtual void advertise_handler(const msg_advertise* msg);
     virtual void gwinfo_handler(const msg_gwinfo* msg);
@@ -96,26 +158,68 @@ protected:
     void puback(const uint16_t topic_id, const uint16_t message_id, const return_code_t return_code);
 
     void dispatch();
+    // Checks the message lengths then calls the handler with a view of data, which
+    // need only stay valid for the duration of the call
+    void dispatch(const uint8_t* data, const uint8_t length);
 
 private:
+    // An acknowledged message on its way: it is resent from here until the ack arrives
+    struct inflight {
+        uint8_t type;               // PUBLISH or REGISTER; ADVERTISE (0) when free
+        uint8_t retries;
+        uint16_t message_id;
+        uint32_t timer;
+        const char* topic_name;     // REGISTER: the name, in topic_names, to add on REGACK
+        uint8_t buffer[MAX_BUFFER_SIZE];
+    };
+
     struct topic {
-        const char* name;
+        const char* name;   // Points into topic_names
         uint16_t id;
     };
 
     uint16_t bswap(const uint16_t val);
-    void send_message();
+    static uint8_t min_length(const uint8_t type);
+    uint8_t* begin_message(const size_t length, const bool retain);
+    void send_message(const uint8_t* buf);
+
+    // Topic table: entries are never removed, only cleared all at once
+    static uint16_t hash_name(const char* name, size_t len);
+    static uint16_t hash_id(const uint16_t id);
+    uint16_t lookup_name(const char* name, size_t len) const;
+    uint16_t lookup_id(const uint16_t id) const;
+    const char* store_name(const char* name, size_t len);
+    bool add_topic(const char* stored_name, const uint16_t id);
+    void set_topic_id(const uint16_t index, const uint16_t id);
+    void index_topic_id(const uint16_t index);
+    void unindex_topic_id(const uint16_t index);
+    void clear_topics();
+    void release_name(const char* name);
+
+    inflight* alloc_inflight();
+    inflight* find_inflight(const uint8_t type, const uint16_t message_id);
+    void send_inflight(inflight& slot, const uint8_t* msg);
+    void free_inflight(inflight& slot);
+    void clear_inflight();
+    void retry_inflight();
 
     // Set to true when we're waiting for some sort of acknowledgement from the
     //server that will transition our state.
     bool waiting_for_response;
     uint8_t response_to_wait_for;
     uint16_t _message_id;
-    uint8_t topic_count;
+    uint16_t topic_count;
 
     uint8_t message_buffer[MAX_BUFFER_SIZE];
     uint8_t response_buffer[MAX_BUFFER_SIZE];
     topic topic_table[MAX_TOPICS];
+    // Open addressed with linear probing; each slot holds a topic_table index + 1, or 0 if empty
+    uint16_t name_index[TOPIC_SLOTS];
+    uint16_t id_index[TOPIC_SLOTS];
+    // Topic names live here, so callers need not keep theirs
+    char topic_names[MQTTSN_TOPIC_NAME_SPACE];
+    size_t topic_names_used;
+    inflight _inflight[MAX_INFLIGHT];
 
     uint8_t _gateway_id;
     uint32_t _response_timer;
@@ -26,42 +26,56 @@
 namespace Sentrifarm {
 
   // --------------------------------------------------------------------------
-  void read_bmp_once(SensorData& sensorData, Adafruit_BMP085_Unified& bmp)
+  /// First half of read_bmp_once(): detect the chip and load its calibration
+  bool begin_bmp(Adafruit_BMP085_Unified& bmp)
   {
     // Note: this calls Wire.begin()
     // If experiencing issues with i2c then look at boot ordering
     if(!bmp.begin(BMP085_MODE_STANDARD))
     {
       Serial.println(F("Error detecting BMP-085!"));
-      sensorData.have_bmp180 = false;
+      return false;
+    }
+    sensor_t sensor;
+    bmp.getSensor(&sensor);
+    Serial.println(F("------------- BMP-085 --------------"));
+    Serial.print  (F("Sensor:       ")); Serial.println(sensor.name);
+    Serial.print  (F("Driver Ver:   ")); Serial.println(sensor.version);
+    Serial.print  (F("Unique ID:    ")); Serial.println(sensor.sensor_id);
+    Serial.print  (F("Max Value:    ")); Serial.print(sensor.max_value); Serial.println(F(" hPa"));
+    Serial.print  (F("Min Value:    ")); Serial.print(sensor.min_value); Serial.println(F(" hPa"));
+    Serial.print  (F("Resolution:   ")); Serial.print(sensor.resolution); Serial.println(F(" hPa"));
+    Serial.println(F("------------------------------------"));
+    return true;
+  }
+
+  /// Second half of read_bmp_once(): take the measurements
+  void read_bmp(SensorData& sensorData, Adafruit_BMP085_Unified& bmp)
+  {
+    sensors_event_t event;
+    bmp.getEvent(&event);
+    if (event.pressure) {
+      // IDEA: use a 3-axis module to get improved SLP?
+      float seaLevelPressure = SENSORS_PRESSURE_SEALEVELHPA;
+      float pressure = event.pressure;
+      float temperature = 0.F;
+      bmp.getTemperature(&temperature);
+      sensorData.ambient_hpa = pressure;
+      sensorData.ambient_degc = temperature;
+      sensorData.altitude_m = bmp.pressureToAltitude(seaLevelPressure, pressure);
+      sensorData.have_bmp180 = true;
     } else {
-      sensor_t sensor;
-      bmp.getSensor(&sensor);
-      Serial.println(F("------------- BMP-085 --------------"));
-      Serial.print  (F("Sensor:       ")); Serial.println(sensor.name);
-      Serial.print  (F("Driver Ver:   ")); Serial.println(sensor.version);
-      Serial.print  (F("Unique ID:    ")); Serial.println(sensor.sensor_id);
-      Serial.print  (F("Max Value:    ")); Serial.print(sensor.max_value); Serial.println(F(" hPa"));
-      Serial.print  (F("Min Value:    ")); Serial.print(sensor.min_value); Serial.println(F(" hPa"));
-      Serial.print  (F("Resolution:   ")); Serial.print(sensor.resolution); Serial.println(F(" hPa"));
-      Serial.println(F("------------------------------------"));
+      Serial.println(F("Error reading BMP-085!"));
+      sensorData.have_bmp180 = false;
+    }
+  }
 
-      sensors_event_t event;
-      bmp.getEvent(&event);
-      if (event.pressure) {
-        // IDEA: use a 3-axis module to get improved SLP?
-        float seaLevelPressure = SENSORS_PRESSURE_SEALEVELHPA;
-        float pressure = event.pressure;
-        float temperature = 0.F;
-        bmp.getTemperature(&temperature);
-        sensorData.ambient_hpa = pressure;
-        sensorData.ambient_degc = temperature;
-        sensorData.altitude_m = bmp.pressureToAltitude(seaLevelPressure, pressure);
-        sensorData.have_bmp180 = true;
-      } else {
-        Serial.println(F("Error reading BMP-085!"));
-        sensorData.have_bmp180 = false;
-      }
+  void read_bmp_once(SensorData& sensorData, Adafruit_BMP085_Unified& bmp)
+  {
+    if (begin_bmp(bmp)) {
+      read_bmp(sensorData, bmp);
+    } else {
+      sensorData.have_bmp180 = false;
     }
   }
 
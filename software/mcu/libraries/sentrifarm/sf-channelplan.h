@@ -0,0 +1,75 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENTRIFARM_CHANNELPLAN_H__
+#define SENTRIFARM_CHANNELPLAN_H__
+
+#include <stdint.h>
+
+namespace Sentrifarm {
+
+  /// Set of carriers the network uses, so nodes can be spread across channels instead of all sharing 919MHz.
+  ///
+  /// A node either sits on one channel chosen from a hash of its id, or hops to a new channel
+  /// each time it wakes, keyed by its wake counter. Either way the gateway needs to be listening
+  /// on the channel: one radio per channel, or (per node, single radio) configured to match.
+  ///
+  /// Base, spacing and count must match the gateway's SX1276_CHANNEL_PLAN.
+  struct ChannelPlan
+  {
+    enum Mode { FIXED, PER_NODE, HOPPING };
+
+    uint32_t base_hz;        ///< Channel 0
+    uint32_t spacing_hz;
+    uint8_t num_channels;
+
+    ChannelPlan(uint32_t base=919000000, uint32_t spacing=400000, uint8_t count=8)
+      : base_hz(base), spacing_hz(spacing), num_channels(count ? count : 1)
+    {}
+
+    uint32_t frequency(uint8_t channel) const { return base_hz + (uint32_t)(channel % num_channels) * spacing_hz; }
+
+    /// Integer hash, so consecutive ids / counters land on unrelated channels
+    static uint32_t mix(uint32_t x) {
+      x ^= x >> 16; x *= 0x7feb352dU;
+      x ^= x >> 15; x *= 0x846ca68bU;
+      x ^= x >> 16;
+      return x;
+    }
+
+    /// Node id from the last four bytes of the MAC
+    static uint32_t node_id(const uint8_t mac[6]) {
+      return ((uint32_t)mac[2] << 24) | ((uint32_t)mac[3] << 16) | ((uint32_t)mac[4] << 8) | mac[5];
+    }
+
+    uint8_t node_channel(uint32_t node) const { return mix(node) % num_channels; }
+
+    uint8_t hop_channel(uint32_t node, uint32_t counter) const { return mix(node ^ mix(counter)) % num_channels; }
+
+    uint8_t channel(Mode mode, uint8_t fixed_channel, uint32_t node, uint32_t counter) const {
+      switch (mode) {
+      case PER_NODE: return node_channel(node);
+      case HOPPING: return hop_channel(node, counter);
+      default: return fixed_channel % num_channels;
+      }
+    }
+  };
+}
+
+#endif // SENTRIFARM_CHANNELPLAN_H__
@@ -40,6 +40,8 @@
 //     RST,21
 //     LED4,5
 //     I2C 18, 19
+//
+// (3) Linux process (SF_HOST), see software/mcu/host: pin numbers are notional
 
 #if defined(ESP8266)
 
@@ -81,6 +83,22 @@
 // I2C is using the teensy default for I2c (18,19) on the adaptor shield
 // So we dont need to specifically setup the pins
 
+#elif defined(SF_HOST)
+
+// No LED to watch, and its flashes only slow down the boot
+#define DISABLE_LED4
+
+#define PIN_DHT          2
+
+#define PIN_SX1276_RST   0
+#define PIN_SX1276_CS   15
+#define PIN_SX1276_MISO 12
+#define PIN_SX1276_MOSI 13
+#define PIN_SX1276_SCK  14
+
+#define PIN_SDA          5
+#define PIN_SCL          4
+
 #endif
 
 /// Notional reference voltage on PCF8591 Vref pin - millivolts
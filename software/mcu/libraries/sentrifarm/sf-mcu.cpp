@@ -50,6 +50,8 @@ namespace Sentrifarm {
     led4_flash();
 #elif defined(ESP8266)
     Serial.println(F("ESP8266 ESP-201"));
+#elif defined(SF_HOST)
+    Serial.println(F("HOST"));
 #endif
   }
 
@@ -117,6 +119,10 @@ namespace Sentrifarm {
     CPU_RESTART
     delay(250);
     Serial.println(F("Never!"));
+#elif defined(SF_HOST)
+    Serial.println();
+    delay(ms);
+    host_reset();
 #else
     delay(ms);
 #endif
@@ -191,6 +197,20 @@ namespace Sentrifarm {
     delay(50);
   }
 
+#if defined(SF_HOST)
+  void read_host_mac(uint8_t mac[6])
+  {
+    const char *id = getenv("SF_HOST_ID");
+    unsigned n = id ? strtoul(id, NULL, 0) : 1;
+    mac[0] = 0x02; // locally administered
+    mac[1] = 'S';
+    mac[2] = 'F';
+    mac[3] = 0;
+    mac[4] = (n >> 8) & 0xff;
+    mac[5] = n & 0xff;
+  }
+#endif
+
   void scan_i2c_bus()
   {
 #if defined(TEENSYDUINO)
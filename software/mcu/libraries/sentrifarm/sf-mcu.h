@@ -30,6 +30,10 @@ extern "C" uint16_t readvdd33(void);
 
 #elif defined(TEENSYDUINO)
 
+#elif defined(SF_HOST)
+
+// Linux process, see software/mcu/host
+
 #else
 
 #error "Unsupported hardware configuration"
@@ -50,6 +54,11 @@ namespace Sentrifarm {
 
   void deep_sleep_and_reset(int ms);
 
+#if defined(SF_HOST)
+  /// Made up MAC, so several leaves can run on one host: 02:53:46:00:hi:lo from $SF_HOST_ID (default 1)
+  void read_host_mac(uint8_t mac[6]);
+#endif
+
   void scan_i2c_bus();
 
   void led4_on();
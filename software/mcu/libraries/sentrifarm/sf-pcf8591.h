@@ -25,66 +25,83 @@
 namespace Sentrifarm {
 
   // --------------------------------------------------------------------------
-  void read_pcf8591_once(SensorData& sensorData)
+  /// Read one channel into sensorData, filtering out junk
+  /// @return false if the chip did not respond
+  bool read_pcf8591_channel(SensorData& sensorData, byte ch)
   {
     byte adcValue = 0;
-    sensorData.have_pcf8591 = false;
 
-    for (byte ch=0; ch <4; ch++) {
-      Wire.beginTransmission(PCF8591_I2C_ADDR);
-      Wire.write(ch | 0x40);   // Enable DAC when using internal oscillator
-      Wire.write(0);
-      if (Wire.endTransmission() != 0) {
-        return;
-      }
-      // Read each value 5 times and average/discard, to try and account for the fact
-      // that randomly there will be junk
-      byte value[5];
-      for (byte r=0; r < 5; r++) {
-        Wire.requestFrom(PCF8591_I2C_ADDR, 2);
-        if (!Wire.available()) { goto done; }
-        Wire.read();
-        if (!Wire.available()) { goto done; }
-        value[r] = Wire.read();
-      }
-      float mean = 0;
-      for (byte r=0; r < 5; r++) {
-        mean += value[r];
-      }
-      mean /= 5.F;
-      // Scan for data that is way off the mean and discard it
-      byte dist[5];
-      float meandist = 0;
+    Wire.beginTransmission(PCF8591_I2C_ADDR);
+    Wire.write(ch | 0x40);   // Enable DAC when using internal oscillator
+    Wire.write(0);
+    if (Wire.endTransmission() != 0) {
+      return false;
+    }
+    // Read each value 5 times and average/discard, to try and account for the fact
+    // that randomly there will be junk
+    byte value[5];
+    for (byte r=0; r < 5; r++) {
+      Wire.requestFrom(PCF8591_I2C_ADDR, 2);
+      if (!Wire.available()) { return false; }
+      Wire.read();
+      if (!Wire.available()) { return false; }
+      value[r] = Wire.read();
+    }
+    float mean = 0;
+    for (byte r=0; r < 5; r++) {
+      mean += value[r];
+    }
+    mean /= 5.F;
+    // Scan for data that is way off the mean and discard it
+    byte dist[5];
+    float meandist = 0;
+    for (byte r=0; r < 5; r++) {
+      meandist += (dist[r] = abs(float(value[r]) - mean));
+    }
+    meandist /= 5;
+    // re-average
+    if (meandist > 0) {
+      mean = 0;
+      byte nvalid = 0;
       for (byte r=0; r < 5; r++) {
-        meandist += (dist[r] = abs(float(value[r]) - mean));
+        if (dist[r] < meandist) { mean += value[r]; nvalid ++; }
       }
-      meandist /= 5;
-      // re-average
-      if (meandist > 0) {
-        mean = 0;
-        byte nvalid = 0;
-        for (byte r=0; r < 5; r++) {
-          if (dist[r] < meandist) { mean += value[r]; nvalid ++; }
-        }
-        if (nvalid > 0) {
-          mean /= nvalid;
-        }
+      if (nvalid > 0) {
+        mean /= nvalid;
       }
-      adcValue = mean;
-      switch (ch) {
-      case 0: sensorData.adc_data0 = adcValue; break;
-      case 1: sensorData.adc_data1 = adcValue; break;
-      case 2: sensorData.adc_data2 = adcValue; break;
-      case 3: sensorData.adc_data3 = adcValue; break;
-      }
-      delay(100);
     }
-    sensorData.have_pcf8591 = true;
-done:
+    adcValue = mean;
+    switch (ch) {
+    case 0: sensorData.adc_data0 = adcValue; break;
+    case 1: sensorData.adc_data1 = adcValue; break;
+    case 2: sensorData.adc_data2 = adcValue; break;
+    case 3: sensorData.adc_data3 = adcValue; break;
+    }
+    return true;
+  }
+
+  /// Turn the DAC off again once we are finished
+  void pcf8591_off()
+  {
     Wire.beginTransmission(PCF8591_I2C_ADDR);
     Wire.write(0);
     Wire.endTransmission();
   }
+
+  void read_pcf8591_once(SensorData& sensorData)
+  {
+    sensorData.have_pcf8591 = false;
+
+    for (byte ch=0; ch <4; ch++) {
+      if (!read_pcf8591_channel(sensorData, ch)) {
+        pcf8591_off();
+        return;
+      }
+      delay(100);
+    }
+    sensorData.have_pcf8591 = true;
+    pcf8591_off();
+  }
 }
 
 
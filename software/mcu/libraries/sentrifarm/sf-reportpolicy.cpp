@@ -0,0 +1,186 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Arduino.h"
+#include "sf-ioadaptorshield.h"
+#include "sf-reportpolicy.h"
+#include "sf-util.h"
+#include "sf-rtc.h"
+#if defined(ESP8266)
+extern "C" {
+#include "user_interface.h"
+}
+#endif
+
+#define POLICY_MAGIC 0x53465333 // SFS3
+
+#define FLAG_BMP180 (1 << 2)
+#define FLAG_PCF8591 (1 << 1)
+#define FLAG_HUMIDITY (1 << 0)
+
+namespace Sentrifarm {
+
+  ICACHE_FLASH_ATTR
+  ReportPolicy::ReportPolicy()
+    : dirty_(false)
+  {
+    memset(&rtc_, 0, sizeof(rtc_));
+    memset(rules_, 0, sizeof(rules_));
+  }
+
+  ICACHE_FLASH_ATTR
+  void ReportPolicy::SetRule(Field field, uint16_t deadband, uint16_t urgent, byte heartbeat)
+  {
+    rules_[field].deadband = deadband;
+    rules_[field].urgent = urgent;
+    rules_[field].heartbeat = heartbeat;
+  }
+
+  ICACHE_FLASH_ATTR
+  bool ReportPolicy::Load()
+  {
+    static_assert(sizeof(RtcPolicy) % 4 == 0 && RTC_POLICY_BLOCK + sizeof(RtcPolicy) / 4 <= RTC_SLOTS_BLOCK, "RTC layout");
+#if defined(ESP8266)
+    if (system_rtc_mem_read(RTC_POLICY_BLOCK, &rtc_, sizeof(rtc_))) {
+      const byte* start = (const byte*)&rtc_.acked_fields;
+      if (rtc_.magic == POLICY_MAGIC && rtc_.crc == crc16(start, sizeof(rtc_) - (start - (const byte*)&rtc_))) {
+        return true;
+      }
+    }
+#endif
+    memset(&rtc_, 0, sizeof(rtc_));
+    return false;
+  }
+
+  ICACHE_FLASH_ATTR
+  bool ReportPolicy::Save()
+  {
+    if (!dirty_) { return true; }
+#if defined(ESP8266)
+    rtc_.magic = POLICY_MAGIC;
+    const byte* start = (const byte*)&rtc_.acked_fields;
+    rtc_.crc = crc16(start, sizeof(rtc_) - (start - (const byte*)&rtc_));
+    dirty_ = false;
+    return system_rtc_mem_write(RTC_POLICY_BLOCK, &rtc_, sizeof(rtc_));
+#else
+    return false;
+#endif
+  }
+
+  ICACHE_FLASH_ATTR
+  bool ReportPolicy::Present(const CompactSample& sample, Field field)
+  {
+    switch (field) {
+    case PRESSURE: case TEMPERATURE: return sample.flags & FLAG_BMP180;
+    case ADC0: case ADC1: case ADC2: case ADC3: return sample.flags & FLAG_PCF8591;
+    case HUMIDITY: case HUMIDITY_TEMP: return sample.flags & FLAG_HUMIDITY;
+    case VCC: return sample.vcc_20mv != 0;
+    default: return false;
+    }
+  }
+
+  ICACHE_FLASH_ATTR
+  int32_t ReportPolicy::Value(const CompactSample& sample, Field field)
+  {
+    switch (field) {
+    case PRESSURE: return sample.hpa_x10;
+    case TEMPERATURE: return sample.degc_x10;
+    case ADC0: case ADC1: case ADC2: case ADC3: return sample.adc[field - ADC0];
+    case HUMIDITY: return sample.humidity;
+    case HUMIDITY_TEMP: return sample.humidity_degc;
+    case VCC: return sample.vcc_20mv;
+    default: return 0;
+    }
+  }
+
+  ICACHE_FLASH_ATTR
+  void ReportPolicy::SetValue(CompactSample& sample, Field field, int32_t value)
+  {
+    switch (field) {
+    case PRESSURE: sample.hpa_x10 = value; break;
+    case TEMPERATURE: sample.degc_x10 = value; break;
+    case ADC0: case ADC1: case ADC2: case ADC3: sample.adc[field - ADC0] = value; break;
+    case HUMIDITY: sample.humidity = value; break;
+    case HUMIDITY_TEMP: sample.humidity_degc = value; break;
+    case VCC: sample.vcc_20mv = value; break;
+    default: break;
+    }
+  }
+
+  ICACHE_FLASH_ATTR
+  uint16_t ReportPolicy::Decide(CompactSample& sample, bool& urgent)
+  {
+    urgent = false;
+    uint16_t fields = 0;
+    for (byte i=0; i < NUM_FIELDS; i++) {
+      Field field = (Field)i;
+      uint16_t bit = 1 << i;
+      if (!Present(sample, field)) { continue; }
+      const Rule& rule = rules_[i];
+      int32_t value = Value(sample, field);
+      bool report = !(rtc_.reported_fields & bit);
+      if (!report && abs(value - Value(rtc_.reported, field)) > rule.deadband) { report = true; }
+      if (rule.heartbeat && rtc_.since[i] + 1 >= rule.heartbeat) { report = true; }
+      if (rule.urgent && (!(rtc_.acked_fields & bit) || abs(value - Value(rtc_.acked, field)) >= rule.urgent)) {
+        urgent = true;
+      }
+      if (report) {
+        fields |= bit;
+        rtc_.reported_fields |= bit;
+        SetValue(rtc_.reported, field, value);
+        rtc_.since[i] = 0;
+      } else if (rtc_.since[i] < 0xff) {
+        rtc_.since[i] ++;
+      }
+    }
+    sample.fields = fields;
+    dirty_ = true;
+    return fields;
+  }
+
+  ICACHE_FLASH_ATTR
+  void ReportPolicy::Acknowledged(const CompactSample& sample)
+  {
+    for (byte i=0; i < NUM_FIELDS; i++) {
+      if (sample.fields & (1 << i)) {
+        SetValue(rtc_.acked, (Field)i, Value(sample, (Field)i));
+        rtc_.acked_fields |= 1 << i;
+      }
+    }
+    dirty_ = true;
+  }
+
+  ICACHE_FLASH_ATTR
+  void ReportPolicy::Uploaded()
+  {
+    dirty_ = true;
+    if (++rtc_.uploads % RESYNC_UPLOADS != 0) { return; }
+    // Forget everything, so next wake reports every field whole
+    rtc_.acked_fields = 0;
+    rtc_.reported_fields = 0;
+  }
+
+  ICACHE_FLASH_ATTR
+  bool ReportPolicy::Encode(const CompactSample& sample, Field field, int32_t& value) const
+  {
+    value = Value(sample, field);
+    if (!(rtc_.acked_fields & (1 << field))) { return false; }
+    value -= Value(rtc_.acked, field);
+    return true;
+  }
+}
@@ -0,0 +1,115 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SENTRIFARM_REPORT_POLICY_H__
+#define SENTRIFARM_REPORT_POLICY_H__
+
+#include "Arduino.h"
+#include "sf-mcu.h"
+#include "sf-samplebuffer.h"
+
+namespace Sentrifarm {
+
+  /// Decides, field by field, which readings are worth sending, so that on a quiet day
+  /// most wakes have nothing to send and need not power up the radio at all.
+  ///
+  /// A field is reported when it has moved beyond its deadband since it was last reported,
+  /// or when it has gone heartbeat wakes without being reported. A sample whose fields
+  /// are all quiet is not kept. A change of urgent or more since the last acknowledged
+  /// value asks for an upload straight away instead of waiting for a full batch.
+  ///
+  /// Reported values are sent as deltas against the last value the gateway acknowledged,
+  /// so a batch resent after a lost PUBACK decodes to the same readings. Each batch carries
+  /// sequence(), the number of batches acknowledged before it: the receiver cannot know which
+  /// copy of a batch was acknowledged, but it was the last one with that sequence, so deltas
+  /// in batch n are against the readings as of the last batch received numbered n-1.
+  /// A field with no acknowledged value is sent whole; every RESYNC_UPLOADS uploads everything
+  /// is sent whole again, so a receiver that lost track recovers.
+  ///
+  /// The state lives in RTC memory next to the SampleBuffer; only the ESP8266 has that.
+  class ReportPolicy
+  {
+  public:
+    enum Field {
+      PRESSURE,       ///< 0.1 hPa
+      TEMPERATURE,    ///< 0.1 degC
+      ADC0, ADC1, ADC2, ADC3,  ///< Raw counts
+      HUMIDITY,       ///< %
+      HUMIDITY_TEMP,  ///< degC
+      VCC,            ///< 20 mV
+      NUM_FIELDS
+    };
+    enum { RESYNC_UPLOADS = 16 };
+
+    struct Rule {
+      uint16_t deadband;    ///< Change that is not worth reporting, in the units of the field
+      uint16_t urgent;      ///< Change since the last upload that makes an upload due now; zero for never
+      byte heartbeat;       ///< Report at least every this many wakes regardless; zero for never
+    };
+
+    ReportPolicy();
+
+    void SetRule(Field field, uint16_t deadband, uint16_t urgent, byte heartbeat);
+
+    /// Pick up the state from previous wakes
+    /// @return false after a power cycle
+    bool Load();
+    /// Keep the state over deep sleep, if changed since Load()
+    bool Save();
+
+    /// Choose the fields of this wake's sample to report, and record them in sample.fields.
+    /// Counts as a wake for the heartbeats, so call once per wake.
+    /// @param urgent Set if the sample should be uploaded now
+    /// @return the fields to report; zero if the sample need not be kept
+    uint16_t Decide(CompactSample& sample, bool& urgent);
+
+    /// The gateway has the reported fields of sample: they become the base for deltas
+    void Acknowledged(const CompactSample& sample);
+    /// Finished acknowledging a batch
+    void Uploaded();
+    /// Batches acknowledged so far, modulo 256; restarts at zero after a power cycle
+    byte sequence() const { return rtc_.uploads; }
+
+    /// Value to send for field: whole, or relative to the last acknowledged value
+    /// @return true if value is a delta
+    bool Encode(const CompactSample& sample, Field field, int32_t& value) const;
+
+    static bool Present(const CompactSample& sample, Field field);
+    static int32_t Value(const CompactSample& sample, Field field);
+    static void SetValue(CompactSample& sample, Field field, int32_t value);
+
+  private:
+    /// Layout in RTC memory, after the samples. Size must be a multiple of 4
+    struct RtcPolicy {
+      uint32_t magic;
+      uint16_t crc;                 ///< CRC16 of everything after this field
+      uint16_t acked_fields;        ///< Fields with a value in acked
+      uint16_t reported_fields;     ///< Fields with a value in reported
+      byte uploads;                 ///< Acknowledged uploads, modulo 256
+      byte since[NUM_FIELDS];       ///< Wakes since each field was last reported
+      CompactSample acked;          ///< Last values the gateway acknowledged: base for deltas
+      CompactSample reported;       ///< Last values reported: base for deadbands
+    };
+    RtcPolicy rtc_;
+
+    Rule rules_[NUM_FIELDS];
+    bool dirty_;
+  };
+}
+
+#endif // SENTRIFARM_REPORT_POLICY_H__
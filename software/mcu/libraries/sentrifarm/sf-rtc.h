@@ -0,0 +1,32 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENTRIFARM_RTC_H__
+#define SENTRIFARM_RTC_H__
+
+// Where each module keeps its state in RTC user memory across deep sleep, in 4 byte blocks.
+// User memory is blocks 64..191 on the ESP8266; each module checks its state fits before the next.
+#define RTC_BEACON_BLOCK   64   // leaf.ino beacon_counter
+#define RTC_SESSION_BLOCK  65   // MQTTSX1276 session, see sx1276mqttsn.cpp
+#define RTC_SAMPLES_BLOCK  110  // SampleBuffer
+#define RTC_POLICY_BLOCK   176  // ReportPolicy
+#define RTC_SLOTS_BLOCK    189  // SlotClock
+#define RTC_END_BLOCK      192
+
+#endif // SENTRIFARM_RTC_H__
@@ -0,0 +1,167 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Arduino.h"
+#include "sf-ioadaptorshield.h"
+#include "sf-samplebuffer.h"
+#include "sf-reportpolicy.h"
+#include "sf-util.h"
+#include "sf-rtc.h"
+#if defined(ESP8266)
+extern "C" {
+#include "user_interface.h"
+}
+#endif
+
+#define SAMPLES_MAGIC 0x53465332 // SFS2
+
+namespace Sentrifarm {
+
+  ICACHE_FLASH_ATTR
+  SampleBuffer::SampleBuffer(byte upload_every)
+    : upload_every_(upload_every < 1 ? 1 : upload_every > MAX_SAMPLES ? MAX_SAMPLES : upload_every),
+      loaded_(false), dirty_(false)
+  {
+    memset(&rtc_, 0, sizeof(rtc_));
+  }
+
+  ICACHE_FLASH_ATTR
+  bool SampleBuffer::Load()
+  {
+    static_assert(sizeof(RtcSamples) % 4 == 0 && RTC_SAMPLES_BLOCK + sizeof(RtcSamples) / 4 <= RTC_POLICY_BLOCK, "RTC layout");
+#if defined(ESP8266)
+    // After a power cycle RTC memory is junk, hence the magic and CRC
+    if (system_rtc_mem_read(RTC_SAMPLES_BLOCK, &rtc_, sizeof(rtc_))) {
+      const byte* start = &rtc_.head;
+      if (rtc_.magic == SAMPLES_MAGIC && rtc_.crc == crc16(start, sizeof(rtc_) - (start - (const byte*)&rtc_)) &&
+          rtc_.head < MAX_SAMPLES && rtc_.count <= MAX_SAMPLES) {
+        loaded_ = true;
+        return true;
+      }
+    }
+#endif
+    memset(&rtc_, 0, sizeof(rtc_));
+    return false;
+  }
+
+  ICACHE_FLASH_ATTR
+  bool SampleBuffer::Save()
+  {
+    if (!dirty_) { return true; }
+#if defined(ESP8266)
+    rtc_.magic = SAMPLES_MAGIC;
+    const byte* start = &rtc_.head;
+    rtc_.crc = crc16(start, sizeof(rtc_) - (start - (const byte*)&rtc_));
+    dirty_ = false;
+    return system_rtc_mem_write(RTC_SAMPLES_BLOCK, &rtc_, sizeof(rtc_));
+#else
+    return false;
+#endif
+  }
+
+  ICACHE_FLASH_ATTR
+  bool SampleBuffer::ScheduledUpload() const
+  {
+    return !loaded_ || rtc_.count + 1 >= upload_every_;
+  }
+
+  ICACHE_FLASH_ATTR
+  void SampleBuffer::Compact(const SensorData& data, CompactSample& sample)
+  {
+    memset(&sample, 0, sizeof(sample));
+    sample.boot = data.bootCount;
+    sample.flags = (data.have_date << 3) | (data.have_bmp180 << 2) | (data.have_pcf8591 << 1) | data.have_humidity;
+    if (data.have_bmp180) {
+      sample.hpa_x10 = data.ambient_hpa * 10.F;
+      sample.degc_x10 = data.ambient_degc * 10.F;
+    }
+    sample.adc[0] = data.adc_data0;
+    sample.adc[1] = data.adc_data1;
+    sample.adc[2] = data.adc_data2;
+    sample.adc[3] = data.adc_data3;
+    if (data.have_humidity) {
+      sample.humidity = data.humidity;
+      sample.humidity_degc = data.humidity_temp;
+    }
+    unsigned vcc = (data.chipVcc + 10) / 20;
+    sample.vcc_20mv = vcc > 0xff ? 0xff : vcc;
+  }
+
+  ICACHE_FLASH_ATTR
+  void SampleBuffer::Add(const CompactSample& sample)
+  {
+    byte slot = (rtc_.head + rtc_.count) % MAX_SAMPLES;
+    if (rtc_.count == MAX_SAMPLES) {
+      rtc_.head = (rtc_.head + 1) % MAX_SAMPLES;   // full: lose the oldest
+    } else {
+      rtc_.count ++;
+    }
+    rtc_.samples[slot] = sample;
+    dirty_ = true;
+  }
+
+  ICACHE_FLASH_ATTR
+  int SampleBuffer::FormatSample(const CompactSample& s, const ReportPolicy& policy, char* buf, int len)
+  {
+    // Sizing pass when buf is NULL, as for snprintf
+    int n = snprintf(buf, len, "\n%u,%u,%x", (unsigned)s.boot, (unsigned)s.flags, (unsigned)s.fields);
+    for (byte i=0; i < ReportPolicy::NUM_FIELDS; i++) {
+      if (!(s.fields & (1 << i))) { continue; }
+      int32_t value;
+      bool delta = policy.Encode(s, (ReportPolicy::Field)i, value);
+      // Not all printf implementations do %+d
+      char sign = !delta ? '=' : value < 0 ? '-' : '+';
+      n += snprintf(buf ? buf + n : NULL, buf ? len - n : 0, ",%c%d", sign, (int)abs(value));
+    }
+    return n;
+  }
+
+  ICACHE_FLASH_ATTR
+  byte SampleBuffer::MakeBatch(char* buf, int len, int rssi, int snr, const ReportPolicy& policy) const
+  {
+    // Work out how many samples fit, then write the lot
+    int n = snprintf(NULL, 0, "Z,%d,%d,%d,%u", (int)rtc_.count, rssi, snr, (unsigned)policy.sequence());
+    byte included = 0;
+    for (; included < rtc_.count; included++) {
+      int m = FormatSample(rtc_.samples[(rtc_.head + included) % MAX_SAMPLES], policy, NULL, 0);
+      if (n + m >= len) { break; }
+      n += m;
+    }
+    if (n >= len) { return 0; }
+    n = snprintf(buf, len, "Z,%d,%d,%d,%u", (int)included, rssi, snr, (unsigned)policy.sequence());
+    for (byte i=0; i < included; i++) {
+      n += FormatSample(rtc_.samples[(rtc_.head + i) % MAX_SAMPLES], policy, buf + n, len - n);
+    }
+    return included;
+  }
+
+  ICACHE_FLASH_ATTR
+  void SampleBuffer::Uploaded(byte count, ReportPolicy& policy)
+  {
+    if (count > rtc_.count) { count = rtc_.count; }
+    if (count == 0) { return; }
+    // In order, so each field ends up with the last value the gateway has
+    for (byte i=0; i < count; i++) {
+      policy.Acknowledged(rtc_.samples[(rtc_.head + i) % MAX_SAMPLES]);
+    }
+    policy.Uploaded();
+    rtc_.head = (rtc_.head + count) % MAX_SAMPLES;
+    rtc_.count -= count;
+    dirty_ = true;
+  }
+}
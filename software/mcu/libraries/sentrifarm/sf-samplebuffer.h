@@ -0,0 +1,101 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENTRIFARM_SAMPLE_BUFFER_H__
+#define SENTRIFARM_SAMPLE_BUFFER_H__
+
+#include "Arduino.h"
+#include "sf-mcu.h"
+#include "sf-sensordata.h"
+
+namespace Sentrifarm {
+
+  class ReportPolicy;
+
+  /// A reading squeezed down for keeping over deep sleep
+  struct CompactSample {
+    uint16_t boot;           ///< Low bits of the boot count, which orders and dates the samples
+    uint16_t fields;         ///< ReportPolicy fields to report, bit per ReportPolicy::Field
+    byte flags;              ///< have_date, have_bmp180, have_pcf8591, have_humidity: bits 3..0
+    byte humidity;           ///< %
+    uint16_t hpa_x10;        ///< BMP180 pressure, 0.1 hPa
+    int16_t degc_x10;        ///< BMP180 temperature, 0.1 degC
+    byte adc[4];             ///< PCF8591 channels, raw
+    int8_t humidity_degc;    ///< DHT temperature
+    byte vcc_20mv;           ///< Supply, 20 mV
+  };
+
+  /// Samples taken every wake, kept in RTC memory until there are enough to be worth
+  /// the CONNECT / REGISTER / PUBLISH / PUBACK exchange, then uploaded together.
+  ///
+  /// Only samples the ReportPolicy thinks worth reporting are kept. An upload is due once
+  /// upload_every have built up, or sooner if the policy says so. When full, the oldest
+  /// sample is overwritten.
+  /// Only the ESP8266 has RTC memory: elsewhere nothing survives, and every wake uploads.
+  class SampleBuffer
+  {
+  public:
+    enum { MAX_SAMPLES = 16 };
+
+    /// @param upload_every Samples per upload
+    SampleBuffer(byte upload_every);
+
+    /// Pick up the samples from previous wakes
+    /// @return false after a power cycle, when there were none
+    bool Load();
+    /// Keep the samples over deep sleep, if changed since Load()
+    bool Save();
+
+    /// Could the sample this wake complete a batch? Then we may as well start connecting now.
+    bool ScheduledUpload() const;
+
+    static void Compact(const SensorData& data, CompactSample& sample);
+
+    void Add(const CompactSample& sample);
+    byte count() const { return rtc_.count; }
+
+    /// Format as many samples as fit, oldest first, as one message:
+    /// Z,count,rssi,snr,sequence then a line per sample of boot,flags,fields in hex, and the value
+    /// of each of those fields in ReportPolicy::Field order: +n or -n relative to the last
+    /// acknowledged value, or =n whole. See ReportPolicy for what sequence means to the receiver.
+    /// @return number of samples included
+    byte MakeBatch(char* buf, int len, int rssi, int snr, const ReportPolicy& policy) const;
+    /// The oldest count samples were acknowledged, so hand them to the policy and forget them
+    void Uploaded(byte count, ReportPolicy& policy);
+
+  private:
+    static int FormatSample(const CompactSample& sample, const ReportPolicy& policy, char* buf, int len);
+
+    /// Layout in RTC memory, after the MQTT-SN session. Size must be a multiple of 4
+    struct RtcSamples {
+      uint32_t magic;
+      uint16_t crc;                 ///< CRC16 of everything after this field
+      byte head;                    ///< Oldest sample
+      byte count;
+      CompactSample samples[MAX_SAMPLES];
+    };
+    RtcSamples rtc_;
+
+    byte upload_every_;
+    bool loaded_;
+    bool dirty_;
+  };
+}
+
+#endif // SENTRIFARM_SAMPLE_BUFFER_H__
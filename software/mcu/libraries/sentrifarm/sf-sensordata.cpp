@@ -76,6 +76,11 @@ namespace Sentrifarm {
       snprintf((char*)buf, sizeof(buf), "ADC#2 %4dmV\n\r", v2); Serial.print(buf);
       snprintf((char*)buf, sizeof(buf), "ADC#3 %4dmV\n\r", v3); Serial.print(buf);
     } else { Serial.println((FF("PCF8591 NOT FOUND"))); }
+
+    snprintf((char*)buf, sizeof(buf), "Timing ms: RTC %u BMP %u ADC %u H/T %u, all %u",
+             (unsigned)read_ms[TIMING_DATETIME], (unsigned)read_ms[TIMING_BMP180],
+             (unsigned)read_ms[TIMING_PCF8591], (unsigned)read_ms[TIMING_HUMIDITY], (unsigned)sensors_ms);
+    Serial.println(buf);
     Serial.println(LINE_DOUBLE);
   }
 
@@ -73,6 +73,12 @@ namespace Sentrifarm {
     float humidity;
     float humidity_temp;
 
+    // How long things took this wake, ms, to see where the awake time goes
+    enum Timing { TIMING_DATETIME, TIMING_BMP180, TIMING_PCF8591, TIMING_HUMIDITY, TIMING_COUNT };
+    uint16_t read_ms[TIMING_COUNT]; ///< Each sensor read, start to finish; the reads overlap
+    uint16_t sensors_ms;            ///< All of the sensor reads together
+    uint32_t awake_ms;              ///< From boot until the data was handed to the radio
+
     void reset() {
       // Requires -DSF_GIT_VERSION to be set...
       strncpy(sw_version, STR_SF_GIT_VERSION, sizeof(sw_version));
@@ -90,6 +96,9 @@ namespace Sentrifarm {
       humidity = -1;
       humidity_temp = -1;
       memset(mac, 0, 6);
+      memset(read_ms, 0, sizeof(read_ms));
+      sensors_ms = 0;
+      awake_ms = 0;
     }
 
     void debug_dump() const;
@@ -0,0 +1,192 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Arduino.h"
+#include "sf-ioadaptorshield.h"
+#include "sf-slotclock.h"
+#include "sf-util.h"
+#include "sf-rtc.h"
+#if defined(ESP8266)
+extern "C" {
+#include "user_interface.h"
+}
+#endif
+
+namespace Sentrifarm {
+
+  ICACHE_FLASH_ATTR
+  SlotClock::SlotClock()
+    : beacon_ms_(0), have_beacon_(false), beacon_wake_(false), slot_(0), slots_(0), slot_ms_(0),
+      drift_ppm_(0), dev_ppm_(INITIAL_DEV_PPM)
+  {
+  }
+
+  ICACHE_FLASH_ATTR
+  bool SlotClock::Load()
+  {
+    static_assert(sizeof(RtcSlots) == 12 && RTC_SLOTS_BLOCK + sizeof(RtcSlots) / 4 <= RTC_END_BLOCK, "RTC layout");
+#if defined(ESP8266)
+    RtcSlots rtc;
+    // After a power cycle RTC memory is junk, hence the CRC
+    if (!system_rtc_mem_read(RTC_SLOTS_BLOCK, &rtc, sizeof(rtc))) { return false; }
+    const byte* start = &rtc.slot;
+    if (rtc.crc != crc16(start, sizeof(rtc) - (start - (const byte*)&rtc)) || rtc.slots < 2 || rtc.slot >= rtc.slots) { return false; }
+    drift_ppm_ = (int32_t)rtc.drift * 10;
+    dev_ppm_ = (int32_t)rtc.dev * 200;
+    if (!rtc.slot || !rtc.slot_ms) { return false; }
+    slot_ = rtc.slot;
+    slots_ = rtc.slots;
+    slot_ms_ = rtc.slot_ms;
+    beacon_wake_ = rtc.periods & 0x80;
+    // We were due to wake this long after the beacon; boot time is taken up in the drift
+    beacon_ms_ = -((int32_t)(rtc.periods & 0x7f) * period_ms() + rtc.phase_ms);
+    have_beacon_ = true;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  ICACHE_FLASH_ATTR
+  bool SlotClock::Save(int32_t wake_ms)
+  {
+#if defined(ESP8266)
+    RtcSlots rtc;
+    memset(&rtc, 0, sizeof(rtc));
+    if (synced()) {
+      int32_t since = wake_ms - beacon_ms_;
+      if (since < 0 || since / period_ms() > MAX_PERIODS) { return false; }
+      rtc.slot = slot_;
+      rtc.slots = slots_;
+      rtc.slot_ms = slot_ms_;
+      rtc.phase_ms = since % period_ms();
+      rtc.periods = (since / period_ms()) | (beacon_wake_ ? 0x80 : 0);
+    } else {
+      rtc.slots = 2;
+    }
+    rtc.drift = drift_ppm_ / 10;
+    rtc.dev = (dev_ppm_ + 199) / 200;
+    const byte* start = &rtc.slot;
+    rtc.crc = crc16(start, sizeof(rtc) - (start - (const byte*)&rtc));
+    return system_rtc_mem_write(RTC_SLOTS_BLOCK, &rtc, sizeof(rtc));
+#else
+    return false;
+#endif
+  }
+
+  ICACHE_FLASH_ATTR
+  bool SlotClock::Beacon(const byte* payload, byte len, uint16_t address, uint32_t now_ms)
+  {
+    if (len < 3) { return false; }
+    uint16_t slot_ms = ((uint16_t)payload[0] << 8) | payload[1];
+    byte slots = payload[2];
+    if (!slot_ms || slots < 2 || (uint32_t)slot_ms * slots > 65535) { return false; }
+
+    // How far out our clock was since the last beacon, if we were counting from one with the same period
+    if (have_beacon_ && slot_ms == slot_ms_ && slots == slots_) {
+      int32_t elapsed = (int32_t)now_ms - beacon_ms_;
+      int32_t n = (elapsed + period_ms() / 2) / period_ms();
+      if (n > 0) {
+        int32_t error_ppm = (int64_t)(n * period_ms() - elapsed) * 1000000 / elapsed;
+        drift_ppm_ += error_ppm / 2;
+        if (drift_ppm_ > MAX_DRIFT_PPM) { drift_ppm_ = MAX_DRIFT_PPM; }
+        if (drift_ppm_ < -MAX_DRIFT_PPM) { drift_ppm_ = -MAX_DRIFT_PPM; }
+        dev_ppm_ += ((error_ppm < 0 ? -error_ppm : error_ppm) - dev_ppm_) / 4;
+        if (dev_ppm_ > MAX_DEV_PPM) { dev_ppm_ = MAX_DEV_PPM; }
+      }
+    }
+
+    beacon_ms_ = now_ms;
+    have_beacon_ = true;
+    beacon_wake_ = false;
+    slot_ms_ = slot_ms;
+    slots_ = slots;
+    slot_ = 0;
+    for (byte i=3; i + 3 <= len; i += 3) {
+      if ((((uint16_t)payload[i] << 8) | payload[i+1]) == address && payload[i+2] < slots) {
+        slot_ = payload[i+2];
+        break;
+      }
+    }
+    return slot_ != 0;
+  }
+
+  ICACHE_FLASH_ATTR
+  int32_t SlotClock::guard_ms(int32_t t_ms) const
+  {
+    int32_t elapsed = t_ms - beacon_ms_;
+    if (elapsed < 0) { elapsed = 0; }
+    return GUARD_MIN_MS + (int32_t)((int64_t)2 * dev_ppm_ * elapsed / 1000000);
+  }
+
+  ICACHE_FLASH_ATTR
+  uint32_t SlotClock::UntilSlot(uint32_t now_ms) const
+  {
+    if (!synced()) { return 0; }
+    // The first slot not over yet
+    int32_t n = ((int32_t)now_ms - slot_start(0)) / period_ms();
+    if (n < 0) { n = 0; }
+    while (slot_start(n) + slot_ms_ - guard_ms(slot_start(n)) <= (int32_t)now_ms) { n++; }
+    int32_t send = slot_start(n) + guard_ms(slot_start(n));
+    return send > (int32_t)now_ms ? send - (int32_t)now_ms : 0;
+  }
+
+  ICACHE_FLASH_ATTR
+  bool SlotClock::BeaconLate(uint32_t now_ms) const
+  {
+    if (!have_beacon_ || !beacon_wake_) { return false; }
+    int32_t n = ((int32_t)now_ms - beacon_ms_ + period_ms() / 2) / period_ms();
+    int32_t due = beacon_ms_ + n * period_ms();
+    return (int32_t)now_ms > due + guard_ms(due) + BEACON_AIR_MS;
+  }
+
+  ICACHE_FLASH_ATTR
+  void SlotClock::Lost()
+  {
+    have_beacon_ = false;
+    beacon_wake_ = false;
+    slot_ = 0;
+    Save(0);
+  }
+
+  ICACHE_FLASH_ATTR
+  uint32_t SlotClock::Sleep(uint32_t now_ms, uint32_t lead_ms, uint32_t interval_ms)
+  {
+    if (!synced()) { return interval_ms; }
+    // Our slot nearest interval_ms from now, and not so soon we cannot wake for it
+    int32_t earliest = (int32_t)now_ms + (int32_t)lead_ms;
+    int32_t want = (int32_t)(now_ms + interval_ms) - period_ms() / 2 + (int32_t)lead_ms;
+    if (want < earliest) { want = earliest; }
+    int32_t n = (want - slot_start(0) + period_ms() - 1) / period_ms();
+    if (n < 0) { n = 0; }
+    while (slot_start(n) < want) { n++; }
+
+    int32_t wake = slot_start(n) - (int32_t)lead_ms;
+    beacon_wake_ = guard_ms(slot_start(n)) > slot_ms_ / 4;
+    if (beacon_wake_) {
+      // Resynchronise first; if that beacon has gone by, use the next period's
+      int32_t beacon = beacon_ms_ + n * period_ms();
+      if (beacon - guard_ms(beacon) <= earliest) { beacon += period_ms(); }
+      wake = beacon - guard_ms(beacon);
+    }
+    // Without RTC memory the next wake will not know when it is, so may as well keep to the interval
+    if (!Save(wake)) { return interval_ms; }
+    // Sleep by our clock, which runs drift_ppm_ slow
+    return (int64_t)(wake - (int32_t)now_ms) * 1000000 / (1000000 + drift_ppm_);
+  }
+}
@@ -0,0 +1,113 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENTRIFARM_SLOT_CLOCK_H__
+#define SENTRIFARM_SLOT_CLOCK_H__
+
+#include "Arduino.h"
+#include "sf-mcu.h"
+
+namespace Sentrifarm {
+
+  /// Follows the gateway's beacon, so a leaf sends in its own uplink slot rather than whenever it
+  /// happens to wake, and sleeps so as to wake just before that slot. The beacon is described in
+  /// software/sx1276/slot_table.hpp: slot n starts n slot lengths after the end of each beacon.
+  ///
+  /// Between beacons we keep time with our own clock, which over deep sleep can be out by a few percent.
+  /// Each beacon heard after a sleep measures how far out it was, which corrects later sleeps, and the
+  /// spread of those measurements sizes a guard time that grows with the time since the last beacon.
+  /// A slot is used a guard time after we reckon it starts, so a clock that is early or late still lands
+  /// in it; once the guard would reach a quarter of a slot, the leaf first wakes for the beacon of that
+  /// period to resynchronise.
+  /// Only the ESP8266 has RTC memory: elsewhere nothing survives deep sleep, and a leaf has to hear
+  /// the beacon again after every wake.
+  class SlotClock
+  {
+  public:
+    SlotClock();
+
+    /// Pick up the schedule from before deep sleep
+    /// @return false after a power cycle, or if we had no slot
+    bool Load();
+
+    /// Handle a beacon that finished arriving at now_ms (millis())
+    /// @return true if it gives address a slot
+    bool Beacon(const byte* payload, byte len, uint16_t address, uint32_t now_ms);
+
+    /// We heard the beacon, and have a slot in it
+    bool synced() const { return have_beacon_ && slot_ != 0; }
+    byte slot() const { return slot_; }
+    /// This wake is for the beacon, before using our slot
+    bool beacon_wake() const { return beacon_wake_; }
+
+    /// How long from now_ms until we should send in our slot; 0 if now
+    uint32_t UntilSlot(uint32_t now_ms) const;
+    /// The beacon we woke for should have arrived by now_ms
+    bool BeaconLate(uint32_t now_ms) const;
+    /// We missed the beacon, so are no longer synchronised; keeps what we learnt about our clock
+    void Lost();
+
+    /// How long to sleep from now_ms to wake lead_ms before our slot nearest interval_ms from now, or
+    /// before the beacon of that period if the guard would be too wide by then; remembered over deep sleep.
+    /// @return Sleep, by our own clock; interval_ms if it cannot be remembered
+    uint32_t Sleep(uint32_t now_ms, uint32_t lead_ms, uint32_t interval_ms);
+
+    /// Margin either side of a beacon or slot we reckon is at t_ms
+    int32_t guard_ms(int32_t t_ms) const;
+    int32_t drift_ppm() const { return drift_ppm_; }
+
+  private:
+    enum {
+      INITIAL_DEV_PPM = 20000,    ///< Until measured, assume the clock may be 2% out
+      MAX_DEV_PPM = 51000,
+      MAX_DRIFT_PPM = 300000,
+      GUARD_MIN_MS = 20,
+      BEACON_AIR_MS = 500,        ///< Allow for the beacon's time on air
+      MAX_PERIODS = 127
+    };
+
+    int32_t period_ms() const { return (int32_t)slot_ms_ * slots_; }
+    /// When our slot starts in the nth period after the last beacon heard
+    int32_t slot_start(int32_t n) const { return beacon_ms_ + n * period_ms() + (int32_t)slot_ * slot_ms_; }
+    bool Save(int32_t wake_ms);
+
+    /// Layout in RTC memory, after the report policy. No room for a magic number; size must be 12
+    struct RtcSlots {
+      uint16_t crc;               ///< CRC16 of everything after this field
+      byte slot;                  ///< 0 if we had none
+      byte slots;
+      uint16_t slot_ms;
+      uint16_t phase_ms;          ///< This wake was due this long after the start of a period
+      int16_t drift;              ///< drift_ppm_ / 10
+      byte dev;                   ///< dev_ppm_ / 200
+      byte periods;               ///< Periods since the last beacon heard; bit 7 set for a beacon wake
+    };
+
+    int32_t beacon_ms_;           ///< millis() when the last beacon heard ended; negative if before this wake
+    bool have_beacon_;
+    bool beacon_wake_;
+    byte slot_;
+    byte slots_;                  ///< Slots per period, including the beacon's
+    uint16_t slot_ms_;
+    int32_t drift_ppm_;           ///< Our clock runs this much slow over deep sleep, so sleeps are shortened to match
+    int32_t dev_ppm_;             ///< Mean deviation of the drift measurements
+  };
+}
+
+#endif // SENTRIFARM_SLOT_CLOCK_H__
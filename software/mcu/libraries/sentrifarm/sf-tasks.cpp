@@ -0,0 +1,100 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Arduino.h"
+#include "sf-tasks.h"
+
+#ifdef TEENSYDUINO
+#define Serial Serial1
+#endif
+
+namespace Sentrifarm {
+
+  ICACHE_FLASH_ATTR
+  TaskScheduler::TaskScheduler()
+    : count_(0), pending_(0), started_(false), start_ms_(0), finish_ms_(0)
+  {
+  }
+
+  ICACHE_FLASH_ATTR
+  bool TaskScheduler::add(const char* name, StepFn step, void* context, byte id, uint16_t budget_ms)
+  {
+    if (count_ >= MAX_TASKS) { return false; }
+    Task& task = tasks_[count_++];
+    task.name = name;
+    task.step = step;
+    task.context = context;
+    task.id = id;
+    task.stage = 0;
+    task.done = false;
+    task.timed_out = false;
+    task.budget_ms = budget_ms;
+    task.due_ms = 0;
+    task.elapsed_ms = 0;
+    task.busy_ms = 0;
+    pending_ ++;
+    return true;
+  }
+
+  ICACHE_FLASH_ATTR
+  void TaskScheduler::finish(Task& task, uint32_t now, bool timed_out)
+  {
+    task.done = true;
+    task.timed_out = timed_out;
+    task.elapsed_ms = now - start_ms_;
+    pending_ --;
+    if (pending_ == 0) { finish_ms_ = now; }
+    if (timed_out) { Serial.print(F("TASK TIMEOUT ")); Serial.println(task.name); }
+  }
+
+  ICACHE_FLASH_ATTR
+  void TaskScheduler::poll()
+  {
+    uint32_t now = millis();
+    if (!started_) {
+      // Everything starts together
+      started_ = true;
+      start_ms_ = now;
+      for (byte i=0; i < count_; i++) { tasks_[i].due_ms = now; }
+      if (pending_ == 0) { finish_ms_ = now; }
+    }
+    for (byte i=0; i < count_; i++) {
+      Task& task = tasks_[i];
+      if (task.done) { continue; }
+      if (now - start_ms_ > task.budget_ms) { finish(task, now, true); continue; }
+      if ((int32_t)(now - task.due_ms) < 0) { continue; }
+
+      int wait_ms = task.step(task);
+      uint32_t after = millis();
+      task.busy_ms += after - now;
+      now = after;
+      if (wait_ms == DONE) {
+        finish(task, now, false);
+      } else {
+        task.due_ms = now + wait_ms;
+      }
+    }
+  }
+
+  ICACHE_FLASH_ATTR
+  uint32_t TaskScheduler::elapsed_ms() const
+  {
+    if (!started_) { return 0; }
+    return (done() ? finish_ms_ : millis()) - start_ms_;
+  }
+}
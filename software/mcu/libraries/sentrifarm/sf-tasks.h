@@ -0,0 +1,88 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENTRIFARM_TASKS_H__
+#define SENTRIFARM_TASKS_H__
+
+#include "Arduino.h"
+#include "sf-mcu.h"
+
+namespace Sentrifarm {
+
+  /// Runs the leaf's sensor reads side by side, instead of one after another.
+  ///
+  /// Each task is a little state machine: its step function does one stage of work,
+  /// advances task.stage, and returns how many ms it wants to wait before the next stage
+  /// (e.g. for a conversion to complete), or DONE. poll() runs whichever tasks are due,
+  /// so while one sensor is converting the others, and the radio, get on with it.
+  /// A task that overruns its budget is abandoned.
+  class TaskScheduler
+  {
+  public:
+    enum { MAX_TASKS = 6 };
+    enum { DONE = -1 };
+
+    struct Task;
+    typedef int (*StepFn)(Task& task);
+
+    struct Task {
+      const char* name;
+      StepFn step;
+      void* context;         ///< For the step function, e.g. the sensor driver object
+      byte id;               ///< Caller's identifier, e.g. where to report the timing
+      byte stage;            ///< Starts at zero; the step function moves it on
+      bool done;
+      bool timed_out;
+      uint16_t budget_ms;
+      uint32_t due_ms;       ///< millis() at which to run the next stage
+      uint16_t elapsed_ms;   ///< Start to finish, including waits
+      uint16_t busy_ms;      ///< Time spent inside step(), when nothing else could run
+    };
+
+    TaskScheduler();
+
+    /// Add a task, to start at the next poll()
+    /// @return false if there is no room
+    bool add(const char* name, StepFn step, void* context, byte id, uint16_t budget_ms);
+
+    /// Run each task that is due; only blocks for as long as the steps do
+    void poll();
+
+    /// True once every task has finished or been abandoned
+    bool done() const { return pending_ == 0; }
+
+    /// ms from the first poll() until done(), so far
+    uint32_t elapsed_ms() const;
+
+    byte count() const { return count_; }
+    const Task& task(byte i) const { return tasks_[i]; }
+
+  private:
+    void finish(Task& task, uint32_t now, bool timed_out);
+
+    Task tasks_[MAX_TASKS];
+    byte count_;
+    byte pending_;
+    bool started_;
+    uint32_t start_ms_;
+    uint32_t finish_ms_;
+  };
+}
+
+#endif // SENTRIFARM_TASKS_H__
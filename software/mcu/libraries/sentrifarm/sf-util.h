@@ -33,6 +33,19 @@ inline byte decToBcd(byte val) { return(val/10*16 + (val%10)); }
 
 inline byte bcdToDec(byte val) { return(val/16*10 + (val%16)); }
 
+/// CRC-16/CCITT-FALSE, bitwise; used to validate what we keep in RTC memory over deep sleep
+inline uint16_t crc16(const byte* buf, unsigned len)
+{
+  uint16_t crc = 0xffff;
+  for (unsigned i=0; i < len; i++) {
+    crc ^= (uint16_t)buf[i] << 8;
+    for (byte b=0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
 #define LINE_DOUBLE "===================="
 #define LINE_SINGLE "--------------------"
 
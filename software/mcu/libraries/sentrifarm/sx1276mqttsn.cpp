@@ -19,14 +19,22 @@
 #include <stdint.h>
 #include <mqttsn.h>
 #include "sx1276mqttsn.h"
+#include "sf-util.h"
+#include "sf-channelplan.h"
+#include "sf-rtc.h"
 #if defined(ESP8266)
 #include <ets_sys.h>
+extern "C" {
+#include "user_interface.h"
+}
 #else
 #define ICACHE_FLASH_ATTR
 #endif
 
 #define VERBOSE 1
 
+#define SESSION_MAGIC 0x5332 // S2
+
 #ifdef TEENSYDUINO
 #define Serial Serial1
 #endif
@@ -40,9 +48,15 @@
 
 ICACHE_FLASH_ATTR
 MQTTSX1276::MQTTSX1276(SX1276Radio& radio)
-  : radio_(radio), rx_buffer_len_(0), tx_rolling_(0),
-    got_disconnect_(0), got_puback_(0), connack_possible_(false)
+  : radio_(radio), rx_buffer_len_(0), listening_(false), windows_(false), window_(NO_WINDOW), window_base_ms_(0),
+    beacon_listen_(false), slotted_(false), slot_offered_(false),
+    tx_rolling_(0), address_(GATEWAY_ADDRESS),
+    got_disconnect_(0), got_puback_(0), puback_code_(ACCEPTED), got_pingresp_(0), publish_fcn_(NULL), publish_context_(NULL),
+    beacon_fcn_(NULL), beacon_context_(NULL), channel_plan_(NULL), carrier_hz_(0), data_rate_(0),
+    adr_rate_(0), adr_power_(DEFAULT_TX_POWER), adr_channel_(0), adr_pending_(false),
+    connack_possible_(false)
 {
+  memset(&session_, 0, sizeof(session_));
 }
 
 ICACHE_FLASH_ATTR
@@ -51,7 +65,7 @@ MQTTSX1276::~MQTTSX1276()
 }
 
 ICACHE_FLASH_ATTR
-bool MQTTSX1276::Begin(Stream* debug)
+bool MQTTSX1276::Begin(Stream* debug, uint32_t carrier_hz)
 {
   bool started_ok  = false;
   // init SPI and then program the chip to LoRa mode
@@ -60,10 +74,15 @@ bool MQTTSX1276::Begin(Stream* debug)
   if (!radio_.Begin()) {
     if (debug) { debug->println(F("SX1276 init err")); }
   } else {
-    radio_.SetCarrier(919000000);
-    uint32_t carrier_hz = 0;
-    radio_.ReadCarrier(carrier_hz);
-    if (debug) { debug->print(F("Carrier: ")); debug->println(carrier_hz); }
+    radio_.SetCarrier(carrier_hz);
+    carrier_hz_ = carrier_hz;
+    data_rate_ = (radio_.GetSpreadingFactor() << 4) | radio_.GetBandwidth();
+    // A session restored before now may have left a data rate from the gateway
+    if (adr_pending_) { apply_adr(); }
+    radio_.SetReceiveFilter(&MQTTSX1276::accept_frame, this, LINK_HEADER);
+    uint32_t actual_hz = 0;
+    radio_.ReadCarrier(actual_hz);
+    if (debug) { debug->print(F("Carrier: ")); debug->println(actual_hz); }
     started_ok = true;
   }
   SPI.end();
@@ -75,6 +94,7 @@ ICACHE_FLASH_ATTR
 bool MQTTSX1276::TryReceive(bool& crc)
 {
   crc = false;
+  listening_ = false;
   SPI.begin();
   rx_buffer_len_ = 0;
   if (radio_.ReceiveMessage(rx_buffer_, sizeof(rx_buffer_), rx_buffer_len_, crc))
@@ -88,18 +108,154 @@ bool MQTTSX1276::TryReceive(bool& crc)
   return false;
 }
 
+ICACHE_FLASH_ATTR
+void MQTTSX1276::EnableReceiveWindows(bool enabled)
+{
+  windows_ = enabled;
+  window_ = NO_WINDOW;
+  if (!enabled) { return; }
+  SPI.begin();
+  radio_.SetSymbolTimeout(radio_.SymbolsFor(RX_WINDOW_MS));
+  SPI.end();
+}
+
+ICACHE_FLASH_ATTR
+bool MQTTSX1276::WindowDue()
+{
+  while (window_ != NO_WINDOW) {
+    uint32_t since = millis() - window_base_ms_;
+    uint32_t open = (window_ == RX1 ? RX1_DELAY_MS : RX2_DELAY_MS) - RX_WINDOW_EARLY_MS;
+    if (since < open) { return false; }
+    if (since <= open + 2 * RX_WINDOW_EARLY_MS) { return true; }
+    DEBUG("RX%d MISSED\n\r", window_ + 1);
+    window_ ++;
+  }
+  return false;
+}
+
+ICACHE_FLASH_ATTR
+bool MQTTSX1276::PollReceive(bool& crc, bool& timeout)
+{
+  crc = false;
+  timeout = false;
+  bool finished = false;
+  // The radio stays in standby between windows
+  if (windows_ && !listening_ && !beacon_listen_ && !WindowDue()) { return false; }
+  SPI.begin();
+  if (!listening_) {
+    radio_.ReceiveStart();
+    listening_ = true;
+  }
+  rx_buffer_len_ = 0;
+  bool received = radio_.ReceivePoll(rx_buffer_, sizeof(rx_buffer_), rx_buffer_len_, crc, finished);
+  SPI.end();
+  if (!finished) { return false; }
+
+  // RX single drops back to standby by itself
+  listening_ = false;
+  if (received) {
+    DEBUG("[RX] %d bytes, crc=%d\n\r", rx_buffer_len_, crc);
+    // One message per window: parse_impl() opens more if the gateway has them, as does any reply we send.
+    // A beacon is not for us in particular, so the window stays open for whatever is.
+    if ((rx_buffer_[0] & FRAME_TYPE_MASK) != FRAME_BEACON) { window_ = NO_WINDOW; }
+    parse(); // <-- calls parse_impl()
+    return true;
+  }
+  if (windows_ && window_ != NO_WINDOW) { window_ ++; }
+  timeout = !crc;
+  return false;
+}
+
 ICACHE_FLASH_ATTR
 bool MQTTSX1276::parse_impl(uint8_t* response)
 {
-  if (rx_buffer_len_ < 3) { DEBUG("SHORT MSG!\n\r"); return true; }
-  // Ooops, our carambola is still using the dogdgy 3-byte header
+  if (rx_buffer_len_ < LEGACY_LINK_HEADER) { DEBUG("SHORT MSG!\n\r"); return false; }
   DEBUG("RX CTR=%d\n\r", rx_buffer_[1]);
 
-  if (rx_buffer_[0] == 0x2) { DEBUG("RX HELLO\n\r"); return true; }
+  if (rx_buffer_[0] == FRAME_HELLO) { DEBUG("RX HELLO\n\r"); return false; }
+  byte type = rx_buffer_[0] & FRAME_TYPE_MASK;
+  if (type == FRAME_BEACON) {
+    if (beacon_fcn_ && rx_buffer_len_ > LEGACY_LINK_HEADER) { beacon_fcn_(rx_buffer_ + LEGACY_LINK_HEADER, rx_buffer_len_ - LEGACY_LINK_HEADER, beacon_context_); }
+    return false;
+  }
+  if (type != FRAME_DATA && type != FRAME_ADDRESSED) { DEBUG("RX TYPE %d\n\r", rx_buffer_[0]); return false; }
+
+  // Ooops, our carambola may still be using the dogdgy 3-byte header
+  byte header = type == FRAME_ADDRESSED ? LINK_HEADER : LEGACY_LINK_HEADER;
+  if (rx_buffer_len_ < header) { DEBUG("SHORT MSG!\n\r"); return false; }
+
+  if (type == FRAME_ADDRESSED) { slot_offered_ = rx_buffer_[0] & FRAME_SLOTTED; }
+  if (windows_ && (rx_buffer_[0] & FRAME_PENDING)) {
+    window_base_ms_ = millis();
+    window_ = RX1;
+  }
+  if (type == FRAME_ADDRESSED && (rx_buffer_[0] & FRAME_MAC)) {
+    header += parse_mac(rx_buffer_ + header, rx_buffer_len_ - header);
+    if (rx_buffer_len_ <= header) { return false; }
+  }
+
+  // Straight from the receive buffer, rather than copying into response
+  dispatch(rx_buffer_ + header, rx_buffer_len_ - header);
+  return false;
+}
+
+ICACHE_FLASH_ATTR
+byte MQTTSX1276::parse_mac(const byte* payload, byte len)
+{
+  if (len < 1) { return 0; }
+  byte mac_len = payload[0] < len ? payload[0] : len - 1;
+  for (byte i=1; i <= mac_len; ) {
+    if (payload[i] != MAC_LINK_ADR || i + MAC_LINK_ADR_LENGTH - 1 > mac_len) {
+      // Nothing else is defined yet, and we cannot tell how long it is
+      DEBUG("MAC %02x?\n\r", payload[i]);
+      break;
+    }
+    adr_rate_ = payload[i+1];
+    adr_power_ = (int8_t)payload[i+2];
+    adr_channel_ = payload[i+3];
+    adr_pending_ = true;
+    DEBUG("LINK_ADR SF%d BW%d %ddBm ch%d\n\r", adr_rate_ >> 4, adr_rate_ & 0xf, adr_power_, adr_channel_);
+    i += MAC_LINK_ADR_LENGTH;
+  }
+  return mac_len + 1;
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSX1276::apply_adr()
+{
+  adr_pending_ = false;
+  byte rate = adr_rate_ ? adr_rate_ : data_rate_;
+  if (!radio_.SetDataRate(rate >> 4, rate & 0xf)) {
+    // Not one we can do, so the gateway will see us stay put
+    adr_rate_ = 0;
+    radio_.SetDataRate(data_rate_ >> 4, data_rate_ & 0xf);
+  }
+  radio_.SetCarrier(adr_rate_ && channel_plan_ ? channel_plan_->frequency(adr_channel_) : carrier_hz_);
+  if (adr_power_ == DEFAULT_TX_POWER) { radio_.DefaultTxPower(); } else { radio_.SetTxPower(adr_power_); }
+  // The receive windows last the same time, not the same symbols
+  if (windows_) { radio_.SetSymbolTimeout(radio_.SymbolsFor(RX_WINDOW_MS)); }
+}
 
-  // If we got a message > 66 bytes not much we can do about it for now
-  memcpy(response, rx_buffer_+3, rx_buffer_len_-3 > MAX_BUFFER_SIZE ? MAX_BUFFER_SIZE : rx_buffer_len_-3);
-  return true; // <-- call dispatch()
+ICACHE_FLASH_ATTR
+bool MQTTSX1276::accept_frame(const byte header[], byte len, void* context)
+{
+  const MQTTSX1276* self = (const MQTTSX1276*)context;
+  if (len < 1) { return false; }
+  // Relayed frames are between relays and the gateway; the last hop to us is an addressed frame
+  byte type = header[0] & FRAME_TYPE_MASK;
+  if (type != FRAME_ADDRESSED) { return type == FRAME_DATA || type == FRAME_BEACON || header[0] == FRAME_HELLO; }
+  if (len < LINK_HEADER) { return false; }
+  uint16_t destination = ((uint16_t)header[5] << 8) | header[6];
+  return self->address_ == GATEWAY_ADDRESS || destination == self->address_ || destination == BROADCAST_ADDRESS;
+}
+
+ICACHE_FLASH_ATTR
+uint16_t MQTTSX1276::address_from_mac(const uint8_t mac[6])
+{
+  uint16_t address = ((uint16_t)mac[4] << 8) | mac[5];
+  // Rare, but keep clear of the reserved addresses
+  if (address == GATEWAY_ADDRESS || address == BROADCAST_ADDRESS) { address = 0x7ffe ^ mac[3]; }
+  return address;
 }
 
 byte MQTTSX1276::xorvbuf(const byte* buf, byte len)
@@ -112,28 +268,105 @@ byte MQTTSX1276::xorvbuf(const byte* buf, byte len)
 }
 
 
+ICACHE_FLASH_ATTR
+uint8_t* MQTTSX1276::tx_buffer_impl(uint8_t& capacity)
+{
+  capacity = sizeof(tx_buffer_) - LINK_HEADER - LINK_TRAILER;
+  return tx_buffer_ + LINK_HEADER;
+}
+
 ICACHE_FLASH_ATTR
 void MQTTSX1276::send_message_impl(const uint8_t* msg, uint8_t length)
 {
-  tx_buffer_[0] = 0;
+  if (length > sizeof(tx_buffer_) - LINK_HEADER - LINK_TRAILER) {
+    DEBUG("TX TOO BIG!\n\r");
+    return;
+  }
+  listening_ = false;
+  tx_buffer_[0] = FRAME_ADDRESSED | (windows_ ? FRAME_RX_WINDOWS : 0) | (slotted_ ? FRAME_SLOTTED : 0);
   tx_buffer_[1] = tx_rolling_;
   tx_buffer_[2] = 0; // echo counter
-  if (length > MAX_BUFFER_SIZE) {
-    DEBUG("TX TRUNC!\n\r");
-    length = MAX_BUFFER_SIZE;
+  tx_buffer_[3] = address_ >> 8;
+  tx_buffer_[4] = address_ & 0xff;
+  tx_buffer_[5] = GATEWAY_ADDRESS >> 8;
+  tx_buffer_[6] = GATEWAY_ADDRESS & 0xff;
+  // Most messages were built in place by tx_buffer_impl(); resends come from elsewhere
+  if (msg != tx_buffer_ + LINK_HEADER) {
+    memcpy(tx_buffer_ + LINK_HEADER, msg, length);
   }
-  memcpy(tx_buffer_+3, msg, length);
-  byte xorv = xorvbuf(tx_buffer_, length+3);
-  tx_buffer_[length + 3] = xorv;
+  byte xorv = xorvbuf(tx_buffer_, length + LINK_HEADER);
+  tx_buffer_[length + LINK_HEADER] = xorv;
 
   DEBUG("TX CNT=%d XOR=%02x payload=%d\n\r", tx_rolling_, xorv, length)
   tx_rolling_ ++;
   SPI.begin();
-  radio_.TransmitMessage(tx_buffer_, length + 4);
+  if (adr_pending_) { apply_adr(); }
+  radio_.TransmitMessage(tx_buffer_, length + LINK_HEADER + LINK_TRAILER);
+  window_base_ms_ = millis();
+  window_ = RX1;
   radio_.Standby();
   SPI.end();
 }
 
+ICACHE_FLASH_ATTR
+bool MQTTSX1276::SaveSession()
+{
+  static_assert(sizeof(RtcSession) % 4 == 0 && RTC_SESSION_BLOCK + sizeof(RtcSession) / 4 <= RTC_SAMPLES_BLOCK, "RTC layout");
+#if defined(ESP8266)
+  if (!save_session(session_.state)) { DEBUG("SESSION TOO BIG\n\r"); return false; }
+  session_.magic = SESSION_MAGIC;
+  session_.tx_rolling = tx_rolling_;
+  session_.adr_rate = adr_rate_;
+  session_.adr_power = adr_power_;
+  session_.adr_channel = adr_channel_;
+  const byte* start = &session_.tx_rolling;
+  session_.crc = Sentrifarm::crc16(start, sizeof(session_) - (start - (const byte*)&session_));
+  return system_rtc_mem_write(RTC_SESSION_BLOCK, &session_, sizeof(session_));
+#else
+  return false;
+#endif
+}
+
+ICACHE_FLASH_ATTR
+bool MQTTSX1276::RestoreSession()
+{
+#if defined(ESP8266)
+  // After a power cycle RTC memory is junk, hence the magic and CRC
+  if (!system_rtc_mem_read(RTC_SESSION_BLOCK, &session_, sizeof(session_))) { return false; }
+  const byte* start = &session_.tx_rolling;
+  if (session_.magic != SESSION_MAGIC || session_.crc != Sentrifarm::crc16(start, sizeof(session_) - (start - (const byte*)&session_))) {
+    DEBUG("NO SESSION\n\r");
+    memset(&session_, 0, sizeof(session_));
+    return false;
+  }
+  for (byte i=0; i < MAX_SESSION_TOPICS; i++) { session_.state.topic_names[i][MAX_SESSION_TOPIC_NAME-1] = 0; }
+  restore_session(session_.state);
+  tx_rolling_ = session_.tx_rolling;
+  adr_rate_ = session_.adr_rate;
+  adr_power_ = session_.adr_power;
+  adr_channel_ = session_.adr_channel;
+  adr_pending_ = adr_rate_ || adr_power_ != DEFAULT_TX_POWER;
+  connack_possible_ = true;
+  DEBUG("SESSION topics=%d msgid=%d rate=%02x\n\r", session_.state.topic_count, session_.state.message_id, adr_rate_);
+  return true;
+#else
+  return false;
+#endif
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSX1276::ForgetSession()
+{
+  // Whatever the gateway told us may be why it cannot hear us
+  adr_pending_ = adr_rate_ || adr_power_ != DEFAULT_TX_POWER;
+  adr_rate_ = 0;
+  adr_power_ = DEFAULT_TX_POWER;
+#if defined(ESP8266)
+  uint32_t magic = 0;
+  system_rtc_mem_write(RTC_SESSION_BLOCK, &magic, sizeof(magic));
+#endif
+}
+
 ICACHE_FLASH_ATTR
 void MQTTSX1276::willmsgreq_handler(const message_header* msg)
 {
@@ -155,8 +388,9 @@ void MQTTSX1276::connack_handler(const msg_connack* msg)
 ICACHE_FLASH_ATTR
 void MQTTSX1276::puback_handler(const msg_puback* msg)
 {
-  DEBUG("PUBACK\n\r");
+  DEBUG("PUBACK %d\n\r", (int)msg->return_code);
   got_puback_ ++;
+  puback_code_ = msg->return_code;
 }
 
 ICACHE_FLASH_ATTR
@@ -166,6 +400,26 @@ void MQTTSX1276::disconnect_handler(const msg_disconnect* msg)
   got_disconnect_ ++;
 }
 
+ICACHE_FLASH_ATTR
+void MQTTSX1276::pingresp_handler()
+{
+  DEBUG("PINGRESP\n\r");
+  got_pingresp_ ++;
+}
+
+ICACHE_FLASH_ATTR
+void MQTTSX1276::publish_handler(const msg_publish* msg)
+{
+  // Acknowledges QoS 1
+  MQTTSN::publish_handler(msg);
+  const byte* topic_id = (const byte*)&msg->topic_id;
+  const char* topic = find_topic_name(((uint16_t)topic_id[0] << 8) | topic_id[1]);
+  DEBUG("PUBLISH %s\n\r", topic ? topic : "?");
+  if (publish_fcn_ && topic) {
+    publish_fcn_(topic, (const byte*)msg->data, msg->length - sizeof(msg_publish), publish_context_);
+  }
+}
+
 #if 0
 ICACHE_FLASH_ATTR
 void MQTTSX1276::advertise_handler(const msg_advertise* msg)
@@ -187,11 +441,6 @@ void MQTTSX1276::regack_handler(const msg_regack* msg)
 {
 }
 
-ICACHE_FLASH_ATTR
-void MQTTSX1276::publish_handler(const msg_publish* msg)
-{
-}
-
 ICACHE_FLASH_ATTR
 void MQTTSX1276::register_handler(const msg_register* msg)
 {
@@ -212,11 +461,6 @@ void MQTTSX1276::pingreq_handler(const msg_pingreq* msg)
 {
 }
 
-ICACHE_FLASH_ATTR
-void MQTTSX1276::pingresp_handler()
-{
-}
-
 ICACHE_FLASH_ATTR
 void MQTTSX1276::willtopicresp_handler(const msg_willtopicresp* msg)
 {
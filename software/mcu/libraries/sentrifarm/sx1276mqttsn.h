@@ -28,6 +28,7 @@
 #include "mqttsn-messages.h"
 
 class Stream;
+namespace Sentrifarm { struct ChannelPlan; }
 
 // To get things moving in a hurry, I forked arduino-mqtt-sn
 // from https://bitbucket.org/MerseyViking/mqtt-sn-arduino
@@ -42,19 +43,76 @@ public:
 
   bool IsMaybeConnected() const { return connack_possible_; }
 
-  bool Begin(Stream* DEBUGV);
+  enum { GATEWAY_ADDRESS = 0x0000, BROADCAST_ADDRESS = 0xffff };
+
+  /// Our link address, so the gateway can tell us apart from other leaves.
+  /// Once set, addressed frames for other leaves are dropped after reading just the link header.
+  void SetAddress(uint16_t address) { address_ = address; }
+  uint16_t address() const { return address_; }
+  /// A link address from the MAC; avoids the reserved addresses
+  static uint16_t address_from_mac(const uint8_t mac[6]);
+
+  /// Start the radio, tuned to carrier_hz (see sf-channelplan.h)
+  bool Begin(Stream* DEBUGV, uint32_t carrier_hz=919000000);
   bool TryReceive(bool &crc);
+  /// TryReceive() without blocking: keeps a receive window open between calls,
+  /// so the caller can get on with other work while waiting for the gateway.
+  /// With receive windows enabled, only listens when one is due, otherwise keeps listening.
+  /// @param timeout Set when the window closed with nothing received; the next call opens another
+  /// @return true if a message was received and processed
+  bool PollReceive(bool& crc, bool& timeout);
+
+  /// Only listen in two short windows after each message we send, RX1_DELAY_MS and RX2_DELAY_MS after it,
+  /// and tell the gateway so it holds anything for us until then. A message from the gateway saying more
+  /// are waiting opens another pair after it. Only for leaves the gateway hears directly, not through a relay.
+  void EnableReceiveWindows(bool enabled);
+  /// No receive window is coming, so nothing can arrive until we send again
+  bool WindowsClosed() const { return windows_ && window_ == NO_WINDOW && !listening_; }
+
+  /// Ask the gateway for an uplink slot (see Sentrifarm::SlotClock); it says whether we have one in its replies
+  void RequestSlot(bool enabled) { slotted_ = enabled; }
+  /// The gateway has given us an uplink slot, so its beacon is worth listening for
+  bool SlotOffered() const { return slot_offered_; }
+  /// Keep listening, receive windows or not, until the gateway's beacon arrives
+  void ListenForBeacon(bool enabled) { beacon_listen_ = enabled; }
   void ResetDisconnect() { got_disconnect_ = 0; }
   bool DidDisconnect() const { return got_disconnect_ > 0; }
   bool DidPuback() const { return got_puback_ > 0; }
+  /// What the gateway said in its last PUBACK: only ACCEPTED means it has the message
+  return_code_t PubackCode() const { return puback_code_; }
+  bool DidPingresp() const { return got_pingresp_ > 0; }
+
+  /// Called with each PUBLISH from the gateway, e.g. configuration it kept for us while we slept
+  typedef void (*publish_fcn_t)(const char* topic, const byte* data, byte len, void* context);
+  void SetPublishHandler(publish_fcn_t handler, void* context) { publish_fcn_ = handler; publish_context_ = context; }
+
+  /// Channels the gateway's LINK_ADR commands (adaptive data rate) refer to; without, they keep our channel
+  void SetChannelPlan(const Sentrifarm::ChannelPlan* plan) { channel_plan_ = plan; }
+
+  /// Called with the payload of each beacon from the gateway, see Sentrifarm::SlotClock::Beacon()
+  typedef void (*beacon_fcn_t)(const byte* payload, byte len, void* context);
+  void SetBeaconHandler(beacon_fcn_t handler, void* context) { beacon_fcn_ = handler; beacon_context_ = context; }
+
+  /// Keep the session (topic ids, message id, counters) in RTC memory over deep sleep,
+  /// so the next wake can publish straight away without CONNECT and REGISTER.
+  /// Only supported on the ESP8266; elsewhere these all fail.
+  bool SaveSession();
+  /// @return true if a valid session was restored, in which case we are ready to publish
+  bool RestoreSession();
+  /// Make the next wake start cold, e.g. when the gateway stopped answering.
+  /// Also drops back to our own data rate, channel and TX power, in case the gateway cannot hear us at its.
+  void ForgetSession();
 
 protected:
   virtual bool parse_impl(uint8_t* response);
   virtual void send_message_impl(const uint8_t* msg, uint8_t length);
+  virtual uint8_t* tx_buffer_impl(uint8_t& capacity);
   virtual void willmsgreq_handler(const message_header* msg);
   virtual void connack_handler(const msg_connack* msg);
   virtual void disconnect_handler(const msg_disconnect* msg);
   virtual void puback_handler(const msg_puback* msg);
+  virtual void publish_handler(const msg_publish* msg);
+  virtual void pingresp_handler();
 #if 0
   virtual void advertise_handler(const msg_advertise* msg);
   virtual void gwinfo_handler(const msg_gwinfo* msg);
@@ -74,15 +132,78 @@ protected:
 #endif
 
 private:
+  /// Link framing: [type, rolling counter, echo counter, source, destination] message [xor]
+  /// Addresses are big endian. The gateway may still send legacy type 0 frames without addresses.
+  enum { LINK_HEADER = 7, LINK_TRAILER = 1, LEGACY_LINK_HEADER = 3 };
+  enum { FRAME_DATA = 0x00, FRAME_HELLO = 0x02, FRAME_ADDRESSED = 0x03, FRAME_BEACON = 0x05 };
+  /// The frame type is in the low nibble, flags in the high
+  enum { FRAME_TYPE_MASK = 0x0f, FRAME_MAC = 0x10, FRAME_SLOTTED = 0x20, FRAME_PENDING = 0x40, FRAME_RX_WINDOWS = 0x80 };
+  /// MAC commands from the gateway, after a length byte: LINK_ADR [sf << 4 | bandwidth code, dBm, channel]
+  enum { MAC_LINK_ADR = 0x01, MAC_LINK_ADR_LENGTH = 4 };
+  /// adr_power_ when the gateway has not set it
+  enum { DEFAULT_TX_POWER = 127 };
+
+  /// Must match the gateway, see software/sx1276/radio_link.hpp
+  enum { RX1_DELAY_MS = 1000, RX2_DELAY_MS = 2000 };
+  /// Open each window a little early, and keep it open long enough for the gateway to be a little late
+  /// (32 symbols at SF9 125kHz; fewer at faster data rates)
+  enum { RX_WINDOW_EARLY_MS = 20, RX_WINDOW_MS = 132 };
+  enum { RX1, RX2, NO_WINDOW };
+
+  /// True once the next receive window is due; skips any we are already too late for
+  bool WindowDue();
+
+  /// SX1276Radio receive filter: false for an addressed frame meant for another leaf
+  static bool accept_frame(const byte header[], byte len, void* context);
+
+  /// Act on the MAC commands at the start of an addressed frame's payload
+  /// @return Bytes they took up, including the length byte
+  byte parse_mac(const byte* payload, byte len);
+  /// Set the radio to the data rate, channel and TX power the gateway last gave us, or our own; SPI must be begun
+  void apply_adr();
+
   SX1276Radio& radio_;
-  byte rx_buffer_[128];
+  byte rx_buffer_[255];            ///< Largest LoRa payload; messages are dispatched from here in place
   byte rx_buffer_len_;
-  byte tx_buffer_[MAX_BUFFER_SIZE+4];
+  bool listening_;                 ///< A receive started by PollReceive() is in progress
+  bool windows_;                   ///< Only listen in receive windows
+  byte window_;                    ///< Receive window to open next
+  uint32_t window_base_ms_;        ///< Windows are timed from the end of this uplink, or downlink with more pending
+  bool beacon_listen_;             ///< Listen regardless of windows, for the beacon
+  bool slotted_;                   ///< Ask for an uplink slot
+  bool slot_offered_;              ///< The gateway said we have one
+  byte tx_buffer_[255];            ///< Messages are built after the link header, see tx_buffer_impl()
   byte tx_rolling_;
+  uint16_t address_;
   byte got_disconnect_;
   byte got_puback_;
+  return_code_t puback_code_;
+  byte got_pingresp_;
+  publish_fcn_t publish_fcn_;
+  void* publish_context_;
+  beacon_fcn_t beacon_fcn_;
+  void* beacon_context_;
+  const Sentrifarm::ChannelPlan* channel_plan_;
+  uint32_t carrier_hz_;            ///< Our own channel
+  byte data_rate_;                 ///< Our own: spreading factor << 4 | bandwidth code
+  byte adr_rate_;                  ///< From the gateway, as data_rate_; 0 for our own
+  int8_t adr_power_;               ///< dBm, or DEFAULT_TX_POWER
+  byte adr_channel_;
+  bool adr_pending_;               ///< To apply before we next send
 
   bool connack_possible_;
+
+  /// Layout in RTC memory. Size must be a multiple of 4
+  struct RtcSession {
+    uint16_t magic;
+    uint16_t crc;                  ///< CRC16 of everything after this field
+    byte tx_rolling;
+    byte adr_rate;                 ///< As adr_rate_ etc.; the gateway's data rate lasts as long as the session
+    int8_t adr_power;
+    byte adr_channel;
+    MQTTSN::session_state state;   ///< Also owns the topic names while the session is in use
+  };
+  RtcSession session_;
 };
 
 #endif // SX1276MQTSN_H__
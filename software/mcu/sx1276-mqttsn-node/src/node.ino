@@ -372,7 +372,7 @@ void loop() {
 
   const char TOPIC[] = "sentrifarm/node/beacon";
   uint16_t topic_id = 0xffff;
-  uint8_t idx = 0;
+  uint16_t idx = 0;
   if (0xffff == (topic_id = MQTTHandler.find_topic_id(TOPIC, idx))) {
     Serial.println("Try register");
     if (!MQTTHandler.register_topic(TOPIC)) {
@@ -0,0 +1,184 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "adr_engine.hpp"
+#include "radio_link.hpp"
+#include "radio_manager.hpp"
+#include "sx1276.hpp"
+#include <boost/format.hpp>
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <math.h>
+
+using std::cout;
+using boost::format;
+using boost::mutex;
+using boost::unique_lock;
+
+AdrEngine::AdrEngine(int margin_db, unsigned history, unsigned idle_s)
+  : margin_db_(margin_db), history_(history < 1 ? 1 : history > MAX_HISTORY ? MAX_HISTORY : history), idle_s_(idle_s),
+    num_commands_(0), num_fallbacks_(0)
+{
+}
+
+bool AdrEngine::AddDataRate(const RadioManager* radio, unsigned channel, unsigned spreading_factor, unsigned bandwidth_hz)
+{
+  DataRate rate;
+  rate.radio = radio;
+  rate.channel = channel;
+  rate.spreading_factor = spreading_factor;
+  rate.bandwidth_hz = bandwidth_hz;
+  if (!SX1276Radio::BandwidthCode(bandwidth_hz, rate.bandwidth_code)) { return false; }
+  unique_lock<mutex> lock(mutex_);
+  rates_.push_back(rate);
+  return true;
+}
+
+int AdrEngine::RequiredSnr(unsigned spreading_factor)
+{
+  // -7.5dB at SF7, 2.5dB lower for each step up to -20dB at SF12
+  return 100 - 25 * (int)spreading_factor;
+}
+
+double AdrEngine::BitRate(const DataRate& rate)
+{
+  return (double)rate.spreading_factor * rate.bandwidth_hz / (1 << rate.spreading_factor);
+}
+
+int AdrEngine::RateOf(const RadioManager* radio) const
+{
+  for (unsigned i=0; i < rates_.size(); i++) {
+    if (rates_[i].radio == radio) { return i; }
+  }
+  return -1;
+}
+
+void AdrEngine::Uplink(uint16_t address, const RadioManager* radio, int snr_db)
+{
+  if (!address) { return; }
+  unique_lock<mutex> lock(mutex_);
+  time_t now = time(NULL);
+  for (std::map<uint16_t, Node>::iterator i = nodes_.begin(); i != nodes_.end(); ) {
+    if (now - i->second.last_heard > (time_t)idle_s_) { nodes_.erase(i++); } else { ++i; }
+  }
+  int heard = RateOf(radio);
+  if (heard < 0) { return; }
+
+  std::map<uint16_t, Node>::iterator i = nodes_.find(address);
+  if (i == nodes_.end()) {
+    Node fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    fresh.rate = heard;
+    fresh.power_dbm = MAX_TX_DBM;
+    i = nodes_.insert(std::make_pair(address, fresh)).first;
+  }
+  Node& node = i->second;
+  if (node.rate != heard) {
+    if (node.told) {
+      cout << format("[ADR] node %.4x did not take SF%u, back on SF%u\n") % address % (unsigned)rates_[node.rate].spreading_factor % (unsigned)rates_[heard].spreading_factor;
+      node.backoff_db = std::min(node.backoff_db + BACKOFF_STEP_DB, (int)MAX_BACKOFF_DB);
+      num_fallbacks_ ++;
+    }
+    // It fell back to its defaults, or moved of its own accord; what we heard before says nothing about here
+    node.rate = heard;
+    node.power_dbm = MAX_TX_DBM;
+    node.count = 0;
+    node.pending = false;
+  }
+  node.told = false;
+  node.last_heard = now;
+  node.snr_db[node.next] = std::max(-128, std::min(127, snr_db));
+  node.next = (node.next + 1) % history_;
+  if (node.count < history_) { node.count ++; }
+  node.uplinks ++;
+  if (node.count == history_) { Decide(address, node); }
+}
+
+void AdrEngine::Decide(uint16_t address, Node& node)
+{
+  int best_db = node.snr_db[0];
+  for (unsigned i=1; i < node.count; i++) { best_db = std::max(best_db, (int)node.snr_db[i]); }
+  const DataRate& current = rates_[node.rate];
+
+  // Headroom at full power for each data rate, tenths of a dB; a wider bandwidth lets in more noise
+  int choice = -1;
+  int choice_headroom = 0;
+  for (unsigned i=0; i < rates_.size(); i++) {
+    const DataRate& rate = rates_[i];
+    int noise = (int)lround(100 * log10((double)rate.bandwidth_hz / current.bandwidth_hz));
+    int headroom = 10 * (best_db + MAX_TX_DBM - node.power_dbm - margin_db_ - node.backoff_db) - noise - RequiredSnr(rate.spreading_factor);
+    bool better;
+    if (choice < 0) { better = true; }
+    else if (headroom >= 0) { better = choice_headroom < 0 || BitRate(rate) > BitRate(rates_[choice]); }
+    else { better = headroom > choice_headroom; }
+    if (better) {
+      choice = i;
+      choice_headroom = headroom;
+    }
+  }
+  int steps = choice_headroom > 0 ? choice_headroom / (10 * POWER_STEP_DB) : 0;
+  int power_dbm = std::max((int)MIN_TX_DBM, MAX_TX_DBM - steps * POWER_STEP_DB);
+
+  if (choice == node.rate && power_dbm == node.power_dbm) {
+    node.pending = false;
+    // Each history's worth of uplinks that needs no change earns back some of the caution
+    if (node.backoff_db > 0 && node.uplinks % history_ == 0) { node.backoff_db --; }
+    return;
+  }
+  if (!node.pending || node.new_rate != choice || node.new_power_dbm != power_dbm) {
+    cout << format("[ADR] node %.4x best SNR %ddB: SF%u %ddBm -> SF%u %ddBm\n") % address % best_db
+      % (unsigned)current.spreading_factor % node.power_dbm % (unsigned)rates_[choice].spreading_factor % power_dbm;
+  }
+  node.pending = true;
+  node.new_rate = choice;
+  node.new_power_dbm = power_dbm;
+}
+
+unsigned AdrEngine::TakeCommands(uint16_t address, uint8_t* commands, unsigned capacity)
+{
+  unique_lock<mutex> lock(mutex_);
+  std::map<uint16_t, Node>::iterator i = nodes_.find(address);
+  if (i == nodes_.end() || !i->second.pending || capacity < radiolink::LINK_ADR_LENGTH) { return 0; }
+  Node& node = i->second;
+  const DataRate& rate = rates_[node.new_rate];
+  commands[0] = radiolink::LINK_ADR;
+  commands[1] = (rate.spreading_factor << 4) | rate.bandwidth_code;
+  commands[2] = (uint8_t)(int8_t)node.new_power_dbm;
+  commands[3] = rate.channel;
+  // Measurements from before the change say little about after it
+  node.told = node.new_rate != node.rate;
+  node.rate = node.new_rate;
+  node.power_dbm = node.new_power_dbm;
+  node.pending = false;
+  node.count = 0;
+  num_commands_ ++;
+  return radiolink::LINK_ADR_LENGTH;
+}
+
+void AdrEngine::PrintStats()
+{
+  unique_lock<mutex> lock(mutex_);
+  cout << format("[ADR] nodes=%u commands=%u fallbacks=%u\n") % nodes_.size() % num_commands_ % num_fallbacks_;
+  for (std::map<uint16_t, Node>::const_iterator i = nodes_.begin(); i != nodes_.end(); ++i) {
+    const Node& node = i->second;
+    const DataRate& rate = rates_[node.rate];
+    cout << format("[ADR] node %.4x SF%u %.1fkHz ch%u %ddBm uplinks=%u backoff=%ddB%s\n") % i->first % (unsigned)rate.spreading_factor
+      % (rate.bandwidth_hz / 1000.0) % (unsigned)rate.channel % node.power_dbm % node.uplinks % node.backoff_db % (node.pending ? " pending" : "");
+  }
+}
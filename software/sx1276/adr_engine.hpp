@@ -0,0 +1,120 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ADR_ENGINE_HPP__
+#define ADR_ENGINE_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class RadioManager;
+
+/// Adaptive data rate: moves each leaf to the fastest data rate, then the lowest TX power, its link to
+/// the gateway can take with a margin to spare, so close-in leaves spend far less of the channel on air.
+///
+/// One SX1276 only demodulates the spreading factor and bandwidth it is set to, so the data rates on
+/// offer are those of the gateway's radios that both receive and transmit, each on its own channel
+/// (or at least its own spreading factor); a gateway with one radio can only adapt TX power.
+///
+/// From the best SNR of the last few uplinks heard directly from a leaf, we estimate the SNR at each
+/// data rate and at full power, and choose the fastest that leaves the margin above what the
+/// demodulator needs at its spreading factor, then take off power in POWER_STEP_DB steps while the
+/// margin holds. Changes go to the leaf as a radiolink::LINK_ADR MAC command on its next downlink.
+/// A leaf falls back to its defaults when it stops hearing the gateway; an uplink at the old data rate
+/// after a change means it did, and makes us more cautious with that leaf for a while.
+///
+/// We cannot hear what power a leaf sends at, so we assume it obeyed, and starts at MAX_TX_DBM.
+///
+/// Methods are thread safe.
+class AdrEngine : boost::noncopyable
+{
+public:
+  enum {
+    MAX_HISTORY = 32,
+    MIN_TX_DBM = 2,
+    MAX_TX_DBM = 14,              ///< What leaves send at by default
+    POWER_STEP_DB = 3,
+    BACKOFF_STEP_DB = 3,          ///< Added to a leaf's margin each time it does not take a change
+    MAX_BACKOFF_DB = 15
+  };
+
+  /// @param margin_db SNR to keep above what the demodulator needs
+  /// @param history Uplinks of SNR to judge a leaf's link on, at most MAX_HISTORY
+  /// @param idle_s Forget leaves quiet for this long
+  AdrEngine(int margin_db, unsigned history=10, unsigned idle_s=3600);
+
+  /// Offer leaves the data rate a radio listens at
+  /// @param channel Of the channel plan, which the radio is tuned to
+  /// @return false if the bandwidth is not one the SX1276 supports
+  bool AddDataRate(const RadioManager* radio, unsigned channel, unsigned spreading_factor, unsigned bandwidth_hz);
+
+  /// Note an uplink heard directly from node on radio
+  void Uplink(uint16_t node, const RadioManager* radio, int snr_db);
+
+  /// Write the MAC commands due to node, and take it they arrive
+  /// @return Bytes written, 0 if none are due or they do not fit
+  unsigned TakeCommands(uint16_t node, uint8_t* commands, unsigned capacity);
+
+  void PrintStats();
+
+private:
+  struct DataRate {
+    const RadioManager* radio;
+    uint8_t channel;
+    uint8_t spreading_factor;
+    uint8_t bandwidth_code;       ///< See SX1276Radio::BandwidthCode()
+    unsigned bandwidth_hz;
+  };
+
+  struct Node {
+    int8_t snr_db[MAX_HISTORY];   ///< Ring of the last uplinks' SNR
+    unsigned count;               ///< Valid entries in snr_db
+    unsigned next;                ///< Where the next goes
+    unsigned uplinks;
+    int rate;                     ///< Index into rates_ of what the leaf sends at
+    int power_dbm;                ///< What we reckon the leaf sends at
+    int new_rate;                 ///< Change to tell the leaf, if pending
+    int new_power_dbm;
+    bool pending;
+    bool told;                    ///< A data rate change went out, and no uplink has shown it taken yet
+    int backoff_db;
+    time_t last_heard;
+  };
+
+  /// Needed SNR at a spreading factor, tenths of a dB
+  static int RequiredSnr(unsigned spreading_factor);
+  static double BitRate(const DataRate& rate);
+  int RateOf(const RadioManager* radio) const;
+  /// Work out where node should be from its history; caller holds mutex_
+  void Decide(uint16_t address, Node& node);
+
+  int margin_db_;
+  unsigned history_;
+  unsigned idle_s_;
+  std::vector<DataRate> rates_;
+  std::map<uint16_t, Node> nodes_;  ///< Leaf link address --> what we know of its link
+  unsigned num_commands_;
+  unsigned num_fallbacks_;          ///< Changes leaves did not take
+  mutable boost::mutex mutex_;      ///< Protect everything above
+};
+
+#endif // ADR_ENGINE_HPP__
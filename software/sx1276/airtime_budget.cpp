@@ -0,0 +1,111 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "airtime_budget.hpp"
+
+using boost::mutex;
+using boost::unique_lock;
+
+#define WINDOW_S 3600.F
+
+// Fraction of the hourly allowance kept back for high priority traffic
+#define HIGH_RESERVE 0.1F
+// Low priority traffic is dropped once less than this fraction of the allowance is left
+#define LOW_THRESHOLD 0.5F
+
+AirtimeBudget::AirtimeBudget(float duty_cycle_pct)
+  : duty_cycle_(duty_cycle_pct <= 0.F ? 0.F : duty_cycle_pct >= 100.F ? 1.F : duty_cycle_pct / 100.F),
+    capacity_(duty_cycle_ * WINDOW_S)
+{
+}
+
+uint64_t AirtimeBudget::Minute() const
+{
+  return boost::chrono::duration_cast<boost::chrono::minutes>(clock::now().time_since_epoch()).count();
+}
+
+AirtimeBudget::Channel& AirtimeBudget::Find(uint32_t channel_hz)
+{
+  std::map<uint32_t, Channel>::iterator i = channels_.find(channel_hz);
+  if (i == channels_.end()) {
+    Channel channel;
+    for (unsigned i=0; i < SLOTS; i++) { channel.used[i] = 0.F; channel.minute[i] = 0; }
+    channel.deferred = 0;
+    channel.dropped = 0;
+    return channels_[channel_hz] = channel;
+  }
+  return i->second;
+}
+
+float AirtimeBudget::Used(const Channel& channel, uint64_t minute) const
+{
+  float used = 0.F;
+  for (unsigned i=0; i < SLOTS; i++) {
+    if (minute - channel.minute[i] <= MINUTES) { used += channel.used[i]; }
+  }
+  return used;
+}
+
+AirtimeBudget::Decision AirtimeBudget::Request(uint32_t channel_hz, float time_on_air_s, Priority priority)
+{
+  unique_lock<mutex> lock(mutex_);
+  if (duty_cycle_ >= 1.F) { return SEND; }
+  Channel& channel = Find(channel_hz);
+  float left = capacity_ - Used(channel, Minute()) - time_on_air_s;
+  switch (priority) {
+  case HIGH:
+    if (left >= 0.F) { return SEND; }
+    break;
+  case NORMAL:
+    if (left >= capacity_ * HIGH_RESERVE) { return SEND; }
+    break;
+  case LOW:
+    if (left >= capacity_ * LOW_THRESHOLD) { return SEND; }
+    channel.dropped ++;
+    return DROP;
+  }
+  channel.deferred ++;
+  return DEFER;
+}
+
+void AirtimeBudget::Charge(uint32_t channel_hz, float time_on_air_s)
+{
+  unique_lock<mutex> lock(mutex_);
+  Channel& channel = Find(channel_hz);
+  uint64_t minute = Minute();
+  unsigned slot = minute % SLOTS;
+  if (channel.minute[slot] != minute) {
+    channel.minute[slot] = minute;
+    channel.used[slot] = 0.F;
+  }
+  channel.used[slot] += time_on_air_s;
+}
+
+AirtimeBudget::Stats AirtimeBudget::GetStats(uint32_t channel_hz)
+{
+  unique_lock<mutex> lock(mutex_);
+  Channel& channel = Find(channel_hz);
+  Stats stats;
+  stats.used_hour_s = Used(channel, Minute());
+  stats.available_s = capacity_ - stats.used_hour_s;
+  stats.capacity_s = capacity_;
+  stats.duty_cycle_pct = stats.used_hour_s * 100.F / WINDOW_S;
+  stats.deferred = channel.deferred;
+  stats.dropped = channel.dropped;
+  return stats;
+}
@@ -0,0 +1,91 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AIRTIME_BUDGET_HPP__
+#define AIRTIME_BUDGET_HPP__
+
+#include <stdint.h>
+#include <map>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/chrono/system_clocks.hpp>
+
+/// Airtime ledger, so we can transmit as much as the rules allow and no more.
+///
+/// Each channel (carrier frequency) has a ring of one minute buckets recording the airtime used.
+/// A frame may only be sent if it fits in an hour's allowance on top of what the ring holds. The ring
+/// covers the current minute and the whole of the MINUTES before it, so it counts every transmission
+/// of the last hour (and a little more), and over any rolling hour we cannot exceed the duty cycle.
+///
+/// Part of the allowance is held back for more important traffic: normal priority frames are
+/// deferred once what is left gets down to the high priority reserve, and low priority frames
+/// are dropped once half the allowance is used.
+///
+/// Methods are thread safe.
+class AirtimeBudget : boost::noncopyable
+{
+public:
+  enum Priority { LOW, NORMAL, HIGH };
+  enum Decision { SEND, DEFER, DROP };
+
+  struct Stats {
+    float available_s;      ///< Airtime left of the hour's allowance, seconds
+    float capacity_s;       ///< The hour's allowance, seconds
+    float used_hour_s;      ///< Airtime used over the last hour, seconds
+    float duty_cycle_pct;   ///< used_hour_s as percent of an hour
+    unsigned deferred;
+    unsigned dropped;
+  };
+
+  /// @param duty_cycle_pct Permitted duty cycle, percent. 100 means accounting only.
+  AirtimeBudget(float duty_cycle_pct=100.F);
+
+  float duty_cycle_pct() const { return duty_cycle_ * 100.F; }
+
+  /// Decide whether a frame may be sent now.
+  Decision Request(uint32_t channel_hz, float time_on_air_s, Priority priority);
+
+  /// Record a transmission
+  void Charge(uint32_t channel_hz, float time_on_air_s);
+
+  Stats GetStats(uint32_t channel_hz);
+
+private:
+  typedef boost::chrono::steady_clock clock;
+
+  /// The ring holds one more than this, for the minute under way
+  enum { MINUTES = 60, SLOTS = MINUTES + 1 };
+  struct Channel {
+    float used[SLOTS];            ///< Airtime used per minute, indexed by minute % SLOTS
+    uint64_t minute[SLOTS];       ///< Which minute each entry of used[] belongs to
+    unsigned deferred;
+    unsigned dropped;
+  };
+
+  Channel& Find(uint32_t channel_hz);
+  /// Airtime used within the last MINUTES whole minutes and the current one
+  float Used(const Channel& channel, uint64_t minute) const;
+  uint64_t Minute() const;
+
+  float duty_cycle_;              ///< 0..1
+  float capacity_;                ///< Seconds of airtime per hour
+  boost::mutex mutex_;
+  std::map<uint32_t, Channel> channels_;
+};
+
+#endif // AIRTIME_BUDGET_HPP__
@@ -0,0 +1,66 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BACKOFF_HPP__
+#define BACKOFF_HPP__
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Exponential backoff with jitter, for retrying a connection without hammering the server,
+/// and without every client retrying in lockstep after the server restarts.
+///
+/// The window starts at min_ms and doubles after each failure, up to max_ms;
+/// each delay is drawn at random from the upper half of the window.
+class Backoff
+{
+public:
+  Backoff(unsigned min_ms=1000, unsigned max_ms=60000)
+    : failures_(0), seed_(time(NULL) ^ getpid() ^ (unsigned)(size_t)this)
+  {
+    SetLimits(min_ms, max_ms);
+  }
+
+  void SetLimits(unsigned min_ms, unsigned max_ms) {
+    min_ms_ = min_ms ? min_ms : 1;
+    max_ms_ = max_ms > min_ms_ ? max_ms : min_ms_;
+  }
+
+  /// Note a failure. @return how long to wait before trying again
+  unsigned Next() {
+    unsigned window = min_ms_;
+    for (unsigned i=0; i < failures_ && window < max_ms_; i++) { window *= 2; }
+    if (window > max_ms_) { window = max_ms_; }
+    if (failures_ < 32) { failures_ ++; }
+    return window - (unsigned)(rand_r(&seed_) % (window / 2 + 1));
+  }
+
+  /// Note a success
+  void Reset() { failures_ = 0; }
+
+  unsigned failures() const { return failures_; }
+
+private:
+  unsigned min_ms_;
+  unsigned max_ms_;
+  unsigned failures_;           ///< Since the last success
+  unsigned seed_;               ///< Per instance, so clients started together still spread out
+};
+
+#endif // BACKOFF_HPP__
@@ -0,0 +1,36 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "channel_plan.hpp"
+#include <stdio.h>
+
+ChannelPlan::ChannelPlan(uint32_t base_hz, uint32_t spacing_hz, unsigned num_channels)
+  : base_hz_(base_hz), spacing_hz_(spacing_hz), num_channels_(num_channels ? num_channels : 1)
+{
+}
+
+bool ChannelPlan::Parse(const std::string& spec)
+{
+  unsigned base = 0, spacing = 0, count = 0;
+  if (sscanf(spec.c_str(), "%u,%u,%u", &base, &spacing, &count) != 3) { return false; }
+  if (count < 1 || count > 64 || (count > 1 && spacing == 0)) { return false; }
+  base_hz_ = base;
+  spacing_hz_ = spacing;
+  num_channels_ = count;
+  return true;
+}
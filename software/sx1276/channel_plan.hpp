@@ -0,0 +1,47 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CHANNEL_PLAN_HPP__
+#define CHANNEL_PLAN_HPP__
+
+#include <stdint.h>
+#include <string>
+
+/// Set of carriers the network uses, so nodes can be spread across channels instead of all sharing 919MHz.
+///
+/// Leaves choose their own channel (sf-channelplan.h); the gateway only needs base, spacing and count
+/// to match, as it receives on a fixed channel per radio and replies on the channel the request came in on.
+class ChannelPlan
+{
+public:
+  ChannelPlan(uint32_t base_hz=919000000, uint32_t spacing_hz=400000, unsigned num_channels=8);
+
+  /// Parse "base_hz,spacing_hz,num_channels" e.g. from the SX1276_CHANNEL_PLAN environment variable.
+  /// @return false on error, leaving the plan unchanged
+  bool Parse(const std::string& spec);
+
+  unsigned num_channels() const { return num_channels_; }
+  uint32_t Frequency(unsigned channel) const { return base_hz_ + (channel % num_channels_) * spacing_hz_; }
+
+private:
+  uint32_t base_hz_;
+  uint32_t spacing_hz_;
+  unsigned num_channels_;
+};
+
+#endif // CHANNEL_PLAN_HPP__
@@ -0,0 +1,56 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "duplicate_cache.hpp"
+
+using boost::mutex;
+using boost::unique_lock;
+
+DuplicateCache::DuplicateCache(unsigned size, unsigned window_s)
+  : window_s_(window_s), next_(0), num_duplicates_(0)
+{
+  Entry empty = { false, 0, 0, 0 };
+  entries_.assign(size ? size : 1, empty);
+}
+
+bool DuplicateCache::Check(uint16_t src, uint8_t counter)
+{
+  unique_lock<mutex> lock(mutex_);
+  time_t now = time(NULL);
+  // Small enough that a scan beats keeping an index up to date
+  for (unsigned i=0; i < entries_.size(); i++) {
+    const Entry& entry = entries_[i];
+    if (entry.used && entry.src == src && entry.counter == counter && now - entry.stamp <= (time_t)window_s_) {
+      num_duplicates_ ++;
+      return true;
+    }
+  }
+  Entry& entry = entries_[next_];
+  entry.used = true;
+  entry.src = src;
+  entry.counter = counter;
+  entry.stamp = now;
+  next_ = (next_ + 1) % entries_.size();
+  return false;
+}
+
+unsigned DuplicateCache::num_duplicates() const
+{
+  unique_lock<mutex> lock(mutex_);
+  return num_duplicates_;
+}
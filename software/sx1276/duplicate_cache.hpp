@@ -0,0 +1,63 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DUPLICATE_CACHE_HPP__
+#define DUPLICATE_CACHE_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/// Remembers recently seen frames by (source, counter), so a frame that arrives more than once,
+/// directly and through relays or through several relays, is only acted on once.
+/// This is what stops relays flooding the channel with each other's retransmissions.
+///
+/// Fixed size: the oldest entry is overwritten once full. The counter is only 8 bits, so entries
+/// older than the window are ignored, else a busy node would wrap round into its own history.
+///
+/// Methods are thread safe.
+class DuplicateCache : boost::noncopyable
+{
+public:
+  /// @param size Number of frames remembered
+  /// @param window_s How long a frame is remembered
+  DuplicateCache(unsigned size=64, unsigned window_s=30);
+
+  /// @return true if the frame was already seen in the window; otherwise remember it and return false
+  bool Check(uint16_t src, uint8_t counter);
+
+  unsigned num_duplicates() const;
+
+private:
+  struct Entry {
+    bool used;
+    uint16_t src;
+    uint8_t counter;
+    time_t stamp;
+  };
+
+  unsigned window_s_;
+  unsigned next_;               ///< Entry to overwrite next
+  unsigned num_duplicates_;
+  std::vector<Entry> entries_;
+  mutable boost::mutex mutex_;  ///< Protect everything above
+};
+
+#endif // DUPLICATE_CACHE_HPP__
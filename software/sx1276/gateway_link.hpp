@@ -0,0 +1,82 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef GATEWAY_LINK_HPP__
+#define GATEWAY_LINK_HPP__
+
+#include <stdint.h>
+
+/// Envelope for frames between gateways (sx1276_mqttsn_bridge in forward mode) and the network
+/// server, over UDP. All fields big endian.
+///
+/// Byte 0 : version, 1
+/// Byte 1 : message type, see MessageType
+/// Bytes 2..3 : gateway id
+/// Bytes 4..5 : leaf link address
+/// Byte 6 : uplinks: the leaf's link counter; otherwise 0
+/// Byte 7 : uplinks: packet RSSI + 200, dBm; otherwise 0
+/// Byte 8 : uplinks: packet SNR, dB, signed; otherwise 0
+/// Bytes 9.. : MQTT-SN payload; none for PING
+namespace gatewaylink {
+
+enum { VERSION = 1, HEADER_LENGTH = 9 };
+
+enum MessageType {
+  UPLINK = 0x01,    ///< Gateway to server: a frame received from a leaf
+  DOWNLINK = 0x02,  ///< Server to gateway: a frame to send to a leaf
+  PING = 0x03       ///< Gateway to server: keeps the server's idea of our address fresh
+};
+
+struct Header {
+  uint8_t type;
+  uint16_t gateway;
+  uint16_t node;
+  uint8_t counter;
+  int rssi_dbm;
+  int snr_db;
+};
+
+inline void WriteHeader(const Header& header, uint8_t* message)
+{
+  message[0] = VERSION;
+  message[1] = header.type;
+  message[2] = header.gateway >> 8;
+  message[3] = header.gateway & 0xff;
+  message[4] = header.node >> 8;
+  message[5] = header.node & 0xff;
+  message[6] = header.counter;
+  message[7] = header.rssi_dbm < -200 ? 0 : header.rssi_dbm > 55 ? 255 : header.rssi_dbm + 200;
+  message[8] = (uint8_t)(int8_t)header.snr_db;
+}
+
+/// @return false if not a message we understand
+inline bool ReadHeader(const uint8_t* message, unsigned len, Header& header)
+{
+  if (len < HEADER_LENGTH || message[0] != VERSION) { return false; }
+  header.type = message[1];
+  header.gateway = ((uint16_t)message[2] << 8) | message[3];
+  header.node = ((uint16_t)message[4] << 8) | message[5];
+  header.counter = message[6];
+  header.rssi_dbm = (int)message[7] - 200;
+  header.snr_db = (int8_t)message[8];
+  return header.type >= UPLINK && header.type <= PING;
+}
+
+};
+
+#endif // GATEWAY_LINK_HPP__
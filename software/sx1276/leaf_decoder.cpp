@@ -0,0 +1,106 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "leaf_decoder.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+using std::string;
+using std::vector;
+using std::map;
+
+LeafDecoder::LeafDecoder()
+  : num_batches_(0), num_unresolved_(0)
+{
+}
+
+const char *LeafDecoder::FieldName(Field field)
+{
+  static const char *names[NUM_FIELDS] = {
+    "pressure", "temperature", "adc0", "adc1", "adc2", "adc3", "humidity", "humidity_temp", "vcc"
+  };
+  return field < NUM_FIELDS ? names[field] : "unknown";
+}
+
+double LeafDecoder::Scale(Field field, int32_t value)
+{
+  switch (field) {
+    case PRESSURE: case TEMPERATURE: return value / 10.;
+    case VCC: return value * 0.02;
+    default: return value;
+  }
+}
+
+bool LeafDecoder::Decode(const string& leaf, const char *payload, unsigned len, vector<Reading>& readings)
+{
+  string text(payload, len);
+  const char *p = text.c_str();
+  char *end;
+  if (strncmp(p, "Z,", 2) != 0) { return false; }
+  long count = strtol(p + 2, &end, 10);
+  if (*end != ',') { return false; }
+  strtol(end + 1, &end, 10);            // rssi
+  if (*end != ',') { return false; }
+  strtol(end + 1, &end, 10);            // snr
+  if (*end != ',') { return false; }
+  long sequence = strtol(end + 1, &end, 10);
+  if (count < 0 || sequence < 0 || sequence > 0xff || (*end != '\n' && *end)) { return false; }
+
+  map<uint8_t, State>& states = leaves_[leaf];
+  uint8_t seq = sequence;
+  uint8_t previous = seq - 1;
+  State base;
+  map<uint8_t, State>::const_iterator b = states.find(previous);
+  if (b != states.end()) { base = b->second; } else { memset(&base, 0, sizeof(base)); }
+  State state = base;
+
+  vector<Reading> decoded;
+  for (long i=0; i < count; i++) {
+    if (*end != '\n') { return false; }
+    long boot = strtol(end + 1, &end, 10);
+    if (*end != ',') { return false; }
+    strtol(end + 1, &end, 10);          // flags
+    if (*end != ',') { return false; }
+    unsigned long fields = strtoul(end + 1, &end, 16);
+    for (unsigned f=0; f < NUM_FIELDS; f++) {
+      if (!(fields & (1 << f))) { continue; }
+      if (*end != ',' || !end[1] || !strchr("=+-", end[1])) { return false; }
+      char sign = end[1];
+      int32_t value = strtol(end + 2, &end, 10);
+      if (sign != '=') {
+        // Deltas are all against the last acknowledged batch, not each other
+        if (!(base.fields & (1 << f))) { num_unresolved_ ++; continue; }
+        value = base.values[f] + (sign == '-' ? -value : value);
+      }
+      state.fields |= 1 << f;
+      state.values[f] = value;
+      Reading reading = { (uint16_t)boot, FieldName((Field)f), Scale((Field)f, value) };
+      decoded.push_back(reading);
+    }
+  }
+  if (*end) { return false; }
+
+  // Only the readings as of this batch and the one before can be a base from now on
+  states[seq] = state;
+  for (map<uint8_t, State>::iterator s = states.begin(); s != states.end(); ) {
+    if (s->first != seq && s->first != previous) { states.erase(s++); } else { ++s; }
+  }
+  readings.insert(readings.end(), decoded.begin(), decoded.end());
+  num_batches_ ++;
+  return true;
+}
@@ -0,0 +1,81 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LEAF_DECODER_HPP__
+#define LEAF_DECODER_HPP__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/noncopyable.hpp>
+
+/// Turns the sample batches leaves publish to sentrifarm/leaf/csv/<mac> back into readings.
+///
+/// A batch (see the leaf's SampleBuffer::MakeBatch) is a header line Z,count,rssi,snr,sequence then
+/// a line per sample: boot,flags,fields in hex, and a value per field set in fields, in field order.
+/// A value is =n whole, or +n / -n relative to the leaf's last acknowledged value of that field.
+///
+/// The leaf only learns a batch arrived from the PUBACK, so after a lost PUBACK it resends, and we may
+/// see several batches with the same sequence. The one acknowledged is the last of them, and batch
+/// n+1 has deltas against the readings as of that; so we keep, per leaf, the readings as of each of
+/// the last two sequences. A delta with no base, e.g. we started after the leaf did, is dropped;
+/// the leaf sends everything whole every few uploads, after which we are in step again.
+///
+/// Not thread safe.
+class LeafDecoder : boost::noncopyable
+{
+public:
+  enum Field {
+    PRESSURE, TEMPERATURE, ADC0, ADC1, ADC2, ADC3, HUMIDITY, HUMIDITY_TEMP, VCC,
+    NUM_FIELDS
+  };
+
+  struct Reading {
+    uint16_t boot;                ///< Low bits of the leaf's boot count when sampled
+    const char *name;             ///< e.g. "pressure"
+    double value;                 ///< In plain units: hPa, degC, %, V, raw ADC counts
+  };
+
+  LeafDecoder();
+
+  /// Decode one batch, appending its readings oldest first
+  /// @param leaf Identifies the sender, e.g. the last topic level
+  /// @return false if the payload is not a batch
+  bool Decode(const std::string& leaf, const char *payload, unsigned len, std::vector<Reading>& readings);
+
+  static const char *FieldName(Field field);
+  /// Value as sent --> plain units
+  static double Scale(Field field, int32_t value);
+
+  unsigned num_batches() const { return num_batches_; }
+  unsigned num_unresolved() const { return num_unresolved_; }
+
+private:
+  /// Readings as of a batch: the base for deltas in the batch after it
+  struct State {
+    uint16_t fields;              ///< Fields with a value
+    int32_t values[NUM_FIELDS];
+  };
+
+  std::map<std::string, std::map<uint8_t, State> > leaves_;  ///< Leaf --> sequence --> readings
+  unsigned num_batches_;
+  unsigned num_unresolved_;       ///< Deltas dropped for want of a base
+};
+
+#endif // LEAF_DECODER_HPP__
@@ -0,0 +1,216 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "link_stats.hpp"
+#include <boost/format.hpp>
+#include <iostream>
+#include <string.h>
+
+using std::cout;
+using boost::format;
+using boost::mutex;
+using boost::unique_lock;
+
+LinkStats::LinkStats()
+  : num_crc_errors_(0), num_evicted_(0)
+{
+  memset(entries_, 0, sizeof(entries_));
+}
+
+LinkStats::Entry* LinkStats::Find(uint16_t node)
+{
+  for (unsigned i=0; i < MAX_NODES; i++) {
+    if (entries_[i].node == node) { return &entries_[i]; }
+  }
+  return NULL;
+}
+
+const LinkStats::Entry* LinkStats::Find(uint16_t node) const
+{
+  return const_cast<LinkStats*>(this)->Find(node);
+}
+
+LinkStats::Entry* LinkStats::FindOrAdd(uint16_t node)
+{
+  Entry* free = NULL;
+  Entry* stalest = NULL;
+  for (unsigned i=0; i < MAX_NODES; i++) {
+    Entry& entry = entries_[i];
+    if (entry.node == node) { return &entry; }
+    if (!entry.node) { if (!free) { free = &entry; } continue; }
+    if (!stalest || entry.last_heard < stalest->last_heard) { stalest = &entry; }
+  }
+  if (!free) {
+    free = stalest;
+    num_evicted_ ++;
+  }
+  memset(free, 0, sizeof(*free));
+  free->node = node;
+  free->window_start = time(NULL);
+  return free;
+}
+
+void LinkStats::Push(uint32_t& bits, uint8_t& used, bool bit)
+{
+  bits = (bits << 1) | (bit ? 1 : 0);
+  if (used < WINDOW) { used ++; }
+}
+
+float LinkStats::Rate(uint32_t bits, uint8_t used)
+{
+  if (!used) { return 0.F; }
+  unsigned count = 0;
+  for (unsigned i=0; i < used; i++) { count += (bits >> i) & 1; }
+  return (float)count / used;
+}
+
+void LinkStats::AddAirtime(Entry& entry, unsigned airtime_ms, time_t now)
+{
+  time_t since = now - entry.window_start;
+  if (since >= 2 * AIRTIME_WINDOW_S) {
+    entry.last_window_ms = 0;
+    entry.window_ms = 0;
+    entry.window_start = now;
+  } else if (since >= AIRTIME_WINDOW_S) {
+    entry.last_window_ms = entry.window_ms;
+    entry.window_ms = 0;
+    entry.window_start += AIRTIME_WINDOW_S;
+  }
+  entry.window_ms += airtime_ms;
+}
+
+void LinkStats::Received(uint16_t node, int counter, int rssi_dbm, int snr_db, unsigned coding_rate, unsigned airtime_ms)
+{
+  if (!node) { return; }
+  unique_lock<mutex> lock(mutex_);
+  time_t now = time(NULL);
+  Entry& entry = *FindOrAdd(node);
+  if (!entry.frames) {
+    entry.rssi_x16 = rssi_dbm * 16;
+    entry.snr_x16 = snr_db * 16;
+  } else {
+    entry.rssi_x16 += (rssi_dbm * 16 - entry.rssi_x16) / (1 << EWMA_SHIFT);
+    entry.snr_x16 += (snr_db * 16 - entry.snr_x16) / (1 << EWMA_SHIFT);
+  }
+  entry.coding_rate = coding_rate;
+  entry.frames ++;
+  Push(entry.crc_bits, entry.crc_bits_used, false);
+
+  if (counter >= 0) {
+    unsigned gap = (uint8_t)(counter - entry.counter);
+    if (!entry.have_counter || gap == 0) {
+      // First, or a repeat of the last
+    } else if (gap > MAX_GAP) {
+      entry.restarts ++;
+    } else {
+      for (unsigned i=1; i < gap; i++) { Push(entry.lost_bits, entry.lost_bits_used, true); }
+      entry.lost += gap - 1;
+    }
+    if (!entry.have_counter || gap != 0) { Push(entry.lost_bits, entry.lost_bits_used, false); }
+    entry.counter = counter;
+    entry.have_counter = true;
+  }
+
+  entry.uplink_ms += airtime_ms;
+  AddAirtime(entry, airtime_ms, now);
+  entry.last_heard = now;
+}
+
+void LinkStats::CrcError(uint16_t node)
+{
+  unique_lock<mutex> lock(mutex_);
+  num_crc_errors_ ++;
+  Entry* entry = node ? Find(node) : NULL;
+  if (!entry) { return; }
+  entry->crc_errors ++;
+  Push(entry->crc_bits, entry->crc_bits_used, true);
+}
+
+void LinkStats::Sent(uint16_t node, unsigned airtime_ms)
+{
+  unique_lock<mutex> lock(mutex_);
+  Entry* entry = node ? Find(node) : NULL;
+  if (!entry) { return; }
+  entry->downlink_ms += airtime_ms;
+  AddAirtime(*entry, airtime_ms, time(NULL));
+}
+
+void LinkStats::Fill(const Entry& entry, Snapshot& snapshot) const
+{
+  snapshot.node = entry.node;
+  snapshot.rssi_dbm = entry.rssi_x16 / 16.F;
+  snapshot.snr_db = entry.snr_x16 / 16.F;
+  snapshot.coding_rate = entry.coding_rate;
+  snapshot.frames = entry.frames;
+  snapshot.lost = entry.lost;
+  snapshot.crc_errors = entry.crc_errors;
+  snapshot.restarts = entry.restarts;
+  snapshot.packet_error_rate = Rate(entry.lost_bits, entry.lost_bits_used);
+  snapshot.crc_error_rate = Rate(entry.crc_bits, entry.crc_bits_used);
+  snapshot.uplink_airtime_ms = entry.uplink_ms;
+  snapshot.downlink_airtime_ms = entry.downlink_ms;
+  // Count the part of the last window still within AIRTIME_WINDOW_S of now, as if it was spread evenly
+  time_t since = time(NULL) - entry.window_start;
+  if (since >= 2 * AIRTIME_WINDOW_S) {
+    snapshot.recent_airtime_ms = 0;
+  } else if (since >= AIRTIME_WINDOW_S) {
+    snapshot.recent_airtime_ms = (uint64_t)entry.window_ms * (2 * AIRTIME_WINDOW_S - since) / AIRTIME_WINDOW_S;
+  } else {
+    snapshot.recent_airtime_ms = entry.window_ms + (uint64_t)entry.last_window_ms * (AIRTIME_WINDOW_S - since) / AIRTIME_WINDOW_S;
+  }
+  snapshot.last_heard = entry.last_heard;
+}
+
+bool LinkStats::Get(uint16_t node, Snapshot& snapshot) const
+{
+  unique_lock<mutex> lock(mutex_);
+  const Entry* entry = node ? Find(node) : NULL;
+  if (!entry) { return false; }
+  Fill(*entry, snapshot);
+  return true;
+}
+
+unsigned LinkStats::Export(Snapshot* snapshots, unsigned capacity) const
+{
+  unique_lock<mutex> lock(mutex_);
+  unsigned n = 0;
+  for (unsigned i=0; i < MAX_NODES && n < capacity; i++) {
+    if (entries_[i].node) { Fill(entries_[i], snapshots[n++]); }
+  }
+  return n;
+}
+
+void LinkStats::PrintStats() const
+{
+  Snapshot snapshots[MAX_NODES];
+  unsigned n = Export(snapshots, MAX_NODES);
+  unsigned crc_errors, evicted;
+  {
+    unique_lock<mutex> lock(mutex_);
+    crc_errors = num_crc_errors_;
+    evicted = num_evicted_;
+  }
+  time_t now = time(NULL);
+  cout << format("[Links] nodes=%u crc_errors=%u evicted=%u\n") % n % crc_errors % evicted;
+  for (unsigned i=0; i < n; i++) {
+    const Snapshot& s = snapshots[i];
+    cout << format("[Links] node %.4x rssi=%.1fdBm snr=%.1fdB cr=4/%u frames=%u lost=%u crc=%u restarts=%u per=%.0f%% crc_rate=%.0f%% airtime up=%ums down=%ums recent=%ums seen=%lds ago\n")
+      % s.node % s.rssi_dbm % s.snr_db % s.coding_rate % s.frames % s.lost % s.crc_errors % s.restarts % (100 * s.packet_error_rate)
+      % (100 * s.crc_error_rate) % s.uplink_airtime_ms % s.downlink_airtime_ms % s.recent_airtime_ms % (long)(now - s.last_heard);
+  }
+}
@@ -0,0 +1,130 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LINK_STATS_HPP__
+#define LINK_STATS_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/// Link quality per neighbour, i.e. each leaf or relay we hear directly: smoothed packet RSSI and SNR,
+/// packet error rate from gaps in its rolling counter, CRC error rate and airtime both ways.
+/// For ADR, routing and capacity decisions, and to see which leaves are struggling.
+///
+/// Frames a relay passes on count towards the relay, which is who we heard, but carry the counter of the
+/// leaf that sent them, so they say nothing of the relay's packet error rate.
+///
+/// A CRC error leaves the header in doubt, so it only counts against a neighbour we already track, and
+/// otherwise only towards the total; a garbled address can still put it against the wrong one.
+///
+/// The table is fixed size and never allocates: past MAX_NODES, the neighbour heard least recently
+/// makes way. Methods are thread safe.
+class LinkStats : boost::noncopyable
+{
+public:
+  enum {
+    MAX_NODES = 64,
+    WINDOW = 32,                  ///< Frames the error rates are taken over
+    MAX_GAP = 16,                 ///< Longer counter gaps are taken as the sender restarting, not losses
+    EWMA_SHIFT = 3,               ///< Each frame moves the averages by 1/8 of the way
+    AIRTIME_WINDOW_S = 3600
+  };
+
+  /// What we know of one neighbour, copied out
+  struct Snapshot {
+    uint16_t node;
+    float rssi_dbm;               ///< Smoothed
+    float snr_db;                 ///< Smoothed
+    unsigned coding_rate;         ///< Of the last frame: 5..8 for 4/5..4/8, 0 if unknown
+    unsigned frames;              ///< Received intact
+    unsigned lost;                ///< Gaps in the counter
+    unsigned crc_errors;
+    unsigned restarts;            ///< Counter jumps too big to be losses
+    float packet_error_rate;      ///< Over the last WINDOW frames expected, 0..1
+    float crc_error_rate;         ///< Over the last WINDOW frames heard, 0..1
+    unsigned uplink_airtime_ms;
+    unsigned downlink_airtime_ms;
+    unsigned recent_airtime_ms;   ///< Both ways, over about the last AIRTIME_WINDOW_S
+    time_t last_heard;
+  };
+
+  LinkStats();
+
+  /// Note a frame received intact from node
+  /// @param counter Its rolling counter, or -1 if it is not node's own, e.g. a relay passing it on
+  /// @param coding_rate 5..8 for 4/5..4/8, 0 if unknown
+  void Received(uint16_t node, int counter, int rssi_dbm, int snr_db, unsigned coding_rate, unsigned airtime_ms);
+
+  /// Note a frame that failed its CRC, which seemed to be from node
+  void CrcError(uint16_t node);
+
+  /// Note a frame we sent to node
+  void Sent(uint16_t node, unsigned airtime_ms);
+
+  /// @return false if we do not track node
+  bool Get(uint16_t node, Snapshot& snapshot) const;
+
+  /// Copy out up to capacity neighbours, in no particular order
+  /// @return How many were written
+  unsigned Export(Snapshot* snapshots, unsigned capacity) const;
+
+  void PrintStats() const;
+
+private:
+  struct Entry {
+    uint16_t node;                ///< 0 if free
+    int32_t rssi_x16;             ///< dBm in 1/16ths
+    int32_t snr_x16;
+    uint8_t coding_rate;
+    uint8_t counter;              ///< Last heard
+    bool have_counter;
+    uint32_t lost_bits;           ///< 1 per frame lost, 0 per frame heard; newest in bit 0
+    uint8_t lost_bits_used;
+    uint32_t crc_bits;            ///< 1 per CRC error, 0 per frame intact
+    uint8_t crc_bits_used;
+    unsigned frames;
+    unsigned lost;
+    unsigned crc_errors;
+    unsigned restarts;
+    unsigned uplink_ms;
+    unsigned downlink_ms;
+    unsigned window_ms;           ///< Airtime since window_start
+    unsigned last_window_ms;      ///< Airtime in the window before
+    time_t window_start;
+    time_t last_heard;
+  };
+
+  /// Caller holds mutex_
+  Entry* Find(uint16_t node);
+  const Entry* Find(uint16_t node) const;
+  /// Find node, or take a free entry or the stalest for it
+  Entry* FindOrAdd(uint16_t node);
+  void AddAirtime(Entry& entry, unsigned airtime_ms, time_t now);
+  void Fill(const Entry& entry, Snapshot& snapshot) const;
+  static void Push(uint32_t& bits, uint8_t& used, bool bit);
+  static float Rate(uint32_t bits, uint8_t used);
+
+  Entry entries_[MAX_NODES];
+  unsigned num_crc_errors_;         ///< Including those we could not put against anyone
+  unsigned num_evicted_;
+  mutable boost::mutex mutex_;      ///< Protect everything above
+};
+
+#endif // LINK_STATS_HPP__
@@ -0,0 +1,452 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "message_store.hpp"
+#include "misc.hpp"
+#include "util.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+
+using std::string;
+using std::map;
+using std::vector;
+using boost::mutex;
+using boost::unique_lock;
+
+#define SEGMENT_MAGIC 0x31514653  // "SFQ1"
+#define RECORD_MAGIC  0x5352      // "RS"
+#define STATE_LIVE    0x4c        // 'L'
+#define STATE_DEAD    0x44        // 'D'
+
+// Unwritten segment space reads back as zeros (ftruncate), which can never match RECORD_MAGIC
+// so the end of the log in a segment is simply the first record without a valid header.
+
+struct __attribute__ ((__packed__)) SegmentHeader {
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t created;
+  uint32_t reserved;
+};
+
+struct __attribute__ ((__packed__)) RecordHeader {
+  uint16_t magic;
+  uint8_t state;
+  uint8_t topic_len;
+  uint16_t payload_len;
+  uint16_t check;
+  uint32_t id;
+  uint32_t stamp;
+};
+
+static inline unsigned RecordSize(unsigned topic_len, unsigned payload_len)
+{
+  return (sizeof(RecordHeader) + topic_len + payload_len + 3) & ~3U;
+}
+
+/// Fletcher-16 over the record body, so a torn write at the tail of a segment is detected on restart
+static uint16_t Checksum(uint32_t id, const uint8_t *body, unsigned len)
+{
+  uint16_t a = id & 0xff, b = (id >> 8) & 0xff;
+  for (unsigned i=0; i < len; i++) {
+    a = (a + body[i]) % 255;
+    b = (b + a) % 255;
+  }
+  return (b << 8) | a;
+}
+
+MessageStore::MessageStore(const string& directory, unsigned segment_bytes, unsigned max_segments)
+  : directory_(directory),
+    segment_bytes_(segment_bytes),
+    max_segments_(max_segments < 2 ? 2 : max_segments),
+    valid_(false),
+    default_max_age_(0),
+    next_id_(1),
+    discarded_(0)
+{
+  if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST) {
+    last_error_ = util::safe_perror(errno, directory_.c_str());
+    return;
+  }
+  DIR *dir = opendir(directory_.c_str());
+  if (!dir) {
+    last_error_ = util::safe_perror(errno, directory_.c_str());
+    return;
+  }
+  vector<uint32_t> found;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    unsigned sequence;
+    char tail;
+    if (sscanf(entry->d_name, "seg-%08x.lo%c", &sequence, &tail) == 2 && tail == 'g') {
+      found.push_back(sequence);
+    }
+  }
+  closedir(dir);
+  // Oldest first, so where Compact() left a message in two segments the copy wins
+  std::sort(found.begin(), found.end());
+
+  unique_lock<mutex> lock(mutex_);
+  for (vector<uint32_t>::const_iterator i = found.begin(); i != found.end(); ++i) {
+    if (!OpenSegment(*i, false)) {
+      PR_ERROR("Ignoring segment %s: %s\n", SegmentPath(*i).c_str(), last_error_.c_str());
+    }
+  }
+  if (segments_.empty() && !OpenSegment(1, true)) {
+    return;
+  }
+  last_error_ = "";
+  valid_ = true;
+}
+
+MessageStore::~MessageStore()
+{
+  Sync();
+  unique_lock<mutex> lock(mutex_);
+  for (map<uint32_t, Segment>::iterator i = segments_.begin(); i != segments_.end(); ++i) {
+    CloseSegment(i->second, false);
+  }
+}
+
+string MessageStore::SegmentPath(uint32_t sequence) const
+{
+  char name[24];
+  snprintf(name, sizeof(name), "/seg-%08x.log", sequence);
+  return directory_ + name;
+}
+
+bool MessageStore::OpenSegment(uint32_t sequence, bool create)
+{
+  string path = SegmentPath(sequence);
+  int fd = open(path.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+  if (fd == -1) { last_error_ = util::safe_perror(errno, path.c_str()); return false; }
+
+  struct stat st;
+  if (create && ftruncate(fd, segment_bytes_) != 0) {
+    last_error_ = util::safe_perror(errno, path.c_str());
+    close(fd); unlink(path.c_str());
+    return false;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)(sizeof(SegmentHeader) + sizeof(RecordHeader))) {
+    last_error_ = "Segment truncated";
+    close(fd);
+    return false;
+  }
+  void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    last_error_ = util::safe_perror(errno, path.c_str());
+    close(fd);
+    return false;
+  }
+
+  Segment segment;
+  segment.sequence = sequence;
+  segment.fd = fd;
+  segment.base = (uint8_t *)base;
+  segment.size = st.st_size;
+  segment.used = sizeof(SegmentHeader);
+  segment.live = 0;
+  segment.live_bytes = 0;
+
+  SegmentHeader *header = (SegmentHeader *)segment.base;
+  if (create) {
+    header->sequence = sequence;
+    header->created = time(NULL);
+    header->reserved = 0;
+    header->magic = SEGMENT_MAGIC;
+  } else if (header->magic != SEGMENT_MAGIC || header->sequence != sequence) {
+    last_error_ = "Bad segment header";
+    CloseSegment(segment, false);
+    return false;
+  }
+  segments_[sequence] = segment;
+  if (!create) { Scan(segments_[sequence]); }
+  return true;
+}
+
+void MessageStore::CloseSegment(Segment& segment, bool remove)
+{
+  if (segment.base) { munmap(segment.base, segment.size); segment.base = NULL; }
+  if (segment.fd != -1) { close(segment.fd); segment.fd = -1; }
+  if (remove) { unlink(SegmentPath(segment.sequence).c_str()); }
+}
+
+/// Rebuild the index from a segment read back from storage
+bool MessageStore::Scan(Segment& segment)
+{
+  unsigned offset = sizeof(SegmentHeader);
+  while (offset + sizeof(RecordHeader) <= segment.size) {
+    const RecordHeader *record = (const RecordHeader *)(segment.base + offset);
+    if (record->magic != RECORD_MAGIC) { break; }
+    unsigned size = RecordSize(record->topic_len, record->payload_len);
+    if (offset + size > segment.size) { break; }
+    const uint8_t *body = segment.base + offset + sizeof(RecordHeader);
+    if (record->check != Checksum(record->id, body, record->topic_len + record->payload_len)) {
+      PR_ERROR("Segment %08x: torn record at %u, ignoring remainder\n", segment.sequence, offset);
+      break;
+    }
+    if (record->state == STATE_LIVE) {
+      map<uint32_t, Location>::const_iterator original = index_.find(record->id);
+      if (original != index_.end()) { Kill(segments_[original->second.sequence], original->second.offset); }
+      Location location = { segment.sequence, offset };
+      index_[record->id] = location;
+      segment.live ++;
+      segment.live_bytes += size;
+    }
+    if (record->id >= next_id_) { next_id_ = record->id + 1; }
+    offset += size;
+  }
+  segment.used = offset;
+  return true;
+}
+
+void MessageStore::SetDefaultMaxAge(unsigned seconds)
+{
+  unique_lock<mutex> lock(mutex_);
+  default_max_age_ = seconds;
+}
+
+void MessageStore::SetTopicMaxAge(const string& topic_prefix, unsigned seconds)
+{
+  unique_lock<mutex> lock(mutex_);
+  max_age_[topic_prefix] = seconds;
+}
+
+bool MessageStore::Expired(const string& topic, time_t stamp, time_t now) const
+{
+  unsigned age = default_max_age_;
+  size_t best = 0;
+  for (map<string, unsigned>::const_iterator i = max_age_.begin(); i != max_age_.end(); ++i) {
+    if (i->first.size() >= best && topic.compare(0, i->first.size(), i->first) == 0) {
+      best = i->first.size();
+      age = i->second;
+    }
+  }
+  return age > 0 && now - stamp > (time_t)age;
+}
+
+void MessageStore::Kill(Segment& segment, unsigned offset)
+{
+  RecordHeader *record = (RecordHeader *)(segment.base + offset);
+  if (record->state != STATE_LIVE) { return; }
+  record->state = STATE_DEAD;
+  segment.live --;
+  segment.live_bytes -= RecordSize(record->topic_len, record->payload_len);
+}
+
+bool MessageStore::Roll()
+{
+  uint32_t sequence = segments_.empty() ? 1 : segments_.rbegin()->first + 1;
+  return OpenSegment(sequence, true);
+}
+
+/// Discard the oldest segment(s), live or not, to stay within max_segments_
+void MessageStore::EnforceLimit()
+{
+  while (segments_.size() > max_segments_) {
+    Segment& oldest = segments_.begin()->second;
+    unsigned offset = sizeof(SegmentHeader);
+    while (offset < oldest.used) {
+      const RecordHeader *record = (const RecordHeader *)(oldest.base + offset);
+      if (record->state == STATE_LIVE) { index_.erase(record->id); discarded_ ++; }
+      offset += RecordSize(record->topic_len, record->payload_len);
+    }
+    PR_ERROR("Store full, discarded segment %08x with %u live messages\n", oldest.sequence, oldest.live);
+    CloseSegment(oldest, true);
+    segments_.erase(segments_.begin());
+  }
+}
+
+bool MessageStore::AppendLocked(const string& topic, const void *payload, unsigned len, uint32_t id, time_t stamp)
+{
+  unsigned size = RecordSize(topic.size(), len);
+  if (topic.size() > 0xff || len > 0xffff || size > segment_bytes_ - sizeof(SegmentHeader)) {
+    last_error_ = "Message too large";
+    return false;
+  }
+  Segment *head = &segments_.rbegin()->second;
+  if (head->used + size > head->size) {
+    if (!Roll()) { return false; }
+    head = &segments_.rbegin()->second;
+  }
+
+  // Write the body first and the magic last, so a crash part way leaves no valid header
+  uint8_t *p = head->base + head->used;
+  RecordHeader *record = (RecordHeader *)p;
+  memcpy(p + sizeof(RecordHeader), topic.data(), topic.size());
+  memcpy(p + sizeof(RecordHeader) + topic.size(), payload, len);
+  record->state = STATE_LIVE;
+  record->topic_len = topic.size();
+  record->payload_len = len;
+  record->id = id;
+  record->stamp = stamp;
+  record->check = Checksum(id, p + sizeof(RecordHeader), topic.size() + len);
+  record->magic = RECORD_MAGIC;
+
+  Location location = { head->sequence, head->used };
+  index_[id] = location;
+  head->used += size;
+  head->live ++;
+  head->live_bytes += size;
+  return true;
+}
+
+bool MessageStore::Append(const string& topic, const void *payload, unsigned len, uint32_t& id)
+{
+  unique_lock<mutex> lock(mutex_);
+  if (!valid_) { return false; }
+  id = next_id_;
+  if (!AppendLocked(topic, payload, len, id, time(NULL))) { return false; }
+  next_id_ ++;
+  EnforceLimit();
+  return true;
+}
+
+bool MessageStore::Ack(uint32_t id)
+{
+  unique_lock<mutex> lock(mutex_);
+  map<uint32_t, Location>::iterator i = index_.find(id);
+  if (i == index_.end()) { return false; }
+  Kill(segments_[i->second.sequence], i->second.offset);
+  index_.erase(i);
+  return true;
+}
+
+void MessageStore::Replay(vector<Message>& messages)
+{
+  unique_lock<mutex> lock(mutex_);
+  time_t now = time(NULL);
+  // Ids are allocated in append order, and relocation preserves them, so the index is already in order
+  for (map<uint32_t, Location>::iterator i = index_.begin(); i != index_.end(); ) {
+    Segment& segment = segments_[i->second.sequence];
+    const RecordHeader *record = (const RecordHeader *)(segment.base + i->second.offset);
+    const char *body = (const char *)(record + 1);
+    Message message;
+    message.id = record->id;
+    message.stamp = record->stamp;
+    message.topic.assign(body, record->topic_len);
+    if (Expired(message.topic, message.stamp, now)) {
+      Kill(segment, i->second.offset);
+      index_.erase(i++);
+      discarded_ ++;
+      continue;
+    }
+    message.payload.assign(body + record->topic_len, body + record->topic_len + record->payload_len);
+    messages.push_back(message);
+    ++i;
+  }
+}
+
+/// Copy the live records of an old segment to the head of the log
+/// @return false if some could not be, in which case they stay live where they are and the segment must be kept
+bool MessageStore::Relocate(Segment& segment)
+{
+  // The copies go to the head, or segments rolled after it
+  uint32_t first = segments_.rbegin()->first;
+  vector<unsigned> copied;
+  bool ok = true;
+  unsigned offset = sizeof(SegmentHeader);
+  while (offset < segment.used) {
+    const RecordHeader *record = (const RecordHeader *)(segment.base + offset);
+    unsigned size = RecordSize(record->topic_len, record->payload_len);
+    if (record->state == STATE_LIVE) {
+      const char *body = (const char *)(record + 1);
+      string topic(body, record->topic_len);
+      if (!AppendLocked(topic, body + record->topic_len, record->payload_len, record->id, record->stamp)) {
+        PR_ERROR("Relocation failed: %s\n", last_error_.c_str());
+        ok = false;
+        break;
+      }
+      // The index now points at the copy
+      copied.push_back(offset);
+    }
+    offset += size;
+  }
+  // The copies must be on flash before any original is marked dead: the kernel may write the
+  // mark back at any time, and a crash before the copy got there would lose the message.
+  // Until then both are live, and a restart picks the copy, being in a later segment
+  if (!SyncFrom(first)) { return false; }
+  for (vector<unsigned>::const_iterator c = copied.begin(); c != copied.end(); ++c) { Kill(segment, *c); }
+  return ok;
+}
+
+bool MessageStore::SyncFrom(uint32_t sequence)
+{
+  bool ok = true;
+  for (map<uint32_t, Segment>::iterator i = segments_.lower_bound(sequence); i != segments_.end(); ++i) {
+    if (msync(i->second.base, i->second.size, MS_SYNC) != 0) {
+      PR_ERROR("%s\n", util::safe_perror(errno, "msync").c_str());
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+unsigned MessageStore::Compact()
+{
+  unique_lock<mutex> lock(mutex_);
+  time_t now = time(NULL);
+
+  for (map<uint32_t, Location>::iterator i = index_.begin(); i != index_.end(); ) {
+    Segment& segment = segments_[i->second.sequence];
+    const RecordHeader *record = (const RecordHeader *)(segment.base + i->second.offset);
+    string topic((const char *)(record + 1), record->topic_len);
+    if (Expired(topic, record->stamp, now)) {
+      Kill(segment, i->second.offset);
+      index_.erase(i++);
+      discarded_ ++;
+    } else {
+      ++i;
+    }
+  }
+
+  // Only relocate from segments less than a quarter full of live data, otherwise we just
+  // shuffle the same bytes around and wear the flash for nothing
+  unsigned removed = 0;
+  uint32_t head = segments_.rbegin()->first;
+  vector<uint32_t> victims;
+  for (map<uint32_t, Segment>::iterator i = segments_.begin(); i != segments_.end(); ++i) {
+    if (i->first != head && i->second.live_bytes * 4 < i->second.size) { victims.push_back(i->first); }
+  }
+  for (vector<uint32_t>::const_iterator v = victims.begin(); v != victims.end(); ++v) {
+    Segment& segment = segments_[*v];
+    if (segment.live > 0 && !Relocate(segment)) { continue; }
+    CloseSegment(segment, true);
+    segments_.erase(*v);
+    removed ++;
+  }
+  return removed;
+}
+
+void MessageStore::Sync()
+{
+  unique_lock<mutex> lock(mutex_);
+  SyncFrom(0);
+}
+
+unsigned MessageStore::pending() const
+{
+  unique_lock<mutex> lock(mutex_);
+  return index_.size();
+}
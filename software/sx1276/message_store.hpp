@@ -0,0 +1,144 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MESSAGE_STORE_HPP__
+#define MESSAGE_STORE_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/// Durable store-and-forward queue, so messages survive link outages and process restarts.
+///
+/// Messages are appended to a log made of fixed size, memory mapped segment files in a directory.
+/// Segments are written through shared writable mmap(), which jffs2 does not support: on OpenWrt the
+/// directory must be on ubifs (or tmpfs, giving up durability over a reboot), not a jffs2 overlay.
+/// Elsewhere opening fails, valid() is false, and the bridge refuses to start rather than run without
+/// the store it was asked for; leave out the store directory to run without one.
+///
+/// The design tries to be kind to the flash on the fencepost (OpenWrt on ubifs):
+///   * segments are only ever appended to, never rewritten as a whole
+///   * acknowledgements flip a state byte in place, and are only flushed by Sync() (i.e. batched);
+///     after a power cut a few messages may be sent twice, which MQTT-SN QoS 1 tolerates anyway
+///   * space is reclaimed by deleting whole segments; a sparse old segment is compacted by
+///     copying its few live records forward first, and only deleted once their copies are flushed
+///
+/// Each topic (actually a topic prefix) can have a maximum age, after which its messages are
+/// discarded instead of being forwarded. This lets stale protocol control traffic die quickly while
+/// sensor data is kept for as long as the link is down.
+///
+/// Methods are thread safe.
+class MessageStore : boost::noncopyable
+{
+public:
+  /// A live message, as returned by Replay()
+  struct Message {
+    uint32_t id;                  ///< Stable identifier, pass to Ack()
+    time_t stamp;                 ///< Time appended
+    std::string topic;
+    std::vector<uint8_t> payload;
+  };
+
+  /// @param directory Where to keep segment files; created if missing
+  /// @param segment_bytes Size of each segment file
+  /// @param max_segments Limit on disk usage; when exceeded the oldest data is discarded
+  MessageStore(const std::string& directory, unsigned segment_bytes=65536, unsigned max_segments=16);
+  ~MessageStore();
+
+  /// False if the directory or head segment could not be opened; last_error() explains why
+  bool valid() const { return valid_; }
+  const char *last_error() const { return last_error_.c_str(); }
+
+  /// Age for topics not matched by SetTopicMaxAge(). Zero means forever.
+  void SetDefaultMaxAge(unsigned seconds);
+
+  /// Set maximum age for any topic starting with topic_prefix. The longest matching prefix wins.
+  void SetTopicMaxAge(const std::string& topic_prefix, unsigned seconds);
+
+  /// Append a message to the log.
+  /// @param id Set to the identifier of the new message
+  /// @return false on I/O error or if the message cannot fit in a segment
+  bool Append(const std::string& topic, const void *payload, unsigned len, uint32_t& id);
+
+  /// Mark a message as delivered. The message will not be returned by Replay() after the next Sync()
+  bool Ack(uint32_t id);
+
+  /// Retrieve all live unexpired messages, oldest first. Typically called once at startup.
+  void Replay(std::vector<Message>& messages);
+
+  /// Discard expired messages and reclaim segments that no longer hold live data
+  /// @return Number of segments removed
+  unsigned Compact();
+
+  /// Flush dirty pages to storage. Call periodically rather than after every operation.
+  void Sync();
+
+  /// Number of live messages
+  unsigned pending() const;
+
+  /// Number of messages discarded due to age or the disk limit
+  unsigned discarded() const { return discarded_; }
+
+private:
+  struct Segment {
+    uint32_t sequence;   ///< Position in the log, also forms the file name
+    int fd;
+    uint8_t *base;       ///< mmap()'d file contents
+    unsigned size;       ///< File size
+    unsigned used;       ///< Append offset
+    unsigned live;       ///< Number of unacknowledged records
+    unsigned live_bytes; ///< Space used by unacknowledged records
+  };
+  struct Location {
+    uint32_t sequence;
+    unsigned offset;
+  };
+
+  std::string SegmentPath(uint32_t sequence) const;
+  bool OpenSegment(uint32_t sequence, bool create);
+  void CloseSegment(Segment& segment, bool remove);
+  bool Scan(Segment& segment);
+  bool AppendLocked(const std::string& topic, const void *payload, unsigned len, uint32_t id, time_t stamp);
+  bool Roll();
+  void EnforceLimit();
+  bool Expired(const std::string& topic, time_t stamp, time_t now) const;
+  void Kill(Segment& segment, unsigned offset);
+  bool Relocate(Segment& segment);
+  /// msync() the segments from sequence on; false on error
+  bool SyncFrom(uint32_t sequence);
+
+  std::string directory_;
+  unsigned segment_bytes_;
+  unsigned max_segments_;
+  bool valid_;
+  std::string last_error_;
+
+  mutable boost::mutex mutex_;
+  std::map<uint32_t, Segment> segments_;    ///< Keyed by sequence; rbegin() is the head segment
+  std::map<uint32_t, Location> index_;      ///< Live messages by id
+  std::map<std::string, unsigned> max_age_; ///< Topic prefix --> seconds
+  unsigned default_max_age_;
+  uint32_t next_id_;
+  unsigned discarded_;
+};
+
+#endif // MESSAGE_STORE_HPP__
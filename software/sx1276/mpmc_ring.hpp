@@ -0,0 +1,112 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MPMC_RING_HPP__
+#define MPMC_RING_HPP__
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+/// Bounded lock free queue for any number of producer and consumer threads.
+///
+/// Each cell carries a sequence number saying whose turn it is: a producer may fill cell i on lap n
+/// when its sequence is i + n * size, a consumer may empty it when it is one more than that.
+/// Threads claim a position by compare and swap on the head or tail counter, then touch only their
+/// own cell, so a stalled thread never blocks the others for longer than its one cell.
+/// (After D. Vyukov's bounded MPMC queue.)
+///
+/// T must be default constructible and assignable. Size is rounded up to a power of two.
+template <typename T>
+class MpmcRing : boost::noncopyable
+{
+public:
+  explicit MpmcRing(size_t size)
+  : mask_(RoundUp(size) - 1), cells_(mask_ + 1), enqueue_(0), dequeue_(0)
+  {
+    for (size_t i=0; i <= mask_; i++) { cells_[i].sequence.store(i, std::memory_order_relaxed); }
+  }
+
+  /// @return false if full
+  bool Push(const T& item) {
+    size_t pos = enqueue_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)pos;
+      if (diff == 0) {
+        if (enqueue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.item = item;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /// @return false if empty
+  bool Pop(T& item) {
+    size_t pos = dequeue_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)(pos + 1);
+      if (diff == 0) {
+        if (dequeue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          item = cell.item;
+          cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+private:
+  struct Cell {
+    Cell() : sequence(0) {}
+    Cell(const Cell& other) : sequence(other.sequence.load()), item(other.item) {}
+    std::atomic<size_t> sequence;
+    T item;
+  };
+
+  static size_t RoundUp(size_t size) {
+    size_t result = 2;
+    while (result < size) { result <<= 1; }
+    return result;
+  }
+
+  size_t mask_;
+  std::vector<Cell> cells_;
+  char pad0_[64];                     ///< Keep producers and consumers off each other's cache line
+  std::atomic<size_t> enqueue_;
+  char pad1_[64];
+  std::atomic<size_t> dequeue_;
+};
+
+#endif // MPMC_RING_HPP__
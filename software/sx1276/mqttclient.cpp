@@ -17,11 +17,19 @@
   along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "mqttclient.hpp"
+#include "message_store.hpp"
+#include "backoff.hpp"
 #include "util.hpp"
 #include <mosquitto.h>
 #include <iostream>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
 #include <boost/format.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <boost/chrono/time_point.hpp>
 #include <boost/chrono/system_clocks.hpp>
 
@@ -29,7 +37,11 @@ using std::string;
 using std::cout;
 using std::cerr;
 using boost::format;
+using std::vector;
 using boost::chrono::steady_clock;
+using boost::shared_ptr;
+using boost::mutex;
+using boost::unique_lock;
 
 #if 0
 #define DEBUG(x ...) printf("[DBG] " x)
@@ -57,43 +69,160 @@ public:
 
 static MosquittoLibrarySingleton mosquitto;
 
+/// Threads that call the handlers, so a slow handler does not hold up the network thread
+class DispatchPool : boost::noncopyable
+{
+public:
+  typedef boost::function<void()> job_t;
+
+  DispatchPool() : stopping_(false) {}
+  ~DispatchPool() { Stop(); }
+
+  void Start(unsigned workers) {
+    unique_lock<mutex> lock(mutex_);
+    stopping_ = false;
+    for (unsigned i=0; i < workers; i++) {
+      threads_.push_back(shared_ptr<boost::thread>(new boost::thread(boost::bind(&DispatchPool::Run, this))));
+    }
+  }
+
+  /// Finish the jobs already posted, then stop the threads
+  void Stop() {
+    { unique_lock<mutex> lock(mutex_); stopping_ = true; }
+    cond_.notify_all();
+    for (unsigned i=0; i < threads_.size(); i++) { threads_[i]->join(); }
+    threads_.clear();
+  }
+
+  void Post(const job_t& job) {
+    { unique_lock<mutex> lock(mutex_); jobs_.push_back(job); }
+    cond_.notify_one();
+  }
+
+private:
+  void Run() {
+    for (;;) {
+      job_t job;
+      {
+        unique_lock<mutex> lock(mutex_);
+        while (jobs_.empty() && !stopping_) { cond_.wait(lock); }
+        if (jobs_.empty()) { return; }
+        job = jobs_.front();
+        jobs_.pop_front();
+      }
+      job();
+    }
+  }
+
+  mutex mutex_;                  ///< Protect jobs_, stopping_
+  boost::condition_variable cond_;
+  std::deque<job_t> jobs_;
+  vector<shared_ptr<boost::thread> > threads_;
+  bool stopping_;
+};
+
 /// Implementation shim wrapping mosquitto C library.
-/// For the time being keep things simple and use the loop / non threaded version.
+/// Uses the loop / non threaded version until Start(), then mosquitto's own network thread.
 class MoqsuittoMQTTClient : public MQTTClient
 {
 public:
-  MoqsuittoMQTTClient(const char *client_id, const char *host, int port);
+  MoqsuittoMQTTClient(const char *client_id, const char *host, int port, bool clean_session);
   virtual ~MoqsuittoMQTTClient();
-  virtual bool have_connack() const { return connack_state_ == HAVE; }
+  virtual bool have_connack() const { unique_lock<mutex> lock(mutex_); return connack_state_ == HAVE; }
   virtual bool Connect();
   virtual bool Poll();
-  virtual bool Subscribe(const char *topic);
+  virtual bool Subscribe(const char *topic, int qos);
   virtual bool Unsubscribe(const char *topic);
+  virtual bool Publish(const char *topic, const void *payload, unsigned len, int qos, bool retain);
+  virtual bool Start(unsigned workers);
+  virtual void Stop();
+  virtual unsigned outbound() const { unique_lock<mutex> lock(mutex_); return outbound_.size() + reserved_; }
+  virtual unsigned offline() const { unique_lock<mutex> lock(mutex_); return offline_.size() + spilled_; }
+  virtual void SetOfflineBuffer(unsigned max_messages, MessageStore* store);
 
 private:
   bool Init();
   void OnConnect(struct mosquitto *mosq, int rc);
+  void OnDisconnect(struct mosquitto *mosq, int rc);
   void OnMessage(struct mosquitto *mosq, const struct mosquitto_message *msg);
+  void OnPublish(struct mosquitto *mosq, int mid);
+  void Dispatch(const DispatchPool::job_t& job);
+  void Deliver(const string& topic, const vector<uint8_t>& payload);
+  void Connacked(bool error);
+  /// Call with mutex_ held. @return true if the flow handler should be told we are accepting messages again
+  bool CheckResume();
+  /// Hand a message to mosquitto, subject to flow control. @param store_id Offline store copy to remove when done, or 0
+  bool Send(const char *topic, const void *payload, unsigned len, int qos, bool retain, uint32_t store_id);
+  /// Call with mutex_ held
+  void Buffer(const char *topic, const void *payload, unsigned len, int qos, bool retain);
+  /// Call with mutex_ held. Refill offline_ from the store. @return false if nothing left to send
+  bool Reload();
+  /// Send offline messages while the connection and flow control allow
+  void Drain();
+  void Resubscribe();
+  void ScheduleReconnect();
 
   struct mosquitto *mosq_;
 
   static void on_connect(struct mosquitto *mosq, void *obj, int rc);
+  static void on_disconnect(struct mosquitto *mosq, void *obj, int rc);
   static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *);
+  static void on_publish(struct mosquitto *mosq, void *obj, int mid);
 
   enum ConnackState { NONE, WANT, HAVE, ERROR };
   ConnackState connack_state_;
+  unsigned connacks_;            ///< Number of successful connections
+
+  /// Published while disconnected
+  struct Offline {
+    string topic;
+    vector<uint8_t> payload;
+    int qos;
+    bool retain;
+    uint32_t store_id;           ///< Copy in store_, or 0 if only in memory
+  };
+
+  DispatchPool pool_;
+  bool threaded_;                ///< Start() was called
+  mutable mutex mutex_;          ///< Protect everything below, and connack_state_
+  std::map<int, int> outbound_;  ///< Message id --> QoS, for messages published but not done with
+  std::set<int> early_;          ///< Message ids done with before Publish() could note them
+  unsigned reserved_;            ///< Publish() calls in progress
+  bool blocked_;                 ///< Refusing messages until the backlog drains to resume_outbound_
+
+  std::deque<Offline> offline_;  ///< Waiting for the connection, oldest first
+  unsigned max_offline_;         ///< Limit on offline_
+  MessageStore* store_;          ///< Optional overflow for offline_
+  unsigned spilled_;             ///< Messages in store_ not yet loaded into offline_
+  std::set<uint32_t> loaded_;    ///< store_ ids in offline_ or in flight
+  std::map<int, uint32_t> stored_; ///< Message id --> store_ id, to Ack() once done with
+  bool draining_;                ///< Drain() in progress
+  std::map<string, int> subscriptions_; ///< Topic --> QoS, renewed on reconnection
+
+  Backoff backoff_;
+  bool reconnect_pending_;       ///< Poll() is to reconnect at next_attempt_
+  steady_clock::time_point next_attempt_;
 };
 
-boost::shared_ptr<MQTTClient> MQTTClient::CreateInstance(const char *client_id, const char *host, int port)
+boost::shared_ptr<MQTTClient> MQTTClient::CreateInstance(const char *client_id, const char *host, int port, bool clean_session)
 {
   if (host == NULL) { host = "127.0.0.1"; }
-  return boost::shared_ptr<MQTTClient>(new MoqsuittoMQTTClient(client_id, host, port));
+  return boost::shared_ptr<MQTTClient>(new MoqsuittoMQTTClient(client_id, host, port, clean_session));
 }
 
-MoqsuittoMQTTClient::MoqsuittoMQTTClient(const char *client_id, const char *host, int port)
-  : MQTTClient(client_id, host, port),
+MoqsuittoMQTTClient::MoqsuittoMQTTClient(const char *client_id, const char *host, int port, bool clean_session)
+  : MQTTClient(client_id, host, port, clean_session),
     mosq_(NULL),
-    connack_state_(NONE)
+    connack_state_(NONE),
+    connacks_(0),
+    threaded_(false),
+    reserved_(0),
+    blocked_(false),
+    max_offline_(256),
+    store_(NULL),
+    spilled_(0),
+    draining_(false),
+    reconnect_pending_(false)
 {
 #ifdef REPORT_DEBUG
   mosquitto.ReportVersion();
@@ -105,6 +234,7 @@ MoqsuittoMQTTClient::MoqsuittoMQTTClient(const char *client_id, const char *host
 MoqsuittoMQTTClient::~MoqsuittoMQTTClient()
 {
   DEBUG("Destructor()\n");
+  Stop();
   if (mosq_) { mosquitto_destroy(mosq_); }
 }
 
@@ -114,10 +244,12 @@ bool MoqsuittoMQTTClient::Init()
   // NOTE: need to ensure all callbacks finish before destruction
   // NOTE: NULL returned only on out of memory or invalid argument.
   // NOTE: in either case there is not much that we can do so just run dead.
-  mosq_ = mosquitto_new(client_id_.c_str(), true, this);
-  if (!mosq_) { last_error_ = util::safe_perror(errno, NULL); return false; }
+  mosq_ = mosquitto_new(client_id_.c_str(), clean_session_, this);
+  if (!mosq_) { SetError(util::safe_perror(errno, NULL)); return false; }
   mosquitto_connect_callback_set(mosq_, &on_connect);
+  mosquitto_disconnect_callback_set(mosq_, &on_disconnect);
   mosquitto_message_callback_set(mosq_, &on_message);
+  mosquitto_publish_callback_set(mosq_, &on_publish);
   return true;
 }
 
@@ -128,6 +260,13 @@ void MoqsuittoMQTTClient::on_connect(struct mosquitto *mosq, void *obj, int rc)
   self->OnConnect(mosq, rc);
 }
 
+void MoqsuittoMQTTClient::on_disconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+  DEBUG("on_disconnect()\n");
+  MoqsuittoMQTTClient* self = static_cast<MoqsuittoMQTTClient*>(obj);
+  self->OnDisconnect(mosq, rc);
+}
+
 void MoqsuittoMQTTClient::on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
 {
   DEBUG("on_message()\n");
@@ -135,28 +274,116 @@ void MoqsuittoMQTTClient::on_message(struct mosquitto *mosq, void *obj, const st
   self->OnMessage(mosq, msg);
 }
 
+void MoqsuittoMQTTClient::on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+  DEBUG("on_publish()\n");
+  MoqsuittoMQTTClient* self = static_cast<MoqsuittoMQTTClient*>(obj);
+  self->OnPublish(mosq, mid);
+}
+
+void MoqsuittoMQTTClient::Dispatch(const DispatchPool::job_t& job)
+{
+  if (threaded_) { pool_.Post(job); } else { job(); }
+}
+
 void MoqsuittoMQTTClient::OnConnect(struct mosquitto *mosq, int rc)
 {
   assert(mosq == mosq_);
+  unique_lock<mutex> lock(mutex_);
   switch (rc) {
     case 0:
-      if (connack_state_ == WANT) { connack_state_ = HAVE; if (connack_fcn_) { connack_fcn_(client_id_.c_str(), false); } return; }
+      if (connack_state_ == WANT) {
+        connack_state_ = HAVE;
+        connacks_++;
+        lock.unlock();
+        backoff_.Reset();
+        // Subscribe() calls made before the first CONNACK never reached the broker; and even with clean_session=false
+        // the broker may have lost our session, e.g. if it restarted without persistence
+        Resubscribe();
+        Dispatch(boost::bind(&MoqsuittoMQTTClient::Connacked, this, false));
+        Drain();
+        return;
+      }
       std::cerr << "Spurious CONNACK!\n";
       return;
-    case 1: last_error_ = "Connection error: procotol version\n"; break;
-    case 2: last_error_ = "Connection error: identifier rejected\n"; break;
-    case 3: last_error_ = "Connection error: broker unavailable\n"; break;
+    case 1: SetError("Connection error: procotol version\n"); break;
+    case 2: SetError("Connection error: identifier rejected\n"); break;
+    case 3: SetError("Connection error: broker unavailable\n"); break;
     default: assert(0);
   }
   connack_state_ = ERROR;
-  if (connack_fcn_) { connack_fcn_(client_id_.c_str(), true); }
+  lock.unlock();
+  Dispatch(boost::bind(&MoqsuittoMQTTClient::Connacked, this, true));
+}
+
+void MoqsuittoMQTTClient::Connacked(bool error)
+{
+  if (connack_fcn_) { connack_fcn_(client_id_.c_str(), error); }
+}
+
+void MoqsuittoMQTTClient::OnDisconnect(struct mosquitto *mosq, int rc)
+{
+  assert(mosq == mosq_);
+  bool resume;
+  {
+    unique_lock<mutex> lock(mutex_);
+    if (connack_state_ == HAVE) { connack_state_ = WANT; }
+    // mosquitto drops QoS 0 messages still queued, without calling on_publish
+    for (std::map<int, int>::iterator i = outbound_.begin(); i != outbound_.end(); ) {
+      if (i->second == 0) { outbound_.erase(i++); } else { ++i; }
+    }
+    resume = CheckResume();
+  }
+  if (resume && flow_fcn_) { flow_fcn_(client_id_.c_str(), false); }
+  if (threaded_) {
+    // mosquitto's thread does the reconnecting: it has no jitter of its own, so vary the first delay
+    unsigned min_s = (backoff_.Next() + 999) / 1000;
+    mosquitto_reconnect_delay_set(mosq_, min_s, (reconnect_max_ms_ + 999) / 1000, true);
+  }
 }
 
 void MoqsuittoMQTTClient::OnMessage(struct mosquitto *mosq, const struct mosquitto_message *msg)
 {
   assert(mosq == mosq_);
   if (!message_fcn_) return;
-  message_fcn_(client_id_.c_str(), msg->topic, msg->payload, msg->payloadlen);
+  if (!threaded_) {
+    message_fcn_(client_id_.c_str(), msg->topic, msg->payload, msg->payloadlen);
+    return;
+  }
+  // msg is only valid during the callback
+  const uint8_t* payload = static_cast<const uint8_t*>(msg->payload);
+  pool_.Post(boost::bind(&MoqsuittoMQTTClient::Deliver, this, string(msg->topic), vector<uint8_t>(payload, payload + msg->payloadlen)));
+}
+
+void MoqsuittoMQTTClient::Deliver(const string& topic, const vector<uint8_t>& payload)
+{
+  message_fcn_(client_id_.c_str(), topic.c_str(), payload.empty() ? NULL : &payload[0], payload.size());
+}
+
+void MoqsuittoMQTTClient::OnPublish(struct mosquitto *mosq, int mid)
+{
+  assert(mosq == mosq_);
+  bool resume;
+  {
+    unique_lock<mutex> lock(mutex_);
+    if (outbound_.erase(mid) == 0) { early_.insert(mid); }
+    std::map<int, uint32_t>::iterator i = stored_.find(mid);
+    if (i != stored_.end()) {
+      store_->Ack(i->second);
+      loaded_.erase(i->second);
+      stored_.erase(i);
+    }
+    resume = CheckResume();
+  }
+  if (resume && flow_fcn_) { flow_fcn_(client_id_.c_str(), false); }
+  Drain();
+}
+
+bool MoqsuittoMQTTClient::CheckResume()
+{
+  if (!blocked_ || outbound_.size() + reserved_ > resume_outbound_) { return false; }
+  blocked_ = false;
+  return true;
 }
 
 std::string MosqErrStr(int code, const char *txt)
@@ -167,11 +394,13 @@ std::string MosqErrStr(int code, const char *txt)
   case MOSQ_ERR_ERRNO:
     return util::safe_perror(errno, txt);
   case MOSQ_ERR_NO_CONN:
-    return string(txt) + ": Out of memory";
+    return string(txt) + ": Not connected to broker";
   case MOSQ_ERR_PROTOCOL:
     return string(txt) + ": Protocol error";
   case MOSQ_ERR_NOMEM:
-    return string(txt) + ": Not connected to broker";
+    return string(txt) + ": Out of memory";
+  case MOSQ_ERR_PAYLOAD_SIZE:
+    return string(txt) + ": Payload too large";
   case MOSQ_ERR_INVAL:
     return string(txt) + ": Invalid argument";
   }
@@ -182,11 +411,14 @@ bool MoqsuittoMQTTClient::Connect()
 {
   DEBUG("Connect()\n");
   if (!valid_) return false;
-  last_error_ = "";
+  SetError("");
   // This function is not re-entrant
-  connack_state_ = WANT;
-  int rc = mosquitto_connect(mosq_, broker_host_.c_str(), broker_port_, keep_alive_s_);
-  last_error_ = MosqErrStr(rc, "Unable to connect to broker");
+  { unique_lock<mutex> lock(mutex_); connack_state_ = WANT; }
+  backoff_.SetLimits(reconnect_min_ms_, reconnect_max_ms_);
+  int rc = threaded_ ? mosquitto_connect_async(mosq_, broker_host_.c_str(), broker_port_, keep_alive_s_)
+                     : mosquitto_connect(mosq_, broker_host_.c_str(), broker_port_, keep_alive_s_);
+  SetError(MosqErrStr(rc, "Unable to connect to broker"));
+  if (rc != MOSQ_ERR_SUCCESS && !threaded_) { ScheduleReconnect(); }
   return rc == MOSQ_ERR_SUCCESS;
 }
 
@@ -194,23 +426,47 @@ bool MoqsuittoMQTTClient::Poll()
 {
   DEBUG("Poll()\n");
   if (!valid_) return false;
-  last_error_ = "";
+  if (threaded_) return true;
+  SetError("");
+  if (reconnect_pending_) {
+    if (steady_clock::now() < next_attempt_) { return true; }
+    reconnect_pending_ = false;
+    { unique_lock<mutex> lock(mutex_); connack_state_ = WANT; }
+    int rc = mosquitto_reconnect(mosq_);
+    if (rc != MOSQ_ERR_SUCCESS) {
+      ScheduleReconnect();
+      SetError(MosqErrStr(rc, "Unable to reconnect to broker"));
+      return false;
+    }
+  }
   int rc = mosquitto_loop(mosq_, 1000, 1);
-  if (rc == MOSQ_ERR_CONN_LOST) {
-    connack_state_ = WANT;
-    rc = mosquitto_reconnect(mosq_);
+  if (rc == MOSQ_ERR_CONN_LOST || rc == MOSQ_ERR_NO_CONN) {
+    // Try again later rather than straight away: the broker may be restarting
+    ScheduleReconnect();
+    SetError(MosqErrStr(rc, "Broker connection lost"));
+    return false;
   }
-  last_error_ = MosqErrStr(rc, "Broker poll error");
+  SetError(MosqErrStr(rc, "Broker poll error"));
   return rc == MOSQ_ERR_SUCCESS;
 }
 
-bool MoqsuittoMQTTClient::Subscribe(const char *topic)
+void MoqsuittoMQTTClient::ScheduleReconnect()
+{
+  unsigned delay_ms = backoff_.Next();
+  DEBUG("Reconnect in %u ms\n", delay_ms);
+  { unique_lock<mutex> lock(mutex_); if (connack_state_ == HAVE) { connack_state_ = WANT; } }
+  reconnect_pending_ = true;
+  next_attempt_ = steady_clock::now() + boost::chrono::milliseconds(delay_ms);
+}
+
+bool MoqsuittoMQTTClient::Subscribe(const char *topic, int qos)
 {
   DEBUG("Subscribe(%s)\n", topic);
   if (!valid_) return false;
-  last_error_ = "";
-  int rc = mosquitto_subscribe(mosq_, NULL, topic, 0);
-  last_error_ = MosqErrStr(rc, "Subscribe");
+  SetError("");
+  { unique_lock<mutex> lock(mutex_); subscriptions_[topic] = qos; }
+  int rc = mosquitto_subscribe(mosq_, NULL, topic, qos);
+  SetError(MosqErrStr(rc, "Subscribe"));
   return rc == MOSQ_ERR_SUCCESS;
 }
 
@@ -218,8 +474,185 @@ bool MoqsuittoMQTTClient::Unsubscribe(const char *topic)
 {
   DEBUG("Unsubscribe(%s)\n", topic);
   if (!valid_) return false;
-  last_error_ = "";
+  SetError("");
+  { unique_lock<mutex> lock(mutex_); subscriptions_.erase(topic); }
   int rc = mosquitto_unsubscribe(mosq_, NULL, topic);
-  last_error_ = MosqErrStr(rc, "Unsubscribe");
+  SetError(MosqErrStr(rc, "Unsubscribe"));
   return rc == MOSQ_ERR_SUCCESS;
 }
+
+void MoqsuittoMQTTClient::Resubscribe()
+{
+  std::map<string, int> subscriptions;
+  { unique_lock<mutex> lock(mutex_); subscriptions = subscriptions_; }
+  for (std::map<string, int>::iterator i = subscriptions.begin(); i != subscriptions.end(); ++i) {
+    mosquitto_subscribe(mosq_, NULL, i->first.c_str(), i->second);
+  }
+}
+
+bool MoqsuittoMQTTClient::Publish(const char *topic, const void *payload, unsigned len, int qos, bool retain)
+{
+  DEBUG("Publish(%s)\n", topic);
+  if (!valid_) return false;
+  {
+    unique_lock<mutex> lock(mutex_);
+    // Join the queue if there is one, to keep messages in order
+    bool queue = connack_state_ != HAVE || !offline_.empty() || spilled_ > 0;
+    if (queue) { Buffer(topic, payload, len, qos, retain); }
+    if (queue && connack_state_ != HAVE) { return true; }
+    if (queue) { lock.unlock(); Drain(); return true; }
+  }
+  return Send(topic, payload, len, qos, retain, 0);
+}
+
+void MoqsuittoMQTTClient::SetOfflineBuffer(unsigned max_messages, MessageStore* store)
+{
+  unique_lock<mutex> lock(mutex_);
+  max_offline_ = max_messages ? max_messages : 1;
+  store_ = store;
+  // Left over from last time
+  spilled_ = store_ ? store_->pending() : 0;
+}
+
+void MoqsuittoMQTTClient::Buffer(const char *topic, const void *payload, unsigned len, int qos, bool retain)
+{
+  if (store_ && (offline_.size() >= max_offline_ || spilled_ > 0)) {
+    uint32_t id;
+    if (store_->Append(topic, payload, len, id)) { spilled_ ++; return; }
+    cerr << format("Offline store error: %s\n") % store_->last_error();
+  }
+  if (offline_.size() >= max_offline_) {
+    // Lose the oldest. If it came from the store it is still there, and will be loaded again
+    if (offline_.front().store_id) { loaded_.erase(offline_.front().store_id); spilled_ ++; } else { num_dropped_ ++; }
+    offline_.pop_front();
+  }
+  Offline message;
+  message.topic = topic;
+  message.payload.assign((const uint8_t*)payload, (const uint8_t*)payload + len);
+  message.qos = qos;
+  message.retain = retain;
+  message.store_id = 0;
+  offline_.push_back(message);
+}
+
+bool MoqsuittoMQTTClient::Reload()
+{
+  if (!offline_.empty()) { return true; }
+  if (!store_ || spilled_ == 0) { return false; }
+  vector<MessageStore::Message> backlog;
+  store_->Replay(backlog);
+  spilled_ = 0;
+  for (unsigned i=0; i < backlog.size(); i++) {
+    if (loaded_.count(backlog[i].id)) { continue; }
+    if (offline_.size() >= max_offline_) { spilled_ ++; continue; }
+    Offline message;
+    message.topic = backlog[i].topic;
+    message.payload = backlog[i].payload;
+    message.qos = 1;
+    message.retain = false;
+    message.store_id = backlog[i].id;
+    offline_.push_back(message);
+    loaded_.insert(message.store_id);
+  }
+  return !offline_.empty();
+}
+
+void MoqsuittoMQTTClient::Drain()
+{
+  {
+    unique_lock<mutex> lock(mutex_);
+    // Without a network thread, Send() can end up back here via on_publish
+    if (draining_) { return; }
+    draining_ = true;
+  }
+  for (;;) {
+    Offline message;
+    {
+      unique_lock<mutex> lock(mutex_);
+      if (connack_state_ != HAVE || outbound_.size() + reserved_ >= max_outbound_ || !Reload()) {
+        draining_ = false;
+        return;
+      }
+      message = offline_.front();
+      offline_.pop_front();
+    }
+    const void *payload = message.payload.empty() ? NULL : &message.payload[0];
+    if (!Send(message.topic.c_str(), payload, message.payload.size(), message.qos, message.retain, message.store_id)) {
+      // Lost the connection meanwhile: keep it for next time
+      unique_lock<mutex> lock(mutex_);
+      offline_.push_front(message);
+      draining_ = false;
+      return;
+    }
+  }
+}
+
+bool MoqsuittoMQTTClient::Send(const char *topic, const void *payload, unsigned len, int qos, bool retain, uint32_t store_id)
+{
+  bool refused;
+  bool block = false;
+  {
+    unique_lock<mutex> lock(mutex_);
+    refused = blocked_ || outbound_.size() + reserved_ >= max_outbound_;
+    if (refused) {
+      num_refused_ ++;
+      block = !blocked_;
+      blocked_ = true;
+    } else {
+      reserved_ ++;
+    }
+  }
+  if (refused) {
+    if (block && flow_fcn_) { flow_fcn_(client_id_.c_str(), true); }
+    return false;
+  }
+  // Not under mutex_: without a network thread, mosquitto may call on_publish() from in here
+  int mid = 0;
+  int rc = mosquitto_publish(mosq_, &mid, topic, len, payload, qos, retain);
+  bool resume;
+  {
+    unique_lock<mutex> lock(mutex_);
+    reserved_ --;
+    if (rc == MOSQ_ERR_SUCCESS && early_.erase(mid) == 0) {
+      outbound_[mid] = qos;
+      if (store_id) { stored_[mid] = store_id; }
+    } else if (rc == MOSQ_ERR_SUCCESS && store_id) {
+      store_->Ack(store_id);
+      loaded_.erase(store_id);
+    }
+    resume = CheckResume();
+  }
+  if (resume && flow_fcn_) { flow_fcn_(client_id_.c_str(), false); }
+  if (rc != MOSQ_ERR_SUCCESS) { SetError(MosqErrStr(rc, "Publish")); }
+  return rc == MOSQ_ERR_SUCCESS;
+}
+
+bool MoqsuittoMQTTClient::Start(unsigned workers)
+{
+  DEBUG("Start(%u)\n", workers);
+  if (!valid_) return false;
+  if (threaded_) return true;
+  SetError("");
+  pool_.Start(workers ? workers : 1);
+  threaded_ = true;
+  reconnect_pending_ = false;
+  mosquitto_reconnect_delay_set(mosq_, (reconnect_min_ms_ + 999) / 1000, (reconnect_max_ms_ + 999) / 1000, true);
+  int rc = mosquitto_loop_start(mosq_);
+  SetError(MosqErrStr(rc, "Unable to start network thread"));
+  if (rc != MOSQ_ERR_SUCCESS) {
+    threaded_ = false;
+    pool_.Stop();
+  }
+  return rc == MOSQ_ERR_SUCCESS;
+}
+
+void MoqsuittoMQTTClient::Stop()
+{
+  DEBUG("Stop()\n");
+  if (!threaded_) return;
+  // The network thread only finishes once disconnected
+  mosquitto_disconnect(mosq_);
+  mosquitto_loop_stop(mosq_, false);
+  pool_.Stop();
+  threaded_ = false;
+}
@@ -23,6 +23,9 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+class MessageStore;
 
 /// Class encapsulating MQTT operations.
 /// Designed for simple use cases, in particular, where there is a broker locally or on a low latency link.
@@ -31,12 +34,23 @@
 /// changed in the future for various reasons, the class is designed in such a way that all changes are isolated to mqttclient.cpp.
 ///
 /// The client is immutable and thus doesnt make sense to copy an instance.
-/// For the moment assume methods are not re-entrant.
+///
+/// By default network activity happens in Poll(), on the caller's thread, and handlers are called from Poll().
+/// After Start() the network has a thread of its own and handlers are called from a pool of worker threads;
+/// with more than one worker, messages may be handled out of order. Publish() may then be called from any thread.
+///
+/// Publish() does not wait for the network; it refuses messages once too many are outstanding, and the flow
+/// handler is told when that happens, and again when enough have gone to accept more.
+///
+/// The broker keeps our session (clean_session=false) so QoS 1 traffic survives a reconnect. Lost connections are
+/// retried with jittered exponential backoff. Messages published while disconnected are buffered, in memory and
+/// then optionally in a MessageStore, and replayed in order once the broker accepts us again.
 class MQTTClient : boost::noncopyable
 {
 public:
   typedef boost::function<void(const char*, const char*,const void*,unsigned)> message_fcn_t;
   typedef boost::function<void(const char*, bool)> connack_fcn_t;
+  typedef boost::function<void(const char*, bool)> flow_fcn_t;
 
   virtual ~MQTTClient();
 
@@ -44,35 +58,81 @@ public:
   /// @param client_id MQTT client id
   /// @param host broker host; NULL defaults to 127.0.0.1
   /// @param id broker port
-  static boost::shared_ptr<MQTTClient> CreateInstance(const char *client_id, const char *host=NULL, int port=1883);
+  /// @param clean_session Start afresh on every connection, instead of resuming the broker's session
+  static boost::shared_ptr<MQTTClient> CreateInstance(const char *client_id, const char *host=NULL, int port=1883, bool clean_session=false);
 
   bool valid() const { return valid_; }
   const char *client_id() const { return client_id_.c_str(); }
-  const char *last_error() const { return last_error_.c_str(); }
+  /// Describe the last error; a copy, as the network thread may overwrite it
+  inline std::string last_error() const;
   virtual bool have_connack() const = 0;
 
   /// Attempt to connect to MQTT broker.
   /// Success does not guarantee broker session; check have_connack() to confirm after calling Poll()
+  /// On failure Poll() keeps trying.
   /// @return true if network connection to broker made
   virtual bool Connect() = 0;
 
-  /// Subscribe to a particular topic.
+  /// Subscribe to a particular topic. Subscriptions are renewed on reconnection.
   /// @param topic Topic to subscribe
+  /// @param qos Maximum QoS; only QoS 1 messages are kept for us by the broker while we are disconnected
   /// @return false if not connected to broker
-  virtual bool Subscribe(const char *topic) = 0;
+  virtual bool Subscribe(const char *topic, int qos=1) = 0;
 
   /// Unsubscribe from a particular topic.
   /// @param topic Topic to unsubscribe
   /// @return false if not connected to broker
   virtual bool Unsubscribe(const char *topic) = 0;
 
+  /// Publish a message. Returns as soon as the message is queued.
+  /// While disconnected, and until the messages buffered meanwhile have gone, the message joins the offline buffer.
+  /// @param topic Topic to publish to
+  /// @param qos 0 or 1; QoS 0 messages still queued when the connection drops are lost
+  /// @return false if too many messages outstanding
+  virtual bool Publish(const char *topic, const void *payload, unsigned len, int qos=0, bool retain=false) = 0;
+
   /// Check for network activity and process any incoming messages.
   /// If the connection to the broker was dropped will try and reconnect automatically
+  /// Does nothing after Start()
   virtual bool Poll() = 0;
 
+  /// Hand the network to a thread of its own, which reconnects automatically.
+  /// @param workers Number of threads to call handlers from
+  virtual bool Start(unsigned workers=1) = 0;
+
+  /// Disconnect, and stop the threads started by Start()
+  virtual void Stop() = 0;
+
+  /// Number of published messages not yet sent (QoS 0) or acknowledged (QoS 1)
+  virtual unsigned outbound() const = 0;
+  unsigned num_refused() const { return num_refused_; }
+
+  /// Number of messages waiting for the connection, in memory and in the offline store
+  virtual unsigned offline() const = 0;
+  /// Number of messages lost because the offline buffer was full
+  unsigned num_dropped() const { return num_dropped_; }
+
+  /// Set how much to buffer while disconnected.
+  /// Call before Connect(); messages left in store by a previous run are sent too.
+  /// @param max_messages Messages kept in memory
+  /// @param store Optional: where messages go once memory is full, instead of losing the oldest.
+  ///   They are sent with QoS 1, and removed from the store once acknowledged.
+  ///   The caller should Sync() and Compact() the store from time to time.
+  virtual void SetOfflineBuffer(unsigned max_messages, MessageStore* store=NULL) = 0;
+
+  /// Set the range of delays between attempts to reconnect
+  inline void SetReconnectDelay(unsigned min_ms, unsigned max_ms);
+
+  /// Set the flow control watermarks: Publish() refuses messages while max_outbound are outstanding,
+  /// until the backlog drains to resume_outbound
+  inline void SetOutboundLimit(unsigned max_outbound, unsigned resume_outbound);
+
   // We could probably go to town and have a function specific for a topic, but for now we leave that for a rainly day
   inline void RegisterMessageHandler(const message_fcn_t& handler);
   inline void RegisterConnackHandler(const connack_fcn_t& handler);
+  /// Handler is called with true when Publish() starts refusing messages, and false when it accepts them again.
+  /// It is called on whichever thread crossed the watermark, so should be quick.
+  inline void RegisterFlowHandler(const flow_fcn_t& handler);
 
 protected:
   /// Constructor. Set up any underlying library resouces, etc.
@@ -80,24 +140,38 @@ protected:
   /// @param client_id MQTT client id for this instance.
   /// @param broker_host hostname / ip address of broker
   /// @param broker_port port for broker
-  MQTTClient(const char *client_id, const char *broker_host, int broker_port);
+  /// @param clean_session Start afresh on every connection
+  MQTTClient(const char *client_id, const char *broker_host, int broker_port, bool clean_session);
+
+  inline void SetError(const std::string& error);
 
   bool valid_;
   std::string client_id_;
   std::string broker_host_;
+  mutable boost::mutex error_mutex_; ///< Protect last_error_, written from any thread
   std::string last_error_;
   int broker_port_;
   unsigned keep_alive_s_;
+  bool clean_session_;
+  unsigned reconnect_min_ms_;
+  unsigned reconnect_max_ms_;
+  unsigned max_outbound_;
+  unsigned resume_outbound_;
+  unsigned num_refused_;
+  unsigned num_dropped_;
   message_fcn_t message_fcn_;
   connack_fcn_t connack_fcn_;
+  flow_fcn_t flow_fcn_;
 
 private:
 };
 
-inline MQTTClient::MQTTClient(const char *client_id, const char *host, int port)
+inline MQTTClient::MQTTClient(const char *client_id, const char *host, int port, bool clean_session)
   : valid_(false),
     client_id_(client_id),
-    broker_host_(host), broker_port_(port), keep_alive_s_(60)
+    broker_host_(host), broker_port_(port), keep_alive_s_(60), clean_session_(clean_session),
+    reconnect_min_ms_(1000), reconnect_max_ms_(60000),
+    max_outbound_(64), resume_outbound_(32), num_refused_(0), num_dropped_(0)
 {
 }
 
@@ -106,6 +180,18 @@ inline MQTTClient::~MQTTClient()
 }
 
 
+inline std::string MQTTClient::last_error() const
+{
+  boost::unique_lock<boost::mutex> lock(error_mutex_);
+  return last_error_;
+}
+
+inline void MQTTClient::SetError(const std::string& error)
+{
+  boost::unique_lock<boost::mutex> lock(error_mutex_);
+  last_error_ = error;
+}
+
 inline void MQTTClient::RegisterMessageHandler(const message_fcn_t& handler)
 {
   message_fcn_ = handler;
@@ -116,4 +202,21 @@ inline void MQTTClient::RegisterConnackHandler(const connack_fcn_t& handler)
   connack_fcn_ = handler;
 }
 
+inline void MQTTClient::RegisterFlowHandler(const flow_fcn_t& handler)
+{
+  flow_fcn_ = handler;
+}
+
+inline void MQTTClient::SetReconnectDelay(unsigned min_ms, unsigned max_ms)
+{
+  reconnect_min_ms_ = min_ms;
+  reconnect_max_ms_ = max_ms;
+}
+
+inline void MQTTClient::SetOutboundLimit(unsigned max_outbound, unsigned resume_outbound)
+{
+  max_outbound_ = max_outbound ? max_outbound : 1;
+  resume_outbound_ = resume_outbound < max_outbound_ ? resume_outbound : max_outbound_ - 1;
+}
+
 #endif // MQTT_HPP__
@@ -0,0 +1,92 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MQTTSN_FRAME_HPP__
+#define MQTTSN_FRAME_HPP__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+/// Minimal helpers for peeking inside MQTT-SN frames as they pass through the bridge.
+/// The bridge is otherwise transparent, so we only decode enough to classify a frame.
+namespace mqttsn {
+
+enum MessageType {
+  ADVERTISE = 0x00, SEARCHGW = 0x01, GWINFO = 0x02,
+  CONNECT = 0x04, CONNACK = 0x05,
+  WILLTOPICREQ = 0x06, WILLTOPIC = 0x07, WILLMSGREQ = 0x08, WILLMSG = 0x09,
+  REGISTER = 0x0a, REGACK = 0x0b,
+  PUBLISH = 0x0c, PUBACK = 0x0d, PUBCOMP = 0x0e, PUBREC = 0x0f, PUBREL = 0x10,
+  SUBSCRIBE = 0x12, SUBACK = 0x13, UNSUBSCRIBE = 0x14, UNSUBACK = 0x15,
+  PINGREQ = 0x16, PINGRESP = 0x17, DISCONNECT = 0x18,
+  WILLTOPICUPD = 0x1a, WILLTOPICRESP = 0x1b, WILLMSGUPD = 0x1c, WILLMSGRESP = 0x1d
+};
+
+/// Decode the MQTT-SN length / type header.
+/// @param header_len Set to 2, or 4 if the three byte length form was used
+/// @return false if the frame is too short or the length field disagrees with the datagram
+inline bool ParseHeader(const void *frame, unsigned len, unsigned& header_len, unsigned& msg_len, uint8_t& type)
+{
+  const uint8_t *p = (const uint8_t *)frame;
+  if (len < 2) { return false; }
+  if (p[0] == 0x01) {
+    if (len < 4) { return false; }
+    msg_len = ((unsigned)p[1] << 8) | p[2];
+    header_len = 4;
+    type = p[3];
+  } else {
+    msg_len = p[0];
+    header_len = 2;
+    type = p[1];
+  }
+  return msg_len >= header_len && msg_len <= len;
+}
+
+/// Topic id of a PUBLISH frame
+inline bool PublishTopicId(const void *frame, unsigned len, uint16_t& topic_id)
+{
+  unsigned header_len, msg_len; uint8_t type;
+  if (!ParseHeader(frame, len, header_len, msg_len, type) || type != PUBLISH) { return false; }
+  if (msg_len < header_len + 5) { return false; }
+  const uint8_t *p = (const uint8_t *)frame + header_len;
+  topic_id = ((uint16_t)p[1] << 8) | p[2];
+  return true;
+}
+
+/// Classify a frame into a queueing key.
+/// PUBLISH frames key on their topic id, i.e. "publish/<id>"; everything else is
+/// protocol control traffic, keyed "ctrl/<type>".
+inline std::string TopicKey(const void *frame, unsigned len)
+{
+  char buf[24];
+  unsigned header_len, msg_len; uint8_t type;
+  uint16_t topic_id;
+  if (PublishTopicId(frame, len, topic_id)) {
+    snprintf(buf, sizeof(buf), "publish/%u", (unsigned)topic_id);
+  } else if (ParseHeader(frame, len, header_len, msg_len, type)) {
+    snprintf(buf, sizeof(buf), "ctrl/%02x", (unsigned)type);
+  } else {
+    snprintf(buf, sizeof(buf), "junk");
+  }
+  return buf;
+}
+
+};
+
+#endif // MQTTSN_FRAME_HPP__
@@ -0,0 +1,515 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "mqttsn_gateway.hpp"
+#include "mqttsn_frame.hpp"
+#include "mqttclient.hpp"
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <iostream>
+#include <string.h>
+
+using std::string;
+using std::map;
+using std::cout;
+using std::cerr;
+using boost::format;
+using boost::mutex;
+using boost::unique_lock;
+
+// MQTT-SN flags
+#define FLAG_RETAIN 0x10
+#define FLAG_WILL 0x08
+#define FLAG_CLEAN 0x04
+#define QOS_OF(flags) (((flags) >> 5) & 0x03)
+#define TOPIC_TYPE(flags) ((flags) & 0x03)
+#define TOPIC_NORMAL 0
+#define TOPIC_PREDEFINED 1
+#define TOPIC_SHORT 2
+#define QOS_MINUS_ONE 3
+
+// Return codes
+#define RC_ACCEPTED 0
+#define RC_CONGESTION 1
+#define RC_INVALID_TOPIC 2
+#define RC_NOT_SUPPORTED 3
+
+// Largest frame a leaf can take (MQTTSN_MAX_BUFFER_SIZE on the MCU)
+#define MAX_LEAF_FRAME 243
+
+// Keep alive is only enforced after this much grace, as in MQTT
+#define KEEP_ALIVE_GRACE(s) ((s) + (s) / 2)
+
+static inline uint16_t Get16(const uint8_t* p) { return ((uint16_t)p[0] << 8) | p[1]; }
+static inline void Put16(uint8_t* p, uint16_t v) { p[0] = v >> 8; p[1] = v & 0xff; }
+
+MqttsnGateway::MqttsnGateway(MQTTClient& mqtt, const send_fcn_t& send, unsigned idle_s)
+  : mqtt_(mqtt), send_(send), idle_s_(idle_s), max_buffered_(8), max_buffered_age_s_(idle_s),
+    num_published_(0), num_refused_(0), num_delivered_(0), num_buffered_(0), num_dropped_(0), num_rejected_(0)
+{
+  mqtt_.RegisterMessageHandler(boost::bind(&MqttsnGateway::OnMessage, this, _1, _2, _3, _4));
+}
+
+void MqttsnGateway::SetSleepBuffer(unsigned max_messages, unsigned max_age_s)
+{
+  unique_lock<mutex> lock(mutex_);
+  max_buffered_ = max_messages;
+  max_buffered_age_s_ = max_age_s;
+}
+
+void MqttsnGateway::Queue(Frames& out, uint16_t node, uint8_t type, const uint8_t* body, unsigned len)
+{
+  Frame frame;
+  frame.node = node;
+  unsigned msg_len = len + 2;
+  if (msg_len < 256) {
+    frame.data.push_back(msg_len);
+  } else {
+    msg_len += 2;
+    frame.data.push_back(0x01);
+    frame.data.push_back(msg_len >> 8);
+    frame.data.push_back(msg_len & 0xff);
+  }
+  frame.data.push_back(type);
+  if (len) { frame.data.insert(frame.data.end(), body, body + len); }
+  out.push_back(frame);
+}
+
+void MqttsnGateway::Send(const Frames& out)
+{
+  for (unsigned i=0; i < out.size(); i++) { send_(out[i].node, &out[i].data[0], out[i].data.size()); }
+}
+
+uint16_t MqttsnGateway::TopicId(const string& topic)
+{
+  map<string, uint16_t>::iterator i = topic_ids_.find(topic);
+  if (i != topic_ids_.end()) { return i->second; }
+  // Ids 0 and 0xffff are reserved
+  if (topics_.size() >= 0xfffe) { return 0; }
+  topics_.push_back(topic);
+  uint16_t topic_id = topics_.size();
+  topic_ids_[topic] = topic_id;
+  return topic_id;
+}
+
+bool MqttsnGateway::TopicName(uint8_t flags, uint16_t topic_id, string& topic) const
+{
+  switch (TOPIC_TYPE(flags)) {
+  case TOPIC_NORMAL:
+    if (topic_id < 1 || topic_id > topics_.size()) { return false; }
+    topic = topics_[topic_id - 1];
+    return true;
+  case TOPIC_SHORT:
+    topic.assign(1, (char)(topic_id >> 8));
+    if (topic_id & 0xff) { topic += (char)(topic_id & 0xff); }
+    return true;
+  }
+  return false;
+}
+
+void MqttsnGateway::AddSubscription(const string& filter, int qos)
+{
+  if (broker_subscriptions_[filter]++ > 0) { return; }
+  // QoS 1 so the broker keeps messages for us while it cannot reach us; leaves get them at QoS 0
+  if (!mqtt_.Subscribe(filter.c_str(), qos > 0 ? 1 : 0)) { cerr << format("Gateway: subscribe %s: %s\n") % filter % mqtt_.last_error(); }
+}
+
+void MqttsnGateway::RemoveSubscription(const string& filter)
+{
+  map<string, unsigned>::iterator i = broker_subscriptions_.find(filter);
+  if (i == broker_subscriptions_.end() || --i->second > 0) { return; }
+  broker_subscriptions_.erase(i);
+  mqtt_.Unsubscribe(filter.c_str());
+}
+
+void MqttsnGateway::EndSession(Client& client, bool publish_will)
+{
+  if (publish_will && !client.will_topic.empty()) {
+    cout << format("Gateway: %s lost, publishing will to %s\n") % client.client_id % client.will_topic;
+    mqtt_.Publish(client.will_topic.c_str(), client.will_message.data(), client.will_message.size(), client.will_qos, client.will_retain);
+  }
+  client.will_topic.clear();
+  client.will_message.clear();
+}
+
+void MqttsnGateway::CheckDeadline(Client& client, time_t now)
+{
+  if (client.state == ACTIVE && client.keep_alive_s && now - client.last_seen > (time_t)KEEP_ALIVE_GRACE(client.keep_alive_s)) {
+    client.state = LOST;
+    EndSession(client, true);
+  }
+  if (client.state == ASLEEP && client.sleep_s && now - client.last_seen > (time_t)KEEP_ALIVE_GRACE(client.sleep_s)) {
+    client.state = LOST;
+    num_dropped_ += client.buffered.size();
+    client.buffered.clear();
+    EndSession(client, true);
+  }
+}
+
+void MqttsnGateway::Handle(uint16_t node, const uint8_t* frame, unsigned len)
+{
+  unsigned header_len, msg_len;
+  uint8_t type;
+  if (!mqttsn::ParseHeader(frame, len, header_len, msg_len, type)) { return; }
+  const uint8_t* body = frame + header_len;
+  unsigned body_len = msg_len - header_len;
+
+  Frames out;
+  {
+    unique_lock<mutex> lock(mutex_);
+    map<uint16_t, Client>::iterator i = clients_.find(node);
+    Client* client = i == clients_.end() ? NULL : &i->second;
+    time_t now = time(NULL);
+    // A leaf that overslept may CONNECT before Expire() noticed; its will is still due
+    if (client && type == mqttsn::CONNECT) { CheckDeadline(*client, now); }
+    if (client) { client->last_seen = now; }
+    // A sleeping leaf may carry on where it left off without waking properly first
+    bool active = client && (client->state == ACTIVE || client->state == ASLEEP);
+
+    switch (type) {
+    case mqttsn::SEARCHGW: {
+      uint8_t gw_id = 1;
+      Queue(out, node, mqttsn::GWINFO, &gw_id, 1);
+      break;
+    }
+    case mqttsn::CONNECT:
+      if (!client) {
+        Client empty;
+        empty.state = DISCONNECTED;
+        empty.keep_alive_s = 0;
+        empty.sleep_s = 0;
+        empty.last_seen = now;
+        empty.will_qos = 0;
+        empty.will_retain = false;
+        empty.next_msg_id = 1;
+        client = &(clients_[node] = empty);
+      }
+      OnConnect(node, *client, body, body_len, out);
+      break;
+    case mqttsn::WILLTOPIC:
+      if (!client || client->state != WANT_WILLTOPIC) { break; }
+      client->will_topic.clear();
+      if (body_len > 1) {
+        client->will_qos = QOS_OF(body[0]) == 0 ? 0 : 1;
+        client->will_retain = body[0] & FLAG_RETAIN;
+        client->will_topic.assign((const char*)body + 1, body_len - 1);
+      }
+      if (client->will_topic.empty()) {
+        Connacked(node, *client, out);
+      } else {
+        client->state = WANT_WILLMSG;
+        Queue(out, node, mqttsn::WILLMSGREQ, NULL, 0);
+      }
+      break;
+    case mqttsn::WILLMSG: {
+      if (!client || client->state != WANT_WILLMSG) { break; }
+      client->will_message.assign((const char*)body, body_len);
+      Connacked(node, *client, out);
+      break;
+    }
+    case mqttsn::REGISTER:
+      if (!active) { Queue(out, node, mqttsn::DISCONNECT, NULL, 0); break; }
+      OnRegister(node, *client, body, body_len, out);
+      break;
+    case mqttsn::PUBLISH:
+      // QoS -1 publishes need no connection
+      if (!active && (body_len < 1 || QOS_OF(body[0]) != QOS_MINUS_ONE)) { Queue(out, node, mqttsn::DISCONNECT, NULL, 0); break; }
+      OnPublish(node, client, body, body_len, out);
+      break;
+    case mqttsn::SUBSCRIBE:
+    case mqttsn::UNSUBSCRIBE:
+      if (!active) { Queue(out, node, mqttsn::DISCONNECT, NULL, 0); break; }
+      OnSubscribe(node, *client, type, body, body_len, out);
+      break;
+    case mqttsn::PINGREQ:
+      if (!active) { Queue(out, node, mqttsn::DISCONNECT, NULL, 0); break; }
+      // A sleeping leaf is awake until the PINGRESP, so everything waiting for it goes first
+      if (client->state == ASLEEP) { Flush(node, *client, out); }
+      Queue(out, node, mqttsn::PINGRESP, NULL, 0);
+      break;
+    case mqttsn::DISCONNECT:
+      if (active && body_len >= 2) {
+        client->state = ASLEEP;
+        client->sleep_s = Get16(body);
+      } else if (client) {
+        client->state = DISCONNECTED;
+        client->buffered.clear();
+        EndSession(*client, false);
+      }
+      Queue(out, node, mqttsn::DISCONNECT, NULL, 0);
+      break;
+    case mqttsn::REGACK:
+    case mqttsn::PUBACK:
+      // Answers to our REGISTER, or to a QoS 1 PUBLISH we never send
+      break;
+    default:
+      num_rejected_ ++;
+      cerr << format("Gateway: node %.4x: unsupported message %.2x\n") % node % (unsigned)type;
+      break;
+    }
+  }
+  Send(out);
+}
+
+void MqttsnGateway::OnConnect(uint16_t node, Client& client, const uint8_t* body, unsigned len, Frames& out)
+{
+  // flags, protocol id, duration, client id
+  if (len < 5) { num_rejected_ ++; return; }
+  uint8_t flags = body[0];
+  // Reconnecting in time is a normal end to the old session, not a lost one
+  if (client.state == ACTIVE || client.state == ASLEEP || client.state == LOST) { EndSession(client, false); }
+  client.client_id.assign((const char*)body + 4, len - 4);
+  client.keep_alive_s = Get16(body + 2);
+  if (flags & FLAG_CLEAN) {
+    for (map<string, int>::iterator i = client.subscriptions.begin(); i != client.subscriptions.end(); ++i) { RemoveSubscription(i->first); }
+    client.subscriptions.clear();
+    client.buffered.clear();
+  }
+  // The leaf starts with an empty topic table whatever it asked for
+  client.known_topics.clear();
+  if (flags & FLAG_WILL) {
+    client.state = WANT_WILLTOPIC;
+    Queue(out, node, mqttsn::WILLTOPICREQ, NULL, 0);
+    return;
+  }
+  Connacked(node, client, out);
+}
+
+void MqttsnGateway::Connacked(uint16_t node, Client& client, Frames& out)
+{
+  uint8_t rc = RC_ACCEPTED;
+  client.state = ACTIVE;
+  Queue(out, node, mqttsn::CONNACK, &rc, 1);
+  cout << format("Gateway: node %.4x connected as %s, keep alive %us\n") % node % client.client_id % client.keep_alive_s;
+  // Anything kept from a previous session while the leaf slept
+  Flush(node, client, out);
+}
+
+void MqttsnGateway::Flush(uint16_t node, Client& client, Frames& out)
+{
+  time_t now = time(NULL);
+  while (!client.buffered.empty()) {
+    const Buffered& message = client.buffered.front();
+    if (max_buffered_age_s_ && now - message.stamp > (time_t)max_buffered_age_s_) {
+      num_dropped_ ++;
+    } else {
+      Deliver(node, client, message.topic, message.payload.empty() ? NULL : &message.payload[0], message.payload.size(), out);
+    }
+    client.buffered.pop_front();
+  }
+}
+
+bool MqttsnGateway::Deliver(uint16_t node, Client& client, const string& topic, const uint8_t* payload, unsigned len, Frames& out)
+{
+  uint16_t topic_id = TopicId(topic);
+  if (!topic_id) { return false; }
+  if (!client.known_topics.count(topic_id)) {
+    // topic id, msg id, topic name
+    if (topic.size() + 6 > MAX_LEAF_FRAME) { return false; }
+    std::vector<uint8_t> reg(4 + topic.size());
+    Put16(&reg[0], topic_id);
+    Put16(&reg[2], client.next_msg_id++);
+    memcpy(&reg[4], topic.data(), topic.size());
+    Queue(out, node, mqttsn::REGISTER, &reg[0], reg.size());
+    client.known_topics.insert(topic_id);
+  }
+  // flags, topic id, msg id, data
+  std::vector<uint8_t> publish(5 + len);
+  publish[0] = TOPIC_NORMAL;
+  Put16(&publish[1], topic_id);
+  Put16(&publish[3], 0);
+  if (len) { memcpy(&publish[5], payload, len); }
+  Queue(out, node, mqttsn::PUBLISH, &publish[0], publish.size());
+  num_delivered_ ++;
+  return true;
+}
+
+void MqttsnGateway::OnRegister(uint16_t node, Client& client, const uint8_t* body, unsigned len, Frames& out)
+{
+  // topic id, msg id, topic name
+  if (len < 5) { num_rejected_ ++; return; }
+  uint8_t ack[5];
+  uint16_t topic_id = TopicId(string((const char*)body + 4, len - 4));
+  Put16(ack, topic_id);
+  memcpy(ack + 2, body + 2, 2);
+  ack[4] = topic_id ? RC_ACCEPTED : RC_CONGESTION;
+  if (topic_id) { client.known_topics.insert(topic_id); }
+  Queue(out, node, mqttsn::REGACK, ack, sizeof(ack));
+}
+
+void MqttsnGateway::OnPublish(uint16_t node, Client* client, const uint8_t* body, unsigned len, Frames& out)
+{
+  // flags, topic id, msg id, data
+  if (len < 5) { num_rejected_ ++; return; }
+  uint8_t flags = body[0];
+  int qos = QOS_OF(flags);
+  uint8_t ack[5];
+  memcpy(ack, body + 1, 4);
+  string topic;
+  if (qos == 2 || !TopicName(flags, Get16(body + 1), topic)) {
+    num_rejected_ ++;
+    ack[4] = qos == 2 ? RC_NOT_SUPPORTED : RC_INVALID_TOPIC;
+    Queue(out, node, mqttsn::PUBACK, ack, sizeof(ack));
+    return;
+  }
+  if (qos == QOS_MINUS_ONE) { qos = 0; }
+  if (mqtt_.Publish(topic.c_str(), body + 5, len - 5, qos, flags & FLAG_RETAIN)) {
+    num_published_ ++;
+    ack[4] = RC_ACCEPTED;
+  } else {
+    num_refused_ ++;
+    ack[4] = RC_CONGESTION;
+  }
+  // QoS 0 cannot be refused, but the leaf should hear a QoS 1 message needs sending again later
+  if (qos == 1 || ack[4] != RC_ACCEPTED) { Queue(out, node, mqttsn::PUBACK, ack, sizeof(ack)); }
+}
+
+void MqttsnGateway::OnSubscribe(uint16_t node, Client& client, uint8_t type, const uint8_t* body, unsigned len, Frames& out)
+{
+  // flags, msg id, topic name or id
+  if (len < 4) { num_rejected_ ++; return; }
+  uint8_t flags = body[0];
+  string filter;
+  if (TOPIC_TYPE(flags) == TOPIC_NORMAL) {
+    filter.assign((const char*)body + 3, len - 3);
+  } else if (len < 5 || !TopicName(flags, Get16(body + 3), filter)) {
+    filter.clear();
+  }
+
+  if (type == mqttsn::UNSUBSCRIBE) {
+    if (client.subscriptions.erase(filter)) { RemoveSubscription(filter); }
+    Queue(out, node, mqttsn::UNSUBACK, body + 1, 2);
+    return;
+  }
+
+  // flags, topic id, msg id, return code
+  uint8_t ack[6] = { 0, 0, 0, body[1], body[2], RC_ACCEPTED };
+  int qos = QOS_OF(flags) == 0 ? 0 : 1;
+  if (filter.empty() || QOS_OF(flags) == QOS_MINUS_ONE) {
+    ack[5] = filter.empty() ? RC_INVALID_TOPIC : RC_NOT_SUPPORTED;
+    Queue(out, node, mqttsn::SUBACK, ack, sizeof(ack));
+    return;
+  }
+  ack[0] = qos << 5;
+  if (TOPIC_TYPE(flags) == TOPIC_NORMAL && filter.find_first_of("+#") == string::npos) {
+    // No wildcards: the id is known now. Leaves do not keep the id from a SUBACK though,
+    // so they still get a REGISTER before the first message
+    Put16(ack + 1, TopicId(filter));
+  }
+  map<string, int>::iterator i = client.subscriptions.find(filter);
+  if (i == client.subscriptions.end()) { AddSubscription(filter, qos); }
+  client.subscriptions[filter] = qos;
+  Queue(out, node, mqttsn::SUBACK, ack, sizeof(ack));
+}
+
+void MqttsnGateway::OnMessage(const char*, const char* topic, const void* payload, unsigned len)
+{
+  Frames out;
+  {
+    unique_lock<mutex> lock(mutex_);
+    // flags, topic id, msg id, data
+    if (len + 7 > MAX_LEAF_FRAME) {
+      cerr << format("Gateway: %s: %u bytes is too big for a leaf\n") % topic % len;
+      num_rejected_ ++;
+      return;
+    }
+    for (map<uint16_t, Client>::iterator i = clients_.begin(); i != clients_.end(); ++i) {
+      Client& client = i->second;
+      if (client.state != ACTIVE && client.state != ASLEEP) { continue; }
+      bool match = false;
+      for (map<string, int>::const_iterator s = client.subscriptions.begin(); !match && s != client.subscriptions.end(); ++s) {
+        match = TopicMatches(s->first, topic);
+      }
+      if (!match) { continue; }
+      if (client.state == ACTIVE) {
+        Deliver(i->first, client, topic, (const uint8_t*)payload, len, out);
+        continue;
+      }
+      if (max_buffered_ == 0) { num_dropped_ ++; continue; }
+      if (client.buffered.size() >= max_buffered_) {
+        client.buffered.pop_front();
+        num_dropped_ ++;
+      }
+      Buffered message;
+      message.stamp = time(NULL);
+      message.topic = topic;
+      message.payload.assign((const uint8_t*)payload, (const uint8_t*)payload + len);
+      client.buffered.push_back(message);
+      num_buffered_ ++;
+    }
+  }
+  Send(out);
+}
+
+unsigned MqttsnGateway::Expire()
+{
+  unique_lock<mutex> lock(mutex_);
+  time_t now = time(NULL);
+  unsigned expired = 0;
+  for (map<uint16_t, Client>::iterator i = clients_.begin(); i != clients_.end(); ) {
+    Client& client = i->second;
+    CheckDeadline(client, now);
+    if (now - client.last_seen > (time_t)idle_s_) {
+      EndSession(client, client.state == ACTIVE || client.state == ASLEEP);
+      for (map<string, int>::iterator s = client.subscriptions.begin(); s != client.subscriptions.end(); ++s) { RemoveSubscription(s->first); }
+      clients_.erase(i++);
+      expired ++;
+    } else {
+      ++i;
+    }
+  }
+  return expired;
+}
+
+unsigned MqttsnGateway::size() const
+{
+  unique_lock<mutex> lock(mutex_);
+  return clients_.size();
+}
+
+void MqttsnGateway::PrintStats()
+{
+  unique_lock<mutex> lock(mutex_);
+  unsigned active = 0, asleep = 0, waiting = 0;
+  for (map<uint16_t, Client>::const_iterator i = clients_.begin(); i != clients_.end(); ++i) {
+    if (i->second.state == ACTIVE) { active ++; }
+    if (i->second.state == ASLEEP) { asleep ++; }
+    waiting += i->second.buffered.size();
+  }
+  cout << format("Gateway: clients=%u active=%u asleep=%u topics=%u subscriptions=%u published=%u refused=%u delivered=%u rejected=%u\n")
+    % clients_.size() % active % asleep % topics_.size() % broker_subscriptions_.size() % num_published_ % num_refused_ % num_delivered_ % num_rejected_;
+  cout << format("Gateway: sleep buffers: waiting=%u buffered=%u dropped=%u\n") % waiting % num_buffered_ % num_dropped_;
+}
+
+bool MqttsnGateway::TopicMatches(const string& filter, const string& topic)
+{
+  // Topics starting with $ are not matched by a leading wildcard
+  if (!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#')) { return false; }
+  size_t f = 0, t = 0;
+  for (;;) {
+    size_t f_end = filter.find('/', f);
+    size_t t_end = topic.find('/', t);
+    string level = filter.substr(f, f_end == string::npos ? string::npos : f_end - f);
+    if (level == "#") { return true; }
+    if (t == string::npos) { return false; }
+    if (level != "+" && level != topic.substr(t, t_end == string::npos ? string::npos : t_end - t)) { return false; }
+    if (f_end == string::npos) { return t_end == string::npos; }
+    f = f_end + 1;
+    t = t_end == string::npos ? string::npos : t_end + 1;
+  }
+}
@@ -0,0 +1,151 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MQTTSN_GATEWAY_HPP__
+#define MQTTSN_GATEWAY_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <deque>
+#include <map>
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+class MQTTClient;
+
+/// MQTT-SN gateway in aggregated mode: leaves are MQTT-SN clients of the bridge itself,
+/// and everything they do goes to the broker over one shared MQTTClient connection,
+/// instead of through a separate MQTT-SN gateway (RSMB) over UDP.
+///
+/// Topic ids are allocated by the gateway and shared by all leaves, so an id stays valid however
+/// long a leaf sleeps. A leaf is only told about ids it registered itself or was sent a REGISTER for.
+/// Broker subscriptions are counted, so the broker is only asked once however many leaves want a topic,
+/// and messages from the broker go to every leaf whose filter matches, at QoS 0.
+///
+/// A leaf that sends DISCONNECT with a duration is asleep: messages for it are buffered, up to a
+/// limit on number and age, and sent in one burst when it wakes and sends PINGREQ, ahead of the PINGRESP.
+/// It stays asleep with the same duration until it CONNECTs again, so a leaf need only say DISCONNECT
+/// once per session; its will is published if it sleeps for longer than it said, or goes quiet for longer
+/// than its keep alive, but not when it CONNECTs again in time.
+///
+/// Not supported: QoS 2, predefined topic ids, and will updates.
+///
+/// Methods are thread safe; frames for leaves are passed to the send function with no lock held.
+class MqttsnGateway : boost::noncopyable
+{
+public:
+  typedef boost::function<void(uint16_t node, const uint8_t* frame, unsigned len)> send_fcn_t;
+
+  /// @param mqtt Broker connection; the gateway registers itself as its message handler
+  /// @param send Called with each frame for a leaf
+  /// @param idle_s Leaves not heard from for this long are forgotten
+  MqttsnGateway(MQTTClient& mqtt, const send_fcn_t& send, unsigned idle_s=3600);
+
+  /// Set how much to buffer for each sleeping leaf: the oldest message makes way once max_messages
+  /// are waiting, and messages older than max_age_s are not delivered.
+  void SetSleepBuffer(unsigned max_messages, unsigned max_age_s);
+
+  /// Handle a frame from a leaf
+  void Handle(uint16_t node, const uint8_t* frame, unsigned len);
+
+  /// Publish the will of any leaf whose keep alive or sleep has run out, and forget leaves idle for the idle time
+  /// @return Number of leaves forgotten
+  unsigned Expire();
+
+  unsigned size() const;
+
+  void PrintStats();
+
+  /// True if topic matches the subscription filter, which may use MQTT wildcards
+  static bool TopicMatches(const std::string& filter, const std::string& topic);
+
+private:
+  enum State { DISCONNECTED, WANT_WILLTOPIC, WANT_WILLMSG, ACTIVE, ASLEEP, LOST };
+
+  struct Buffered {
+    time_t stamp;
+    std::string topic;
+    std::vector<uint8_t> payload;
+  };
+
+  struct Client {
+    std::string client_id;
+    State state;
+    unsigned keep_alive_s;
+    unsigned sleep_s;                           ///< Duration of the last DISCONNECT
+    time_t last_seen;
+    std::string will_topic;
+    std::string will_message;
+    int will_qos;
+    bool will_retain;
+    std::map<std::string, int> subscriptions;   ///< Filter --> granted QoS
+    std::set<uint16_t> known_topics;            ///< Topic ids the leaf has been told about
+    uint16_t next_msg_id;
+    std::deque<Buffered> buffered;              ///< Messages waiting for the leaf to wake
+  };
+
+  struct Frame {
+    uint16_t node;
+    std::vector<uint8_t> data;
+  };
+  typedef std::vector<Frame> Frames;
+
+  void OnMessage(const char* client_id, const char* topic, const void* payload, unsigned len);
+
+  void OnConnect(uint16_t node, Client& client, const uint8_t* body, unsigned len, Frames& out);
+  void OnRegister(uint16_t node, Client& client, const uint8_t* body, unsigned len, Frames& out);
+  void OnPublish(uint16_t node, Client* client, const uint8_t* body, unsigned len, Frames& out);
+  void OnSubscribe(uint16_t node, Client& client, uint8_t type, const uint8_t* body, unsigned len, Frames& out);
+  void Connacked(uint16_t node, Client& client, Frames& out);
+  void Flush(uint16_t node, Client& client, Frames& out);
+  bool Deliver(uint16_t node, Client& client, const std::string& topic, const uint8_t* payload, unsigned len, Frames& out);
+  void EndSession(Client& client, bool publish_will);
+  /// Mark the client LOST, and publish its will, if its keep alive or sleep has run out by now
+  void CheckDeadline(Client& client, time_t now);
+
+  uint16_t TopicId(const std::string& topic);
+  bool TopicName(uint8_t flags, uint16_t topic_id, std::string& topic) const;
+  void AddSubscription(const std::string& filter, int qos);
+  void RemoveSubscription(const std::string& filter);
+
+  static void Queue(Frames& out, uint16_t node, uint8_t type, const uint8_t* body, unsigned len);
+  void Send(const Frames& out);
+
+  MQTTClient& mqtt_;
+  send_fcn_t send_;
+  unsigned idle_s_;
+  unsigned max_buffered_;
+  unsigned max_buffered_age_s_;
+  mutable boost::mutex mutex_;                 ///< Protect everything below
+  std::map<uint16_t, Client> clients_;         ///< Node --> client state
+  std::map<std::string, uint16_t> topic_ids_;  ///< Topic --> id
+  std::vector<std::string> topics_;            ///< Id - 1 --> topic
+  std::map<std::string, unsigned> broker_subscriptions_; ///< Filter --> number of leaves subscribed
+  unsigned num_published_;
+  unsigned num_refused_;
+  unsigned num_delivered_;
+  unsigned num_buffered_;                      ///< Messages held for a sleeping leaf
+  unsigned num_dropped_;                       ///< Buffered messages lost to the size or age limit
+  unsigned num_rejected_;
+};
+
+#endif // MQTTSN_GATEWAY_HPP__
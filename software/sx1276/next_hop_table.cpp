@@ -0,0 +1,84 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "next_hop_table.hpp"
+#include "radio_link.hpp"
+#include <boost/format.hpp>
+#include <iostream>
+
+using std::cout;
+using boost::format;
+using boost::mutex;
+using boost::unique_lock;
+
+// Weight of a new SNR reading in the smoothed value
+#define SNR_ALPHA 0.25F
+// A marginal link costs as much as this many extra hops
+#define MARGINAL_PENALTY 2
+
+NextHopTable::NextHopTable(unsigned max_age_s, int marginal_snr_db)
+  : max_age_s_(max_age_s), marginal_snr_db_(marginal_snr_db)
+{
+}
+
+unsigned NextHopTable::Cost(const Route& route) const
+{
+  return route.hops + (route.snr_db < marginal_snr_db_ ? MARGINAL_PENALTY : 0);
+}
+
+void NextHopTable::Heard(uint16_t origin, uint16_t neighbour, unsigned hops, int snr_db)
+{
+  unique_lock<mutex> lock(mutex_);
+  time_t now = time(NULL);
+  std::map<uint16_t, Route>::iterator i = routes_.find(origin);
+  if (i != routes_.end() && i->second.neighbour == neighbour) {
+    Route& route = i->second;
+    route.hops = hops;
+    route.snr_db += SNR_ALPHA * (snr_db - route.snr_db);
+    route.updated = now;
+    return;
+  }
+  Route candidate = { neighbour, hops, (float)snr_db, now };
+  if (i == routes_.end()) {
+    routes_[origin] = candidate;
+    return;
+  }
+  Route& route = i->second;
+  if (Cost(candidate) < Cost(route) || now - route.updated > (time_t)max_age_s_) {
+    cout << format("Route to %.4x now via %.4x (%u hops, %ddB)\n") % origin % neighbour % hops % snr_db;
+    route = candidate;
+  }
+}
+
+uint16_t NextHopTable::NextHop(uint16_t dst) const
+{
+  unique_lock<mutex> lock(mutex_);
+  std::map<uint16_t, Route>::const_iterator i = routes_.find(dst);
+  if (i == routes_.end() || time(NULL) - i->second.updated > (time_t)max_age_s_) { return radiolink::BROADCAST_ADDRESS; }
+  return i->second.neighbour;
+}
+
+void NextHopTable::PrintStats() const
+{
+  unique_lock<mutex> lock(mutex_);
+  time_t now = time(NULL);
+  for (std::map<uint16_t, Route>::const_iterator i = routes_.begin(); i != routes_.end(); ++i) {
+    const Route& route = i->second;
+    cout << format("Next hop: %.4x via %.4x hops=%u snr=%.1fdB seen=%lds ago\n") % i->first % route.neighbour % route.hops % route.snr_db % (long)(now - route.updated);
+  }
+}
@@ -0,0 +1,67 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef NEXT_HOP_TABLE_HPP__
+#define NEXT_HOP_TABLE_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/// Where a relay should send a frame next, learnt by listening.
+///
+/// A frame from node X that reached us through neighbour N after h hops means N is a way back to X.
+/// Per destination we keep the neighbour with the fewest hops, but a link whose smoothed SNR is
+/// marginal counts as extra hops, so a strong two hop path beats a one hop path that keeps failing.
+/// Routes not refreshed within the maximum age are forgotten and traffic floods again until relearnt.
+///
+/// Methods are thread safe.
+class NextHopTable : boost::noncopyable
+{
+public:
+  /// @param max_age_s Forget routes not heard for this long
+  /// @param marginal_snr_db Links below this SNR are penalised
+  NextHopTable(unsigned max_age_s=3600, int marginal_snr_db=-10);
+
+  /// A frame from origin arrived from neighbour, having been relayed hops times before
+  void Heard(uint16_t origin, uint16_t neighbour, unsigned hops, int snr_db);
+
+  /// Neighbour to send towards dst, or radiolink::BROADCAST_ADDRESS if there is no route yet
+  uint16_t NextHop(uint16_t dst) const;
+
+  void PrintStats() const;
+
+private:
+  struct Route {
+    uint16_t neighbour;
+    unsigned hops;              ///< Relays between neighbour and destination
+    float snr_db;               ///< Smoothed SNR of the link to neighbour
+    time_t updated;
+  };
+
+  unsigned Cost(const Route& route) const;
+
+  unsigned max_age_s_;
+  int marginal_snr_db_;
+  std::map<uint16_t, Route> routes_;  ///< Destination --> best route
+  mutable boost::mutex mutex_;        ///< Protect routes_
+};
+
+#endif // NEXT_HOP_TABLE_HPP__
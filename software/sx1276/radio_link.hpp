@@ -0,0 +1,160 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RADIO_LINK_HPP__
+#define RADIO_LINK_HPP__
+
+#include <stdint.h>
+
+/// Layer 2 framing shared by the gateway, relays and leaves.
+///
+/// Byte 0 : frame type, see FrameType, in the low nibble; flags, see FrameFlags, in the high nibble
+/// Byte 1 : Sender's rolling counter. A relay keeps the originator's, so (source, counter) identifies a frame
+/// Byte 2 : Rolling counter last received from the other side, for debug purposes; hop count in a relayed frame
+/// Bytes 3..6 : Addressed and relayed frames: source and final destination link address, big endian
+/// Bytes 7..10 : Relayed frames: address of the relay that sent this copy, and of the next hop, big endian
+/// Byte N : xor of rest of buffer - because CRC can pass but data get corrupted by BusPirate serial it seems
+///
+/// Leaves take their link address from their MAC; the gateway is address 0.
+/// Older leaves send unaddressed data, which is treated as from node 0.
+/// Leaves only understand unaddressed and addressed frames; relays deliver to them as addressed frames.
+///
+/// Receive windows: a leaf that sets RX_WINDOWS on an uplink only listens for a downlink in two short
+/// windows after it, opening RX1_DELAY_MS and RX2_DELAY_MS after the end of the uplink, so the gateway
+/// holds downlinks for it until then. Each window carries one downlink; if the gateway has more for the
+/// leaf it sets PENDING, and the leaf opens another pair of windows timed from the end of that downlink.
+/// Windows are only timed for leaves the gateway hears directly.
+///
+/// Uplink slots: a gateway may broadcast a BEACON at the start of every period, giving each leaf that
+/// sets SLOTTED a slot of the period to send in, see slot_table.hpp. Only leaves that hear the gateway
+/// directly can follow the beacon; relays do not pass it on.
+///
+/// MAC commands: the gateway may put commands for a leaf in front of the payload of any addressed downlink
+/// to it, setting MAC: a length byte, then that many bytes of commands, each a MacCommand and its arguments.
+/// So far the only one is LINK_ADR, from the adaptive data rate engine (see adr_engine.hpp).
+namespace radiolink {
+
+enum FrameType {
+  DATA = 0x00,        ///< Unaddressed MQTT-SN data
+  HELLO = 0x02,
+  ADDRESSED = 0x03,   ///< MQTT-SN data with source and destination
+  RELAYED = 0x04,     ///< Addressed MQTT-SN data on its way through relays
+  BEACON = 0x05       ///< Unaddressed timing beacon with the uplink slot assignments
+};
+
+enum FrameFlags {
+  TYPE_MASK = 0x0f,
+  MAC = 0x10,         ///< Downlink: MAC commands precede the payload
+  SLOTTED = 0x20,     ///< Uplink: the sender follows the beacon, and wants a slot. Downlink: it has one
+  PENDING = 0x40,     ///< Downlink: more follow in the next receive window
+  RX_WINDOWS = 0x80   ///< Uplink: the sender only listens in the receive windows after this frame
+};
+
+enum MacCommand {
+  /// Data rate for the leaf to use from its next uplink, until it stops hearing from the gateway:
+  /// spreading factor in the high nibble and SX1276 bandwidth code in the low, TX power in dBm, channel of the plan
+  LINK_ADR = 0x01
+};
+
+enum {
+  LINK_ADR_LENGTH = 4,          ///< Including the command byte
+  MAX_MAC_LENGTH = 16           ///< Of the commands in one downlink, after the length byte
+};
+
+enum {
+  GATEWAY_ADDRESS = 0x0000,
+  BROADCAST_ADDRESS = 0xffff,   ///< As a next hop: any relay
+  MAX_HOPS = 3
+};
+
+enum {
+  MAX_FRAME = 255               ///< Largest LoRa payload: header, payload and xor
+};
+
+enum {
+  RX1_DELAY_MS = 1000,
+  RX2_DELAY_MS = 2000
+};
+
+struct Header {
+  uint8_t type;
+  uint8_t flags;                ///< FrameFlags
+  uint8_t counter;
+  uint8_t echo;                 ///< Unused in relayed frames
+  uint8_t hops;                 ///< Relays passed so far; relayed frames only
+  uint16_t src;
+  uint16_t dst;
+  uint16_t from;                ///< Relayed frames only
+  uint16_t to;                  ///< Relayed frames only
+};
+
+/// Bytes before the payload
+inline unsigned HeaderLength(uint8_t type)
+{
+  switch (type) {
+  case ADDRESSED: return 7;
+  case RELAYED: return 11;
+  default: return 3;
+  }
+}
+
+/// Header bytes plus the trailing xor
+inline unsigned Overhead(uint8_t type) { return HeaderLength(type) + 1; }
+
+inline void WriteHeader(const Header& header, uint8_t* frame)
+{
+  frame[0] = header.type | header.flags;
+  frame[1] = header.counter;
+  frame[2] = header.type == RELAYED ? header.hops : header.echo;
+  if (header.type != ADDRESSED && header.type != RELAYED) { return; }
+  frame[3] = header.src >> 8;
+  frame[4] = header.src & 0xff;
+  frame[5] = header.dst >> 8;
+  frame[6] = header.dst & 0xff;
+  if (header.type != RELAYED) { return; }
+  frame[7] = header.from >> 8;
+  frame[8] = header.from & 0xff;
+  frame[9] = header.to >> 8;
+  frame[10] = header.to & 0xff;
+}
+
+/// @return false if frame is too short for its type
+inline bool ReadHeader(const uint8_t* frame, unsigned len, Header& header)
+{
+  if (len < 1 || len < HeaderLength(frame[0] & TYPE_MASK)) { return false; }
+  header.type = frame[0] & TYPE_MASK;
+  header.flags = frame[0] & ~TYPE_MASK;
+  header.counter = frame[1];
+  header.echo = header.type == RELAYED ? 0 : frame[2];
+  header.hops = header.type == RELAYED ? frame[2] : 0;
+  header.src = header.dst = GATEWAY_ADDRESS;
+  header.from = header.to = GATEWAY_ADDRESS;
+  if (header.type == ADDRESSED || header.type == RELAYED) {
+    header.src = ((uint16_t)frame[3] << 8) | frame[4];
+    header.dst = ((uint16_t)frame[5] << 8) | frame[6];
+  }
+  if (header.type == RELAYED) {
+    header.from = ((uint16_t)frame[7] << 8) | frame[8];
+    header.to = ((uint16_t)frame[9] << 8) | frame[10];
+  }
+  return true;
+}
+
+};
+
+#endif // RADIO_LINK_HPP__
@@ -0,0 +1,304 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "radio_manager.hpp"
+#include "sx1276.hpp"
+#include "sx1276_platform.hpp"
+#include "link_stats.hpp"
+#include <boost/format.hpp>
+#include <iostream>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using std::string;
+using std::cout;
+using std::cerr;
+using boost::format;
+using boost::shared_ptr;
+using boost::mutex;
+using boost::unique_lock;
+using boost::chrono::steady_clock;
+
+// A reservation nobody used is forgotten this long after it was due
+#define RESERVE_LAPSE_MS 500
+
+// A receive ending this close to a reservation does not start another
+#define RESERVE_EARLY_MS 5
+
+RadioManager::RadioManager(const string& name, shared_ptr<SX1276Radio>& radio, shared_ptr<SX1276Platform>& platform,
+                           AirtimeBudget& budget, uint32_t carrier_hz, Role role)
+  : name_(name),
+    radio_(radio),
+    platform_(platform),
+    budget_(budget),
+    carrier_hz_(carrier_hz), tuned_hz_(carrier_hz),
+    role_(role),
+    rolling_counter_(0),
+    num_tx_(0), num_valid_received_(0), num_crc_errors_(0), num_junk_(0), num_xorv_(0),
+    link_stats_(NULL)
+{
+}
+
+void RadioManager::Restart()
+{
+  unique_lock<mutex> lock(radio_mutex_);
+  platform_->ResetSX1276();
+  radio_->ChangeCarrier(carrier_hz_);
+  tuned_hz_ = carrier_hz_;
+  radio_->ApplyDefaultLoraConfiguration();
+}
+
+bool RadioManager::TransmitHello()
+{
+  unique_lock<mutex> lock(radio_mutex_);
+  bool ok = true;
+  for (int i=0; i < 5; i++) {
+    uint8_t buffer[10] = { 0x02, rolling_counter_, 0xff, 'h', 'e', 'l', 'l', 'o', (uint8_t)('0'+i), 0};
+    uint8_t xorv = 0;
+    for (unsigned j=0; j < 9; j++) {
+      xorv = xorv ^ buffer[j];
+    }
+    buffer[9] = xorv;
+    rolling_counter_ ++;
+    if (radio_->SendSimpleMessage(buffer, sizeof(buffer))) {
+      budget_.Charge(tuned_hz_, radio_->PredictTimeOnAir(buffer, sizeof(buffer)));
+    } else {
+      ok = false;
+    }
+    usleep(100000); // Not too close, sometimes they dont all get received
+  }
+  return ok;
+}
+
+AirtimeBudget::Decision RadioManager::CheckAirtime(unsigned len, AirtimeBudget::Priority priority, uint32_t carrier_hz, uint8_t type)
+{
+  if (!carrier_hz || role_ != TX) { carrier_hz = carrier_hz_; }
+  return budget_.Request(carrier_hz, radio_->PredictTimeOnAir(NULL, len + radiolink::Overhead(type)), priority);
+}
+
+bool RadioManager::Transmit(const void* payload, unsigned len, uint32_t carrier_hz, uint16_t node, uint16_t via, uint8_t flags)
+{
+  radiolink::Header header;
+  header.type = !node ? radiolink::DATA : via ? radiolink::RELAYED : radiolink::ADDRESSED;
+  header.flags = flags;
+  header.hops = 0;
+  header.src = radiolink::GATEWAY_ADDRESS;
+  header.dst = node;
+  header.from = radiolink::GATEWAY_ADDRESS;
+  header.to = via;
+
+  unique_lock<mutex> lock(radio_mutex_);
+  header.counter = rolling_counter_;
+  header.echo = 0;             // With many senders there is no single counter to echo; leaves send 0 too
+  rolling_counter_ = (rolling_counter_==0xff ? 0 : rolling_counter_+1);
+  Unreserve();
+  return Send(header, payload, len, carrier_hz);
+}
+
+bool RadioManager::TransmitBeacon(const void* payload, unsigned len)
+{
+  radiolink::Header header;
+  memset(&header, 0, sizeof(header));
+  header.type = radiolink::BEACON;
+
+  unique_lock<mutex> lock(radio_mutex_);
+  header.counter = rolling_counter_;
+  header.echo = 0;
+  rolling_counter_ = (rolling_counter_==0xff ? 0 : rolling_counter_+1);
+  Unreserve();
+  return Send(header, payload, len, carrier_hz_);
+}
+
+void RadioManager::Reserve(steady_clock::time_point at)
+{
+  unique_lock<mutex> lock(reserve_mutex_);
+  reserved_.insert(at);
+}
+
+bool RadioManager::Reserved()
+{
+  steady_clock::time_point now = steady_clock::now();
+  unique_lock<mutex> lock(reserve_mutex_);
+  while (!reserved_.empty() && now > *reserved_.begin() + boost::chrono::milliseconds(RESERVE_LAPSE_MS)) {
+    reserved_.erase(reserved_.begin());
+  }
+  return !reserved_.empty() && *reserved_.begin() <= now + boost::chrono::milliseconds(RESERVE_EARLY_MS);
+}
+
+void RadioManager::Unreserve()
+{
+  steady_clock::time_point now = steady_clock::now() + boost::chrono::milliseconds(RESERVE_EARLY_MS);
+  unique_lock<mutex> lock(reserve_mutex_);
+  reserved_.erase(reserved_.begin(), reserved_.upper_bound(now));
+}
+
+bool RadioManager::Forward(const radiolink::Header& header, const void* payload, unsigned len, uint32_t carrier_hz)
+{
+  unique_lock<mutex> lock(radio_mutex_);
+  return Send(header, payload, len, carrier_hz);
+}
+
+bool RadioManager::Send(const radiolink::Header& header, const void* payload, unsigned len, uint32_t carrier_hz)
+{
+  unsigned header_len = radiolink::HeaderLength(header.type);
+  if (len + header_len + 1 > radiolink::MAX_FRAME) { cerr << format("[%s] Frame of %u bytes too long\n") % name_ % len; return false; }
+  uint8_t buffer[len + header_len + 1];
+  radiolink::WriteHeader(header, buffer);
+  memcpy(buffer + header_len, payload, len);
+
+  uint8_t xorv = 0;
+  for (unsigned j=0; j < len + header_len; j++) {
+    xorv = xorv ^ buffer[j];
+  }
+  buffer[len + header_len] = xorv;
+
+  if (role_ == TX && carrier_hz && carrier_hz != tuned_hz_) {
+    if (!radio_->ChangeCarrier(carrier_hz)) { return false; }
+    tuned_hz_ = carrier_hz;
+  }
+  float toa = radio_->PredictTimeOnAir(buffer, sizeof(buffer));
+#if 1
+  cout << format("[%s] Predicted time on air: %.3f @ %uHz\n") % name_ % toa % tuned_hz_;
+#endif
+  if (!radio_->SendSimpleMessage(buffer, sizeof(buffer))) {
+    // SPI error
+    return false;
+  }
+  budget_.Charge(tuned_hz_, toa);
+  num_tx_++;
+  if (link_stats_) {
+    // The neighbour it is for: the relay, when it goes through one
+    uint16_t node = header.type == radiolink::RELAYED ? header.to : header.type == radiolink::ADDRESSED ? header.dst : 0;
+    if (node != radiolink::BROADCAST_ADDRESS) { link_stats_->Sent(node, (unsigned)(toa * 1000)); }
+  }
+  if (header.flags & radiolink::PENDING) { AddWindows(steady_clock::now()); }
+  return true;
+}
+
+void RadioManager::AddWindows(steady_clock::time_point base)
+{
+  if (!can_transmit()) { return; }
+  windows_.insert(base + boost::chrono::milliseconds(radiolink::RX1_DELAY_MS));
+  windows_.insert(base + boost::chrono::milliseconds(radiolink::RX2_DELAY_MS));
+}
+
+unsigned RadioManager::ReceiveSlice(unsigned timeout_ms)
+{
+  steady_clock::time_point now = steady_clock::now();
+  while (!windows_.empty() && *windows_.begin() <= now) { windows_.erase(windows_.begin()); }
+  steady_clock::time_point end = now + boost::chrono::milliseconds(timeout_ms);
+  if (!windows_.empty()) { end = std::min(end, *windows_.begin()); }
+  {
+    unique_lock<mutex> lock(reserve_mutex_);
+    std::set<steady_clock::time_point>::const_iterator reserved = reserved_.upper_bound(now);
+    if (reserved != reserved_.end()) { end = std::min(end, *reserved); }
+  }
+  return std::max(1L, (long)boost::chrono::duration_cast<boost::chrono::milliseconds>(end - now).count());
+}
+
+void RadioManager::PrintStats()
+{
+  cout << format("[%s] TX=%4u RX=%4u CRC=%4u JUNK=%4u\n") % name_ % num_tx_ % num_valid_received_ % num_crc_errors_ % num_junk_;
+  AirtimeBudget::Stats airtime = budget_.GetStats(tuned_hz_);
+  cout << format("[%s] Airtime: used=%.1fs/h (%.2f%% of %.0f%%) available=%.1fs/%.0fs deferred=%u dropped=%u\n")
+    % name_ % airtime.used_hour_s % airtime.duty_cycle_pct % budget_.duty_cycle_pct() % airtime.available_s % airtime.capacity_s % airtime.deferred % airtime.dropped;
+}
+
+bool RadioManager::TryReceive(uint8_t* payload, unsigned len, unsigned& rx, RxInfo& info)
+{
+  // Do a blocking receive, but in such a way we can break it out if Transmit needs to do its thing
+  // OTOH dont let a high rate of TX starve receiving
+  bool crc_error = false;
+  bool timeout = false;
+  unsigned timeout_ms = 20000; // This timeout is a safety sanity check; normally, ReceiveSimpleMessage returns on a symbol timeout without retrying
+
+  unique_lock<mutex> lock(radio_mutex_);
+  int received = 0;
+  uint8_t buffer[len + radiolink::Overhead(radiolink::RELAYED)];
+  do {
+    // Leave the air to a transmission that is due; the receive before it was cut short for it
+    while (Reserved()) {
+      lock.unlock();
+      usleep(1000);
+      lock.lock();
+    }
+    received = sizeof(buffer);
+    if (!radio_->ReceiveSimpleMessage(buffer, received, ReceiveSlice(timeout_ms), timeout, crc_error)) {
+      // SPI error
+      return false;
+    }
+    if (!timeout && !crc_error) {
+      uint8_t xorv = 0;
+      for (unsigned j=0; j < received - 1; j++) {
+        xorv = xorv ^ buffer[j];
+      }
+      uint8_t type = buffer[0] & radiolink::TYPE_MASK;
+      if (xorv != buffer[received-1]) {
+        cerr << format("XOR checksum error! %.2x != %.2x\n") % (int)xorv % (int)buffer[received-1];
+        num_xorv_ ++;
+        FILE* f = popen("od -Ax -tx1z -v -w16", "w");
+        if (f) { fwrite(buffer, received, 1, f); pclose(f); }
+      }
+      else if (buffer[0] == 2) {
+        cout << format("[RX Hello] cntr=%d\n") % (int)buffer[1];
+        continue;
+      }
+      else if ((type == radiolink::DATA || type == radiolink::ADDRESSED || type == radiolink::RELAYED) &&
+               radiolink::ReadHeader(buffer, received - 1, info.header)) {
+        num_valid_received_ ++;
+        PrintStats();
+        info.rssi_dbm = radio_->last_packet_rssi();
+        info.snr_db = radio_->last_packet_snr();
+        info.received = radio_->last_packet_time();
+        info.coding_rate = radio_->last_packet_coding_rate();
+        info.airtime_ms = (unsigned)(radio_->PredictTimeOnAir(buffer, received) * 1000);
+        if (link_stats_) {
+          // Losses are counted per sender; a relay's frames carry the counter of the leaf they came from
+          bool relayed = info.header.type == radiolink::RELAYED;
+          link_stats_->Received(relayed ? info.header.from : info.header.src, relayed ? -1 : info.header.counter,
+                                info.rssi_dbm, info.snr_db, info.coding_rate, info.airtime_ms);
+        }
+        if (info.header.type != radiolink::RELAYED && (info.header.flags & radiolink::RX_WINDOWS)) { AddWindows(info.received); }
+        unsigned header_len = radiolink::HeaderLength(info.header.type);
+        memcpy(payload, buffer + header_len, received - header_len - 1);
+        rx = received - header_len - 1;
+        return true;
+      } else {
+        num_junk_ ++;
+        cerr << format("Junk? type=%.2x cntr=%d\n") % (int)buffer[0] % (int)buffer[1];
+      }
+    } else if (crc_error) {
+      num_crc_errors_ ++;
+      cerr << "CRC error\n";
+      radiolink::Header header;
+      if (link_stats_ && received > 0 && radiolink::ReadHeader(buffer, received - 1, header)) {
+        link_stats_->CrcError(header.type == radiolink::RELAYED ? header.from : header.src);
+      } else if (link_stats_) {
+        link_stats_->CrcError(0);
+      }
+    }
+    else { cerr  << "~"; }
+
+    // allow pending tx...
+    lock.unlock();
+    usleep(50); // there must be a better way to do this...
+    lock.lock();
+  } while (true); // DODGY: we need a higher level time timeout for O/S servicing
+}
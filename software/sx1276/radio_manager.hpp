@@ -0,0 +1,142 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RADIO_MANAGER_HPP__
+#define RADIO_MANAGER_HPP__
+
+#include "airtime_budget.hpp"
+#include "radio_link.hpp"
+#include <stdint.h>
+#include <string>
+#include <set>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/chrono/system_clocks.hpp>
+
+class SX1276Radio;
+class SX1276Platform;
+class LinkStats;
+
+/// Owns one SX1276 and its layer 2 framing (see radio_link.hpp), and serialises access to it
+/// between receive and transmit.
+class RadioManager : boost::noncopyable
+{
+public:
+  /// What TryReceive() learnt about a frame besides its payload
+  struct RxInfo {
+    radiolink::Header header;
+    int rssi_dbm;                ///< Packet RSSI
+    int snr_db;                  ///< Packet SNR
+    unsigned coding_rate;        ///< 5..8 for 4/5..4/8, 0 if unknown
+    unsigned airtime_ms;         ///< How long the frame took on air
+    boost::chrono::steady_clock::time_point received; ///< When it finished arriving
+  };
+
+  /// What a radio is used for when there is more than one (see RadioPool)
+  enum Role {
+    RXTX,   ///< Half duplex on its own channel
+    RX,     ///< Receive only
+    TX      ///< Transmit only; retunes to whichever channel a reply is due on
+  };
+
+  RadioManager(const std::string& name, boost::shared_ptr<SX1276Radio>& radio, boost::shared_ptr<SX1276Platform>& platform,
+               AirtimeBudget& budget, uint32_t carrier_hz=919000000, Role role=RXTX);
+
+  const std::string& name() const { return name_; }
+  Role role() const { return role_; }
+  bool can_receive() const { return role_ != TX; }
+  bool can_transmit() const { return role_ != RX; }
+  /// Channel we normally sit on
+  uint32_t carrier_hz() const { return carrier_hz_; }
+
+  void Restart();
+
+  bool TransmitHello();
+
+  /// Check whether a payload of len bytes fits the airtime budget of the channel
+  /// @param carrier_hz Channel to send on, or 0 for our own
+  /// @param type Frame type it will be sent in, for the header overhead
+  AirtimeBudget::Decision CheckAirtime(unsigned len, AirtimeBudget::Priority priority, uint32_t carrier_hz=0, uint8_t type=radiolink::DATA);
+
+  /// Send a payload from the gateway
+  /// @param carrier_hz Channel to send on, or 0 for our own. Only a TX radio will retune.
+  /// @param node Link address it is for, or 0 to send unaddressed
+  /// @param via Relay to reach node through, or 0 if node hears us directly
+  /// @param flags radiolink::FrameFlags to set
+  bool Transmit(const void* payload, unsigned len, uint32_t carrier_hz=0, uint16_t node=0, uint16_t via=0, uint8_t flags=0);
+
+  /// Send a timing beacon on our own channel, see SlotTable
+  bool TransmitBeacon(const void* payload, unsigned len);
+
+  /// Keep the air clear for a transmission due at a given time, e.g. in a leaf's receive window:
+  /// TryReceive() stops listening then, and leaves the radio to the transmission.
+  /// Lapses with the first transmission from then on, or shortly after the time if nothing was sent.
+  void Reserve(boost::chrono::steady_clock::time_point at);
+
+  /// Send a frame with the given header as is, keeping the originator's counter; for relays
+  bool Forward(const radiolink::Header& header, const void* payload, unsigned len, uint32_t carrier_hz=0);
+
+  void PrintStats();
+
+  /// Keep per neighbour link quality in stats, which may be shared with other radios; or NULL
+  void SetLinkStats(LinkStats* stats) { link_stats_ = stats; }
+
+  /// Blocking receive of the next MQTT-SN payload.
+  /// A receive is cut short when the receive window of a leaf we heard opens, so a reply can go out in it.
+  /// @param info Set to the link header of the frame and its signal quality
+  /// @return false on SPI error
+  bool TryReceive(uint8_t* payload, unsigned len, unsigned& rx, RxInfo& info);
+
+private:
+  /// True once a Reserve() is due
+  bool Reserved();
+
+  /// Forget reservations a transmission now fulfils
+  void Unreserve();
+
+  /// Note the receive windows a leaf opens after base, if we could reply in them
+  void AddWindows(boost::chrono::steady_clock::time_point base);
+
+  /// How long the next receive may run without overlapping a receive window or a reservation
+  unsigned ReceiveSlice(unsigned timeout_ms);
+
+  /// Caller holds radio_mutex_
+  bool Send(const radiolink::Header& header, const void* payload, unsigned len, uint32_t carrier_hz);
+
+  std::string name_;
+  boost::shared_ptr<SX1276Radio> radio_;
+  boost::shared_ptr<SX1276Platform> platform_;
+  AirtimeBudget& budget_;      ///< Duty cycle accounting, per channel, shared by all radios
+  uint32_t carrier_hz_;        ///< Channel we are tuned to when idle
+  uint32_t tuned_hz_;          ///< Channel we are tuned to now
+  Role role_;
+  boost::mutex radio_mutex_;   ///< Protect access to the radio
+  boost::mutex reserve_mutex_; ///< Protect reserved_, which must not wait for a receive to finish
+  std::set<boost::chrono::steady_clock::time_point> reserved_; ///< Transmissions the air is kept clear for
+  std::set<boost::chrono::steady_clock::time_point> windows_; ///< Receive windows of leaves we heard or told there is more; radio_mutex_
+  uint8_t rolling_counter_;    ///< Rolling message counter output
+  int num_tx_;                 ///< Number of transmitted MQTT-SN messages
+  int num_valid_received_;     ///< Number of valid received MQTT-SN messages
+  int num_crc_errors_;         ///< Number of crc errors
+  int num_junk_;               ///< Number of junk messages
+  int num_xorv_;               ///< Number of junk XOR messages
+  LinkStats* link_stats_;      ///< Losses per sender, or NULL
+};
+
+#endif // RADIO_MANAGER_HPP__
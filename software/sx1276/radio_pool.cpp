@@ -0,0 +1,275 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "radio_pool.hpp"
+#include <boost/format.hpp>
+#include <iostream>
+#include <string.h>
+
+using std::string;
+using std::cout;
+using std::cerr;
+using boost::format;
+using boost::shared_ptr;
+using boost::mutex;
+using boost::unique_lock;
+using boost::chrono::steady_clock;
+
+// How late we may still transmit into a leaf's receive window; it stays open a little longer than this
+#define WINDOW_LATE_MS 30
+
+RadioPool::RadioPool()
+  : adr_(NULL), link_stats_(NULL), reply_hz_(0), have_port_(false)
+{
+}
+
+void RadioPool::Add(const shared_ptr<RadioManager>& radio)
+{
+  radios_.push_back(radio);
+}
+
+void RadioPool::SetLinkStats(LinkStats* stats)
+{
+  link_stats_ = stats;
+  for (unsigned i=0; i < radios_.size(); i++) { radios_[i]->SetLinkStats(stats); }
+}
+
+void RadioPool::Restart()
+{
+  for (unsigned i=0; i < radios_.size(); i++) { radios_[i]->Restart(); }
+}
+
+bool RadioPool::TransmitHello()
+{
+  bool ok = true;
+  for (unsigned i=0; i < radios_.size(); i++) {
+    if (radios_[i]->can_transmit() && !radios_[i]->TransmitHello()) { ok = false; }
+  }
+  return ok;
+}
+
+bool RadioPool::TransmitBeacon(const void* payload, unsigned len)
+{
+  bool ok = true;
+  for (unsigned i=0; i < radios_.size(); i++) {
+    if (radios_[i]->can_transmit() && !radios_[i]->TransmitBeacon(payload, len)) { ok = Restart(radios_[i].get()); }
+  }
+  return ok;
+}
+
+void RadioPool::ReserveBeacon(steady_clock::time_point at)
+{
+  for (unsigned i=0; i < radios_.size(); i++) {
+    if (radios_[i]->can_transmit()) { radios_[i]->Reserve(at); }
+  }
+}
+
+RadioManager* RadioPool::Transmitter(uint16_t node, uint32_t& carrier_hz, uint16_t& via) const
+{
+  const RadioManager* heard_by = NULL;
+  {
+    unique_lock<mutex> lock(mutex_);
+    std::map<uint16_t, Route>::const_iterator route = routes_.find(node);
+    bool known = node && route != routes_.end();
+    carrier_hz = known ? route->second.carrier_hz : reply_hz_;
+    via = known ? route->second.via : 0;
+    heard_by = known ? route->second.radio : NULL;
+  }
+  // Half duplex radios may share a channel at different data rates, and only the one that heard the leaf is at its rate
+  for (unsigned i=0; i < radios_.size(); i++) {
+    if (radios_[i].get() == heard_by && heard_by->role() == RadioManager::RXTX) { return radios_[i].get(); }
+  }
+  RadioManager* fallback = NULL;
+  for (unsigned i=0; i < radios_.size(); i++) {
+    RadioManager* radio = radios_[i].get();
+    if (radio->role() == RadioManager::TX) { return radio; }
+    if (radio->role() == RadioManager::RXTX) {
+      if (!carrier_hz || radio->carrier_hz() == carrier_hz) { return radio; }
+      if (!fallback) { fallback = radio; }
+    }
+  }
+  return fallback;
+}
+
+AirtimeBudget::Decision RadioPool::CheckAirtime(unsigned len, AirtimeBudget::Priority priority, uint16_t node)
+{
+  uint32_t carrier_hz = 0;
+  uint16_t via = 0;
+  RadioManager* radio = Transmitter(node, carrier_hz, via);
+  if (!radio) { return AirtimeBudget::DROP; }
+  uint8_t type = !node ? radiolink::DATA : via ? radiolink::RELAYED : radiolink::ADDRESSED;
+  return radio->CheckAirtime(len, priority, carrier_hz, type);
+}
+
+bool RadioPool::Transmit(const void* payload, unsigned len, uint16_t node, bool more)
+{
+  uint32_t carrier_hz = 0;
+  uint16_t via = 0;
+  RadioManager* radio = Transmitter(node, carrier_hz, via);
+  if (!radio) { cerr << "No radio can transmit!\n"; return false; }
+  uint8_t flags = more ? radiolink::PENDING : 0;
+  {
+    unique_lock<mutex> lock(mutex_);
+    std::map<uint16_t, Route>::const_iterator route = routes_.find(node);
+    if (node && route != routes_.end() && route->second.slot) { flags |= radiolink::SLOTTED; }
+  }
+  // MAC commands go in front of the payload
+  uint8_t buffer[radiolink::MAX_FRAME];
+  if (adr_ && node && !via && len + radiolink::Overhead(radiolink::ADDRESSED) + 1 + radiolink::MAX_MAC_LENGTH <= sizeof(buffer)) {
+    unsigned mac_len = adr_->TakeCommands(node, buffer + 1, radiolink::MAX_MAC_LENGTH);
+    if (mac_len) {
+      buffer[0] = mac_len;
+      memcpy(buffer + 1 + mac_len, payload, len);
+      payload = buffer;
+      len += 1 + mac_len;
+      flags |= radiolink::MAC;
+    }
+  }
+  if (!radio->Transmit(payload, len, carrier_hz, node, via, flags)) { return Restart(radio); }
+  unique_lock<mutex> lock(mutex_);
+  std::map<uint16_t, Route>::iterator route = routes_.find(node);
+  if (node && route != routes_.end() && route->second.windows) {
+    // The leaf only opens windows again if we said there was more, timed from now
+    route->second.window_base = steady_clock::now();
+    route->second.window = more ? 0 : 2;
+  }
+  return true;
+}
+
+RadioPool::Window RadioPool::NextWindow(uint16_t node, steady_clock::time_point& at) const
+{
+  at = steady_clock::now();
+  unique_lock<mutex> lock(mutex_);
+  std::map<uint16_t, Route>::const_iterator i = routes_.find(node);
+  if (!node || i == routes_.end() || !i->second.windows || i->second.via) { return NOW; }
+  const Route& route = i->second;
+  steady_clock::time_point late = at - boost::chrono::milliseconds(WINDOW_LATE_MS);
+  for (unsigned window = route.window; window < 2; window++) {
+    at = route.window_base + boost::chrono::milliseconds(window == 0 ? radiolink::RX1_DELAY_MS : radiolink::RX2_DELAY_MS);
+    if (at >= late) { return LATER; }
+  }
+  return MISSED;
+}
+
+void RadioPool::Reserve(uint16_t node, steady_clock::time_point at)
+{
+  uint32_t carrier_hz = 0;
+  uint16_t via = 0;
+  RadioManager* radio = Transmitter(node, carrier_hz, via);
+  if (radio) { radio->Reserve(at); }
+}
+
+AirtimeBudget::Decision RadioPool::CheckForward(const radiolink::Header& header, unsigned len, AirtimeBudget::Priority priority)
+{
+  uint32_t carrier_hz = 0;
+  uint16_t via = 0;
+  RadioManager* radio = Transmitter(0, carrier_hz, via);
+  if (!radio) { return AirtimeBudget::DROP; }
+  return radio->CheckAirtime(len, priority, carrier_hz, header.type);
+}
+
+bool RadioPool::Forward(const radiolink::Header& header, const void* payload, unsigned len)
+{
+  uint32_t carrier_hz = 0;
+  uint16_t via = 0;
+  RadioManager* radio = Transmitter(0, carrier_hz, via);
+  if (!radio) { cerr << "No radio can transmit!\n"; return false; }
+  if (radio->Forward(header, payload, len, carrier_hz)) { return true; }
+  return Restart(radio);
+}
+
+bool RadioPool::Restart(RadioManager* radio)
+{
+  cerr << format("[%s] TX error, restarting\n") % radio->name();
+  radio->Restart();
+  return false;
+}
+
+void RadioPool::NoteReceived(const RadioManager& radio, const RadioManager::RxInfo& info)
+{
+  const radiolink::Header& header = info.header;
+  unique_lock<mutex> lock(mutex_);
+  reply_hz_ = radio.carrier_hz();
+  uint16_t node = header.src;
+  if (!node) { return; }
+  uint16_t via = header.type == radiolink::RELAYED ? header.from : 0;
+  Route& route = routes_[node];
+  if (route.frames == 0) {
+    cout << format("[%s] New node %.4x\n") % radio.name() % node;
+  } else if (route.carrier_hz != radio.carrier_hz()) {
+    cout << format("[%s] Node %.4x moved %uHz -> %uHz\n") % radio.name() % node % route.carrier_hz % radio.carrier_hz();
+  } else if (route.via != via) {
+    cout << format("[%s] Node %.4x now via %.4x\n") % radio.name() % node % via;
+  }
+  route.radio = &radio;
+  route.carrier_hz = radio.carrier_hz();
+  route.via = via;
+  route.last_seen = time(NULL);
+  route.frames ++;
+  route.windows = header.flags & radiolink::RX_WINDOWS;
+  route.window_base = info.received;
+  route.window = 0;
+}
+
+void RadioPool::NoteSlot(uint16_t node, unsigned slot)
+{
+  unique_lock<mutex> lock(mutex_);
+  std::map<uint16_t, Route>::iterator route = routes_.find(node);
+  if (route != routes_.end()) { route->second.slot = slot; }
+}
+
+void RadioPool::PrintRoutes() const
+{
+  {
+    unique_lock<mutex> lock(mutex_);
+    time_t now = time(NULL);
+    for (std::map<uint16_t, Route>::const_iterator i = routes_.begin(); i != routes_.end(); ++i) {
+      const Route& route = i->second;
+      cout << format("Route: node %.4x via %s @ %uHz relay=%.4x frames=%u seen=%lds ago%s slot=%u\n") % i->first % route.radio->name() % route.carrier_hz % route.via % route.frames % (long)(now - route.last_seen) % (route.windows ? " windows" : "") % route.slot;
+    }
+  }
+  if (adr_) { adr_->PrintStats(); }
+  PrintLinks();
+}
+
+void RadioPool::PrintLinks() const
+{
+  if (link_stats_) { link_stats_->PrintStats(); }
+}
+
+bool RadioPool::GetPort(string& ip, string& port) const
+{
+  unique_lock<mutex> lock(port_mutex_);
+  if (have_port_) {
+    ip = from_ip_;
+    port = from_port_;
+  }
+  return have_port_;
+}
+
+void RadioPool::SetPort(const string& ip, const string& port)
+{
+  unique_lock<mutex> lock(port_mutex_);
+  if (from_ip_ != ip || from_port_ != port) {
+    cout << format("Port change: %s %s\n") % ip % port;
+    // TODO: break out of receive early?
+  }
+  have_port_ = true;
+  from_ip_ = ip;
+  from_port_ = port;
+}
@@ -0,0 +1,146 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RADIO_POOL_HPP__
+#define RADIO_POOL_HPP__
+
+#include "radio_manager.hpp"
+#include "adr_engine.hpp"
+#include "link_stats.hpp"
+#include <vector>
+#include <string>
+#include <map>
+#include <time.h>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/chrono/system_clocks.hpp>
+
+/// The set of radios a gateway drives, e.g. one per spidev chip select.
+///
+/// Every radio that can receive gets its own receive thread (see sx1276_mqttsn_bridge).
+/// Transmissions are dispatched to a dedicated TX radio if there is one, retuned to the channel
+/// the destination leaf was last heard on, otherwise to a half duplex radio on that channel.
+/// With dedicated receivers, transmitting never takes a receiver off the air.
+///
+/// The routing table remembers, per leaf link address, the radio and channel it was last heard on,
+/// and the relay it came through if it was relayed; replies go back through the same relay.
+/// Unaddressed messages, and leaves not yet heard from, go out on the channel of the last message received.
+///
+/// It also follows the receive windows (see radio_link.hpp) of leaves that only listen in them,
+/// and tells leaves with an uplink slot (see SlotTable) that they have one.
+/// With an AdrEngine, downlinks to leaves heard directly carry any data rate change due to them,
+/// and go out on the radio that heard the leaf, so at its data rate.
+class RadioPool : boost::noncopyable
+{
+public:
+  RadioPool();
+
+  void Add(const boost::shared_ptr<RadioManager>& radio);
+
+  /// Pass data rate changes for leaves on in their downlinks
+  void SetAdr(AdrEngine* adr) { adr_ = adr; }
+
+  /// Have every radio added so far keep link quality in stats
+  void SetLinkStats(LinkStats* stats);
+
+  unsigned size() const { return radios_.size(); }
+  RadioManager& radio(unsigned i) { return *radios_[i]; }
+
+  /// Restart all radios
+  void Restart();
+
+  bool TransmitHello();
+
+  /// Send a timing beacon from every radio that can transmit, each on its own channel
+  bool TransmitBeacon(const void* payload, unsigned len);
+  /// Keep every radio that can transmit clear for a beacon at the given time
+  void ReserveBeacon(boost::chrono::steady_clock::time_point at);
+
+  AirtimeBudget::Decision CheckAirtime(unsigned len, AirtimeBudget::Priority priority, uint16_t node=0);
+
+  /// Send via the most suitable radio. On failure that radio is restarted.
+  /// @param node Link address of the leaf it is for, or 0 to send unaddressed
+  /// @param more There is more for node, so it should open another receive window
+  bool Transmit(const void* payload, unsigned len, uint16_t node=0, bool more=false);
+
+  enum Window {
+    NOW,      ///< The leaf listens all the time, or we cannot time its windows
+    LATER,    ///< Hold on until its next window opens
+    MISSED    ///< Its windows have passed; wait until we hear from it again
+  };
+
+  /// When a downlink to node can go out
+  /// @param at Set to when its next receive window opens, for LATER; may be just past
+  Window NextWindow(uint16_t node, boost::chrono::steady_clock::time_point& at) const;
+
+  /// Keep the radio that would transmit to node from starting a receive that runs past at
+  void Reserve(uint16_t node, boost::chrono::steady_clock::time_point at);
+
+  /// As CheckAirtime(), for a frame to Forward()
+  AirtimeBudget::Decision CheckForward(const radiolink::Header& header, unsigned len, AirtimeBudget::Priority priority);
+
+  /// Pass on a frame received by a relay, see RadioManager::Forward()
+  bool Forward(const radiolink::Header& header, const void* payload, unsigned len);
+
+  /// Record that radio received a frame, so replies to its source go out on the same channel and path,
+  /// and in its receive windows if it asked for them
+  void NoteReceived(const RadioManager& radio, const RadioManager::RxInfo& info);
+
+  /// Record the uplink slot node was given, or 0 for none; downlinks to it then say so
+  void NoteSlot(uint16_t node, unsigned slot);
+
+  /// Print the routing table, and link quality
+  void PrintRoutes() const;
+
+  /// Print link quality per neighbour, if kept
+  void PrintLinks() const;
+
+  /// Peer that UDP traffic last came from
+  bool GetPort(std::string& ip, std::string& port) const;
+  void SetPort(const std::string& ip, const std::string& port);
+
+private:
+  struct Route {
+    const RadioManager* radio; ///< Radio it was last heard by
+    uint32_t carrier_hz;
+    uint16_t via;              ///< Relay it was last heard through, or 0 if direct
+    time_t last_seen;
+    unsigned frames;
+    bool windows;              ///< Only listens in receive windows
+    boost::chrono::steady_clock::time_point window_base; ///< Windows are timed from here
+    unsigned window;           ///< Next window: 0 for RX1, 1 for RX2, 2 when both are used up
+    unsigned slot;             ///< Uplink slot, or 0 for none
+  };
+
+  RadioManager* Transmitter(uint16_t node, uint32_t& carrier_hz, uint16_t& via) const;
+  bool Restart(RadioManager* radio);
+
+  std::vector<boost::shared_ptr<RadioManager> > radios_;
+  AdrEngine* adr_;             ///< Or NULL
+  LinkStats* link_stats_;      ///< Or NULL
+  mutable boost::mutex mutex_; ///< Protect reply_hz_, routes_
+  uint32_t reply_hz_;          ///< Channel last message was received on, zero until then
+  std::map<uint16_t, Route> routes_; ///< Leaf link address --> where it was last heard
+  std::string from_ip_;        ///< IP last UDP packet was received from
+  std::string from_port_;      ///< port last UDP packet was received from
+  mutable boost::mutex port_mutex_; ///< Protection for from_ip_, from_port_
+  bool have_port_;             ///< false until from_port_ set for the first time
+};
+
+#endif // RADIO_POOL_HPP__
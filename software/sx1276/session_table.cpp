@@ -0,0 +1,240 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "session_table.hpp"
+#include "libsocket/inetclientdgram.hpp"
+#include <boost/format.hpp>
+#include <iostream>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using boost::format;
+using boost::shared_ptr;
+using boost::mutex;
+using boost::unique_lock;
+
+SessionTable::SessionTable(const string& host, const string& port, unsigned capacity, unsigned idle_s)
+  : host_(host), port_(port), idle_s_(idle_s), bits_(3), count_(0), touches_(0),
+    num_opened_(0), num_expired_(0), num_evicted_(0)
+{
+  if (capacity > 49152) { capacity = 49152; }
+  while (capacity > (3U << bits_) / 4) { bits_ ++; }
+  limit_ = capacity ? capacity : 1;
+  Session empty = { false, 0, 0, 0, shared_ptr<libsocket::inet_dgram_client>(), 0, 0 };
+  slots_.assign(1U << bits_, empty);
+  // Self pipe, so Open() can wake a Poll() that is already waiting on the sessions it copied out
+  if (pipe(wake_) < 0) {
+    cerr << "Unable to create session table wake pipe; new sessions wait for the next poll\n";
+    wake_[0] = wake_[1] = -1;
+  } else {
+    fcntl(wake_[0], F_SETFL, fcntl(wake_[0], F_GETFL) | O_NONBLOCK);
+    fcntl(wake_[1], F_SETFL, fcntl(wake_[1], F_GETFL) | O_NONBLOCK);
+  }
+}
+
+SessionTable::~SessionTable()
+{
+  if (wake_[0] >= 0) { close(wake_[0]); close(wake_[1]); }
+}
+
+unsigned SessionTable::Home(uint16_t node) const
+{
+  // Fibonacci hashing: 40503 ~= 2^16 / golden ratio, so consecutive addresses land far apart
+  return (uint16_t)(node * 40503U) >> (16 - bits_);
+}
+
+int SessionTable::Find(uint16_t node) const
+{
+  unsigned mask = slots_.size() - 1;
+  for (unsigned i = Home(node); slots_[i].used; i = (i + 1) & mask) {
+    if (slots_[i].node == node) { return i; }
+  }
+  return -1;
+}
+
+void SessionTable::Remove(unsigned index)
+{
+  unsigned mask = slots_.size() - 1;
+  unsigned i = index;
+  unsigned j = index;
+  slots_[i].used = false;
+  slots_[i].socket.reset();
+  count_ --;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (!slots_[j].used) { return; }
+    // Leave an entry alone if its home is cyclically within (i, j]; otherwise it moves back into the hole
+    unsigned k = Home(slots_[j].node);
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) { continue; }
+    slots_[i] = slots_[j];
+    slots_[j].used = false;
+    slots_[j].socket.reset();
+    i = j;
+  }
+}
+
+SessionTable::Session* SessionTable::Open(uint16_t node)
+{
+  int found = Find(node);
+  if (found >= 0) { return &slots_[found]; }
+
+  if (count_ >= limit_) {
+    unsigned oldest = 0;
+    bool have = false;
+    for (unsigned i=0; i < slots_.size(); i++) {
+      if (slots_[i].used && (!have || slots_[i].touched < slots_[oldest].touched)) { oldest = i; have = true; }
+    }
+    cerr << format("Session table full, closing node %.4x\n") % slots_[oldest].node;
+    Remove(oldest);
+    num_evicted_ ++;
+  }
+
+  shared_ptr<libsocket::inet_dgram_client> socket(new libsocket::inet_dgram_client(host_, port_, LIBSOCKET_IPv4));
+  unsigned mask = slots_.size() - 1;
+  unsigned i = Home(node);
+  while (slots_[i].used) { i = (i + 1) & mask; }
+  Session& session = slots_[i];
+  session.used = true;
+  session.node = node;
+  session.last_active = time(NULL);
+  session.touched = touches_++;
+  session.socket = socket;
+  session.tx = 0;
+  session.rx = 0;
+  count_ ++;
+  num_opened_ ++;
+  cout << format("Session opened for node %.4x (%u active)\n") % node % count_;
+  if (wake_[1] >= 0) {
+    // EAGAIN just means the pipe is full and Poll() is due to wake anyway
+    uint8_t b = 0;
+    ssize_t n = write(wake_[1], &b, 1);
+    (void)n;
+  }
+  return &session;
+}
+
+bool SessionTable::Send(uint16_t node, const void* payload, unsigned len)
+{
+  shared_ptr<libsocket::inet_dgram_client> socket;
+  {
+    unique_lock<mutex> lock(mutex_);
+    try {
+      Session* session = Open(node);
+      session->last_active = time(NULL);
+      session->touched = touches_++;
+      session->tx ++;
+      socket = session->socket;
+    } catch (libsocket::socket_exception& e) { cerr << e.mesg << "\n"; return false; }
+  }
+  try {
+    socket->snd(payload, len);
+  } catch (libsocket::socket_exception& e) { cerr << e.mesg << "\n"; return false; }
+  return true;
+}
+
+unsigned SessionTable::Poll(unsigned timeout_ms, const handler_fcn_t& handler)
+{
+  // Copy the sockets out so the table is not locked while waiting; a session expired meanwhile
+  // keeps its socket alive until we are done with it
+  vector<shared_ptr<libsocket::inet_dgram_client> > sockets;
+  vector<uint16_t> nodes;
+  vector<struct pollfd> fds;
+  // fds[0] is the wake pipe (ignored by poll() if it could not be created), the rest are the sessions
+  struct pollfd wake = { wake_[0], POLLIN, 0 };
+  fds.push_back(wake);
+  sockets.push_back(shared_ptr<libsocket::inet_dgram_client>());
+  nodes.push_back(0);
+  {
+    unique_lock<mutex> lock(mutex_);
+    for (unsigned i=0; i < slots_.size(); i++) {
+      if (!slots_[i].used) { continue; }
+      struct pollfd pfd = { slots_[i].socket->getfd(), POLLIN, 0 };
+      fds.push_back(pfd);
+      sockets.push_back(slots_[i].socket);
+      nodes.push_back(slots_[i].node);
+    }
+  }
+  if (poll(&fds[0], fds.size(), timeout_ms) <= 0) { return 0; }
+  if (fds[0].revents & POLLIN) {
+    // A session was opened: drain the pipe, the caller polls again straight away and picks it up
+    uint8_t drain[64];
+    while (read(wake_[0], drain, sizeof(drain)) > 0) { }
+  }
+
+  unsigned handled = 0;
+  for (unsigned i=1; i < fds.size(); i++) {
+    if (!(fds[i].revents & POLLIN)) { continue; }
+    uint8_t payload[256];
+    ssize_t n = 0;
+    try {
+      n = sockets[i]->rcv(payload, sizeof(payload));
+    } catch (libsocket::socket_exception& e) { cerr << e.mesg << "\n"; continue; }
+    if (n <= 0) { continue; }
+    {
+      unique_lock<mutex> lock(mutex_);
+      int found = Find(nodes[i]);
+      if (found >= 0) {
+        slots_[found].last_active = time(NULL);
+        slots_[found].touched = touches_++;
+        slots_[found].rx ++;
+      }
+    }
+    handler(nodes[i], payload, n);
+    handled ++;
+  }
+  return handled;
+}
+
+unsigned SessionTable::Expire()
+{
+  unique_lock<mutex> lock(mutex_);
+  time_t now = time(NULL);
+  vector<uint16_t> idle;
+  for (unsigned i=0; i < slots_.size(); i++) {
+    if (slots_[i].used && now - slots_[i].last_active > (time_t)idle_s_) { idle.push_back(slots_[i].node); }
+  }
+  for (unsigned i=0; i < idle.size(); i++) {
+    int found = Find(idle[i]);
+    if (found < 0) { continue; }
+    cout << format("Session expired for node %.4x\n") % idle[i];
+    Remove(found);
+    num_expired_ ++;
+  }
+  return idle.size();
+}
+
+unsigned SessionTable::size() const
+{
+  unique_lock<mutex> lock(mutex_);
+  return count_;
+}
+
+void SessionTable::PrintStats()
+{
+  unique_lock<mutex> lock(mutex_);
+  cout << format("Sessions: active=%u opened=%u expired=%u evicted=%u\n") % count_ % num_opened_ % num_expired_ % num_evicted_;
+  for (unsigned i=0; i < slots_.size(); i++) {
+    if (!slots_[i].used) { continue; }
+    cout << format("  node %.4x: tx=%u rx=%u idle=%lds\n") % slots_[i].node % slots_[i].tx % slots_[i].rx % (long)(time(NULL) - slots_[i].last_active);
+  }
+}
@@ -0,0 +1,105 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SESSION_TABLE_HPP__
+#define SESSION_TABLE_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace libsocket { class inet_dgram_client; }
+
+/// Maps the link address of each leaf to its own UDP socket towards the MQTT-SN gateway (RSMB),
+/// so the gateway sees every leaf as a distinct client with its own session, instead of all leaves
+/// sharing whichever UDP endpoint spoke last.
+///
+/// The table is open addressed with linear probing, keyed by a Fibonacci hash of the 16 bit node
+/// address, and deletes by shifting entries back so no tombstones build up.
+/// A session whose leaf has been quiet for the idle time is closed by Expire(); the idle time must be
+/// longer than the leaf sleeps between uploads or it will lose its gateway session every wake.
+/// When full, the session that has been idle longest makes way for the new one.
+///
+/// Methods are thread safe.
+class SessionTable : boost::noncopyable
+{
+public:
+  typedef boost::function<void(uint16_t node, const uint8_t* payload, unsigned len)> handler_fcn_t;
+
+  /// @param host, port MQTT-SN gateway each session connects to
+  /// @param capacity Maximum number of sessions
+  /// @param idle_s Sessions with no traffic for this long are expired
+  SessionTable(const std::string& host, const std::string& port, unsigned capacity=256, unsigned idle_s=3600);
+  ~SessionTable();
+
+  /// Send a datagram from node to the gateway, opening a session for the node if it has none
+  /// @return false if the socket could not be created or written
+  bool Send(uint16_t node, const void* payload, unsigned len);
+
+  /// Wait up to timeout_ms for datagrams from the gateway, and pass each one to handler
+  /// together with the node its session belongs to.
+  /// Returns early when Send() opens a new session, so the caller polls again including it
+  /// and a CONNACK for a new leaf is not held up for the rest of timeout_ms.
+  /// @return Number of datagrams handled
+  unsigned Poll(unsigned timeout_ms, const handler_fcn_t& handler);
+
+  /// Close sessions idle for longer than the idle time
+  /// @return Number of sessions closed
+  unsigned Expire();
+
+  unsigned size() const;
+
+  void PrintStats();
+
+private:
+  struct Session {
+    bool used;
+    uint16_t node;
+    time_t last_active;
+    uint32_t touched;             ///< Value of touches_ when last active, to order evictions
+    boost::shared_ptr<libsocket::inet_dgram_client> socket;
+    unsigned tx;                  ///< Datagrams sent to the gateway
+    unsigned rx;                  ///< Datagrams received from the gateway
+  };
+
+  unsigned Home(uint16_t node) const;
+  int Find(uint16_t node) const;
+  Session* Open(uint16_t node);
+  void Remove(unsigned index);
+
+  std::string host_;
+  std::string port_;
+  unsigned idle_s_;
+  unsigned bits_;                 ///< log2 of the number of slots
+  unsigned limit_;                ///< Sessions allowed, keeps the load factor <= 3/4
+  unsigned count_;
+  uint32_t touches_;
+  unsigned num_opened_;
+  unsigned num_expired_;
+  unsigned num_evicted_;
+  std::vector<Session> slots_;
+  int wake_[2];                   ///< Self pipe written by Open() to wake Poll()
+  mutable boost::mutex mutex_;    ///< Protect everything above
+};
+
+#endif // SESSION_TABLE_HPP__
@@ -0,0 +1,45 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "sim_spi.hpp"
+#include <stdio.h>
+
+SimSPI::SimSPI()
+{
+}
+
+SimSPI::~SimSPI()
+{
+}
+
+bool SimSPI::ReadRegister(uint8_t reg, uint8_t& result)
+{
+  result = sim_.Read(reg & 0x7f);
+
+  if (trace_reads_ && !trace_next_suppress_) { fprintf(stderr, "[R] %.2x --> %.2x\n", (int)reg, (int)result); }
+  trace_next_suppress_ = false;
+  return true;
+}
+
+bool SimSPI::WriteRegister(uint8_t reg, uint8_t value)
+{
+  if (trace_writes_) { fprintf(stderr, "[W] %.2x <-- %.2x\n", (int)reg, (int)value); }
+
+  sim_.Write(reg & 0x7f, value);
+  return true;
+}
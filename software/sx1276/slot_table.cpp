@@ -0,0 +1,96 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "slot_table.hpp"
+#include <boost/format.hpp>
+#include <iostream>
+
+using std::cout;
+using boost::format;
+using boost::mutex;
+using boost::unique_lock;
+
+SlotTable::SlotTable(unsigned slot_ms, unsigned slots, unsigned idle_s)
+  : slot_ms_(slot_ms), idle_s_(idle_s), used_(0), num_assigned_(0), num_expired_(0), num_refused_(0)
+{
+  if (slots < 2) { slots = 2; }
+  if (slots > MAX_SLOTS) { slots = MAX_SLOTS; }
+  Slot empty = { 0, 0 };
+  slots_.assign(slots, empty);
+}
+
+unsigned SlotTable::Assign(uint16_t node)
+{
+  if (!node) { return 0; }
+  unique_lock<mutex> lock(mutex_);
+  unsigned free = 0;
+  for (unsigned i=1; i < slots_.size(); i++) {
+    if (slots_[i].node == node) {
+      slots_[i].last_heard = time(NULL);
+      return i;
+    }
+    if (!free && !slots_[i].node) { free = i; }
+  }
+  if (!free) {
+    num_refused_ ++;
+    return 0;
+  }
+  slots_[free].node = node;
+  slots_[free].last_heard = time(NULL);
+  used_ ++;
+  num_assigned_ ++;
+  cout << format("[Slots] node %.4x has slot %u\n") % node % free;
+  return free;
+}
+
+unsigned SlotTable::Beacon(uint8_t* payload, unsigned capacity)
+{
+  unique_lock<mutex> lock(mutex_);
+  if (capacity < 3) { return 0; }
+  time_t now = time(NULL);
+  payload[0] = slot_ms_ >> 8;
+  payload[1] = slot_ms_ & 0xff;
+  payload[2] = slots_.size();
+  unsigned len = 3;
+  for (unsigned i=1; i < slots_.size(); i++) {
+    Slot& slot = slots_[i];
+    if (!slot.node) { continue; }
+    if (now - slot.last_heard > (time_t)idle_s_) {
+      cout << format("[Slots] node %.4x lost slot %u\n") % slot.node % i;
+      slot.node = 0;
+      used_ --;
+      num_expired_ ++;
+      continue;
+    }
+    // A leaf left out would take it that it had lost its slot
+    if (len + 3 > capacity) {
+      cout << format("[Slots] beacon of %u bytes too small\n") % capacity;
+      return 0;
+    }
+    payload[len++] = slot.node >> 8;
+    payload[len++] = slot.node & 0xff;
+    payload[len++] = i;
+  }
+  return len;
+}
+
+void SlotTable::PrintStats()
+{
+  unique_lock<mutex> lock(mutex_);
+  cout << format("[Slots] used=%u of %u assigned=%u expired=%u refused=%u\n") % used_ % (slots_.size() - 1) % num_assigned_ % num_expired_ % num_refused_;
+}
@@ -0,0 +1,85 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SLOT_TABLE_HPP__
+#define SLOT_TABLE_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/// Gives each leaf its own uplink slot, so leaves stop colliding as they do when each sends whenever
+/// its own timer wakes it (pure ALOHA, which tops out at under a fifth of the channel).
+///
+/// The gateway broadcasts a beacon (radiolink::BEACON) at the start of every period, which is split into
+/// equal slots: slot 0 is the beacon's own, and slot n starts n slot lengths after the end of the beacon.
+/// A leaf asks for a slot by setting radiolink::SLOTTED on its uplinks, and keeps it for as long as it is
+/// heard from within the idle time. Leaves time their wakes from the beacon, see sf-slotclock.h; a slot
+/// should be long enough for a leaf's whole exchange with the gateway, receive windows included.
+///
+/// Beacon payload, big endian:
+///   Bytes 0..1 : slot length, ms
+///   Byte 2     : slots per period, including slot 0; the period must fit 16 bits of ms
+///   Then 3 bytes per assigned slot: leaf link address, slot
+///
+/// Methods are thread safe.
+class SlotTable : boost::noncopyable
+{
+public:
+  /// A beacon with every slot assigned must fit one frame: 3 + 3 x 40 payload bytes, plus the
+  /// 3 byte link header and the xor, is 127 bytes, well inside radiolink::MAX_FRAME
+  enum { MAX_SLOTS = 41, MAX_BEACON = 3 + 3 * (MAX_SLOTS - 1), MAX_PERIOD_MS = 65535 };
+
+  /// @param slot_ms Length of a slot
+  /// @param slots Slots per period, including the beacon's; at most MAX_SLOTS
+  /// @param idle_s A leaf quiet for this long loses its slot
+  SlotTable(unsigned slot_ms, unsigned slots, unsigned idle_s=3600);
+
+  unsigned slot_ms() const { return slot_ms_; }
+  unsigned period_ms() const { return slot_ms_ * slots_.size(); }
+
+  /// Note an uplink from node asking for a slot, and give it one if it has none and one is free
+  /// @return Its slot, or 0 if all are taken
+  unsigned Assign(uint16_t node);
+
+  /// Free the slots of leaves quiet for the idle time, then write the beacon payload
+  /// @param capacity At least MAX_BEACON, so every assigned slot fits
+  /// @return Payload length, or 0 if the assignments do not all fit
+  unsigned Beacon(uint8_t* payload, unsigned capacity);
+
+  void PrintStats();
+
+private:
+  struct Slot {
+    uint16_t node;                ///< Leaf link address, or 0 when free; the gateway's address is never a leaf's
+    time_t last_heard;
+  };
+
+  unsigned slot_ms_;
+  unsigned idle_s_;
+  unsigned used_;
+  unsigned num_assigned_;
+  unsigned num_expired_;
+  unsigned num_refused_;          ///< Leaves that asked when every slot was taken
+  std::vector<Slot> slots_;       ///< Indexed by slot; slot 0 is the beacon
+  mutable boost::mutex mutex_;    ///< Protect everything above
+};
+
+#endif // SLOT_TABLE_HPP__
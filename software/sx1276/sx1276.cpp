@@ -63,6 +63,7 @@ using boost::chrono::steady_clock;
 #define SX1276REG_PayloadLength     0x22
 #define SX1276REG_MaxPayloadLength  0x23
 #define SX1276REG_FifoRxByteAddrPtr 0x25
+#define SX1276REG_ModemConfig3      0x26
 #define SX1276REG_DioMapping1       0x40
 #define SX1276REG_DioMapping2       0x41
 #define SX1276REG_PaDac             0x4d
@@ -94,6 +95,9 @@ using boost::chrono::steady_clock;
 #define DEBUG(x ...)
 #endif
 
+// FIFO start for transmitting
+#define TX_BASE_ADDR 0x00
+
 inline unsigned BandwidthToBitfield(unsigned bandwidthHz)
 {
   switch (bandwidthHz) {
@@ -132,15 +136,20 @@ inline unsigned BitfieldToBandwidth(unsigned bitfield)
 SX1276Radio::SX1276Radio(const boost::shared_ptr<SPI>& spi)
 : spi_(spi),
   fault_(false),
-  max_tx_payload_bytes_(0x80),
-  max_rx_payload_bytes_(0x80),
+  max_tx_payload_bytes_(MAX_PAYLOAD),
+  max_rx_payload_bytes_(MAX_PAYLOAD), // leaves may send a full LoRa payload
   last_rssi_dbm_(255),
+  last_packet_rssi_dbm_(255),
+  last_packet_snr_db_(-255),
+  last_packet_coding_rate_(0),
   actual_hz_(0),
   continuousMode_(false),
   continuousSetup_(false),
   high_power_mode_(false),
   preamble_(0x8),
-  symbolTimeout_(0x08)
+  symbolTimeout_(0x08),
+  spreading_factor_(9),
+  bandwidth_hz_(125000)
 {
   char *p = getenv("SX1276_HIGH");
   if (p && strcmp(p, "1")==0) {
@@ -325,17 +334,21 @@ bool SX1276Radio::ApplyDefaultLoraConfiguration()
 
   // IMPORTANT: Testing of 2015-09-13 was accidentally done using 4/5
 
-  // 125kHz, 4/6, explicit header
-  v = (SX1276_LORA_BW_125000 << 4) | ((SX1276_LORA_CODING_RATE_4_6) << 1) | 0x0;
+  // 125kHz unless SetDataRate() said otherwise, 4/6, explicit header
+  v = (BandwidthToBitfield(bandwidth_hz_) << 4) | ((SX1276_LORA_CODING_RATE_4_6) << 1) | 0x0;
   WriteRegisterVerify(SX1276REG_ModemConfig1, v);
 
-  // SF9, normal (not continuous) mode, CRC, and upper 2 bits of symbol timeout (maximum i.e. 1023)
+  // SF9 unless SetDataRate() said otherwise, normal (not continuous) mode, CRC, and upper 2 bits of symbol timeout (maximum i.e. 1023)
   // We use 255, or 255 x (2^9)/125000 or ~1 second
-  v = (0x9 << 4) | (0 << 3)| (1 << 2) | ((symbolTimeout_ >> 8) & 0x03);
+  v = (spreading_factor_ << 4) | (0 << 3)| (1 << 2) | ((symbolTimeout_ >> 8) & 0x03);
   WriteRegisterVerify(SX1276REG_ModemConfig2, v);
   v = symbolTimeout_ & 0xff;
   WriteRegisterVerify(SX1276REG_SymbTimeoutLsb, v);
 
+  // The datasheet requires low data rate optimisation once a symbol exceeds 16ms, e.g. SF11 and SF12 at 125kHz; AGC on
+  v = (LowDataRateOptimise() ? (1 << 3) : 0) | (1 << 2);
+  WriteRegisterVerify(SX1276REG_ModemConfig3, v);
+
   // Power (PA)
   // Bit 7 == 0 -- 14dBm max (our inAir9 version)
   // Bit 4..6 --> max power : 10.8 + 0.6 * K  dBm i.e. 10.8, 11.4, 12, 12.6, 13.2, 13.8, 14.4
@@ -385,21 +398,44 @@ bool SX1276Radio::ApplyDefaultLoraConfiguration()
   return !fault_;
 }
 
+bool SX1276Radio::SetDataRate(unsigned spreading_factor, unsigned bandwidth_hz)
+{
+  uint8_t code;
+  if (spreading_factor < 7 || spreading_factor > 12 || !BandwidthCode(bandwidth_hz, code)) { return false; }
+  spreading_factor_ = spreading_factor;
+  bandwidth_hz_ = bandwidth_hz;
+  return true;
+}
+
+bool SX1276Radio::BandwidthCode(unsigned bandwidth_hz, uint8_t& code)
+{
+  switch (bandwidth_hz) {
+  case 7800: case 10400: case 15600: case 20800: case 31250: case 41700: case 62500: case 125000: case 250000: case 500000:
+    code = BandwidthToBitfield(bandwidth_hz);
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool SX1276Radio::LowDataRateOptimise() const
+{
+  return ((uint64_t)1000000 << spreading_factor_) / bandwidth_hz_ > 16000;
+}
+
 /// Calcluates the estimated time on air for a given simple payload
 /// based on the formulae in the SX1276 datasheet
 float SX1276Radio::PredictTimeOnAir(const char *payload) const
 {
-  unsigned BW = 125000;
-  unsigned SF = 9;
-  float toa = (6.F+4.25F+8+ceil( (8*(strlen(payload)+1)-4*SF+28+16)/(4*SF))*6.F) * (1 << SF) / BW;
-  return toa;
+  return PredictTimeOnAir(payload, strlen(payload));
 }
 
 float SX1276Radio::PredictTimeOnAir(const void *payload, unsigned len) const
 {
-  unsigned BW = 125000;
-  unsigned SF = 9;
-  float toa = (6.F+4.25F+8+ceil( (8*(len+1)-4*SF+28+16)/(4*SF))*6.F) * (1 << SF) / BW;
+  unsigned BW = bandwidth_hz_;
+  unsigned SF = spreading_factor_;
+  unsigned DE = LowDataRateOptimise() ? 1 : 0;
+  float toa = (6.F+4.25F+8+ceil( (8*(len+1)-4*SF+28+16)/(4.F*(SF-2*DE)))*6.F) * (1 << SF) / BW;
   return toa;
 }
 
@@ -417,7 +453,7 @@ bool SX1276Radio::SendSimpleMessage(const char *payload)
 bool SX1276Radio::SendSimpleMessage(const void *payload, unsigned n)
 {
   uint8_t v;
-  if (n > 127) { fprintf(stderr, "Message too long; truncated!\n"); }
+  if (n > max_tx_payload_bytes_) { PR_ERROR("Message of %u bytes too long\n", n); return false; }
 
   continuousSetup_ = false;
 
@@ -432,9 +468,9 @@ bool SX1276Radio::SendSimpleMessage(const void *payload, unsigned n)
   // Turns out this need to be longer for very short messages
   WriteRegisterVerify(SX1276REG_PreambleLSB, preamble_);
 
-  // Reset TX FIFO
-  WriteRegisterVerify(SX1276REG_FifoTxBaseAddr, 0x80);
-  WriteRegisterVerify(SX1276REG_FifoAddrPtr, 0x80);
+  // Reset TX FIFO; from the bottom, so a full payload fits without wrapping. We are not receiving meanwhile
+  WriteRegisterVerify(SX1276REG_FifoTxBaseAddr, TX_BASE_ADDR);
+  WriteRegisterVerify(SX1276REG_FifoAddrPtr, TX_BASE_ADDR);
   // Payload length includes zero terminator
   WriteRegisterVerify(SX1276REG_MaxPayloadLength, max_tx_payload_bytes_);
   WriteRegisterVerify(SX1276REG_PayloadLength, n);
@@ -454,9 +490,9 @@ bool SX1276Radio::SendSimpleMessage(const void *payload, unsigned n)
     }
   }
   ReadRegisterHarder(SX1276REG_FifoAddrPtr, v);
-  if (v != 0x80 + n) {
+  if (v != TX_BASE_ADDR + n) {
     fault_ = true;
-    PR_ERROR("FIFO ptr mismatch, got %.2x expected %.2x\n", (int)v, (int)(0x80+n+1));
+    PR_ERROR("FIFO ptr mismatch, got %.2x expected %.2x\n", (int)v, (int)(TX_BASE_ADDR+n));
     return false;
   }
 
@@ -593,6 +629,7 @@ bool SX1276Radio::ReceiveSimpleMessage(uint8_t buffer[], int& size, int timeout_
     }
     if (flags & (1 << 6)) { // rx done
       printf("R\n");
+      last_packet_time_ = steady_clock::now();
       done = true;
       break;
     } else if (flags & (1 << 7)) {
@@ -616,6 +653,7 @@ bool SX1276Radio::ReceiveSimpleMessage(uint8_t buffer[], int& size, int timeout_
   if (ReadRegisterHarder(SX1276REG_Rssi, v)) { last_rssi_dbm_ = -137 + v; }
 
   if (!done) {
+    timeout = true;
     // DEBUG("[SX1276][RX] fin flags=%.2x stat=%.2x rssi=%d\n", flags, (int)stat, last_rssi_dbm_);
     return true; // no error, only a timeout or crc
   }
@@ -625,7 +663,7 @@ bool SX1276Radio::ReceiveSimpleMessage(uint8_t buffer[], int& size, int timeout_
   int snr_packet = -255;
   unsigned coding_rate = 0;
   if (ReadRegisterHarder(SX1276REG_PacketRssi, v)) { rssi_packet = -137 + v; }
-  if (ReadRegisterHarder(SX1276REG_PacketSnr, v)) { snr_packet = (v & 0x80 ? (~v + 1) : v) >> 4; } // 2's comp
+  if (ReadRegisterHarder(SX1276REG_PacketSnr, v)) { snr_packet = (int8_t)v / 4; } // 2's comp, quarter dB
   if (ReadRegisterHarder(SX1276REG_ModemStat, stat)) {
     switch (stat >> 5) {
     case 1: coding_rate = 5; break;
@@ -652,6 +690,10 @@ bool SX1276Radio::ReceiveSimpleMessage(uint8_t buffer[], int& size, int timeout_
   payloadSizeBytes--; // DONT KNOW WHY, I THINK FifoRxNbBytes points 1 down
 #endif
 
+  last_packet_rssi_dbm_ = rssi_packet;
+  last_packet_snr_db_ = snr_packet;
+  last_packet_coding_rate_ = coding_rate;
+
   DEBUG("[DBUG] RX ");
   boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
   printf("%s ", boost::posix_time::to_simple_string(now).c_str());
@@ -666,11 +708,10 @@ bool SX1276Radio::ReceiveSimpleMessage(uint8_t buffer[], int& size, int timeout_
 
   if (fault_) { PR_ERROR("SPI fault assessing packet.\n"); return false; }
 
-  // check CRC ...
-  if ((flags & (1 << 5)) == 1) {
+  // check CRC ... but read the packet out anyway, so the caller can guess who it was from
+  if (flags & (1 << 5)) {
     PR_ERROR("CRC Error. Packet rssi=%ddBm snr=%d cr=4/%d\n", rssi_packet, snr_packet, coding_rate);
     crc_error = true;
-    return true;
   }
 
   if (fault_) { PR_ERROR("SPI fault processing packet.\n"); return false; }
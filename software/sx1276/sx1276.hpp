@@ -22,6 +22,7 @@
 #include "spi.hpp"
 #include <boost/shared_ptr.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/chrono/system_clocks.hpp>
 
 #if defined(HAVE_DEVICE_CARAMBOLA2)
 #define DEFAULT_INTRA_DELAY_US 100 // Carambola2
@@ -45,6 +46,7 @@ class SPI;
 class SX1276Radio : boost::noncopyable
 {
 public:
+  enum { MAX_PAYLOAD = 255 };   ///< Largest LoRa payload, either way
 
   /// This radio instance is bound to a particular pre-configured SPI implementation and bus device.
   /// @param spi Reference to SPI object
@@ -66,6 +68,18 @@ public:
   /// @return Last RSSI value, set by last call to ReceiveSimpleMessage()
   int last_rssi() const { return last_rssi_dbm_; }
 
+  /// RSSI of the last packet received, dBm
+  int last_packet_rssi() const { return last_packet_rssi_dbm_; }
+
+  /// SNR of the last packet received, dB; negative below the noise floor
+  int last_packet_snr() const { return last_packet_snr_db_; }
+
+  /// Coding rate of the last packet received, from its header: 5..8 for 4/5..4/8, 0 if unknown
+  unsigned last_packet_coding_rate() const { return last_packet_coding_rate_; }
+
+  /// When the last packet received finished arriving, i.e. when RX done was seen
+  boost::chrono::steady_clock::time_point last_packet_time() const { return last_packet_time_; }
+
   uint32_t carrier() const { return actual_hz_; }
 
   /// Reset the module to our specific configuration.
@@ -78,16 +92,17 @@ public:
   /// @return true if OK, false if a fault() happened.
   bool ChangeCarrier(uint32_t carrier_hz);
 
-  /// Send an ASCII message, including zero terminator, truncated by maximum payload length.
+  /// Send an ASCII message, including zero terminator, of up to MAX_PAYLOAD bytes.
   /// No headers or protocol layer are used, this is only a test / beacon function.
   /// @param payload Message to send
   /// @return true if OK, false if a fault() happened
   bool SendSimpleMessage(const char *payload);
 
-  /// Send a binary message, truncated by maximum payload length.
+  /// Send a binary message. @return false, sending nothing, if longer than MAX_PAYLOAD
   bool SendSimpleMessage(const void *payload, unsigned len);
 
   /// Wait for a message
+  /// @param crc_error Set if the message failed its CRC; it is still read into buffer, corrupt
   bool ReceiveSimpleMessage(uint8_t buffer[], int& size, int timeout_ms, bool& timeout, bool& crc_error);
 
   void SetSymbolTimeout(unsigned symbolTimeout) { symbolTimeout_ = symbolTimeout; }
@@ -97,6 +112,17 @@ public:
   // Default set by environment variable
   void EnableHighPowerMode(bool enabled) { high_power_mode_ = enabled; }
 
+  /// Spreading factor (7..12) and bandwidth; the default is SF9 at 125kHz.
+  /// Like EnableHighPowerMode(), only has effect if called before ApplyDefaultLoraConfiguration()
+  /// @return false if not a valid combination
+  bool SetDataRate(unsigned spreading_factor, unsigned bandwidth_hz);
+  unsigned spreading_factor() const { return spreading_factor_; }
+  unsigned bandwidth_hz() const { return bandwidth_hz_; }
+
+  /// The ModemConfig1 bit field for a bandwidth, as leaves are told it (see radiolink::LINK_ADR)
+  /// @return false if the SX1276 does not support that bandwidth
+  static bool BandwidthCode(unsigned bandwidth_hz, uint8_t& code);
+
   /// Revert to LoRa standby mode.
   /// @param old_value Previous mode register value
   /// @return true if OK, false if a fault() happened
@@ -109,7 +135,7 @@ public:
   bool Sleep(uint8_t& old_value);
   bool Sleep() { uint8_t dummy; return Sleep(dummy); }
 
-  /// Predict time on air for a zero terminated payload.
+  /// Predict time on air for a zero terminated payload, at the data rate we are set to.
   /// @param Payload text
   /// @return Time on air, seconds.
   float PredictTimeOnAir(const char *payload) const;
@@ -118,6 +144,8 @@ public:
 private:
 
   void ReadCarrier();
+  /// Symbols are too long to track without it
+  bool LowDataRateOptimise() const;
   void EnterStandby();
   void EnterSleep();
 
@@ -131,12 +159,18 @@ private:
   uint8_t max_tx_payload_bytes_;
   uint8_t max_rx_payload_bytes_;
   int last_rssi_dbm_;            ///< RSSI read during last call to ReceiveSimpleMessage
+  int last_packet_rssi_dbm_;     ///< Packet RSSI of the last message received
+  int last_packet_snr_db_;       ///< Packet SNR of the last message received
+  unsigned last_packet_coding_rate_; ///< Coding rate of the last message received
+  boost::chrono::steady_clock::time_point last_packet_time_; ///< When RX done was seen for the last message received
   uint32_t actual_hz_;           ///< Actual carrier frequency, hz
   bool continuousMode_;          ///< If true then next call to ReceiveSimpleMessage will use continuous mode and not return to standby
   bool continuousSetup_;
   bool high_power_mode_;
   unsigned preamble_;
   unsigned symbolTimeout_;
+  unsigned spreading_factor_;
+  unsigned bandwidth_hz_;
 };
 
 #endif // SX1276_HPP__
@@ -0,0 +1,98 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "mqttclient.hpp"
+#include "leaf_decoder.hpp"
+#include <string>
+#include <vector>
+#include <iostream>
+#include <boost/format.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+#include <stdlib.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using boost::format;
+using boost::shared_ptr;
+
+// Leaf decoder: subscribes to the sample batches leaves publish, and republishes each reading
+// on a topic of its own as a plain number, for consumers such as mqtt2graphite:
+//   sx1276_leaf_decoder [broker-host [broker-port]]
+//
+//   sentrifarm/leaf/csv/<mac>  Z,2,-80,7,5 ...  -->  sentrifarm/leaf/value/<mac>/temperature  21.5
+//
+// Run it against the broker the gateway publishes to, and keep it running: a leaf's readings are
+// mostly deltas, which cannot be decoded until the leaf next sends everything whole.
+
+#define SUBSCRIBE_TOPIC "sentrifarm/leaf/csv/+"
+#define VALUE_TOPIC "sentrifarm/leaf/value/"
+
+class Republisher
+{
+public:
+  Republisher(MQTTClient& mqtt) : mqtt_(mqtt) { }
+
+  // Called from the one worker thread, so in order and one at a time
+  void OnMessage(const char *client_id, const char *topic, const void *payload, unsigned len) {
+    string leaf(topic);
+    leaf = leaf.substr(leaf.rfind('/') + 1);
+    vector<LeafDecoder::Reading> readings;
+    unsigned unresolved = decoder_.num_unresolved();
+    if (!decoder_.Decode(leaf, (const char*)payload, len, readings)) {
+      cerr << format("Not a sample batch from %s\n") % leaf;
+      return;
+    }
+    if (decoder_.num_unresolved() > unresolved) {
+      cerr << format("%u readings from %s have no base yet\n") % (decoder_.num_unresolved() - unresolved) % leaf;
+    }
+    for (unsigned i=0; i < readings.size(); i++) {
+      string value = (format("%g") % readings[i].value).str();
+      string value_topic = VALUE_TOPIC + leaf + "/" + readings[i].name;
+      if (!mqtt_.Publish(value_topic.c_str(), value.data(), value.size())) {
+        cerr << format("Publish %s: %s\n") % value_topic % mqtt_.last_error();
+      }
+    }
+  }
+
+private:
+  MQTTClient& mqtt_;
+  LeafDecoder decoder_;
+};
+
+int main(int argc, char *argv[])
+{
+  const char *host = argc > 1 ? argv[1] : NULL;
+  int port = argc > 2 ? atoi(argv[2]) : 1883;
+  if (port < 1) { cerr << "Invalid broker port.\n"; return 1; }
+
+  shared_ptr<MQTTClient> mqtt = MQTTClient::CreateInstance("sx1276_leaf_decoder", host, port);
+  if (!mqtt->valid()) { cerr << "MQTT init: " << mqtt->last_error() << "\n"; return 1; }
+  Republisher republisher(*mqtt);
+  mqtt->RegisterMessageHandler(boost::bind(&Republisher::OnMessage, &republisher, _1, _2, _3, _4));
+
+  // If the broker is not there yet we keep trying; the subscription goes out once it accepts us
+  if (!mqtt->Connect()) { cerr << "MQTT connect: " << mqtt->last_error() << "\n"; }
+  mqtt->Subscribe(SUBSCRIBE_TOPIC);
+  if (!mqtt->Start(1)) { cerr << "MQTT start: " << mqtt->last_error() << "\n"; return 1; }
+  cout << format("Decoding %s\n") % SUBSCRIBE_TOPIC;
+  while (true) { sleep(60); }
+}
@@ -20,17 +20,40 @@ along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
 #include "sx1276_platform.hpp"
 #include "misc.hpp"
 #include "util.hpp"
+#include "message_store.hpp"
+#include "mqttsn_frame.hpp"
+#include "topic_scheduler.hpp"
+#include "airtime_budget.hpp"
+#include "channel_plan.hpp"
+#include "radio_manager.hpp"
+#include "radio_pool.hpp"
+#include "session_table.hpp"
+#include "slot_table.hpp"
+#include "adr_engine.hpp"
+#include "link_stats.hpp"
+#include "duplicate_cache.hpp"
+#include "next_hop_table.hpp"
+#include "gateway_link.hpp"
+#include "mqttclient.hpp"
+#include "mqttsn_gateway.hpp"
 #include "libsocket/inetserverdgram.hpp"
 #include "libsocket/inetclientdgram.hpp"
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/format.hpp>
+#include <boost/algorithm/string.hpp>
 #include <boost/chrono/time_point.hpp>
 #include <boost/chrono/system_clocks.hpp>
 #include <iostream>
 #include <string.h>
+#include <math.h>
 #include <string>
 #include <iostream>
+#include <deque>
+#include <map>
+#include <vector>
+#include <poll.h>
 
 using std::string;
 using std::cout;
@@ -43,198 +66,339 @@ using boost::condition_variable;
 using boost::unique_lock;
 using boost::chrono::steady_clock;
 
-class RadioManager
+/// Drains queued messages from the broker into the radio.
+/// The TopicScheduler decides which message goes next so a chatty topic cannot starve the rest.
+/// If a store is configured, a message stays in it until the radio reports it was transmitted,
+/// so if we crash or the radio needs a restart it is sent again rather than lost.
+/// A message for a particular leaf carries its link address as a topic suffix, "@<node>", so it
+/// survives the store; topic ids are per client in MQTT-SN anyway, so each leaf coalesces separately.
+/// Messages for a leaf that only listens in receive windows are held, in order, until its next window
+/// opens (see RadioPool::NextWindow()); one goes in each window, telling the leaf if more are waiting.
+class Forwarder
 {
 public:
-  RadioManager(shared_ptr<SX1276Radio>& radio, shared_ptr<SX1276Platform>& platform)
-  :  radio_(radio),
-    platform_(platform),
-    have_port_(false), rolling_counter_(0), rolling_counter_rx_(0xff),
-    num_tx_(0), num_valid_received_(0), num_crc_errors_(0), num_junk_(0), num_xorv_(0), dropped_(0),
-    have_rx_(false)
+  Forwarder(RadioPool& radios, MessageStore* store)
+  : radios_(radios), store_(store)
   {
+    // Protocol control traffic first, and it goes stale quickly.
+    // Sensor data can be coalesced to the latest value when the link is saturated.
+    TopicScheduler::TopicClass ctrl = { 4, 30, false };
+    TopicScheduler::TopicClass telemetry = { 1, 3600, true };
+    scheduler_.SetTopicClass("ctrl/", ctrl);
+    scheduler_.SetTopicClass("publish/", telemetry);
   }
-  void Restart() {
-    unique_lock<mutex> lock(radio_mutex_);
-    platform_->ResetSX1276();
-    radio_->ChangeCarrier(919000000);
-    radio_->ApplyDefaultLoraConfiguration();
-  }
-  bool GetPort(string& ip, string& port) const {
-    unique_lock<mutex> lock(port_mutex_);
-    if (have_port_) {
-      ip = from_ip_;
-      port = from_port_;
+  void Push(const MessageStore::Message& message) {
+    TopicScheduler::Item item;
+    item.id = message.id;
+    item.stamp = message.stamp;
+    item.topic = message.topic;
+    item.payload = message.payload;
+    std::vector<uint32_t> dropped;
+    {
+      unique_lock<mutex> lock(mutex_);
+      scheduler_.Push(item, dropped);
+      cond_.notify_one();
     }
-    return have_port_;
+    Discard(dropped);
   }
-  void SetPort(const string& ip, const string& port) {
-    unique_lock<mutex> lock(port_mutex_);
-    if (from_ip_ != ip || from_port_ != port) {
-      cout << format("Port change: %s %s\n") % ip % port;
-      // TODO: break out of receive early?
-    }
-    have_port_ = true;
-    from_ip_ = ip;
-    from_port_ = port;
-  }
-
-  // Very dumb layer 2 protocol
-  // Byte 0 : 0x00 == MQTT-SN data, 0x02 == HELLO message
-  // Byte 1 : Rolling counter (for debug purposes)
-  // Byte 2 : Rolling counter last received from other side, for debug purposes
-  // Byte N : xor of rest of buffer - because CRC can pass but data get corrupted by BusPirate serial it seems
-  bool TransmitHello() {
-    unique_lock<mutex> lock(radio_mutex_);
-    for (int i=0; i < 5; i++) {
-      uint8_t buffer[10] = { 0x02, rolling_counter_, 0xff, 'h', 'e', 'l', 'l', 'o', (uint8_t)('0'+i), 0};
-      uint8_t xorv = 0;
-      for (unsigned j=0; j < 9; j++) {
-        xorv = xorv ^ buffer[j];
+  /// @param node Link address of the leaf the message is for, or 0 to send unaddressed
+  bool Enqueue(const void *payload, unsigned len, uint16_t node=0) {
+    MessageStore::Message message;
+    message.topic = mqttsn::TopicKey(payload, len);
+    if (node) { message.topic += str(format("@%04x") % node); }
+    message.id = 0;
+    if (store_ && !store_->Append(message.topic, payload, len, message.id)) { return false; }
+    message.stamp = time(NULL);
+    message.payload.assign((const uint8_t*)payload, (const uint8_t*)payload + len);
+    Push(message);
+    return true;
+  }
+  void Run() {
+    steady_clock::time_point housekeeping = steady_clock::now();
+    TopicScheduler::Item item;
+    bool have = false;
+    for (;;) {
+      steady_clock::time_point window = SendHeld();
+      if (!have) {
+        std::vector<uint32_t> expired;
+        {
+          unique_lock<mutex> lock(mutex_);
+          if (scheduler_.size() == 0) { cond_.wait_until(lock, window); }
+          have = scheduler_.Pop(item, expired);
+        }
+        Discard(expired);
+      }
+      if (have && Hold(item)) {
+        have = false;
+      } else if (have) {
+        switch (Send(item, false)) {
+        case DEFERRED:
+          // Let other topics have a go while the budget refills
+          {
+            unique_lock<mutex> lock(mutex_);
+            scheduler_.Requeue(item);
+          }
+          have = false;
+          usleep(500000);
+          break;
+        case FAILED:
+          // Hang on to it and try again once the radio is back
+          usleep(100000);
+          break;
+        default:
+          have = false;
+          break;
+        }
+      }
+      if (steady_clock::now() - housekeeping > boost::chrono::seconds(10)) {
+        Housekeeping();
+        housekeeping = steady_clock::now();
       }
-      buffer[9] = xorv;
-      rolling_counter_ ++;
-      radio_->SendSimpleMessage(buffer, sizeof(buffer));
-      usleep(100000); // Not too close, sometimes they dont all get received
     }
   }
-  bool Transmit(const void* payload, unsigned len) {
-
-    uint8_t buffer[len+4];
-    buffer[0] = 0x0;
-    buffer[1] = rolling_counter_;
-    memcpy(buffer+3, payload, len);
-    rolling_counter_ = (rolling_counter_==0xff ? 0 : rolling_counter_+1);
-
-    unique_lock<mutex> lock(radio_mutex_);
-    buffer[2] = rolling_counter_rx_;
+private:
+  enum Outcome { SENT, DROPPED, DEFERRED, FAILED };
 
-    uint8_t xorv = 0;
-    for (unsigned j=0; j < len+3; j++) {
-      xorv = xorv ^ buffer[j];
+  static uint16_t NodeOf(const TopicScheduler::Item& item) {
+    size_t at = item.topic.rfind('@');
+    if (at == string::npos) { return 0; }
+    return strtoul(item.topic.c_str() + at + 1, NULL, 16);
+  }
+  /// Control traffic may use the airtime reserve; telemetry that would be coalesced anyway is the first to go
+  AirtimeBudget::Priority PriorityOf(const TopicScheduler::Item& item) {
+    unique_lock<mutex> lock(mutex_);
+    const TopicScheduler::TopicClass& topic_class = scheduler_.ClassFor(item.topic);
+    if (topic_class.priority > 1) { return AirtimeBudget::HIGH; }
+    if (topic_class.coalesce && scheduler_.saturated()) { return AirtimeBudget::LOW; }
+    return AirtimeBudget::NORMAL;
+  }
+  /// @param more Another message for the same leaf follows in its next receive window
+  Outcome Send(const TopicScheduler::Item& item, bool more) {
+    uint16_t node = NodeOf(item);
+    AirtimeBudget::Decision decision = radios_.CheckAirtime(item.payload.size(), PriorityOf(item), node);
+    if (decision == AirtimeBudget::DROP) {
+      cerr << format("Airtime low, dropped %s\n") % item.topic;
+      Discard(std::vector<uint32_t>(1, item.id));
+      return DROPPED;
     }
-    buffer[len+3] = xorv;
-#if 1
-    cout << "Predicted time on air: " << radio_->PredictTimeOnAir(buffer, sizeof(buffer)) << "\n";
-#endif
-    if (!radio_->SendSimpleMessage(buffer, sizeof(buffer))) {
-      // SPI error
-      return false;
+    if (decision == AirtimeBudget::DEFER) { return DEFERRED; }
+    if (!radios_.Transmit(&item.payload[0], item.payload.size(), node, more)) {
+      cerr << "TX error, will retry\n";
+      return FAILED;
     }
-    num_tx_++;
-    return true;
+    if (store_) { store_->Ack(item.id); }
+    return SENT;
   }
-  void PrintStats() {
-    cout << format("TX=%4u RX=%4u CRC=%4u JUNK=%4u DROPPED=%d\n") % num_tx_ % num_valid_received_ % num_crc_errors_ % num_junk_ % dropped_;
+  /// Keep a message for a leaf that is not listening yet, behind any already waiting for it
+  bool Hold(const TopicScheduler::Item& item) {
+    uint16_t node = NodeOf(item);
+    steady_clock::time_point at;
+    if (held_.find(node) == held_.end() && radios_.NextWindow(node, at) == RadioPool::NOW) { return false; }
+    held_[node].push_back(item);
+    return true;
   }
-  bool TryReceive(uint8_t* payload, unsigned len, unsigned& rx)
-  {
-    // Do a blocking receive, but in such a way we can break it out if Transmit needs to do its thing
-    // OTOH dont let a high rate of TX starve receiving
-    bool crc_error = false;
-    bool timeout = false;
-    unsigned timeout_ms = 20000; // This timeout is a safety sanity check; normally, ReceiveSimpleMessage returns on a symbol timeout without retrying
-
-    unique_lock<mutex> lock(radio_mutex_);
-    int received = 0;
-    uint8_t buffer[len+4];
-    do {
-      received = sizeof(buffer);
-      if (!radio_->ReceiveSimpleMessage(buffer, received, timeout_ms, timeout, crc_error)) {
-        // SPI error
-        return false;
+  /// Send one held message to each leaf whose receive window is open now
+  /// @return When the next window we are waiting for opens, or a while from now if none
+  steady_clock::time_point SendHeld() {
+    steady_clock::time_point next = steady_clock::now() + boost::chrono::seconds(5);
+    for (std::map<uint16_t, std::deque<TopicScheduler::Item> >::iterator i = held_.begin(); i != held_.end(); ) {
+      std::deque<TopicScheduler::Item>& items = i->second;
+      steady_clock::time_point at;
+      RadioPool::Window window = radios_.NextWindow(i->first, at);
+      if (window == RadioPool::LATER && at > steady_clock::now()) {
+        // Keep the radio from starting a receive it would still be busy with then
+        radios_.Reserve(i->first, at);
+        if (at < next) { next = at; }
+      } else if (window != RadioPool::MISSED) {
+        Outcome outcome = Send(items.front(), items.size() > 1);
+        if (outcome == SENT || outcome == DROPPED) { items.pop_front(); }
       }
-      if (!timeout && !crc_error) {
-        uint8_t xorv = 0;
-        for (unsigned j=0; j < received - 1; j++) {
-          xorv = xorv ^ buffer[j];
-        }
-        if (xorv != buffer[received-1]) {
-          cerr << format("XOR checksum error! %.2x != %.2x\n") % (int)xorv % (int)buffer[received-1];
-          num_xorv_ ++;
-          FILE* f = popen("od -Ax -tx1z -v -w16", "w");
-          if (f) { fwrite(buffer, received, 1, f); pclose(f); }
-        }
-        else if (buffer[0] == 2) {
-          rolling_counter_rx_ = buffer[1];
-          have_rx_ = false;
-          cout << format("[RX Hello] cntr=%d\n") % (int)buffer[1];
-          continue;
-        }
-        else if (buffer[0] == 0) {
-          num_valid_received_ ++;
-          PrintStats();
-          uint8_t received_counter = buffer[1];
-          uint8_t expected_counter = (rolling_counter_rx_ == 0xff ? 0 : rolling_counter_rx_+1);
-          if (!have_rx_) {
-            have_rx_ = true;
-          }
-          else if (received_counter != expected_counter) {
-            // if received > expected then a message got lost
-            int skipped = (int)received_counter - (int)expected_counter;
-            if (skipped < 1) { skipped += 256; }
-            cerr << format("Dropped %d messages? cntr.xpt=%d cntr.rxd=%d othr.rxd=%d\n") % skipped % (int)expected_counter % (int)buffer[1] % (int)buffer[2];
-            dropped_ += skipped;
-          }
-          rolling_counter_rx_ = buffer[1];
-          memcpy(payload, buffer+3, received-4);
-          rx = received-4;
-          return true;
+      if (items.empty()) { held_.erase(i++); } else { ++i; }
+    }
+    return next;
+  }
+  /// Held messages go stale like queued ones, e.g. while a leaf sleeps after missing its windows
+  void ExpireHeld() {
+    time_t now = time(NULL);
+    std::vector<uint32_t> expired;
+    unique_lock<mutex> lock(mutex_);
+    for (std::map<uint16_t, std::deque<TopicScheduler::Item> >::iterator i = held_.begin(); i != held_.end(); ) {
+      std::deque<TopicScheduler::Item>& items = i->second;
+      for (std::deque<TopicScheduler::Item>::iterator j = items.begin(); j != items.end(); ) {
+        unsigned max_age = scheduler_.ClassFor(j->topic).max_age_s;
+        if (max_age > 0 && now - j->stamp > (time_t)max_age) {
+          expired.push_back(j->id);
+          j = items.erase(j);
         } else {
-          num_junk_ ++;
-          cerr << format("Junk? type=%.2x cntr=%d\n") % (int)buffer[0] % (int)buffer[1];
+          ++j;
         }
-      } else if (crc_error) {
-        num_crc_errors_ ++;
-        cerr << "CRC error\n";
       }
-      else { cerr  << "~"; }
+      if (items.empty()) { held_.erase(i++); } else { ++i; }
+    }
+    lock.unlock();
+    Discard(expired);
+  }
+  void Discard(const std::vector<uint32_t>& ids) {
+    if (!store_) { return; }
+    for (unsigned i=0; i < ids.size(); i++) { store_->Ack(ids[i]); }
+  }
+  void Housekeeping() {
+    ExpireHeld();
+    {
+      unique_lock<mutex> lock(mutex_);
+      unsigned held = 0;
+      for (std::map<uint16_t, std::deque<TopicScheduler::Item> >::const_iterator i = held_.begin(); i != held_.end(); ++i) { held += i->second.size(); }
+      cout << format("Queue: backlog=%u coalesced=%u expired=%u held=%u\n") % scheduler_.size() % scheduler_.num_coalesced() % scheduler_.num_expired() % held;
+    }
+    radios_.PrintRoutes();
+    if (!store_) { return; }
+    // Batch up flash writes
+    unsigned removed = store_->Compact();
+    store_->Sync();
+    if (removed) { cout << format("Store: removed %u segments, pending=%u discarded=%u\n") % removed % store_->pending() % store_->discarded(); }
+  }
 
-      // allow pending tx...
-      lock.unlock();
-      usleep(50); // there must be a better way to do this...
-      lock.lock();
-    } while (true); // DODGY: we need a higher level time timeout for O/S servicing
+  RadioPool& radios_;
+  MessageStore* store_;          ///< Optional persistent copy of the queue
+  mutex mutex_;                  ///< Protect scheduler_
+  condition_variable cond_;
+  TopicScheduler scheduler_;
+  std::map<uint16_t, std::deque<TopicScheduler::Item> > held_; ///< Leaf link address --> messages awaiting its receive window; Run() thread only
+};
+
+/// Broadcasts the beacon leaves time their uplink slots from, at the start of every period (see SlotTable).
+/// Each beacon is reserved on the radios as soon as the one before has gone, so a receive cannot hold it up.
+class Beaconer
+{
+public:
+  Beaconer(RadioPool& radios, SlotTable& slots)
+  : radios_(radios), slots_(slots)
+  {}
+  void Run() {
+    steady_clock::time_point next = steady_clock::now();
+    for (;;) {
+      next += boost::chrono::milliseconds(slots_.period_ms());
+      radios_.ReserveBeacon(next);
+      boost::this_thread::sleep_until(next);
+      uint8_t payload[SlotTable::MAX_BEACON];
+      unsigned len = slots_.Beacon(payload, sizeof(payload));
+      if (!len || !radios_.TransmitBeacon(payload, len)) { cerr << "Beacon TX error\n"; }
+      slots_.PrintStats();
+    }
   }
 private:
-  shared_ptr<SX1276Radio> radio_;
-  shared_ptr<SX1276Platform> platform_;
-  mutex radio_mutex_;          ///< Protect access to the radio
-  string from_ip_;             ///< IP last UDP packet was received from
-  string from_port_;           ///< port last UDP packet was received from
-  mutable mutex port_mutex_;   ///< Protection for from_ip_, from_port_
-  bool have_port_;             ///< false until from_port_ set for the first time
-  uint8_t rolling_counter_;    ///< Rolling message counter output
-  uint8_t rolling_counter_rx_; ///< Rolling message counter last received
-  int num_tx_;                 ///< Number of transmitted MQTT-SN messages
-  int num_valid_received_;     ///< Number of valid received MQTT-SN messages
-  int num_crc_errors_;         ///< Number of crc errors
-  int num_junk_;               ///< Number of junk messages
-  int num_xorv_;               ///< Number of junk XOR messages
-  int dropped_;                ///< Estimated number of lost messages in transit
-  bool have_rx_;               ///< false until first message received successfully
+  RadioPool& radios_;
+  SlotTable& slots_;
+};
+
+/// Gateway end of the link to a network server (sx1276_network_server), used in forward mode.
+/// Uplinks go to the server tagged with our gateway id and their signal quality; downlinks
+/// from the server are queued for the radio like those from a broker.
+class ServerLink
+{
+public:
+  ServerLink(const shared_ptr<libsocket::inet_dgram_client>& socket, uint16_t gateway, Forwarder& forwarder)
+  : socket_(socket), gateway_(gateway), forwarder_(forwarder)
+  {}
+  void Uplink(const RadioManager::RxInfo& info, const uint8_t* payload, unsigned len) {
+    gatewaylink::Header header = { gatewaylink::UPLINK, gateway_, info.header.src, info.header.counter, info.rssi_dbm, info.snr_db };
+    Send(header, payload, len);
+  }
+  void Run() {
+    steady_clock::time_point pinged;
+    bool have_pinged = false;
+    for (;;) {
+      // Keep any NAT on the way open, and let a restarted server find us before the next uplink
+      if (!have_pinged || steady_clock::now() - pinged > boost::chrono::seconds(30)) {
+        gatewaylink::Header header = { gatewaylink::PING, gateway_, 0, 0, 0, 0 };
+        Send(header, NULL, 0);
+        pinged = steady_clock::now();
+        have_pinged = true;
+      }
+      struct pollfd pfd = { socket_->getfd(), POLLIN, 0 };
+      if (poll(&pfd, 1, 1000) <= 0) { continue; }
+      uint8_t message[gatewaylink::HEADER_LENGTH + 256];
+      ssize_t n = socket_->rcv(message, sizeof(message));
+      gatewaylink::Header header;
+      if (n <= 0 || !gatewaylink::ReadHeader(message, n, header) || header.type != gatewaylink::DOWNLINK) { continue; }
+      const uint8_t* payload = message + gatewaylink::HEADER_LENGTH;
+      unsigned len = n - gatewaylink::HEADER_LENGTH;
+      cerr << format("[Server RX] node %.4x : %d:%s\n") % header.node % len % util::buf2str(payload, len);
+      if (!forwarder_.Enqueue(payload, len, header.node)) { cerr << "Store error, dropped\n"; }
+    }
+  }
+private:
+  void Send(const gatewaylink::Header& header, const uint8_t* payload, unsigned len) {
+    uint8_t message[gatewaylink::HEADER_LENGTH + len];
+    gatewaylink::WriteHeader(header, message);
+    if (len) { memcpy(message + gatewaylink::HEADER_LENGTH, payload, len); }
+    try {
+      socket_->snd(message, sizeof(message));
+    } catch (libsocket::socket_exception& e) { cerr << e.mesg << "\n"; }
+  }
+
+  shared_ptr<libsocket::inet_dgram_client> socket_;
+  uint16_t gateway_;
+  Forwarder& forwarder_;
 };
 
 class WorkerThread
 {
   shared_ptr<libsocket::inet_dgram> socket_;
-  RadioManager& radio_;
-  bool outward_;
+  RadioPool& radios_;
+  Forwarder& forwarder_;
+  RadioManager* receiver_;       ///< Radio InLoop() receives from; NULL for OutLoop()
+  SessionTable* sessions_;       ///< One UDP socket per leaf in connect mode; NULL when listening
+  DuplicateCache& duplicates_;   ///< Frames heard both directly and through relays
+  ServerLink* server_;           ///< Network server in forward mode, else NULL
+  MqttsnGateway* gateway_;       ///< Our own MQTT-SN gateway in gateway mode, else NULL
+  SlotTable* slots_;             ///< Uplink slots when beaconing, else NULL
+  AdrEngine* adr_;               ///< Adaptive data rate, else NULL
+  void FromGateway(uint16_t node, const uint8_t* buffer, unsigned n) {
+    cerr << format("[UDP RX] node %.4x : %d:%s\n") % node % n % util::buf2str(buffer,n);
+    if (!forwarder_.Enqueue(buffer, n, node)) {
+      cerr << "Store error, sending directly\n";
+      if (!radios_.Transmit(buffer, n, node)) { cerr << "TX error!\n"; }
+    }
+  }
+  void SessionLoop() {
+    steady_clock::time_point housekeeping = steady_clock::now();
+    for (;;) {
+      sessions_->Poll(1000, boost::bind(&WorkerThread::FromGateway, this, _1, _2, _3));
+      if (steady_clock::now() - housekeeping > boost::chrono::seconds(60)) {
+        sessions_->Expire();
+        sessions_->PrintStats();
+        housekeeping = steady_clock::now();
+      }
+    }
+  }
+  void GatewayLoop() {
+    // Messages from the broker arrive on the MQTT client's threads; all that is left is housekeeping
+    for (unsigned n=1; ; n++) {
+      sleep(10);
+      gateway_->Expire();
+      if (n % 6 == 0) { gateway_->PrintStats(); }
+    }
+  }
   void OutLoop() {
+    if (server_) { server_->Run(); return; }
+    if (gateway_) { GatewayLoop(); return; }
+    if (sessions_) { SessionLoop(); return; }
     for (;;) {
-      uint8_t buffer[127];
+      uint8_t buffer[radiolink::MAX_FRAME];   // Anything too long for a frame is refused when sent
       string from, fromport;
       int n = socket_->rcvfrom(buffer, sizeof(buffer), from, fromport);
       if (n > 0) {
-        { radio_.SetPort(from, fromport); }
+        { radios_.SetPort(from, fromport); }
         cerr << format("[UDP RX] %s:%d : %d:%s\n") % from % fromport % n % util::buf2str(buffer,n);
 
         FILE* f = popen("od -Ax -tx1z -v -w16", "w");
         if (f) { fwrite(buffer, n, 1, f); pclose(f); }
 
 
-        if (!radio_.Transmit(buffer, n)) {
-          cerr << "TX error!\n";
+        if (!forwarder_.Enqueue(buffer, n)) {
+          cerr << "Store error, sending directly\n";
+          if (!radios_.Transmit(buffer, n)) { cerr << "TX error!\n"; }
         }
         cerr << format("[UDP RX] FIN\n");
 
@@ -252,15 +416,45 @@ class WorkerThread
       // The SX1276 supports all sorts of nice stuff, like CAD but we havent gotten into that yet
       // For the moment we need to sit here and wait (receive with block)
       // but with a way of falling out to allow transmits to happen...
-      bool ok = radio_.TryReceive(buffer, 256, r);
-
+      RadioManager::RxInfo info;
+      bool ok = receiver_->TryReceive(buffer, 256, r, info);
+      const radiolink::Header& header = info.header;
+      uint16_t node = header.src;
+
+      if (ok && header.type != radiolink::DATA) {
+        // Relays pass on our own downlinks too
+        if (header.dst != radiolink::GATEWAY_ADDRESS) { continue; }
+        if (duplicates_.Check(header.src, header.counter)) {
+          cerr << format("[Radio RX] duplicate from %.4x cntr=%d hops=%d\n") % node % (int)header.counter % (int)header.hops;
+          continue;
+        }
+      }
       if (ok) { // FIXME
 #if 0
         FILE* f = popen("od -Ax -tx1z -v -w16", "w");
         if (f) { fwrite(buffer, r, 1, f); pclose(f); }
 #endif
+        radios_.NoteReceived(*receiver_, info);
+        if (slots_ && header.type != radiolink::RELAYED && (header.flags & radiolink::SLOTTED)) {
+          radios_.NoteSlot(node, slots_->Assign(node));
+        }
+        if (adr_ && header.type != radiolink::RELAYED) { adr_->Uplink(node, receiver_, info.snr_db); }
+        if (server_) {
+          server_->Uplink(info, buffer, r);
+          continue;
+        }
+        if (gateway_) {
+          cerr << format("[Radio RX -> gateway] node %.4x : %d:%s\n") % node % r % util::buf2str(buffer,r);
+          gateway_->Handle(node, buffer, r);
+          continue;
+        }
+        if (sessions_) {
+          cerr << format("[Radio RX -> node %.4x] %d:%s\n") % node % r % util::buf2str(buffer,r);
+          if (!sessions_->Send(node, buffer, r)) { cerr << "UDP TX error!\n"; }
+          continue;
+        }
         string ip; string port;
-        bool have_port = radio_.GetPort(ip, port);
+        bool have_port = radios_.GetPort(ip, port);
         try {
           if (have_port) {
             cerr << format("[Radio RX -> %s:%s] %d:%s\n") % ip % port % r % util::buf2str(buffer,r);
@@ -276,20 +470,34 @@ class WorkerThread
           }
         } catch (libsocket::socket_exception& e) { cerr << e.mesg<< "\n"; }
       } else {
-        radio_.Restart();
+        receiver_->Restart();
       }
     }
   }
 public:
   // TODO: abstract SX1276 Radio to Radio, etc
-  WorkerThread(boost::shared_ptr<libsocket::inet_dgram>& socket, RadioManager& radio, bool outward)
+  /// @param receiver Radio to receive from, or NULL to forward UDP to the radios
+  /// @param sessions Per leaf sockets to the gateway, or NULL to use socket for every leaf
+  /// @param server Network server to forward to instead, or NULL
+  /// @param gateway MQTT-SN gateway to hand frames to instead, or NULL
+  /// @param slots Uplink slots to give leaves that ask, or NULL
+  /// @param adr Adaptive data rate to tell about uplinks, or NULL
+  WorkerThread(boost::shared_ptr<libsocket::inet_dgram>& socket, RadioPool& radios, Forwarder& forwarder, RadioManager* receiver, SessionTable* sessions,
+               DuplicateCache& duplicates, ServerLink* server, MqttsnGateway* gateway, SlotTable* slots, AdrEngine* adr)
   : socket_(socket),
-    radio_(radio),
-    outward_(outward)
+    radios_(radios),
+    forwarder_(forwarder),
+    receiver_(receiver),
+    sessions_(sessions),
+    duplicates_(duplicates),
+    server_(server),
+    gateway_(gateway),
+    slots_(slots),
+    adr_(adr)
   {}
   void Run() {
     try {
-      if (outward_) { OutLoop(); } else { InLoop(); }
+      if (!receiver_) { OutLoop(); } else { InLoop(); }
     } catch (const libsocket::socket_exception& exc) {
       cerr << exc.mesg;
     }
@@ -297,6 +505,77 @@ public:
   }
 };
 
+/// Passes frames on between leaves and a gateway out of their range, e.g. from a fence post.
+///
+/// Frames from leaves to the gateway are relayed towards the gateway; relayed frames addressed to us
+/// as the next hop go on towards their destination, as an ordinary addressed frame for the last hop
+/// to a leaf. Next hops are learnt from what we hear; with no route yet a frame goes to any relay,
+/// and the duplicate cache keeps relays that hear each other from passing the same frame back and forth.
+class Relay
+{
+public:
+  Relay(RadioPool& radios, RadioManager& receiver, uint16_t address, DuplicateCache& duplicates, NextHopTable& next_hops)
+  : radios_(radios), receiver_(receiver), address_(address), duplicates_(duplicates), next_hops_(next_hops),
+    forwarded_(0), dropped_(0)
+  {}
+  void Run() {
+    steady_clock::time_point housekeeping = steady_clock::now();
+    for (;;) {
+      uint8_t buffer[256];
+      unsigned r = 0;
+      RadioManager::RxInfo info;
+      if (!receiver_.TryReceive(buffer, sizeof(buffer), r, info)) { receiver_.Restart(); continue; }
+      if (r > 0) { Handle(info, buffer, r); }
+      if (steady_clock::now() - housekeeping > boost::chrono::seconds(60)) {
+        next_hops_.PrintStats();
+        radios_.PrintLinks();
+        cout << format("Relay: forwarded=%u duplicates=%u dropped=%u\n") % forwarded_ % duplicates_.num_duplicates() % dropped_;
+        housekeeping = steady_clock::now();
+      }
+    }
+  }
+private:
+  void Handle(const RadioManager::RxInfo& info, const uint8_t* payload, unsigned len) {
+    const radiolink::Header& header = info.header;
+    // Without addresses there is nowhere to relay to
+    if (header.type == radiolink::DATA) { return; }
+    bool relayed = header.type == radiolink::RELAYED;
+    uint16_t neighbour = relayed ? header.from : header.src;
+    if (neighbour == address_) { return; }
+    next_hops_.Heard(header.src, neighbour, header.hops, info.snr_db);
+    if (duplicates_.Check(header.src, header.counter)) { return; }
+
+    // Downlinks the gateway sent direct are none of our business, nor are relayed frames meant for another relay
+    if (!relayed && header.dst != radiolink::GATEWAY_ADDRESS) { return; }
+    if (relayed && header.to != address_ && header.to != radiolink::BROADCAST_ADDRESS) { return; }
+    if (header.dst == address_) { return; }
+    if (header.hops >= radiolink::MAX_HOPS || len + radiolink::Overhead(radiolink::RELAYED) > radiolink::MAX_FRAME) { dropped_ ++; return; }
+
+    radiolink::Header out = header;
+    out.type = radiolink::RELAYED;
+    out.hops = header.hops + 1;
+    out.from = address_;
+    out.to = next_hops_.NextHop(header.dst);
+    if (out.to == header.dst && header.dst != radiolink::GATEWAY_ADDRESS) {
+      // Last hop: leaves only understand addressed frames
+      out.type = radiolink::ADDRESSED;
+      out.echo = 0;
+    }
+    // Nowhere to queue it; the originator retries if it mattered
+    if (radios_.CheckForward(out, len, AirtimeBudget::NORMAL) != AirtimeBudget::SEND) { dropped_ ++; return; }
+    cerr << format("[Relay] %.4x -> %.4x via %.4x hops=%d snr=%d\n") % header.src % header.dst % out.to % (int)out.hops % info.snr_db;
+    if (radios_.Forward(out, payload, len)) { forwarded_ ++; } else { dropped_ ++; }
+  }
+
+  RadioPool& radios_;
+  RadioManager& receiver_;
+  uint16_t address_;
+  DuplicateCache& duplicates_;
+  NextHopTable& next_hops_;
+  unsigned forwarded_;
+  unsigned dropped_;
+};
+
 // OK. so it seems bridge mode is no good when we dont actually have a borker on the other side (like the leaf)
 // So if we just connect to the broker as a client we can bridge the leaf node as a publisher without any issues
 //
@@ -305,6 +584,104 @@ public:
 //   sx1276_mqttsn_bridge /dev/spidev0.1 connect 1883
 //   mqtt-sn-sub -v -t '#'
 // Issues with this configuration: if we restart the subscriber the broker gets confused on msgs from leaf?
+//
+// In connect mode each leaf gets its own UDP socket to the broker, keyed by its link address, so the
+// broker sees one client per leaf. SX1276_SESSION_IDLE (seconds, default 3600) closes the socket of a
+// leaf not heard from for that long; it must exceed the longest time a leaf sleeps.
+// In listen mode all leaves share the one socket, and replies go to whichever peer spoke last.
+//
+// With a 4th argument, the queue of messages from the broker is also kept in a store-and-forward directory
+// instead of being sent straight out, and survive a restart. It must be on ubifs or tmpfs, not a jffs2
+// overlay, which cannot map files for writing (see message_store.hpp); if it cannot be opened we exit.
+//
+// Set SX1276_DUTY_CYCLE to a percentage (e.g. 1 for the EU868 g1 sub-band) to hold transmissions to that
+// duty cycle over any hour; by default airtime is only accounted.
+//
+// SX1276_CHANNEL selects which channel of the plan to use (default 0, 919MHz); SX1276_CHANNEL_PLAN
+// overrides the plan as "base_hz,spacing_hz,num_channels". Leaves must be set to the same channel,
+// or assigned to it per node.
+//
+// Several radios can be given, comma separated, e.g. two receivers on channels 0 and 1 and a transmitter:
+//   sx1276_mqttsn_bridge /dev/spidev0.0@18:rx:0,/dev/spidev0.1@19:rx:1,/dev/spidev0.2@20:tx connect 1883
+// Each radio needs its own reset GPIO (default 18). A fourth field sets the spreading factor and optionally
+// bandwidth in kHz (default 9/125); a leaf has to be set to match unless the gateway moves it, see below.
+//
+// In relay mode there is no broker; the third argument is the relay's own link address (hex), which
+// must not clash with any leaf, e.g. on a fence post out of range of the gateway:
+//   sx1276_mqttsn_bridge /dev/spidev0.1 relay 8001
+//
+// In forward mode the gateway hands everything to a network server (sx1276_network_server) instead of a
+// broker, so several gateways can cover the same leaves; the third argument is host:port of the server,
+// and SX1276_GATEWAY_ID (hex, default 1) must be unique to each gateway:
+//   SX1276_GATEWAY_ID=2 sx1276_mqttsn_bridge /dev/spidev0.1 forward 192.168.1.10:1700
+//
+// In gateway mode the bridge is the MQTT-SN gateway itself, so no RSMB is needed: leaves' CONNECT,
+// REGISTER, PUBLISH and SUBSCRIBE go straight to the MQTT broker given as host[:port] (default port 1883),
+// all over one connection with client id SX1276_CLIENT_ID (default sx1276-gateway). SX1276_SESSION_IDLE
+// applies as in connect mode. Messages for a leaf that went to sleep with DISCONNECT are kept until it
+// sends PINGREQ, up to SX1276_SLEEP_BUFFER (default 8) each, for at most the idle time:
+//   sx1276_mqttsn_bridge /dev/spidev0.1 gateway 127.0.0.1:1883
+//
+// Set SX1276_SLOTS to slot_ms:slots (e.g. 4000:15, for a 60s period) to broadcast a beacon every period
+// giving each leaf that asks its own uplink slot, see slot_table.hpp; leaves then wake in their slot rather
+// than colliding. The period must not exceed 65535ms, nor slots 41, so the beacon fits one frame. Not in relay mode.
+//
+// Set SX1276_ADR to margin_db[:uplinks] (e.g. 10:10) for adaptive data rate: from the best SNR of each
+// leaf's last few uplinks, it is moved to the fastest data rate and then the lowest TX power that keep that
+// margin, see adr_engine.hpp. The data rates on offer are those of the half duplex (rxtx) radios, so a
+// second radio at a faster spreading factor lets close-in leaves move to it, e.g.
+//   sx1276_mqttsn_bridge /dev/spidev0.0@18:rxtx:0,/dev/spidev0.1@19:rxtx:1:7 gateway 127.0.0.1
+// The default radio must stay at the leaves' default data rate, which is where they fall back to.
+// Only for leaves the gateway hears directly, not through a relay; not in relay mode.
+//
+// A device of "sim" uses a simulated radio (see sx1276_sim.hpp), so the whole system including leaves
+// built by software/mcu/host can be run on one PC:
+//   sx1276_mqttsn_bridge sim connect 1883
+
+struct RadioSpec
+{
+  string device;
+  int reset_gpio;
+  RadioManager::Role role;
+  unsigned channel;
+  unsigned spreading_factor;
+  unsigned bandwidth_hz;
+};
+
+/// Parse device[@reset_gpio][:role[:channel[:sf[/bw_khz]]]]; spec.channel should hold the default channel
+static bool ParseRadioSpec(const string& text, const ChannelPlan& channel_plan, RadioSpec& spec)
+{
+  std::vector<string> fields;
+  boost::split(fields, text, boost::is_any_of(":"));
+  if (fields.size() > 4 || fields[0].empty()) { return false; }
+  spec.device = fields[0];
+  spec.reset_gpio = 18;
+  size_t at = spec.device.find('@');
+  if (at != string::npos) {
+    spec.reset_gpio = atoi(spec.device.c_str() + at + 1);
+    spec.device.erase(at);
+  }
+  spec.role = RadioManager::RXTX;
+  if (fields.size() > 1) {
+    if (fields[1] == "rx") { spec.role = RadioManager::RX; }
+    else if (fields[1] == "tx") { spec.role = RadioManager::TX; }
+    else if (fields[1] != "rxtx") { return false; }
+  }
+  if (fields.size() > 2) {
+    spec.channel = atoi(fields[2].c_str());
+    if (spec.channel >= channel_plan.num_channels()) { return false; }
+  }
+  spec.spreading_factor = 9;
+  spec.bandwidth_hz = 125000;
+  if (fields.size() > 3) {
+    spec.spreading_factor = atoi(fields[3].c_str());
+    size_t slash = fields[3].find('/');
+    if (slash != string::npos) { spec.bandwidth_hz = (unsigned)lround(atof(fields[3].c_str() + slash + 1) * 1000); }
+    uint8_t code;
+    if (spec.spreading_factor < 7 || spec.spreading_factor > 12 || !SX1276Radio::BandwidthCode(spec.bandwidth_hz, code)) { return false; }
+  }
+  return true;
+}
 
 int main(int argc, char *argv[])
 {
@@ -312,58 +689,220 @@ int main(int argc, char *argv[])
   int port = 1884;
 
   bool udp_server = false;
-
-  if (argc < 4) { fprintf(stderr, "Usage: %s <spidev> <listen|connect> <udp-port>\n(Supports localhost connections only)\n", argv[0]); return 1; }
+  bool relay = false;
+  uint16_t relay_address = 0;
+  bool forward = false;
+  string server_host, server_port;
+  uint16_t gateway_id = 1;
+  bool gateway = false;
+  string broker_host;
+  int broker_port = 1883;
+
+  if (argc < 4) { fprintf(stderr, "Usage: %s <spidev[@rst-gpio][:rxtx|rx|tx[:channel[:sf[/bw-khz]]]]>[,...] <listen|connect|relay|forward|gateway> <udp-port|relay-address|server:port|broker[:port]> [store-dir]\n(Supports localhost connections only)\n", argv[0]); return 1; }
   string udp_type = string(argv[2]);
   if (udp_type == "listen") {
     udp_server = true;
   } else if (udp_type == "connect") {
+  } else if (udp_type == "relay") {
+    relay = true;
+  } else if (udp_type == "forward") {
+    forward = true;
+  } else if (udp_type == "gateway") {
+    gateway = true;
   } else {
     cerr << "Invalid command.\n"; return 1; 
   }
 
-  if ((port = atoi(argv[3]) < 1)) { cerr << "Invalid port.\n"; return 1; }
+  if (relay) {
+    unsigned long address = strtoul(argv[3], NULL, 16);
+    if (address == radiolink::GATEWAY_ADDRESS || address >= radiolink::BROADCAST_ADDRESS) { cerr << "Invalid relay address.\n"; return 1; }
+    relay_address = address;
+  }
+  else if (forward) {
+    string server = argv[3];
+    size_t colon = server.rfind(':');
+    if (colon == string::npos || atoi(server.c_str() + colon + 1) < 1) { cerr << "Invalid server.\n"; return 1; }
+    server_host = server.substr(0, colon);
+    server_port = server.substr(colon + 1);
+    if (getenv("SX1276_GATEWAY_ID")) {
+      gateway_id = strtoul(getenv("SX1276_GATEWAY_ID"), NULL, 16);
+      if (!gateway_id) { cerr << "Invalid SX1276_GATEWAY_ID.\n"; return 1; }
+    }
+  }
+  else if (gateway) {
+    broker_host = argv[3];
+    size_t colon = broker_host.rfind(':');
+    if (colon != string::npos) {
+      broker_port = atoi(broker_host.c_str() + colon + 1);
+      broker_host.erase(colon);
+    }
+    if (broker_host.empty() || broker_port < 1) { cerr << "Invalid broker.\n"; return 1; }
+  }
+  else if ((port = atoi(argv[3]) < 1)) { cerr << "Invalid port.\n"; return 1; }
 
   shared_ptr<libsocket::inet_dgram> udpsocket;
+  shared_ptr<SessionTable> sessions;
+  unsigned idle_s = 3600;
+  if (getenv("SX1276_SESSION_IDLE")) {
+    idle_s = atoi(getenv("SX1276_SESSION_IDLE"));
+    if (idle_s < 1) { cerr << "Invalid SX1276_SESSION_IDLE.\n"; return 1; }
+  }
   if (udp_server) {
     udpsocket.reset(new libsocket::inet_dgram_server(UDP_BIND_IP, argv[3], LIBSOCKET_IPv4));
-  } else {
-    udpsocket.reset(new libsocket::inet_dgram_client("127.0.0.1", argv[3], LIBSOCKET_IPv4));
+  } else if (!relay && !forward && !gateway) {
+    sessions.reset(new SessionTable("127.0.0.1", argv[3], 256, idle_s));
+  }
+
+  float duty_cycle_pct = 100.F;
+  if (getenv("SX1276_DUTY_CYCLE")) {
+    duty_cycle_pct = atof(getenv("SX1276_DUTY_CYCLE"));
+    if (duty_cycle_pct <= 0.F) { cerr << "Invalid SX1276_DUTY_CYCLE.\n"; return 1; }
+    cout << format("Duty cycle limit: %.2f%%\n") % duty_cycle_pct;
+  }
+
+  ChannelPlan channel_plan;
+  if (getenv("SX1276_CHANNEL_PLAN") && !channel_plan.Parse(getenv("SX1276_CHANNEL_PLAN"))) { cerr << "Invalid SX1276_CHANNEL_PLAN.\n"; return 1; }
+  unsigned channel = 0;
+  if (getenv("SX1276_CHANNEL")) {
+    channel = atoi(getenv("SX1276_CHANNEL"));
+    if (channel >= channel_plan.num_channels()) { cerr << "Invalid SX1276_CHANNEL.\n"; return 1; }
+  }
+
+  shared_ptr<AdrEngine> adr;
+  if (getenv("SX1276_ADR")) {
+    int margin_db = 0;
+    unsigned history = 10;
+    if (sscanf(getenv("SX1276_ADR"), "%d:%u", &margin_db, &history) < 1 || margin_db < 0 || history < 1 ||
+        history > AdrEngine::MAX_HISTORY) { cerr << "Invalid SX1276_ADR.\n"; return 1; }
+    adr.reset(new AdrEngine(margin_db, history, idle_s));
+    cout << format("ADR: %ddB margin over %u uplinks\n") % margin_db % history;
   }
 
-  shared_ptr<SX1276Platform> platform = SX1276Platform::GetInstance(argv[1]);
-  if (!platform) { PR_ERROR("Unable to create platform instance\n"); return 1; }
+  AirtimeBudget budget(duty_cycle_pct);
+  RadioPool radios;
+  std::vector<string> specs;
+  boost::split(specs, argv[1], boost::is_any_of(","));
+  for (unsigned i=0; i < specs.size(); i++) {
+    RadioSpec spec;
+    spec.channel = channel;
+    if (!ParseRadioSpec(specs[i], channel_plan, spec)) { cerr << format("Invalid radio: %s\n") % specs[i]; return 1; }
 
-  shared_ptr<SPI> spi = platform->GetSPI();
-  if (!spi) { PR_ERROR("Unable to get SPI instance\n"); return 1; }
+    shared_ptr<SX1276Platform> platform = SX1276Platform::GetInstance(spec.device.c_str(), spec.reset_gpio);
+    if (!platform) { PR_ERROR("Unable to create platform instance\n"); return 1; }
 
-  usleep(100);
+    shared_ptr<SPI> spi = platform->GetSPI();
+    if (!spi) { PR_ERROR("Unable to get SPI instance\n"); return 1; }
 
-  Misc::UserTraceSettings(spi);
+    usleep(100);
 
+    Misc::UserTraceSettings(spi);
 
-  shared_ptr<SX1276Radio> radio(new SX1276Radio(spi));
-  cout << format("SX1276 Version: %.2x\n") % radio->version();
 
-  // radio->SetPreamble(0x50); // probably a red herring now I found the RX bug
+    shared_ptr<SX1276Radio> radio(new SX1276Radio(spi));
+    cout << format("%s: SX1276 Version: %.2x\n") % spec.device % radio->version();
 
-  //radio->SetSymbolTimeout(366);
-  radio->SetSymbolTimeout(732);
+    // radio->SetPreamble(0x50); // probably a red herring now I found the RX bug
 
-  RadioManager radio_manager(radio, platform);
-  radio_manager.Restart();
-  cout << format("Carrier Frequency: %uHz\n") % radio->carrier();
-  if (radio->fault()) { PR_ERROR("Radio Fault\n"); return 1; }
+    //radio->SetSymbolTimeout(366);
+    radio->SetSymbolTimeout(732);
+    radio->SetDataRate(spec.spreading_factor, spec.bandwidth_hz);
 
-  WorkerThread outThread(udpsocket, radio_manager, true);
-  WorkerThread inThread(udpsocket, radio_manager, false);
+    shared_ptr<RadioManager> radio_manager(new RadioManager(spec.device, radio, platform, budget, channel_plan.Frequency(spec.channel), spec.role));
+    radio_manager->Restart();
+    cout << format("%s: Carrier Frequency: %uHz (channel %u of %u) SF%u %ukHz\n") % spec.device % radio->carrier() % spec.channel % channel_plan.num_channels()
+      % spec.spreading_factor % (spec.bandwidth_hz / 1000);
+    if (radio->fault()) { PR_ERROR("Radio Fault\n"); return 1; }
+    radios.Add(radio_manager);
+    if (adr && spec.role == RadioManager::RXTX) { adr->AddDataRate(radio_manager.get(), spec.channel, spec.spreading_factor, spec.bandwidth_hz); }
+  }
+
+  LinkStats link_stats;
+  radios.SetLinkStats(&link_stats);
+
+  DuplicateCache duplicates;
+  if (relay) {
+    NextHopTable next_hops;
+    std::vector<shared_ptr<Relay> > relays;
+    for (unsigned i=0; i < radios.size(); i++) {
+      if (radios.radio(i).can_receive()) { relays.push_back(shared_ptr<Relay>(new Relay(radios, radios.radio(i), relay_address, duplicates, next_hops))); }
+    }
+    if (relays.empty()) { cerr << "No radio can receive.\n"; return 1; }
+    cout << format("Relay address: %.4x\n") % relay_address;
+    boost::thread_group threads;
+    for (unsigned i=0; i < relays.size(); i++) { threads.create_thread(boost::bind(&Relay::Run, relays[i].get())); }
+    threads.join_all();
+    return 0;
+  }
+
+  shared_ptr<MessageStore> store;
+  if (argc > 4) {
+    store.reset(new MessageStore(argv[4]));
+    if (!store->valid()) { PR_ERROR("Unable to open store: %s\n", store->last_error()); return 1; }
+    // Stale protocol exchanges are worse than useless, but keep sensor data for a day
+    store->SetDefaultMaxAge(86400);
+    store->SetTopicMaxAge("ctrl/", 30);
+  }
+  radios.SetAdr(adr.get());
+  Forwarder forwarder(radios, store.get());
+  if (store) {
+    std::vector<MessageStore::Message> backlog;
+    store->Replay(backlog);
+    cout << format("Store: replaying %u messages\n") % backlog.size();
+    for (unsigned i=0; i < backlog.size(); i++) { forwarder.Push(backlog[i]); }
+  }
+
+  shared_ptr<ServerLink> server;
+  if (forward) {
+    shared_ptr<libsocket::inet_dgram_client> socket;
+    try {
+      socket.reset(new libsocket::inet_dgram_client(server_host, server_port, LIBSOCKET_IPv4));
+    } catch (const libsocket::socket_exception& exc) { cerr << exc.mesg; return 1; }
+    server.reset(new ServerLink(socket, gateway_id, forwarder));
+    cout << format("Forwarding to %s:%s as gateway %.4x\n") % server_host % server_port % gateway_id;
+  }
+
+  shared_ptr<MQTTClient> mqtt;
+  shared_ptr<MqttsnGateway> mqttsn_gateway;
+  if (gateway) {
+    const char* client_id = getenv("SX1276_CLIENT_ID") ? getenv("SX1276_CLIENT_ID") : "sx1276-gateway";
+    mqtt = MQTTClient::CreateInstance(client_id, broker_host.c_str(), broker_port);
+    if (!mqtt->valid()) { cerr << "MQTT init: " << mqtt->last_error() << "\n"; return 1; }
+    // Replies and messages for leaves queue for the radio like any other downlink
+    mqttsn_gateway.reset(new MqttsnGateway(*mqtt, boost::bind(&Forwarder::Enqueue, &forwarder, _2, _3, _1), idle_s));
+    if (getenv("SX1276_SLEEP_BUFFER")) { mqttsn_gateway->SetSleepBuffer(atoi(getenv("SX1276_SLEEP_BUFFER")), idle_s); }
+    // If the broker is not there yet the client keeps trying, and buffers what leaves publish meanwhile
+    if (!mqtt->Connect()) { cerr << "MQTT connect: " << mqtt->last_error() << "\n"; }
+    if (!mqtt->Start()) { cerr << "MQTT start: " << mqtt->last_error() << "\n"; return 1; }
+    cout << format("MQTT-SN gateway to %s:%d as %s\n") % broker_host % broker_port % client_id;
+  }
+
+  shared_ptr<SlotTable> slots;
+  shared_ptr<Beaconer> beaconer;
+  if (getenv("SX1276_SLOTS")) {
+    unsigned slot_ms = 0, num_slots = 0;
+    if (sscanf(getenv("SX1276_SLOTS"), "%u:%u", &slot_ms, &num_slots) != 2 || slot_ms < 100 || num_slots < 2 ||
+        num_slots > SlotTable::MAX_SLOTS || slot_ms * num_slots > SlotTable::MAX_PERIOD_MS) { cerr << "Invalid SX1276_SLOTS.\n"; return 1; }
+    slots.reset(new SlotTable(slot_ms, num_slots, idle_s));
+    beaconer.reset(new Beaconer(radios, *slots));
+    cout << format("Beacon every %ums, %u uplink slots of %ums\n") % slots->period_ms() % (num_slots - 1) % slot_ms;
+  }
+
+  WorkerThread outThread(udpsocket, radios, forwarder, NULL, sessions.get(), duplicates, server.get(), mqttsn_gateway.get(), slots.get(), adr.get());
+  // One receive thread per radio that can receive
+  std::vector<shared_ptr<WorkerThread> > inThreads;
+  for (unsigned i=0; i < radios.size(); i++) {
+    if (radios.radio(i).can_receive()) { inThreads.push_back(shared_ptr<WorkerThread>(new WorkerThread(udpsocket, radios, forwarder, &radios.radio(i), sessions.get(), duplicates, server.get(), mqttsn_gateway.get(), slots.get(), adr.get()))); }
+  }
+  if (inThreads.empty()) { cerr << "No radio can receive.\n"; return 1; }
 
-  radio_manager.TransmitHello();
+  radios.TransmitHello();
 
-  thread outInstance(boost::bind(&WorkerThread::Run, &outThread));
-  thread inInstance(boost::bind(&WorkerThread::Run, &inThread));
-  outInstance.join();
-  inInstance.join();
+  boost::thread_group threads;
+  threads.create_thread(boost::bind(&WorkerThread::Run, &outThread));
+  for (unsigned i=0; i < inThreads.size(); i++) { threads.create_thread(boost::bind(&WorkerThread::Run, inThreads[i].get())); }
+  threads.create_thread(boost::bind(&Forwarder::Run, &forwarder));
+  if (beaconer) { threads.create_thread(boost::bind(&Beaconer::Run, beaconer.get())); }
+  threads.join_all();
   cout << "DONE\n";
 }
 
@@ -0,0 +1,278 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "gateway_link.hpp"
+#include "uplink_table.hpp"
+#include "session_table.hpp"
+#include "mpmc_ring.hpp"
+#include "util.hpp"
+#include "libsocket/inetserverdgram.hpp"
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/crc.hpp>
+#include <boost/chrono/system_clocks.hpp>
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <map>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+using std::string;
+using std::cout;
+using std::cerr;
+using boost::format;
+using boost::shared_ptr;
+using boost::mutex;
+using boost::unique_lock;
+using boost::chrono::steady_clock;
+
+// Network server: sits between any number of gateways (sx1276_mqttsn_bridge ... forward host:port)
+// and the MQTT-SN broker, so a leaf heard by several gateways reaches the broker once:
+//   sx1276_network_server 1700 1883
+//
+// Each leaf gets its own session with the broker (see SessionTable), downlinks go out through
+// whichever gateway heard that leaf best (see UplinkTable), and gateway load is printed every minute.
+// SX1276_SESSION_IDLE is as for the bridge. SX1276_WORKERS sets the number of worker threads.
+//
+// Every session holds a UDP socket, so the number of sessions is bounded by RLIMIT_NOFILE: at startup the
+// soft limit is raised to the hard limit, and the table sized to fit within it (at most 4096 sessions).
+// Beyond that the session idle longest is closed to make way; raise the hard limit (ulimit -Hn,
+// or LimitNOFILE= under systemd) to serve more leaves at once.
+//
+// Leaves too old to send their link address all appear as node 0, and share one broker session.
+
+/// A datagram from a gateway, as queued between the receive thread and the workers.
+/// Fixed size so queueing it never allocates.
+struct Datagram
+{
+  struct sockaddr_in from;
+  unsigned len;
+  uint8_t data[gatewaylink::HEADER_LENGTH + 256];
+};
+
+/// Gateways we have heard from, where to reach them, and how busy they are
+class GatewayTable
+{
+public:
+  void Heard(uint16_t id, const struct sockaddr_in& from, uint8_t type, bool duplicate) {
+    unique_lock<mutex> lock(mutex_);
+    Gateway& gateway = gateways_[id];
+    if (gateway.last_seen == 0) {
+      cout << format("New gateway %.4x at %s:%u\n") % id % inet_ntoa(from.sin_addr) % ntohs(from.sin_port);
+    }
+    gateway.address = from;
+    gateway.last_seen = time(NULL);
+    if (type == gatewaylink::UPLINK) {
+      gateway.uplinks ++;
+      if (duplicate) { gateway.duplicates ++; }
+    }
+  }
+  bool Address(uint16_t id, struct sockaddr_in& address) {
+    unique_lock<mutex> lock(mutex_);
+    std::map<uint16_t, Gateway>::iterator i = gateways_.find(id);
+    if (i == gateways_.end()) { return false; }
+    address = i->second.address;
+    i->second.downlinks ++;
+    return true;
+  }
+  void PrintStats() {
+    unique_lock<mutex> lock(mutex_);
+    time_t now = time(NULL);
+    for (std::map<uint16_t, Gateway>::iterator i = gateways_.begin(); i != gateways_.end(); ++i) {
+      const Gateway& gateway = i->second;
+      cout << format("Gateway %.4x: uplinks=%u duplicates=%u downlinks=%u seen=%lds ago\n")
+        % i->first % gateway.uplinks % gateway.duplicates % gateway.downlinks % (long)(now - gateway.last_seen);
+    }
+  }
+private:
+  struct Gateway {
+    struct sockaddr_in address;
+    time_t last_seen;
+    unsigned uplinks;
+    unsigned duplicates;         ///< Uplinks another gateway got to us first
+    unsigned downlinks;
+  };
+  mutex mutex_;                  ///< Protect gateways_
+  std::map<uint16_t, Gateway> gateways_;
+};
+
+class NetworkServer
+{
+public:
+  NetworkServer(int fd, SessionTable& sessions)
+  : fd_(fd), sessions_(sessions), queue_(4096), num_overflow_(0), num_uplinks_(0), num_downlinks_(0), num_no_route_(0)
+  {}
+
+  /// Receive from gateways as fast as we can, and leave the work to the workers
+  void ReceiveLoop() {
+    Datagram datagram;
+    for (;;) {
+      socklen_t from_len = sizeof(datagram.from);
+      ssize_t n = recvfrom(fd_, datagram.data, sizeof(datagram.data), 0, (struct sockaddr*)&datagram.from, &from_len);
+      if (n <= 0) { continue; }
+      datagram.len = n;
+      if (!queue_.Push(datagram)) { num_overflow_ ++; }
+    }
+  }
+
+  void WorkerLoop() {
+    Datagram datagram;
+    unsigned idle_us = 0;
+    for (;;) {
+      if (!queue_.Pop(datagram)) {
+        // Back off gently when there is nothing to do, rather than spinning
+        idle_us = idle_us ? std::min(idle_us * 2, 1000U) : 10;
+        usleep(idle_us);
+        continue;
+      }
+      idle_us = 0;
+      Handle(datagram);
+    }
+  }
+
+  /// Broker to leaves, plus housekeeping
+  void DownlinkLoop() {
+    steady_clock::time_point expired = steady_clock::now();
+    steady_clock::time_point stats = steady_clock::now();
+    for (;;) {
+      sessions_.Poll(1000, boost::bind(&NetworkServer::Downlink, this, _1, _2, _3));
+      if (steady_clock::now() - expired > boost::chrono::seconds(5)) {
+        uplinks_.Expire();
+        expired = steady_clock::now();
+      }
+      if (steady_clock::now() - stats > boost::chrono::seconds(60)) {
+        sessions_.Expire();
+        PrintStats();
+        stats = steady_clock::now();
+      }
+    }
+  }
+
+private:
+  void Handle(const Datagram& datagram) {
+    gatewaylink::Header header;
+    if (!gatewaylink::ReadHeader(datagram.data, datagram.len, header)) { return; }
+    const uint8_t* payload = datagram.data + gatewaylink::HEADER_LENGTH;
+    unsigned len = datagram.len - gatewaylink::HEADER_LENGTH;
+    bool duplicate = false;
+    if (header.type == gatewaylink::UPLINK && len > 0) {
+      boost::crc_32_type crc;
+      crc.process_bytes(payload, len);
+      UplinkTable::Copy copy = { header.node, header.counter, crc.checksum(), header.gateway, header.snr_db };
+      duplicate = !uplinks_.Receive(copy);
+      if (!duplicate) {
+        num_uplinks_ ++;
+        sessions_.Send(header.node, payload, len);
+      }
+    }
+    gateways_.Heard(header.gateway, datagram.from, header.type, duplicate);
+  }
+
+  void Downlink(uint16_t node, const uint8_t* payload, unsigned len) {
+    uint16_t gateway = 0;
+    struct sockaddr_in address;
+    if (!uplinks_.BestGateway(node, gateway) || !gateways_.Address(gateway, address)) {
+      cerr << format("No gateway for node %.4x, dropped %d:%s\n") % node % len % util::buf2str(payload, len);
+      num_no_route_ ++;
+      return;
+    }
+    uint8_t message[gatewaylink::HEADER_LENGTH + 256];
+    if (len > sizeof(message) - gatewaylink::HEADER_LENGTH) { return; }
+    gatewaylink::Header header = { gatewaylink::DOWNLINK, gateway, node, 0, 0, 0 };
+    gatewaylink::WriteHeader(header, message);
+    memcpy(message + gatewaylink::HEADER_LENGTH, payload, len);
+    if (sendto(fd_, message, gatewaylink::HEADER_LENGTH + len, 0, (struct sockaddr*)&address, sizeof(address)) < 0) {
+      perror("sendto");
+      return;
+    }
+    num_downlinks_ ++;
+  }
+
+  void PrintStats() {
+    cout << format("Server: uplinks=%u duplicates=%u downlinks=%u no-route=%u overflow=%u\n")
+      % num_uplinks_.load() % uplinks_.num_duplicates() % num_downlinks_.load() % num_no_route_.load() % num_overflow_.load();
+    gateways_.PrintStats();
+    sessions_.PrintStats();
+  }
+
+  int fd_;                        ///< Socket gateways talk to
+  SessionTable& sessions_;
+  MpmcRing<Datagram> queue_;      ///< Receive thread --> workers
+  UplinkTable uplinks_;
+  GatewayTable gateways_;
+  std::atomic<unsigned> num_overflow_;   ///< Datagrams lost because the workers fell behind
+  std::atomic<unsigned> num_uplinks_;
+  std::atomic<unsigned> num_downlinks_;
+  std::atomic<unsigned> num_no_route_;
+};
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) { fprintf(stderr, "Usage: %s <gateway-udp-port> <broker-udp-port>\n(Broker on localhost only)\n", argv[0]); return 1; }
+  if (atoi(argv[1]) < 1) { cerr << "Invalid gateway port.\n"; return 1; }
+  if (atoi(argv[2]) < 1) { cerr << "Invalid broker port.\n"; return 1; }
+
+  unsigned idle_s = 3600;
+  if (getenv("SX1276_SESSION_IDLE")) {
+    idle_s = atoi(getenv("SX1276_SESSION_IDLE"));
+    if (idle_s < 1) { cerr << "Invalid SX1276_SESSION_IDLE.\n"; return 1; }
+  }
+  unsigned workers = boost::thread::hardware_concurrency();
+  if (getenv("SX1276_WORKERS")) { workers = atoi(getenv("SX1276_WORKERS")); }
+  if (workers < 1) { workers = 1; }
+
+  shared_ptr<libsocket::inet_dgram_server> socket;
+  try {
+    socket.reset(new libsocket::inet_dgram_server("0.0.0.0", argv[1], LIBSOCKET_IPv4));
+  } catch (const libsocket::socket_exception& exc) { cerr << exc.mesg; return 1; }
+
+  // Enough sessions for a farm's worth of leaves, if we may have a socket for each
+  unsigned max_sessions = 4096;
+  struct rlimit nofile;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+    if (nofile.rlim_cur < nofile.rlim_max) {
+      nofile.rlim_cur = nofile.rlim_max;
+      if (setrlimit(RLIMIT_NOFILE, &nofile) != 0) { getrlimit(RLIMIT_NOFILE, &nofile); }
+    }
+    // Leave some for stdio, the gateway socket and whatever the libraries open
+    const rlim_t reserved = 32;
+    if (nofile.rlim_cur != RLIM_INFINITY && nofile.rlim_cur < max_sessions + reserved) {
+      if (nofile.rlim_cur <= reserved) { cerr << "Too few file descriptors (RLIMIT_NOFILE).\n"; return 1; }
+      max_sessions = nofile.rlim_cur - reserved;
+      cerr << format("RLIMIT_NOFILE %u: limited to %u sessions\n") % (unsigned)nofile.rlim_cur % max_sessions;
+    }
+  }
+  SessionTable sessions("127.0.0.1", argv[2], max_sessions, idle_s);
+  NetworkServer server(socket->getfd(), sessions);
+
+  cout << format("Listening for gateways on port %s, %u workers\n") % argv[1] % workers;
+  boost::thread_group threads;
+  threads.create_thread(boost::bind(&NetworkServer::ReceiveLoop, &server));
+  for (unsigned i=0; i < workers; i++) { threads.create_thread(boost::bind(&NetworkServer::WorkerLoop, &server)); }
+  threads.create_thread(boost::bind(&NetworkServer::DownlinkLoop, &server));
+  threads.join_all();
+  cout << "DONE\n";
+}
@@ -20,6 +20,7 @@
 #include "buspirate_spi.hpp"
 #include "buspirate_binary.h"
 #include "spidev_spi.hpp"
+#include "sim_spi.hpp"
 #include "spi.hpp"
 #include <string.h>
 
@@ -56,8 +57,8 @@ private:
 class Carambola2Platform : public SX1276Platform
 {
 public:
-  Carambola2Platform(const char *device)
-  : device_(device), rst_gpio_(18), rst_gp_(NULL)
+  Carambola2Platform(const char *device, int reset_gpio)
+  : device_(device), rst_gpio_(reset_gpio), rst_gp_(NULL)
   {
     printf("Platform:Linux spidev\n");
     spi_.reset(new SpidevSPI);
@@ -95,14 +96,37 @@ private:
   shared_ptr<SpidevSPI> spi_;
 };
 
-shared_ptr<SX1276Platform> SX1276Platform::GetInstance(const char *device)
+/// No hardware: the radio is simulated, see SX1276Sim
+class SimPlatform : public SX1276Platform
+{
+public:
+  SimPlatform()
+  {
+    printf("Platform:Simulated\n");
+    spi_.reset(new SimSPI);
+  }
+  virtual ~SimPlatform() {}
+
+  virtual bool PowerSX1276(bool powered) { return true; }
+  virtual bool PowerCycleSX1276(bool powered) { spi_->Reset(); return true; }
+  virtual bool ResetSX1276() { spi_->Reset(); return true; }
+
+  virtual boost::shared_ptr<SPI> GetSPI() const { return spi_; }
+
+private:
+  shared_ptr<SimSPI> spi_;
+};
+
+shared_ptr<SX1276Platform> SX1276Platform::GetInstance(const char *device, int reset_gpio)
 {
   shared_ptr<SX1276Platform> platform;
   // For the time being, use a simple heuristic:
-  // if not /dev/spidev then tty for buspirate
+  // if not /dev/spidev then tty for buspirate; "sim" for a simulated radio
   const char *PFX_SPIDEV = "/dev/spidev";
-  if (strncmp(device, PFX_SPIDEV, strlen(PFX_SPIDEV))==0) {
-    platform.reset(new Carambola2Platform(device));
+  if (strcmp(device, "sim")==0) {
+    platform.reset(new SimPlatform);
+  } else if (strncmp(device, PFX_SPIDEV, strlen(PFX_SPIDEV))==0) {
+    platform.reset(new Carambola2Platform(device, reset_gpio));
   } else {
     platform.reset(new BusPiratePlatform(device));
   }
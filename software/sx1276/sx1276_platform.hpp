@@ -34,7 +34,8 @@ public:
   SX1276Platform();
   virtual ~SX1276Platform();
 
-  static boost::shared_ptr<SX1276Platform> GetInstance(const char *device);
+  /// @param reset_gpio GPIO wired to the SX1276 reset line, when using spidev
+  static boost::shared_ptr<SX1276Platform> GetInstance(const char *device, int reset_gpio=18);
 
   virtual bool PowerSX1276(bool powered) = 0;
   virtual bool PowerCycleSX1276(bool powered) = 0;
@@ -0,0 +1,449 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "sx1276_sim.hpp"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Registers the model cares about; naming follows SX1276 Datasheet chapter 6
+#define REG_Fifo              0x00
+#define REG_OpMode            0x01
+#define REG_FrfMsb            0x06
+#define REG_FrfMid            0x07
+#define REG_FrfLsb            0x08
+#define REG_FifoAddrPtr       0x0D
+#define REG_FifoTxBaseAddr    0x0E
+#define REG_FifoRxBaseAddr    0x0F
+#define REG_FifoRxCurrentAddr 0x10
+#define REG_IrqFlagsMask      0x11
+#define REG_IrqFlags          0x12
+#define REG_FifoRxNbBytes     0x13
+#define REG_RxHeaderCntValueMsb  0x14
+#define REG_RxHeaderCntValueLsb  0x15
+#define REG_RxPacketCntValueMsb  0x16
+#define REG_RxPacketCntValueLsb  0x17
+#define REG_ModemStat         0x18
+#define REG_PacketSnr         0x19
+#define REG_PacketRssi        0x1A
+#define REG_Rssi              0x1B
+#define REG_ModemConfig1      0x1D
+#define REG_ModemConfig2      0x1E
+#define REG_SymbTimeoutLsb    0x1F
+#define REG_PreambleMsb       0x20
+#define REG_PreambleLsb       0x21
+#define REG_PayloadLength     0x22
+#define REG_FifoRxByteAddrPtr 0x25
+#define REG_ModemConfig3      0x26
+#define REG_Version           0x42
+
+#define MODE_LORA   0x80
+#define MODE_MASK   0x07
+#define MODE_SLEEP  0x00
+#define MODE_STDBY  0x01
+#define MODE_TX     0x03
+#define MODE_RXCONT 0x05
+#define MODE_RXSINGLE 0x06
+
+#define IRQ_RxTimeout         (1<<7)
+#define IRQ_RxDone            (1<<6)
+#define IRQ_PayloadCrcError   (1<<5)
+#define IRQ_ValidHeader       (1<<4)
+#define IRQ_TxDone            (1<<3)
+
+#define NOISE_FLOOR_DBM -120
+// Preamble symbols the modem needs to detect a packet
+#define PREAMBLE_LOCK_SYMBOLS 4
+#define PACKET_SNR_DB 8
+
+static const uint32_t BANDWIDTH_HZ[] = { 7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000 };
+
+/// What goes over the simulated air. All simulators run on the one host, so native layout is fine.
+struct AirFrame {
+  char magic[4];
+  uint32_t frf;               ///< Raw carrier register value
+  uint8_t sf;
+  uint8_t bw;
+  uint8_t crc_error;
+  uint8_t len;
+  uint64_t start_us;          ///< CLOCK_MONOTONIC, which all processes share
+  uint32_t time_on_air_us;
+  uint16_t sender_port;
+  uint8_t payload[255];
+};
+
+static const char AIR_MAGIC[4] = { 'S', 'X', '7', '6' };
+
+static unsigned EnvUnsigned(const char *name, unsigned fallback)
+{
+  const char *s = getenv(name);
+  return s && *s ? (unsigned)strtoul(s, NULL, 0) : fallback;
+}
+
+SX1276Sim::SX1276Sim()
+  : fd_(-1),
+    base_port_(47100),
+    num_ports_(256),
+    port_(0),
+    loss_pct_(EnvUnsigned("SX1276_SIM_LOSS", 0)),
+    crc_pct_(EnvUnsigned("SX1276_SIM_CRC", 0)),
+    rssi_dbm_(-80),
+    transfer_reg_(0),
+    transfer_write_(false)
+{
+  const char *air = getenv("SX1276_SIM_AIR");
+  if (air && *air) {
+    unsigned base = 0, n = 0;
+    if (sscanf(air, "%u,%u", &base, &n) == 2 && base > 0 && base + n <= 65536 && n > 0) {
+      base_port_ = base;
+      num_ports_ = n;
+    } else {
+      fprintf(stderr, "SX1276_SIM_AIR: expected base_port,num_ports\n");
+    }
+  }
+  const char *rssi = getenv("SX1276_SIM_RSSI");
+  if (rssi && *rssi) { rssi_dbm_ = atoi(rssi); }
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) { perror("SX1276Sim socket"); return; }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  for (unsigned p = base_port_; p < base_port_ + num_ports_; p++) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(p);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+      port_ = p;
+      break;
+    }
+  }
+  if (!port_) {
+    fprintf(stderr, "SX1276Sim: no free port in %u..%u\n", base_port_, base_port_ + num_ports_ - 1);
+    close(fd);
+    return;
+  }
+  fd_ = fd;
+  srand(port_ ^ (unsigned)NowUs());
+  Reset();
+}
+
+SX1276Sim::~SX1276Sim()
+{
+  if (fd_ >= 0) { close(fd_); }
+}
+
+uint64_t SX1276Sim::NowUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void SX1276Sim::Reset()
+{
+  memset(regs_, 0, sizeof(regs_));
+  memset(fifo_, 0, sizeof(fifo_));
+  // Power on values, from the datasheet, for the registers the drivers look at
+  regs_[REG_OpMode] = 0x09;
+  regs_[REG_FrfMsb] = 0x6c;
+  regs_[REG_FrfMid] = 0x80;
+  regs_[0x09] = 0x4f;   // PaConfig
+  regs_[0x0A] = 0x09;   // PaRamp
+  regs_[0x0B] = 0x2b;   // Ocp
+  regs_[0x0C] = 0x20;   // Lna
+  regs_[REG_FifoTxBaseAddr] = 0x80;
+  regs_[REG_ModemConfig1] = 0x72;
+  regs_[REG_ModemConfig2] = 0x70;
+  regs_[REG_SymbTimeoutLsb] = 0x64;
+  regs_[REG_PreambleLsb] = 0x08;
+  regs_[REG_PayloadLength] = 0x01;
+  regs_[0x23] = 0xff;   // MaxPayloadLength
+  regs_[REG_ModemConfig3] = 0x04;
+  regs_[REG_Version] = 0x12;
+  regs_[0x4D] = 0x84;   // PaDac
+  mode_until_us_ = 0;
+  rx_since_us_ = 0;
+  rx_write_ = 0;
+  pending_.active = false;
+  header_count_ = 0;
+  packet_count_ = 0;
+}
+
+uint32_t SX1276Sim::Frf() const
+{
+  return (uint32_t)regs_[REG_FrfMsb] << 16 | (uint32_t)regs_[REG_FrfMid] << 8 | regs_[REG_FrfLsb];
+}
+
+uint32_t SX1276Sim::SymbolUs() const
+{
+  uint8_t bw = BandwidthCode();
+  uint32_t bw_hz = bw < sizeof(BANDWIDTH_HZ)/sizeof(BANDWIDTH_HZ[0]) ? BANDWIDTH_HZ[bw] : 125000;
+  return (uint32_t)(((uint64_t)1000000 << SpreadingFactor()) / bw_hz);
+}
+
+/// Time on air per the formula in datasheet section 4.1.1.7
+uint32_t SX1276Sim::TimeOnAirUs(unsigned len) const
+{
+  int sf = SpreadingFactor();
+  int cr = (regs_[REG_ModemConfig1] >> 1) & 0x7;
+  int implicit = regs_[REG_ModemConfig1] & 1;
+  int crc = (regs_[REG_ModemConfig2] >> 2) & 1;
+  int de = (regs_[REG_ModemConfig3] >> 3) & 1;
+  unsigned preamble = (unsigned)regs_[REG_PreambleMsb] << 8 | regs_[REG_PreambleLsb];
+  int denominator = 4 * (sf - 2 * de);
+  if (denominator <= 0) { denominator = 4; }
+  double n = ceil((8.0 * len - 4 * sf + 28 + 16 * crc - 20 * implicit) / denominator) * (cr + 4);
+  double symbols = preamble + 4.25 + 8 + (n > 0 ? n : 0);
+  return (uint32_t)(symbols * SymbolUs());
+}
+
+void SX1276Sim::Raise(uint8_t flags)
+{
+  regs_[REG_IrqFlags] |= flags & ~regs_[REG_IrqFlagsMask];
+}
+
+void SX1276Sim::SetMode(uint8_t value)
+{
+  uint8_t old = regs_[REG_OpMode];
+  // The LoRa bit can only be changed in sleep mode
+  if ((old & MODE_MASK) != MODE_SLEEP) { value = (value & ~MODE_LORA) | (old & MODE_LORA); }
+  regs_[REG_OpMode] = value;
+  if (!(value & MODE_LORA)) { return; }
+
+  uint64_t now = NowUs();
+  uint8_t mode = value & MODE_MASK;
+  if (mode == (old & MODE_MASK) && (value & MODE_LORA) == (old & MODE_LORA)) { return; }
+  pending_.active = false;
+  switch (mode) {
+  case MODE_TX:
+    Transmit(now);
+    break;
+  case MODE_RXSINGLE:
+    mode_until_us_ = now + (uint64_t)SymbolUs() * ((regs_[REG_ModemConfig2] & 0x3) << 8 | regs_[REG_SymbTimeoutLsb]);
+    // fall through
+  case MODE_RXCONT:
+    rx_since_us_ = now;
+    rx_write_ = regs_[REG_FifoRxBaseAddr];
+    break;
+  default:
+    break;
+  }
+}
+
+void SX1276Sim::Transmit(uint64_t now)
+{
+  AirFrame frame;
+  memcpy(frame.magic, AIR_MAGIC, sizeof(frame.magic));
+  frame.frf = Frf();
+  frame.sf = SpreadingFactor();
+  frame.bw = BandwidthCode();
+  frame.crc_error = 0;
+  frame.len = regs_[REG_PayloadLength];
+  frame.start_us = now;
+  frame.time_on_air_us = TimeOnAirUs(frame.len);
+  frame.sender_port = port_;
+  for (unsigned i=0; i < frame.len; i++) {
+    frame.payload[i] = fifo_[(uint8_t)(regs_[REG_FifoTxBaseAddr] + i)];
+  }
+  mode_until_us_ = now + frame.time_on_air_us;
+
+  size_t size = offsetof(AirFrame, payload) + frame.len;
+  for (unsigned p = base_port_; p < base_port_ + num_ports_; p++) {
+    if (p == port_) { continue; }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(p);
+    // Nobody listening on most ports; that is expected
+    sendto(fd_, &frame, size, 0, (struct sockaddr*)&addr, sizeof(addr));
+  }
+}
+
+void SX1276Sim::ReceiveFromAir()
+{
+  AirFrame frame;
+  ssize_t n;
+  while ((n = recv(fd_, &frame, sizeof(frame), 0)) > 0) {
+    if ((size_t)n < offsetof(AirFrame, payload) || memcmp(frame.magic, AIR_MAGIC, sizeof(frame.magic)) != 0) { continue; }
+    if ((size_t)n != offsetof(AirFrame, payload) + frame.len || frame.sender_port == port_) { continue; }
+
+    if (frame.frf != Frf() || frame.sf != SpreadingFactor() || frame.bw != BandwidthCode()) { continue; }
+
+    // Something already on air that ends before this starts is complete; hand it over first
+    if (pending_.active && pending_.done_us <= frame.start_us) { Deliver(); }
+
+    uint8_t mode = regs_[REG_OpMode] & MODE_MASK;
+    bool listening = (regs_[REG_OpMode] & MODE_LORA) && (mode == MODE_RXSINGLE || mode == MODE_RXCONT);
+    // We can still lock on to a preamble already under way, if enough of it is left
+    unsigned preamble = (unsigned)regs_[REG_PreambleMsb] << 8 | regs_[REG_PreambleLsb];
+    uint64_t lock_us = preamble > PREAMBLE_LOCK_SYMBOLS ? (uint64_t)(preamble - PREAMBLE_LOCK_SYMBOLS) * SymbolUs() : 0;
+    if (!listening || frame.start_us + lock_us < rx_since_us_) { continue; }
+    // Preamble must start before the symbol timeout, unless we are already locked on to something
+    if (mode == MODE_RXSINGLE && !pending_.active && frame.start_us > mode_until_us_) { continue; }
+
+    if (pending_.active) {
+      // Overlap on the same channel: both are lost
+      pending_.collided = true;
+      if (frame.start_us + frame.time_on_air_us > pending_.done_us) { pending_.done_us = frame.start_us + frame.time_on_air_us; }
+      continue;
+    }
+    if (loss_pct_ && (unsigned)(rand() % 100) < loss_pct_) { continue; }
+
+    pending_.active = true;
+    pending_.collided = false;
+    pending_.crc_error = frame.crc_error || (crc_pct_ && (unsigned)(rand() % 100) < crc_pct_);
+    pending_.done_us = frame.start_us + frame.time_on_air_us;
+    pending_.len = frame.len;
+    memcpy(pending_.payload, frame.payload, frame.len);
+    header_count_ ++;
+    Raise(IRQ_ValidHeader);
+  }
+}
+
+void SX1276Sim::Deliver()
+{
+  pending_.active = false;
+  if (pending_.collided) { return; }
+
+  if (pending_.crc_error && pending_.len) {
+    pending_.payload[rand() % pending_.len] ^= 1 << (rand() % 8);
+  } else {
+    packet_count_ ++;
+  }
+  uint8_t start = rx_write_;
+  for (unsigned i=0; i < pending_.len; i++) { fifo_[rx_write_++] = pending_.payload[i]; }
+  regs_[REG_FifoRxCurrentAddr] = start;
+  regs_[REG_FifoRxByteAddrPtr] = rx_write_;
+  regs_[REG_FifoRxNbBytes] = pending_.len;
+  regs_[REG_PacketRssi] = (uint8_t)(rssi_dbm_ + 137);
+  regs_[REG_PacketSnr] = (uint8_t)(PACKET_SNR_DB * 4);
+  Raise(IRQ_RxDone | (pending_.crc_error ? IRQ_PayloadCrcError : 0));
+  if ((regs_[REG_OpMode] & MODE_MASK) == MODE_RXSINGLE) {
+    regs_[REG_OpMode] = (regs_[REG_OpMode] & ~MODE_MASK) | MODE_STDBY;
+  }
+}
+
+void SX1276Sim::Poll()
+{
+  if (!(regs_[REG_OpMode] & MODE_LORA)) { return; }
+  ReceiveFromAir();
+
+  uint64_t now = NowUs();
+  uint8_t mode = regs_[REG_OpMode] & MODE_MASK;
+  if (pending_.active && now >= pending_.done_us) {
+    Deliver();
+  }
+  if (mode == MODE_TX && now >= mode_until_us_) {
+    Raise(IRQ_TxDone);
+    regs_[REG_OpMode] = (regs_[REG_OpMode] & ~MODE_MASK) | MODE_STDBY;
+  } else if (mode == MODE_RXSINGLE && !pending_.active && now >= mode_until_us_ && (regs_[REG_OpMode] & MODE_MASK) == MODE_RXSINGLE) {
+    Raise(IRQ_RxTimeout);
+    regs_[REG_OpMode] = (regs_[REG_OpMode] & ~MODE_MASK) | MODE_STDBY;
+  }
+}
+
+uint8_t SX1276Sim::Read(uint8_t reg)
+{
+  reg &= 0x7f;
+  switch (reg) {
+  case REG_Fifo:
+    return fifo_[regs_[REG_FifoAddrPtr]++];
+  case REG_IrqFlags:
+  case REG_ModemStat:
+  case REG_Rssi:
+    Poll();
+    break;
+  default:
+    break;
+  }
+  switch (reg) {
+  case REG_RxHeaderCntValueMsb: return header_count_ >> 8;
+  case REG_RxHeaderCntValueLsb: return header_count_ & 0xff;
+  case REG_RxPacketCntValueMsb: return packet_count_ >> 8;
+  case REG_RxPacketCntValueLsb: return packet_count_ & 0xff;
+  case REG_ModemStat:
+    // Coding rate of the last header, and signal detected / synchronised / header valid while receiving
+    return (regs_[REG_ModemConfig1] & 0x0e) << 4 | (pending_.active ? 0x0b : 0x10);
+  case REG_Rssi:
+    return (uint8_t)((pending_.active ? rssi_dbm_ : NOISE_FLOOR_DBM) + 137);
+  default:
+    return regs_[reg];
+  }
+}
+
+void SX1276Sim::Write(uint8_t reg, uint8_t value)
+{
+  reg &= 0x7f;
+  switch (reg) {
+  case REG_Fifo:
+    fifo_[regs_[REG_FifoAddrPtr]++] = value;
+    break;
+  case REG_OpMode:
+    SetMode(value);
+    break;
+  case REG_IrqFlags:
+    regs_[REG_IrqFlags] &= ~value;
+    break;
+  case REG_FifoRxCurrentAddr:
+  case REG_FifoRxNbBytes:
+  case REG_RxHeaderCntValueMsb:
+  case REG_RxHeaderCntValueLsb:
+  case REG_RxPacketCntValueMsb:
+  case REG_RxPacketCntValueLsb:
+  case REG_ModemStat:
+  case REG_PacketSnr:
+  case REG_PacketRssi:
+  case REG_Rssi:
+  case REG_FifoRxByteAddrPtr:
+  case REG_Version:
+    // Read only
+    break;
+  default:
+    regs_[reg] = value;
+    break;
+  }
+}
+
+uint8_t SX1276Sim::Transfer(bool first, uint8_t value)
+{
+  if (first) {
+    transfer_reg_ = value & 0x7f;
+    transfer_write_ = value & 0x80;
+    return 0;
+  }
+  uint8_t result = 0;
+  if (transfer_write_) {
+    Write(transfer_reg_, value);
+  } else {
+    result = Read(transfer_reg_);
+  }
+  // Burst access auto increments the address, except for the FIFO
+  if (transfer_reg_ != REG_Fifo) { transfer_reg_ = (transfer_reg_ + 1) & 0x7f; }
+  return result;
+}
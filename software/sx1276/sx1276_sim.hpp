@@ -0,0 +1,107 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SX1276_SIM_HPP__
+#define SX1276_SIM_HPP__
+
+#include <stdint.h>
+
+/// Register level model of an SX1276 in LoRa mode, so the gateway and the leaf firmware
+/// can run as ordinary processes on one PC without any radio hardware.
+///
+/// The "air" is a range of UDP ports on localhost: each simulated radio binds the first free
+/// port and a transmission is sent to every port in the range. A receiver only hears frames
+/// on the same carrier, spreading factor and bandwidth, after the predicted time on air.
+/// Frames that overlap on the same channel collide and are lost.
+///
+/// Deliberately plain C++ with no dependencies, because it is shared with the host build of
+/// the MCU firmware (software/mcu/host).
+///
+/// Environment:
+///  - SX1276_SIM_AIR  "base_port,num_ports" (default 47100,256), which bounds the number of radios
+///  - SX1276_SIM_LOSS percentage of received frames silently lost
+///  - SX1276_SIM_CRC  percentage of received frames flagged with a CRC error
+///  - SX1276_SIM_RSSI packet RSSI reported to receivers, dBm (default -80)
+class SX1276Sim
+{
+public:
+  SX1276Sim();
+  ~SX1276Sim();
+
+  bool IsOpen() const { return fd_ >= 0; }
+
+  /// Power on defaults, as after pulsing the reset line
+  void Reset();
+
+  uint8_t Read(uint8_t reg);
+  void Write(uint8_t reg, uint8_t value);
+
+  /// Convenience for SPI shims that see raw transfers: byte 0 is the address, bit 7 set for write
+  uint8_t Transfer(bool first, uint8_t value);
+
+private:
+  SX1276Sim(const SX1276Sim&);
+  SX1276Sim& operator=(const SX1276Sim&);
+
+  enum { MAX_FRAME = 255 };
+
+  struct Pending {
+    bool active;
+    bool collided;
+    bool crc_error;
+    uint64_t done_us;           ///< When the last symbol arrives
+    uint8_t len;
+    uint8_t payload[MAX_FRAME];
+  };
+
+  void SetMode(uint8_t value);
+  void Raise(uint8_t flags);
+  void Poll();
+  void ReceiveFromAir();
+  void Deliver();
+  void Transmit(uint64_t now);
+
+  uint32_t Frf() const;
+  unsigned SpreadingFactor() const { return regs_[0x1e] >> 4; }
+  uint8_t BandwidthCode() const { return regs_[0x1d] >> 4; }
+  uint32_t SymbolUs() const;
+  uint32_t TimeOnAirUs(unsigned len) const;
+  static uint64_t NowUs();
+
+  int fd_;
+  unsigned base_port_;
+  unsigned num_ports_;
+  unsigned port_;               ///< Our own port, to ignore our own transmissions
+  unsigned loss_pct_;
+  unsigned crc_pct_;
+  int rssi_dbm_;
+
+  uint8_t regs_[0x80];
+  uint8_t fifo_[256];
+  uint64_t mode_until_us_;      ///< End of TX, or of the RX single symbol timeout
+  uint64_t rx_since_us_;        ///< When we started listening
+  uint8_t rx_write_;            ///< Where the modem writes the next received packet
+  Pending pending_;
+  uint16_t header_count_;
+  uint16_t packet_count_;
+
+  uint8_t transfer_reg_;        ///< State for Transfer()
+  bool transfer_write_;
+};
+
+#endif // SX1276_SIM_HPP__
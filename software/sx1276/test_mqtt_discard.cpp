@@ -17,6 +17,7 @@
   along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "util.hpp"
+#include "backoff.hpp"
 #include <mosquitto.h>
 #include <string>
 #include <iostream>
@@ -78,11 +79,12 @@ int main(int argc, char *argv[])
     if (rc == MOSQ_ERR_INVAL) { cerr << "Configuration error on subscribe\n"; break; }
     if (rc == MOSQ_ERR_NOMEM) { cerr << "Memory error on subscribe\n"; break; }
     // if (rc == MOSQ_ERR_NO_CONN)
+    Backoff backoff;
     while (true) {
       rc = mosquitto_loop(mosq, -1, 1);
-      if (true && rc != 0) {
-        sleep(20);
-        mosquitto_reconnect(mosq);
+      if (rc != 0) {
+        usleep(backoff.Next() * 1000);
+        if (mosquitto_reconnect(mosq) == MOSQ_ERR_SUCCESS) { backoff.Reset(); }
       }
     }
     mosquitto_destroy(mosq);
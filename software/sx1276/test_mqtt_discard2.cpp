@@ -50,12 +50,12 @@ int main(int argc, char *argv[])
 
   if (!client->valid()) { cerr << "init: " << client->last_error() << "\n"; return 1; }
 
-  // One shot test: if we cant connect now then die
-  if (!client->Connect()) { cerr << "connect: " << client->last_error() << "\n"; return 1; }
-  if (!client->Subscribe("#")) { cerr << "subscribe: " << client->last_error() << "\n"; return 1; }
+  // If the broker is not there yet, Poll() keeps trying; the subscription is renewed on connection
+  if (!client->Connect()) { cerr << "connect: " << client->last_error() << "\n"; }
+  if (!client->Subscribe("#")) { cerr << "subscribe: " << client->last_error() << "\n"; }
   cout << "Waiting...\n";
   while (true) {
-    if (!client->Poll())  { cerr << "poll: " << client->last_error() << "\n"; return 1; }
+    if (!client->Poll())  { cerr << "poll: " << client->last_error() << "\n"; }
     usleep(1e6);
   }
 }
@@ -0,0 +1,139 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "topic_scheduler.hpp"
+
+using std::string;
+using std::vector;
+using std::map;
+
+TopicScheduler::TopicScheduler(unsigned quantum_bytes, unsigned saturation_depth)
+  : quantum_(quantum_bytes ? quantum_bytes : 1),
+    saturation_depth_(saturation_depth),
+    total_(0),
+    num_coalesced_(0),
+    num_expired_(0)
+{
+  default_class_.priority = 1;
+  default_class_.max_age_s = 0;
+  default_class_.coalesce = false;
+}
+
+void TopicScheduler::SetTopicClass(const string& topic_prefix, const TopicClass& topic_class)
+{
+  classes_[topic_prefix] = topic_class;
+}
+
+const TopicScheduler::TopicClass& TopicScheduler::ClassFor(const string& topic) const
+{
+  const TopicClass *result = &default_class_;
+  size_t best = 0;
+  for (map<string, TopicClass>::const_iterator i = classes_.begin(); i != classes_.end(); ++i) {
+    if (i->first.size() >= best && topic.compare(0, i->first.size(), i->first) == 0) {
+      best = i->first.size();
+      result = &i->second;
+    }
+  }
+  return *result;
+}
+
+TopicScheduler::Queue& TopicScheduler::QueueFor(const string& topic)
+{
+  map<string, Queue>::iterator q = queues_.find(topic);
+  if (q == queues_.end()) {
+    Queue queue;
+    queue.topic_class = ClassFor(topic);
+    if (queue.topic_class.priority < 1) { queue.topic_class.priority = 1; }
+    queue.deficit = 0;
+    queue.credited = false;
+    q = queues_.insert(std::make_pair(topic, queue)).first;
+  }
+  return q->second;
+}
+
+void TopicScheduler::Push(const Item& item, vector<uint32_t>& dropped)
+{
+  Queue& queue = QueueFor(item.topic);
+  if (queue.items.empty()) { active_.push_back(item.topic); }
+
+  if (queue.topic_class.coalesce && saturated()) {
+    while (!queue.items.empty()) {
+      dropped.push_back(queue.items.front().id);
+      queue.items.pop_front();
+      total_ --;
+      num_coalesced_ ++;
+    }
+  }
+  queue.items.push_back(item);
+  total_ ++;
+}
+
+void TopicScheduler::Requeue(const Item& item)
+{
+  // Credit spent on the item is not refunded, so a deferred topic still yields to the others
+  Queue& queue = QueueFor(item.topic);
+  if (queue.items.empty()) { active_.push_back(item.topic); }
+  queue.items.push_front(item);
+  total_ ++;
+}
+
+void TopicScheduler::Retire()
+{
+  // Forget the queue altogether, else every topic ever seen, e.g. one per node, would keep one
+  queues_.erase(active_.front());
+  active_.pop_front();
+}
+
+bool TopicScheduler::Pop(Item& item, vector<uint32_t>& expired)
+{
+  time_t now = time(NULL);
+  while (!active_.empty()) {
+    Queue& queue = queues_[active_.front()];
+    unsigned max_age = queue.topic_class.max_age_s;
+    while (max_age > 0 && !queue.items.empty() && now - queue.items.front().stamp > (time_t)max_age) {
+      expired.push_back(queue.items.front().id);
+      queue.items.pop_front();
+      total_ --;
+      num_expired_ ++;
+    }
+    if (queue.items.empty()) {
+      Retire();
+      continue;
+    }
+    if (!queue.credited) {
+      queue.deficit += quantum_ * queue.topic_class.priority;
+      queue.credited = true;
+    }
+    unsigned size = queue.items.front().payload.size();
+    if (queue.deficit >= size) {
+      queue.deficit -= size;
+      item = queue.items.front();
+      queue.items.pop_front();
+      total_ --;
+      // An idle topic does not get to bank credit
+      if (queue.items.empty()) { Retire(); }
+      return true;
+    }
+    // Out of credit: next topic's turn
+    queue.credited = false;
+    string topic = active_.front();
+    active_.pop_front();
+    active_.push_back(topic);
+  }
+  return false;
+}
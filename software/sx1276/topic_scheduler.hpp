@@ -0,0 +1,111 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TOPIC_SCHEDULER_HPP__
+#define TOPIC_SCHEDULER_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <boost/noncopyable.hpp>
+
+/// Decides which queued message goes to air next, so one chatty topic cannot hog the radio.
+///
+/// Each topic has its own FIFO, and topics are served by deficit round robin: every round a
+/// topic earns quantum x priority bytes of credit, and may send messages while it has credit.
+/// Topics are matched to a class (priority, maximum age, coalescing) by longest prefix.
+///
+/// When the total backlog exceeds the saturation depth, a topic whose class allows coalescing
+/// keeps only its newest message: for telemetry the latest value is what matters.
+///
+/// Not thread safe; the caller provides locking.
+class TopicScheduler : boost::noncopyable
+{
+public:
+  struct Item {
+    uint32_t id;                  ///< Caller's identifier, e.g. MessageStore id
+    time_t stamp;
+    std::string topic;
+    std::vector<uint8_t> payload;
+  };
+
+  struct TopicClass {
+    unsigned priority;            ///< Relative share of airtime, >= 1
+    unsigned max_age_s;           ///< Messages older than this are dropped; zero means forever
+    bool coalesce;                ///< Keep only the latest message when saturated
+  };
+
+  /// @param quantum_bytes Credit per round for a priority 1 topic
+  /// @param saturation_depth Backlog at which coalescing kicks in
+  TopicScheduler(unsigned quantum_bytes=64, unsigned saturation_depth=16);
+
+  /// Class for topics not matched by SetTopicClass()
+  void SetDefaultClass(const TopicClass& topic_class) { default_class_ = topic_class; }
+
+  /// Set the class for any topic beginning with topic_prefix. Applies to topics with nothing queued at the time of the call.
+  void SetTopicClass(const std::string& topic_prefix, const TopicClass& topic_class);
+
+  /// Queue a message.
+  /// @param dropped Appended with the ids of any older messages superseded by coalescing
+  void Push(const Item& item, std::vector<uint32_t>& dropped);
+
+  /// Take the next message to send.
+  /// @param expired Appended with the ids of messages discarded for being too old
+  /// @return false if nothing is queued
+  bool Pop(Item& item, std::vector<uint32_t>& expired);
+
+  /// Put back an item taken by Pop() that could not be sent yet; it goes to the front of its topic.
+  void Requeue(const Item& item);
+
+  /// Class that applies to topic
+  const TopicClass& ClassFor(const std::string& topic) const;
+
+  /// Total number of queued messages
+  unsigned size() const { return total_; }
+  bool saturated() const { return total_ >= saturation_depth_; }
+
+  unsigned num_coalesced() const { return num_coalesced_; }
+  unsigned num_expired() const { return num_expired_; }
+
+private:
+  struct Queue {
+    TopicClass topic_class;
+    std::deque<Item> items;
+    unsigned deficit;             ///< Unspent credit, bytes
+    bool credited;                ///< Already given credit this visit
+  };
+
+  Queue& QueueFor(const std::string& topic);
+  /// Drop the empty queue at the front of active_, with any unspent credit
+  void Retire();
+
+  unsigned quantum_;
+  unsigned saturation_depth_;
+  unsigned total_;
+  unsigned num_coalesced_;
+  unsigned num_expired_;
+  TopicClass default_class_;
+  std::map<std::string, TopicClass> classes_;  ///< Topic prefix --> class
+  std::map<std::string, Queue> queues_;        ///< Topic --> queue, for topics with something queued
+  std::deque<std::string> active_;             ///< Round robin order of topics with something queued
+};
+
+#endif // TOPIC_SCHEDULER_HPP__
@@ -0,0 +1,101 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "uplink_table.hpp"
+
+using boost::mutex;
+using boost::unique_lock;
+using boost::shared_ptr;
+
+UplinkTable::UplinkTable(unsigned shards, unsigned window_s)
+  : window_s_(window_s)
+{
+  for (unsigned i=0; i < (shards ? shards : 1); i++) {
+    shared_ptr<Shard> shard(new Shard);
+    shard->duplicates = 0;
+    shards_.push_back(shard);
+  }
+}
+
+UplinkTable::Shard& UplinkTable::ShardFor(uint16_t node) const
+{
+  // Leaf addresses come from MACs, so the low bits are well spread already
+  return *shards_[node % shards_.size()];
+}
+
+bool UplinkTable::Receive(const Copy& copy)
+{
+  Shard& shard = ShardFor(copy.node);
+  unique_lock<mutex> lock(shard.mutex);
+  time_t now = time(NULL);
+  uint32_t key = (uint32_t)copy.node << 8 | copy.counter;
+  boost::unordered_map<uint32_t, Uplink>::iterator i = shard.uplinks.find(key);
+  if (i != shard.uplinks.end() && i->second.crc == copy.crc && now - i->second.stamp <= (time_t)window_s_) {
+    shard.duplicates ++;
+    Route& route = shard.routes[copy.node];
+    if (route.counter == copy.counter && copy.snr_db > route.snr_db) {
+      route.gateway = copy.gateway;
+      route.snr_db = copy.snr_db;
+    }
+    return false;
+  }
+  Uplink uplink = { copy.crc, now };
+  shard.uplinks[key] = uplink;
+  Route route = { copy.gateway, copy.snr_db, copy.counter };
+  shard.routes[copy.node] = route;
+  return true;
+}
+
+bool UplinkTable::BestGateway(uint16_t node, uint16_t& gateway) const
+{
+  Shard& shard = ShardFor(node);
+  unique_lock<mutex> lock(shard.mutex);
+  boost::unordered_map<uint16_t, Route>::const_iterator i = shard.routes.find(node);
+  if (i == shard.routes.end()) { return false; }
+  gateway = i->second.gateway;
+  return true;
+}
+
+unsigned UplinkTable::Expire()
+{
+  unsigned expired = 0;
+  time_t now = time(NULL);
+  for (unsigned s=0; s < shards_.size(); s++) {
+    Shard& shard = *shards_[s];
+    unique_lock<mutex> lock(shard.mutex);
+    for (boost::unordered_map<uint32_t, Uplink>::iterator i = shard.uplinks.begin(); i != shard.uplinks.end(); ) {
+      if (now - i->second.stamp > (time_t)window_s_) {
+        i = shard.uplinks.erase(i);
+        expired ++;
+      } else {
+        ++i;
+      }
+    }
+  }
+  return expired;
+}
+
+unsigned UplinkTable::num_duplicates() const
+{
+  unsigned total = 0;
+  for (unsigned s=0; s < shards_.size(); s++) {
+    unique_lock<mutex> lock(shards_[s]->mutex);
+    total += shards_[s]->duplicates;
+  }
+  return total;
+}
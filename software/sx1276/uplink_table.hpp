@@ -0,0 +1,98 @@
+/*
+  Copyright (c) 2015 Andrew McDonnell <bugs@andrewmcdonnell.net>
+
+  This file is part of SentriFarm Radio Relay.
+
+  SentriFarm Radio Relay is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  SentriFarm Radio Relay is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SentriFarm Radio Relay.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef UPLINK_TABLE_HPP__
+#define UPLINK_TABLE_HPP__
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+
+/// The network server's view of recent uplinks: which ones it has already passed on, and which
+/// gateway hears each leaf best.
+///
+/// A leaf uplink heard by several gateways arrives once per gateway. The first copy within the window
+/// is passed on and the rest are dropped. Copies match on (node, link counter) plus a CRC of the
+/// payload, so a counter that wrapped or restarted after a reboot is not mistaken for a duplicate.
+/// Every copy is a vote for the gateway that heard it: downlinks go to whichever gateway heard the
+/// node's latest uplink with the best SNR.
+///
+/// The table is split into shards by node, each with its own lock, so worker threads handling
+/// different leaves rarely contend.
+///
+/// Methods are thread safe.
+class UplinkTable : boost::noncopyable
+{
+public:
+  /// One gateway's copy of an uplink
+  struct Copy {
+    uint16_t node;
+    uint8_t counter;
+    uint32_t crc;                 ///< Of the payload
+    uint16_t gateway;
+    int snr_db;
+  };
+
+  /// @param shards Number of independently locked shards
+  /// @param window_s How long after the first copy later copies count as duplicates
+  UplinkTable(unsigned shards=16, unsigned window_s=10);
+
+  /// Record a copy of an uplink
+  /// @return true for the first copy, which should be passed on; false for a duplicate
+  bool Receive(const Copy& copy);
+
+  /// Gateway to reach node through
+  /// @return false if node has not been heard from
+  bool BestGateway(uint16_t node, uint16_t& gateway) const;
+
+  /// Forget uplinks older than the window
+  /// @return Number forgotten
+  unsigned Expire();
+
+  unsigned num_duplicates() const;
+
+private:
+  struct Uplink {
+    uint32_t crc;
+    time_t stamp;
+  };
+
+  struct Route {
+    uint16_t gateway;
+    int snr_db;                   ///< Best SNR of the latest uplink so far
+    uint8_t counter;              ///< Latest uplink
+  };
+
+  struct Shard {
+    boost::mutex mutex;           ///< Protect everything in the shard
+    boost::unordered_map<uint32_t, Uplink> uplinks;  ///< node << 8 | counter --> first copy
+    boost::unordered_map<uint16_t, Route> routes;    ///< node --> downlink gateway
+    unsigned duplicates;
+  };
+
+  Shard& ShardFor(uint16_t node) const;
+
+  unsigned window_s_;
+  std::vector<boost::shared_ptr<Shard> > shards_;
+};
+
+#endif // UPLINK_TABLE_HPP__